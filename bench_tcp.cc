@@ -0,0 +1,660 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file bench_tcp.cc
+ * @brief TCP load generator / latency benchmark for echo servers
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ * 多数の接続を epoll で同時に張り、メッセージを送ってエコーバックが揃うまでの時間を測る。
+ * 結果 (スループットと p50/p99/p99.9 レイテンシー) は回帰比較用に JSON で出力する。
+ *
+ * - closed loop (-r 0): 各接続で常に -P 個の要求を出したままにする
+ * - open loop (-r N) : 全体で毎秒 N 要求を予定時刻どおりに出す (応答待ちで遅れても予定は詰めない)
+ *
+ * coordinated omission の補正:
+ * - open loop では予定時刻からの時間を測る (遅れて送った分の待ちも含む)
+ * - closed loop では HdrHistogram と同様に、期待間隔 (-e、省略時は実測の中央値) より長い
+ *   サンプルの間に止まっていたはずの要求を補う
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <nlohmann/json.hpp>
+
+#include "cc_thread.h"
+#include "cc_resolver.h"
+
+extern "C" {
+#include <getopt.h>
+}
+
+#define BENCH_TCP_IP_ADDR       "127.0.0.1"
+#define BENCH_TCP_PORT_NO       5000
+#define BENCH_TCP_EVENTS        256             ///< epoll_wait() 1回で受け取るイベント数
+#define BENCH_TCP_RECV_SIZE     65536
+
+/// 時刻取得 (nsec)
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// -------------------------------------------------------------------------------------------
+
+///
+/// 対数線形ヒストグラム (nsec、相対誤差 1/64 以下)
+///
+/// 2のべき乗ごとに 64 区間に分ける。128 未満はそのまま。
+///
+class bench_histogram {
+private:
+    static const int SUB_BITS  = 6;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS   = (64 - SUB_BITS + 1) * SUB_COUNT;
+    std::vector<uint64_t> counts;
+
+    static int index (uint64_t v) {
+        if (v < (uint64_t)SUB_COUNT * 2) {
+            return (int)v;
+        }
+        int shift = 63 - __builtin_clzll (v) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int)((v >> shift) - SUB_COUNT);
+    }
+    static uint64_t value (int idx) {
+        if (idx < SUB_COUNT * 2) {
+            return idx;
+        }
+        int shift = idx / SUB_COUNT - 1;
+        uint64_t lower = (uint64_t)(idx % SUB_COUNT + SUB_COUNT) << shift;
+        return lower + ((1ULL << shift) >> 1);  // 区間の中央
+    }
+
+public:
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+
+    bench_histogram (void) : counts (BUCKETS, 0), total (0), min (UINT64_MAX), max (0), sum (0) {}
+
+    void record (uint64_t v, uint64_t n=1) {
+        counts[index (v)] += n;
+        total += n;
+        sum   += (double)v * n;
+        if (v < min) min = v;
+        if (v > max) max = v;
+    }
+    void merge (const bench_histogram &h) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += h.counts[i];
+        }
+        total += h.total;
+        sum   += h.sum;
+        if (h.min < min) min = h.min;
+        if (h.max > max) max = h.max;
+    }
+    uint64_t percentile (double p) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t v = value (i);
+                return v > max ? max : (v < min ? min : v);
+            }
+        }
+        return max;
+    }
+    double mean (void) const { return total ? sum / total : 0; }
+
+    /// closed loop 用の coordinated omission 補正 (HdrHistogram の copyCorrectedForCoordinatedOmission と同じ)
+    bench_histogram corrected (uint64_t expected) const {
+        bench_histogram out = *this;
+        if (expected == 0) {
+            return out;
+        }
+        for (int i = 0; i < BUCKETS; i++) {
+            if (counts[i] == 0) {
+                continue;
+            }
+            uint64_t v = value (i);
+            for (uint64_t miss = expected; v > miss + expected; miss += expected) {
+                out.record (v - miss, counts[i]);
+            }
+        }
+        return out;
+    }
+    nlohmann::json to_json (void) const {
+        nlohmann::json j;
+        j["count"]  = total;
+        j["min"]    = total ? min / 1000.0 : 0;
+        j["mean"]   = mean () / 1000.0;
+        j["p50"]    = percentile (50.0) / 1000.0;
+        j["p90"]    = percentile (90.0) / 1000.0;
+        j["p99"]    = percentile (99.0) / 1000.0;
+        j["p99_9"]  = percentile (99.9) / 1000.0;
+        j["p99_99"] = percentile (99.99) / 1000.0;
+        j["max"]    = max / 1000.0;
+        return j;
+    }
+};
+
+// -------------------------------------------------------------------------------------------
+
+/// ベンチマーク条件
+struct bench_config {
+    std::string host;
+    unsigned int port;
+    int conns;                                  ///< 同時接続数
+    int threads;                                ///< 送受信スレッド数
+    int duration;                               ///< 計測時間 (sec)
+    int warmup;                                 ///< 計測前の慣らし時間 (sec)
+    size_t msg_size;                            ///< 1要求のバイト数 (同じバイト数が返ってくれば完了)
+    int depth;                                  ///< 1接続あたりの最大未完了要求数 (パイプライン段数)
+    double rate;                                ///< 全体の要求レート (req/sec)、0 なら closed loop
+    uint64_t expected_ns;                       ///< closed loop の補正に使う期待間隔、0 なら中央値
+};
+
+static std::atomic<bool> recording (false);    ///< 計測期間中
+static volatile bool process_keep = true;
+
+/// 1接続の状態
+struct bench_conn {
+    int fd;
+    bool connected;
+    std::deque<uint64_t> sched;                 ///< 未完了要求の予定時刻 (closed loop では送信時刻)
+    std::deque<uint64_t> issued;                ///< 未完了要求の送信時刻
+    size_t out_bytes;                           ///< まだ書けていないバイト数
+    size_t in_bytes;                            ///< 先頭の要求に対して受信済みのバイト数
+    uint64_t next_ns;                           ///< open loop の次の予定時刻
+    bool want_write;                            ///< EPOLLOUT 待ち
+
+    bench_conn (void) : fd (-1), connected (false), out_bytes (0), in_bytes (0), next_ns (0), want_write (true) {}
+};
+
+///
+/// 送受信スレッド (接続の一部を担当する)
+///
+class bench_worker : public cc_thread {
+private:
+    const bench_config &conf;
+    const cc_sockaddr &server;
+    std::vector<bench_conn> conns;
+    uint64_t interval_ns;                       ///< open loop の1接続あたりの要求間隔
+    int epfd;
+    std::vector<char> wbuf;
+
+    bool open_conn (bench_conn &c);
+    void close_conn (bench_conn &c, bool error);
+    void issue (bench_conn &c, uint64_t sched_ns, uint64_t now);
+    bool flush (bench_conn &c);
+    bool on_readable (bench_conn &c, char *buf);
+    void set_write (bench_conn &c, bool on);
+    uint64_t schedule (uint64_t now);
+
+public:
+    bench_histogram raw;                        ///< 送信時刻から
+    bench_histogram sched;                      ///< 予定時刻から (open loop)
+    uint64_t completed;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t errors;
+
+    bench_worker (const bench_config &conf, const cc_sockaddr &server, int nconns, int first);
+    virtual ~bench_worker ();
+    virtual void thread_main (void);
+};
+
+bench_worker::bench_worker (const bench_config &conf, const cc_sockaddr &server, int nconns, int first) :
+    cc_thread (-1, "bench_worker", CC_MAILBOX_NONE), conf (conf), server (server), conns (nconns),
+    completed (0), bytes (0), connect_errors (0), errors (0)
+{
+    interval_ns = 0;
+    if (conf.rate > 0) {
+        interval_ns = (uint64_t)(1e9 * conf.conns / conf.rate);
+    }
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    wbuf.assign (conf.msg_size * conf.depth < 65536 ? conf.msg_size * conf.depth : 65536, 'x');
+
+    // open loop の予定は接続ごとにずらして、全接続が同時に送らないようにする
+    uint64_t now = monotonic_ns ();
+    for (int i = 0; i < nconns; i++) {
+        conns[i].next_ns = now + (interval_ns * (first + i)) / conf.conns;
+    }
+}
+
+bench_worker::~bench_worker ()
+{
+    for (auto &c : conns) {
+        if (c.fd != -1) {
+            close (c.fd);
+        }
+    }
+    if (epfd != -1) {
+        close (epfd);
+    }
+}
+
+bool
+bench_worker::open_conn (bench_conn &c)
+{
+    c.fd = socket (server.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd == -1) {
+        perror ("socket() error");
+        return false;
+    }
+    int one = 1;
+    setsockopt (c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect (c.fd, (const struct sockaddr *)&server.addr, server.len) == -1 && errno != EINPROGRESS) {
+        perror ("connect() error");
+        close (c.fd);
+        c.fd = -1;
+        return false;
+    }
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = &c;
+    epoll_ctl (epfd, EPOLL_CTL_ADD, c.fd, &ev);
+    return true;
+}
+
+void
+bench_worker::close_conn (bench_conn &c, bool error)
+{
+    if (c.fd == -1) {
+        return;
+    }
+    if (error) {
+        if (c.connected) {
+            errors++;
+        } else {
+            connect_errors++;
+        }
+    }
+    epoll_ctl (epfd, EPOLL_CTL_DEL, c.fd, NULL);
+    close (c.fd);
+    c.fd = -1;
+    c.connected = false;
+}
+
+void
+bench_worker::set_write (bench_conn &c, bool on)
+{
+    if (c.want_write == on) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events   = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = &c;
+    epoll_ctl (epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    c.want_write = on;
+}
+
+/// 要求を1つ出す (書けなかった分は EPOLLOUT で続きを書く)
+void
+bench_worker::issue (bench_conn &c, uint64_t sched_ns, uint64_t now)
+{
+    c.sched.push_back (sched_ns);
+    c.issued.push_back (now);
+    c.out_bytes += conf.msg_size;
+}
+
+bool
+bench_worker::flush (bench_conn &c)
+{
+    while (c.out_bytes > 0) {
+        size_t len = c.out_bytes < wbuf.size () ? c.out_bytes : wbuf.size ();
+        ssize_t n = send (c.fd, wbuf.data (), len, MSG_NOSIGNAL);
+        if (n > 0) {
+            c.out_bytes -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_write (c, true);
+            return true;
+        }
+        return false;
+    }
+    set_write (c, false);
+    return true;
+}
+
+bool
+bench_worker::on_readable (bench_conn &c, char *buf)
+{
+    for (;;) {
+        ssize_t n = recv (c.fd, buf, BENCH_TCP_RECV_SIZE, 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c.in_bytes += n;
+        uint64_t now = monotonic_ns ();
+        bool rec = recording.load (std::memory_order_relaxed);
+        while (c.in_bytes >= conf.msg_size && c.sched.empty () == false) {
+            c.in_bytes -= conf.msg_size;
+            if (rec) {
+                raw.record (now - c.issued.front ());
+                sched.record (now - c.sched.front ());
+                completed++;
+                bytes += conf.msg_size;
+            }
+            c.sched.pop_front ();
+            c.issued.pop_front ();
+            if (interval_ns == 0) {
+                issue (c, now, now);
+            }
+        }
+        if ((size_t)n < BENCH_TCP_RECV_SIZE) {
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief 予定時刻を過ぎた要求を出す (open loop)
+ * @return 次の予定時刻 (なければ 0)
+ */
+uint64_t
+bench_worker::schedule (uint64_t now)
+{
+    uint64_t next = 0;
+    for (auto &c : conns) {
+        if (c.connected == false) {
+            continue;
+        }
+        // 未完了が depth に達していれば予定時刻は進めない (遅れた分は予定時刻からの時間に含まれる)
+        bool issued = false;
+        while (c.next_ns <= now && c.sched.size () < (size_t)conf.depth) {
+            issue (c, c.next_ns, now);
+            c.next_ns += interval_ns;
+            issued = true;
+        }
+        if (issued && flush (c) == false) {
+            close_conn (c, true);
+            continue;
+        }
+        if (c.sched.size () < (size_t)conf.depth && (next == 0 || c.next_ns < next)) {
+            next = c.next_ns;
+        }
+    }
+    return next;
+}
+
+void
+bench_worker::thread_main (void)
+{
+    for (auto &c : conns) {
+        if (open_conn (c) == false) {
+            connect_errors++;
+        }
+    }
+    struct epoll_event events[BENCH_TCP_EVENTS];
+    std::vector<char> rbuf (BENCH_TCP_RECV_SIZE);
+
+    while (loop_continue ()) {
+        int timeout_ms = 100;
+        if (interval_ns != 0) {
+            uint64_t now  = monotonic_ns ();
+            uint64_t next = schedule (now);
+            if (next != 0) {
+                timeout_ms = next > now ? (int)((next - now) / 1000000) : 0;
+                if (timeout_ms > 100) timeout_ms = 100;
+            }
+        }
+        int n = thread_epoll_wait (epfd, events, BENCH_TCP_EVENTS, timeout_ms);
+        for (int i = 0; i < n; i++) {
+            bench_conn &c = *(bench_conn *)events[i].data.ptr;
+            if (c.fd == -1) {
+                continue;
+            }
+            if (c.connected == false) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt (c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                    close_conn (c, true);
+                    continue;
+                }
+                c.connected = true;
+                if (interval_ns == 0) {
+                    uint64_t now = monotonic_ns ();
+                    for (int d = 0; d < conf.depth; d++) {
+                        issue (c, now, now);
+                    }
+                }
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && on_readable (c, rbuf.data ()) == false) {
+                close_conn (c, true);
+                continue;
+            }
+            if (c.out_bytes > 0 || c.want_write) {
+                if (flush (c) == false) {
+                    close_conn (c, true);
+                }
+            }
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+// カスタムのシグナルハンドラ関数
+void signalHandler(int signum) {
+    process_keep = false;
+}
+
+// コマンドラインヘルプを表示する
+void help (char *argv0)
+{
+    printf ("%s [options]\n", argv0);
+    printf ("   -i <host>      server address (default %s)\n", BENCH_TCP_IP_ADDR);
+    printf ("   -p <port>      server port (default %d)\n", BENCH_TCP_PORT_NO);
+    printf ("   -c <conns>     concurrent connections (default 100)\n");
+    printf ("   -t <threads>   worker threads (default 1)\n");
+    printf ("   -d <sec>       measurement duration (default 10)\n");
+    printf ("   -w <sec>       warmup before measurement (default 1)\n");
+    printf ("   -s <bytes>     message size (default 64)\n");
+    printf ("   -P <depth>     pipelined requests per connection (default 1)\n");
+    printf ("   -r <req/sec>   total request rate, open loop (default 0 = closed loop)\n");
+    printf ("   -e <usec>      expected interval for closed loop correction (default: median)\n");
+    printf ("   -o <file>      write JSON result to file (default stdout)\n");
+}
+
+/// 接続数に合わせてファイルディスクリプターの上限を上げる
+static void
+raise_nofile (int conns)
+{
+    struct rlimit rl;
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)conns + 64) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit (RLIMIT_NOFILE, &rl) == -1) {
+            perror ("setrlimit() error");
+        }
+    }
+}
+
+// メイン関数
+int
+main (int argc, char *argv[])
+{
+    signal(SIGTERM, signalHandler);
+    signal(SIGINT,  signalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    bench_config conf;
+    conf.host        = BENCH_TCP_IP_ADDR;
+    conf.port        = BENCH_TCP_PORT_NO;
+    conf.conns       = 100;
+    conf.threads     = 1;
+    conf.duration    = 10;
+    conf.warmup      = 1;
+    conf.msg_size    = 64;
+    conf.depth       = 1;
+    conf.rate        = 0;
+    conf.expected_ns = 0;
+    std::string out_file;
+
+    // 引数の読み込み
+    int opt;
+    while ((opt = getopt(argc, argv, "i:p:c:t:d:w:s:P:r:e:o:h")) != -1) {
+        switch (opt) {
+        case 'i': conf.host        = optarg; break;
+        case 'p': conf.port        = atoi(optarg); break;
+        case 'c': conf.conns       = atoi(optarg); break;
+        case 't': conf.threads     = atoi(optarg); break;
+        case 'd': conf.duration    = atoi(optarg); break;
+        case 'w': conf.warmup      = atoi(optarg); break;
+        case 's': conf.msg_size    = atol(optarg); break;
+        case 'P': conf.depth       = atoi(optarg); break;
+        case 'r': conf.rate        = atof(optarg); break;
+        case 'e': conf.expected_ns = (uint64_t)(atof(optarg) * 1000); break;
+        case 'o': out_file         = optarg; break;
+        case 'h':
+            help (argv[0]);
+            return 0;
+        default:
+            help (argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc || conf.port == 0 || conf.conns <= 0 || conf.threads <= 0 || conf.duration <= 0 ||
+        conf.warmup < 0 || conf.msg_size == 0 || conf.depth <= 0 || conf.rate < 0) {
+        fprintf (stderr, "ERROR: invalid argument\n");
+        help (argv[0]);
+        return 1;
+    }
+    if (conf.threads > conf.conns) {
+        conf.threads = conf.conns;
+    }
+
+    std::vector<cc_sockaddr> addrs;
+    if (cc_resolver::instance ().resolve (conf.host, addrs, 5000) == false) {
+        fprintf (stderr, "ERROR: cannot resolve %s\n", conf.host.c_str());
+        return 1;
+    }
+    cc_sockaddr server = addrs[0];
+    server.set_port (conf.port);
+    raise_nofile (conf.conns);
+
+    fprintf (stderr, "bench_tcp: %s, %d conns, %d threads, %lu bytes, depth %d, %s\n",
+             server.str ().c_str(), conf.conns, conf.threads, (unsigned long)conf.msg_size, conf.depth,
+             conf.rate > 0 ? ("open loop " + std::to_string ((long)conf.rate) + " req/sec").c_str() : "closed loop");
+
+    std::vector<bench_worker*> workers;
+    for (int i = 0, first = 0; i < conf.threads; i++) {
+        int n = conf.conns / conf.threads + (i < conf.conns % conf.threads ? 1 : 0);
+        workers.push_back (new bench_worker (conf, server, n, first));
+        first += n;
+    }
+    for (auto w : workers) {
+        w->thread_up ();
+    }
+
+    // 慣らし → 計測
+    uint64_t end_ns = monotonic_ns () + (uint64_t)conf.warmup * 1000000000ULL;
+    while (process_keep && monotonic_ns () < end_ns) {
+        usleep (10*1000);
+    }
+    recording = true;
+    uint64_t start_ns = monotonic_ns ();
+    end_ns = start_ns + (uint64_t)conf.duration * 1000000000ULL;
+    while (process_keep && monotonic_ns () < end_ns) {
+        usleep (10*1000);
+    }
+    recording = false;
+    double elapsed = (monotonic_ns () - start_ns) / 1e9;
+
+    for (auto w : workers) {
+        w->set_loop_continue (false);
+    }
+    bench_histogram raw, sched;
+    uint64_t completed = 0, bytes = 0, connect_errors = 0, errors = 0;
+    for (auto w : workers) {
+        w->thread_down ();
+        raw.merge (w->raw);
+        sched.merge (w->sched);
+        completed      += w->completed;
+        bytes          += w->bytes;
+        connect_errors += w->connect_errors;
+        errors         += w->errors;
+        delete w;
+    }
+
+    // open loop は予定時刻からの時間がそのまま補正済み、closed loop は期待間隔で補う
+    uint64_t expected = 0;
+    bench_histogram corrected;
+    if (conf.rate > 0) {
+        corrected = sched;
+    } else {
+        expected  = conf.expected_ns ? conf.expected_ns : raw.percentile (50.0);
+        corrected = raw.corrected (expected);
+    }
+
+    nlohmann::json result;
+    result["config"]["server"]          = server.str ();
+    result["config"]["connections"]     = conf.conns;
+    result["config"]["threads"]         = conf.threads;
+    result["config"]["duration_s"]      = conf.duration;
+    result["config"]["warmup_s"]        = conf.warmup;
+    result["config"]["message_size"]    = conf.msg_size;
+    result["config"]["pipeline_depth"]  = conf.depth;
+    result["config"]["mode"]            = conf.rate > 0 ? "open" : "closed";
+    result["config"]["rate"]            = conf.rate;
+    result["elapsed_s"]                 = elapsed;
+    result["requests"]                  = completed;
+    result["throughput_rps"]            = completed / elapsed;
+    result["throughput_mbps"]           = bytes * 8 / elapsed / 1e6;
+    result["connect_errors"]            = connect_errors;
+    result["errors"]                    = errors;
+    result["co_expected_interval_us"]   = expected / 1000.0;
+    result["latency_us"]                = corrected.to_json ();
+    result["latency_uncorrected_us"]    = raw.to_json ();
+
+    std::string text = result.dump (2);
+    if (out_file.empty () || out_file == "-") {
+        printf ("%s\n", text.c_str());
+    } else {
+        std::ofstream ofs (out_file);
+        ofs << text << std::endl;
+        if (!ofs) {
+            fprintf (stderr, "ERROR: cannot write %s\n", out_file.c_str());
+            return 1;
+        }
+    }
+    return (completed == 0) ? 1 : 0;
+}
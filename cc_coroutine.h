@@ -0,0 +1,444 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_coroutine.h
+ * @brief C++20 coroutine task layer for fd-driven cc_thread logic
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ * このヘッダーだけは C++20 (-std=gnu++20) でコンパイルすること。
+ * cclib.a 本体は gnu++11 のままなので cclib.h からはインクルードしていない。
+ *
+ * 使い方
+ * @code
+ *   cc_cotask echo (cc_tcpconnect *conn) {
+ *       unsigned char buf[1024];
+ *       while (true) {
+ *           ssize_t n = co_await cc_co::recv (*conn, buf, sizeof(buf));
+ *           if (n <= 0) break;
+ *           co_await cc_co::send (*conn, buf, n);
+ *       }
+ *   }
+ *   cc_coloop loop ("coloop");
+ *   loop.spawn (echo (conn));
+ *   loop.thread_up ();
+ * @endcode
+ */
+
+#ifndef __CC_COROUTINE_H__
+#define __CC_COROUTINE_H__
+
+#if __cplusplus < 202002L
+#error "cc_coroutine.h requires C++20 (-std=gnu++20)"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <errno.h>
+
+#include "cc_thread.h"
+#include "cc_timer.h"
+#include "cc_tcpcomm.h"
+
+class cc_coloop;
+
+/**
+ * @class cc_cotask
+ * @brief コルーチンの戻り値型
+ *
+ * 生成時点では停止しており、cc_coloop::spawn() で起動するか、
+ * 別のコルーチンから co_await すると実行される。
+ */
+class cc_cotask {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation;           ///< co_await している呼び出し元
+        bool detached = false;                          ///< spawn() されたタスク
+        cc_coloop *loop = nullptr;                      ///< spawn() されたタスクを実行しているループ
+        std::exception_ptr exception;
+
+        cc_cotask get_return_object () {
+            return cc_cotask (std::coroutine_handle<promise_type>::from_promise (*this));
+        }
+        std::suspend_always initial_suspend () noexcept { return {}; }
+        struct final_awaiter {
+            bool await_ready () noexcept { return false; }
+            std::coroutine_handle<> await_suspend (std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume () noexcept {}
+        };
+        final_awaiter final_suspend () noexcept { return {}; }
+        void return_void () {}
+        void unhandled_exception () {
+            exception = std::current_exception ();
+            if (detached) {
+                std::terminate ();                      // 待っている相手がいない
+            }
+        }
+    };
+
+    cc_cotask (cc_cotask &&other) noexcept : handle (other.handle) { other.handle = nullptr; }
+    cc_cotask (const cc_cotask &) = delete;
+    cc_cotask &operator= (const cc_cotask &) = delete;
+    ~cc_cotask () {
+        if (handle) handle.destroy ();
+    }
+
+    // 別のコルーチンから co_await する
+    bool await_ready () noexcept { return !handle || handle.done (); }
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> caller) noexcept {
+        handle.promise ().continuation = caller;
+        return handle;
+    }
+    void await_resume () {
+        if (handle.promise ().exception) {
+            std::rethrow_exception (handle.promise ().exception);
+        }
+    }
+
+    /// 所有権を手放してハンドルを返す (cc_coloop::spawn() 用)
+    std::coroutine_handle<promise_type> release () {
+        std::coroutine_handle<promise_type> h = handle;
+        handle = nullptr;
+        return h;
+    }
+
+private:
+    explicit cc_cotask (std::coroutine_handle<promise_type> h) : handle (h) {}
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @class cc_coloop
+ * @brief コルーチンを駆動する epoll イベントループ
+ *
+ * thread_up() すると専用スレッドでループする。既存のスレッドから poll() を呼んで駆動してもよい。
+ * 1つのループに登録したコルーチンは、すべてそのループのスレッドで実行される。
+ */
+class cc_coloop : public cc_thread {
+public:
+    cc_coloop (std::string nickname) :
+        cc_thread (-1, nickname, CC_MAILBOX_LAZY),
+        coloop_dbg (nickname),
+        timer (nickname + "_timer")
+    {
+        epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            perror ("epoll_create1()");
+        }
+        add_fd_event (timer.get_fd ());
+        wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd == -1) {
+            perror ("eventfd()");
+        } else {
+            add_fd_event (wake_fd);
+        }
+    }
+    virtual ~cc_coloop () {
+        thread_down ();
+        // 完了していないタスクを解放する。タスクのフレームが待っている子タスクを持っているので、
+        // spawn() したタスクだけ destroy() すれば fd やタイマーで待っている子のフレームも解放される
+        {
+            std::lock_guard<std::mutex> lock (spawn_mtx);
+            for (size_t i = 0; i < spawned.size (); i++) {
+                tasks.insert (spawned[i].address ());
+            }
+            spawned.clear ();
+        }
+        for (void *addr : tasks) {
+            std::coroutine_handle<>::from_address (addr).destroy ();
+        }
+        tasks.clear ();
+        ready.clear ();
+        waiters.clear ();
+        if (wake_fd != -1) {
+            close (wake_fd);
+        }
+        if (epoll_fd != -1) {
+            close (epoll_fd);
+        }
+    }
+
+    /// コルーチンを起動してループに預ける (完了時に自動で解放される、どのスレッドから呼んでもよい)
+    void spawn (cc_cotask task) {
+        std::coroutine_handle<cc_cotask::promise_type> h = task.release ();
+        if (!h) return;
+        h.promise ().detached = true;
+        {
+            std::lock_guard<std::mutex> lock (spawn_mtx);
+            spawned.push_back (h);
+        }
+        if (current_loop () != this && wake_fd != -1) {
+            uint64_t one = 1;                           // 他スレッドからなら epoll_wait() を起こす
+            if (write (wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                perror ("cc_coloop::spawn: write()");
+            }
+        }
+    }
+
+    /// 専用スレッドで駆動する場合のメイン関数
+    virtual void thread_main (void) {
+        while (loop_continue ()) {
+            poll (100);                                 // 100msec ごとに停止判定
+        }
+    }
+
+    /**
+     * @brief イベントを1回待って、再開可能なコルーチンを実行する
+     * @param timeout_ms epoll_wait() のタイムアウト
+     * @return 再開したコルーチン数
+     */
+    int poll (int timeout_ms) {
+        cc_coloop *prev = current_loop ();
+        current_loop () = this;
+        int resumed = run_ready ();
+
+        struct epoll_event events[64];
+        int n = thread_epoll_wait (epoll_fd, events, 64, ready.empty () ? timeout_ms : 0);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == timer.get_fd ()) {
+                timer.process ();                       // sleep_for() の再開は ready に積まれる
+                continue;
+            }
+            if (fd == wake_fd) {
+                uint64_t count;                         // spawn() の起床通知を読み捨てる (spawned は後の run_ready() で起動)
+                if (read (wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    perror ("cc_coloop::poll: read()");
+                }
+                continue;
+            }
+            std::unordered_map<int, fd_waiter>::iterator it = waiters.find (fd);
+            if (it == waiters.end ()) continue;
+            uint32_t ev = events[i].events;
+            bool err = (ev & (EPOLLERR | EPOLLHUP)) != 0;
+            if (ev & EPOLLIN || err) {
+                ready.insert (ready.end (), it->second.readers.begin (), it->second.readers.end ());
+                it->second.readers.clear ();
+            }
+            if (ev & EPOLLOUT || err) {
+                ready.insert (ready.end (), it->second.writers.begin (), it->second.writers.end ());
+                it->second.writers.clear ();
+            }
+            update_fd (fd, it->second);
+        }
+        resumed += run_ready ();
+        current_loop () = prev;
+        return resumed;
+    }
+
+    /// 実行中のループ (コルーチンの中から参照する)
+    static cc_coloop *&current_loop (void) {
+        static thread_local cc_coloop *loop = nullptr;
+        return loop;
+    }
+
+    // ----------------------------------------------- awaitable から使う
+    /// 同じ fd・同じ向きで複数のコルーチンが待ってもよい (イベントが来たら全員を再開する)
+    void wait_fd (int fd, bool write, std::coroutine_handle<> h) {
+        fd_waiter &w = waiters[fd];
+        if (write) {
+            w.writers.push_back (h);
+        } else {
+            w.readers.push_back (h);
+        }
+        update_fd (fd, w);
+    }
+    /// spawn() したタスクが完了した (final_suspend から呼ばれる)
+    void task_done (std::coroutine_handle<> h) {
+        tasks.erase (h.address ());
+    }
+    void wait_ms (unsigned int ms, std::coroutine_handle<> h) {
+        timer.add_oneshot (ms, [this, h]() { ready.push_back (h); });
+    }
+
+    cc_debugprint coloop_dbg;                           ///< cclib debugprint
+
+private:
+    struct fd_waiter {
+        std::vector<std::coroutine_handle<>> readers;
+        std::vector<std::coroutine_handle<>> writers;
+        bool registered = false;
+    };
+
+    int epoll_fd;
+    int wake_fd;                                        ///< 他スレッドからの spawn() を知らせる eventfd
+    cc_timer timer;                                     ///< sleep_for() 用、スレッドは起動せずこのループで駆動
+    std::unordered_map<int, fd_waiter> waiters;         ///< fd ごとの待ちコルーチン
+    std::vector<std::coroutine_handle<>> ready;         ///< 再開待ちコルーチン
+    std::mutex spawn_mtx;                               ///< spawned 保護用
+    std::vector<std::coroutine_handle<cc_cotask::promise_type>> spawned; ///< spawn() されて未起動のコルーチン
+    std::unordered_set<void *> tasks;                   ///< 起動して未完了の spawn() されたコルーチン (ループのスレッドだけが触る)
+
+    int run_ready (void) {
+        {
+            std::lock_guard<std::mutex> lock (spawn_mtx);
+            for (size_t i = 0; i < spawned.size (); i++) {
+                spawned[i].promise ().loop = this;
+                tasks.insert (spawned[i].address ());
+                ready.push_back (spawned[i]);
+            }
+            spawned.clear ();
+        }
+        int count = 0;
+        while (!ready.empty ()) {
+            std::vector<std::coroutine_handle<>> list;
+            list.swap (ready);
+            for (size_t i = 0; i < list.size (); i++) {
+                list[i].resume ();
+                count++;
+            }
+        }
+        return count;
+    }
+    void add_fd_event (int fd) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    void update_fd (int fd, fd_waiter &w) {
+        uint32_t mask = (w.readers.empty () ? 0 : EPOLLIN) | (w.writers.empty () ? 0 : EPOLLOUT);
+        if (mask == 0) {
+            if (w.registered) {
+                epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            }
+            waiters.erase (fd);
+            return;
+        }
+        struct epoll_event ev = {};
+        ev.events = mask;
+        ev.data.fd = fd;
+        if (epoll_ctl (epoll_fd, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror ("epoll_ctl()");
+        }
+        w.registered = true;
+    }
+};
+
+inline std::coroutine_handle<>
+cc_cotask::promise_type::final_awaiter::await_suspend (std::coroutine_handle<promise_type> h) noexcept
+{
+    promise_type &p = h.promise ();
+    if (p.continuation) {
+        return p.continuation;                          // 呼び出し元を再開
+    }
+    if (p.detached) {
+        if (p.loop) {
+            p.loop->task_done (h);
+        }
+        h.destroy ();                                   // spawn() されたタスクは自分で解放
+    }
+    return std::noop_coroutine ();
+}
+
+/**
+ * @brief コルーチンから co_await する待ち合わせプリミティブ
+ */
+namespace cc_co {
+
+/// fd が読み込み可能になるまで待つ
+struct readable {
+    int fd;
+    explicit readable (int fd) : fd (fd) {}
+    bool await_ready () noexcept { return false; }
+    void await_suspend (std::coroutine_handle<> h) { cc_coloop::current_loop ()->wait_fd (fd, false, h); }
+    void await_resume () noexcept {}
+};
+
+/// fd が書き込み可能になるまで待つ
+struct writable {
+    int fd;
+    explicit writable (int fd) : fd (fd) {}
+    bool await_ready () noexcept { return false; }
+    void await_suspend (std::coroutine_handle<> h) { cc_coloop::current_loop ()->wait_fd (fd, true, h); }
+    void await_resume () noexcept {}
+};
+
+/// 指定時間スリープする
+struct sleep_for {
+    unsigned int ms;
+    explicit sleep_for (unsigned int ms) : ms (ms) {}
+    bool await_ready () noexcept { return false; }
+    void await_suspend (std::coroutine_handle<> h) { cc_coloop::current_loop ()->wait_ms (ms, h); }
+    void await_resume () noexcept {}
+};
+
+/// 受信できるまで待って recv() する、戻り値は recv() と同じ (0:切断)
+inline cc_cotask
+recv_impl (cc_tcpconnect &conn, void *buf, size_t size, ssize_t &result)
+{
+    while (true) {
+        result = ::recv (conn.get_fd (), buf, size, MSG_DONTWAIT);
+        if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            co_return;
+        }
+        co_await readable (conn.get_fd ());
+    }
+}
+struct recv {
+    ssize_t result = -1;
+    cc_cotask task;
+    recv (cc_tcpconnect &conn, void *buf, size_t size) : task (recv_impl (conn, buf, size, result)) {}
+    bool await_ready () noexcept { return false; }
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> h) noexcept { return task.await_suspend (h); }
+    ssize_t await_resume () { return result; }
+};
+
+/// 全データを送信し終わるまで待つ、戻り値は送信バイト数 (-1:エラー)
+inline cc_cotask
+send_impl (cc_tcpconnect &conn, const void *buf, size_t size, ssize_t &result)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t ret = ::send (conn.get_fd (), (const char *)buf + done, size - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret >= 0) {
+            done += ret;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            co_await writable (conn.get_fd ());
+        } else {
+            result = -1;
+            co_return;
+        }
+    }
+    result = (ssize_t)done;
+}
+struct send {
+    ssize_t result = -1;
+    cc_cotask task;
+    send (cc_tcpconnect &conn, const void *buf, size_t size) : task (send_impl (conn, buf, size, result)) {}
+    bool await_ready () noexcept { return false; }
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> h) noexcept { return task.await_suspend (h); }
+    ssize_t await_resume () { return result; }
+};
+
+/// cc_message を受信できるまで待つ、JSON文字列を返す
+/// 起床通知だけ (取り出すものがない) なら空文字列になるので、中身が届くまで待ち直す
+inline cc_cotask
+message_impl (cc_message &msg, std::string &result)
+{
+    do {
+        co_await readable (msg.receiver_get_fd ());
+        result = msg.receiver_recv_json_str ();
+    } while (result.empty ());
+}
+struct message {
+    std::string result;
+    cc_cotask task;
+    explicit message (cc_message &msg) : task (message_impl (msg, result)) {}
+    bool await_ready () noexcept { return false; }
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> h) noexcept { return task.await_suspend (h); }
+    std::string await_resume () { return std::move (result); }
+};
+
+} // namespace cc_co
+
+#endif // __CC_COROUTINE_H__
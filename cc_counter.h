@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_counter.h
+ * @brief per-thread sharded statistics counters for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_COUNTER_H__
+#define __CC_COUNTER_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+#include <algorithm>
+
+/// スレッド分散カウンターのシャード数
+#if !defined(CC_SHARDED_COUNT)
+#define CC_SHARDED_COUNT 16
+#endif
+
+#define CC_COUNTER_CACHELINE    64              ///< キャッシュラインの大きさ
+
+/// 呼び出したスレッドが使うシャード番号 (最初の呼び出しで順番に割り当てる)
+inline unsigned int
+cc_shard_index (void)
+{
+    static std::atomic<unsigned int> next (0);
+    static __thread int index = -1;
+    if (index < 0) {
+        index = (int)(next.fetch_add (1, std::memory_order_relaxed) % CC_SHARDED_COUNT);
+    }
+    return (unsigned int)index;
+}
+
+///
+/// ■■■■■　スレッド分散カウンター
+///
+/// N 個の 64bit カウンターの組をシャードごとに持ち、書き込みはスレッドごとに決まったシャードへ行う。
+/// シャードはキャッシュライン境界に揃えて別に確保するので、別スレッドや持ち主のオブジェクトの
+/// 他のメンバーとキャッシュラインを取り合わず、イベントループのたびに数えても安い。
+/// 読み出しは全シャードを合計 (最大値は全シャードの最大) するだけで、書き込み側を止めない。
+///
+template <int N>
+class cc_sharded_counters {
+private:
+    struct alignas(CC_COUNTER_CACHELINE) shard {
+        std::atomic<uint64_t> v[N];
+    };
+    shard *shards;                              ///< CC_SHARDED_COUNT 個 (キャッシュライン境界に確保)
+
+    cc_sharded_counters (const cc_sharded_counters &);      // コピー禁止
+    cc_sharded_counters &operator= (const cc_sharded_counters &);
+public:
+    cc_sharded_counters (void)
+    {
+        // C++17 より前の new は過剰アラインメントを保証しないので posix_memalign() で確保する
+        void *mem = NULL;
+        if (posix_memalign (&mem, CC_COUNTER_CACHELINE, sizeof(shard) * CC_SHARDED_COUNT) != 0) {
+            throw std::bad_alloc ();
+        }
+        shards = (shard *)mem;
+        for (int i = 0; i < CC_SHARDED_COUNT; i++) {
+            new (&shards[i]) shard;
+        }
+        reset ();
+    }
+    ~cc_sharded_counters ()
+    {
+        for (int i = 0; i < CC_SHARDED_COUNT; i++) {
+            shards[i].~shard ();
+        }
+        free (shards);
+    }
+
+    /// 加算
+    void add (int idx, uint64_t n=1)
+    {
+        shards[cc_shard_index ()].v[idx].fetch_add (n, std::memory_order_relaxed);
+    }
+
+    /// 最大値の更新
+    void update_max (int idx, uint64_t n)
+    {
+        std::atomic<uint64_t> &c = shards[cc_shard_index ()].v[idx];
+        uint64_t cur = c.load (std::memory_order_relaxed);
+        while (cur < n && !c.compare_exchange_weak (cur, n, std::memory_order_relaxed)) {
+        }
+    }
+
+    /// 全シャードの合計
+    uint64_t sum (int idx) const
+    {
+        uint64_t total = 0;
+        for (int i = 0; i < CC_SHARDED_COUNT; i++) {
+            total += shards[i].v[idx].load (std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /// 全シャードの最大値
+    uint64_t max (int idx) const
+    {
+        uint64_t m = 0;
+        for (int i = 0; i < CC_SHARDED_COUNT; i++) {
+            m = std::max (m, shards[i].v[idx].load (std::memory_order_relaxed));
+        }
+        return m;
+    }
+
+    void reset (void)
+    {
+        for (int i = 0; i < CC_SHARDED_COUNT; i++) {
+            for (int j = 0; j < N; j++) {
+                shards[i].v[j].store (0, std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif // __CC_COUNTER_H__
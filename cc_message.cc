@@ -14,6 +14,8 @@
 #include <fcntl.h>              // for O_RDWR etc
 #include <unistd.h>             // for open/close etc
 #include <sys/stat.h>           // for mkfifo etc
+#include <map>
+#include <mutex>
 
 #include "cc_message.h"
 
@@ -27,6 +29,72 @@
 #define CC_MESSAGE_DBGPR(fmt, args...) \
     if (message_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,message_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
 
+// -------------------------------------------------------------------------------------------
+// 同一プロセス内の受信箱の登録簿 (qid -> 受信箱)
+// 終了時の破棄順に依存しないよう解放しない
+
+struct local_entry {
+    int count;                                  ///< 同じ qid の受信側(master)の数
+    std::shared_ptr<cc_message_local> box;
+};
+static std::mutex &
+local_registry_mutex (void)
+{
+    static std::mutex *mtx = new std::mutex;
+    return *mtx;
+}
+static std::map<int, local_entry> &
+local_registry (void)
+{
+    static std::map<int, local_entry> *registry = new std::map<int, local_entry>;
+    return *registry;
+}
+/// 登録簿の版 (登録/削除のたびに増える)、送信側は版が変わるまで見つからなかった結果を使い回す
+static std::atomic<uint64_t> local_generation (1);
+
+/// 受信箱を登録する、同じ qid の受信側が複数あると FIFO を共有するので同一プロセス内配送を止める
+static void
+local_register (int qid, std::shared_ptr<cc_message_local> &box)
+{
+    std::lock_guard<std::mutex> lock(local_registry_mutex());
+    std::map<int, local_entry>::iterator it = local_registry().find (qid);
+    if (it == local_registry().end()) {
+        local_entry entry;
+        entry.count = 1;
+        entry.box = box;
+        local_registry()[qid] = entry;
+    } else {
+        it->second.count++;
+        it->second.box->enabled = false;
+        box->enabled = false;
+    }
+    local_generation.fetch_add (1, std::memory_order_release);
+}
+static void
+local_unregister (int qid, std::shared_ptr<cc_message_local> &box)
+{
+    std::lock_guard<std::mutex> lock(local_registry_mutex());
+    box->enabled = false;
+    std::map<int, local_entry>::iterator it = local_registry().find (qid);
+    if (it != local_registry().end()) {
+        if (--it->second.count <= 0) {
+            local_registry().erase (it);
+        }
+    }
+    local_generation.fetch_add (1, std::memory_order_release);
+}
+static std::shared_ptr<cc_message_local>
+local_lookup (int qid)
+{
+    std::lock_guard<std::mutex> lock(local_registry_mutex());
+    std::map<int, local_entry>::iterator it = local_registry().find (qid);
+    if (it == local_registry().end() || !it->second.box->enabled) {
+        return std::shared_ptr<cc_message_local>();
+    }
+    return it->second.box;
+}
+
+// -------------------------------------------------------------------------------------------
 
 cc_message_base::cc_message_base (std::string nickname)
 {
@@ -35,10 +103,66 @@ cc_message_base::cc_message_base (std::string nickname)
 cc_message_base::~cc_message_base ()
 {}
 
-cc_message::cc_message (key_t send_key, std::string nickname, bool master_flag) :
+/**
+ * @brief コンストラクター
+ * @param send_key    メッセージキー
+ * @param nickname    ニックネーム文字列(デバックプリントで使用)
+ * @param master_flag 受信側 (FIFO を読み書きで開き、同一プロセス内の受信箱を登録する)
+ * @param policy      受信箱を作るタイミング
+ *                    LAZY の受信側は最初の送受信まで FIFO を開かないので、それまでは
+ *                    別の cc_message (送信側) からは送れない
+ */
+cc_message::cc_message (key_t send_key, std::string nickname, bool master_flag, cc_mailbox_policy policy) :
     cc_message_base (nickname)
 {
+    this->send_key    = send_key;
     this->master_flag = master_flag;
+    this->policy      = policy;
+    send_qid = -1;
+    send_fd  = -1;
+    opened   = false;
+    local_miss_gen = 0;
+
+    if (policy == CC_MAILBOX_EAGER) {
+        open_mailbox ();
+    }
+}
+
+cc_message::~cc_message ()
+{
+    if (!opened) {
+        return;
+    }
+    if (master_flag && local) {
+        local_unregister (send_qid, local);
+    }
+    if (send_fd != -1) {
+        close_fifo (send_fd);
+    }
+    if (master_flag && send_qid != -1) {
+        destroy_fifo(send_qid);
+    }
+}
+
+/**
+ * @brief 受信箱を作る (1回だけ、どのスレッドからでも可)
+ * @return true: 使える, false: 作れなかったか CC_MAILBOX_NONE
+ */
+bool
+cc_message::open_mailbox (void)
+{
+    if (opened.load (std::memory_order_acquire)) {
+        return send_fd != -1;
+    }
+    std::lock_guard<std::mutex> lock(open_mtx);
+    if (opened.load (std::memory_order_relaxed)) {
+        return send_fd != -1;
+    }
+    if (policy == CC_MAILBOX_NONE) {
+        CC_MESSAGE_DBGPR ("mailbox disabled\n");
+        opened.store (true, std::memory_order_release);
+        return false;
+    }
 
     this->send_qid = msgget (send_key , 0666 | IPC_CREAT);
     if (this->send_qid == -1) {
@@ -48,36 +172,67 @@ cc_message::cc_message (key_t send_key, std::string nickname, bool master_flag)
     }
     send_fd = open_fifo (this->send_qid, master_flag ? O_RDWR : O_WRONLY);
 
+    // 受信側は同一プロセス内配送用の受信箱を登録する
+    if (master_flag && send_fd != -1) {
+        local = std::make_shared<cc_message_local>();
+        local_register (send_qid, local);
+    }
 
  FINISH:
-    return;
-}
-
-cc_message::~cc_message ()
-{
-    close_fifo (send_fd);
-    if (master_flag) {
-        destroy_fifo(send_qid);
-    }
+    opened.store (true, std::memory_order_release);
+    return send_fd != -1;
 }
 
 int
 cc_message::receiver_get_fd (void)
 {
+    open_mailbox ();
     return send_fd;
 }
 
+/**
+ * @brief メッセージ受信
+ * 同一プロセス内から届いたものを先に取り出す。起床通知はキューが空になるまで FIFO に残しておくので、
+ * キューに残りがある間は receiver_get_fd() が読み込み可能のままになる (1通ごとのシステムコールはない)。
+ * 起床通知だけで取り出すものがなければ空文字列を返す
+ */
 std::string
 cc_message::receiver_recv_json_str (void)
 {
     std::string json_str;
-    
+    cc_message_local::item item;
+
+    // 同一プロセス内配送 (システムコールなし)
+    if (recv_local (item)) {
+        return item.is_obj ? item.json_obj.dump() : item.json_str;
+    }
+    if (!open_mailbox ()) {
+        return json_str;
+    }
+
     // メッセージ受信
     message_packet packet = {0};
     int ret = read (send_fd, (void*)&packet, sizeof(packet)); // 受信
     if (ret == -1) {
-        perror("read()");
-        CC_MESSAGE_ERRPR ("message read error\n");
+        if (errno != EAGAIN) {
+            perror("read()");
+            CC_MESSAGE_ERRPR ("message read error\n");
+        }
+        goto FINISH;
+    }
+    if (packet.com == COM_COMMON_WAKEUP) {
+        // 起床通知はキューが空になってから読むので、ここで次の送信が起床通知を書けるようにする
+        if (local) {
+            local->wake_pending.store (false);
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            if (recv_local (item)) {
+                json_str = item.is_obj ? item.json_obj.dump() : item.json_str;
+            }
+            // 起床通知を書かなかった送信の分が残っていれば、select ループで取りこぼさないよう自分宛てに書く
+            if (local->queue.maybe_nonempty()) {
+                wakeup_local (local.get());
+            }
+        }
         goto FINISH;
     }
     
@@ -92,6 +247,49 @@ cc_message::receiver_recv_json_str (void)
     return json_str;
 }
 
+/**
+ * @brief メッセージ受信 (JSON オブジェクト)
+ * 同一プロセス内から send_json_move() で届いたものはシリアライズせずにそのまま受け取る
+ * @param json_obj 受信したオブジェクトの格納先
+ * @return true: 受信した, false: 受信するものがなかった
+ */
+bool
+cc_message::receiver_recv_json (nlohmann::json &json_obj)
+{
+    cc_message_local::item item;
+    if (recv_local (item)) {
+        if (item.is_obj) {
+            json_obj = std::move (item.json_obj);
+        } else {
+            json_obj = nlohmann::json::parse (item.json_str);
+        }
+        return true;
+    }
+    std::string json_str = receiver_recv_json_str ();
+    if (json_str.empty()) {
+        return false;
+    }
+    json_obj = nlohmann::json::parse (json_str);
+    return true;
+}
+
+/**
+ * @brief 同一プロセス内キューだけから受信する (システムコールなし)
+ * 起床1回で溜まっているメッセージをまとめて取り出すときに使う
+ * @param json_str 受信した文字列の格納先
+ * @return true: 受信した, false: キューが空
+ */
+bool
+cc_message::receiver_try_recv_json_str (std::string &json_str)
+{
+    cc_message_local::item item;
+    if (!recv_local (item)) {
+        return false;
+    }
+    json_str = item.is_obj ? item.json_obj.dump() : item.json_str;
+    return true;
+}
+
 // ----------------------------------------------- newAPI
 std::string
 cc_message::send_json (nlohmann::json &send_json_obj)
@@ -101,7 +299,12 @@ cc_message::send_json (nlohmann::json &send_json_obj)
     int reply_fd  = -1;
 
     bool reply_required = send_json_obj.at("reply_required");
-    
+
+    if (!open_mailbox ()) {
+        CC_MESSAGE_ERRPR ("no mailbox\n");
+        return reply_json_str;
+    }
+
     if (reply_required) {
         reply_qid = msgget (IPC_PRIVATE , 0666 | IPC_CREAT);
         if (reply_qid == -1) {
@@ -110,7 +313,24 @@ cc_message::send_json (nlohmann::json &send_json_obj)
             return "";
         }
         send_json_obj["reply_qid"] = reply_qid;
+        // 返信FIFOは送信前に開いておく (同一プロセス内配送だと送った直後に返信が来る)
+        reply_fd = open_fifo (reply_qid, O_RDONLY);
+        if (reply_fd == -1) {
+            CC_MESSAGE_ERRPR ("reply fifo open error\n");
+            goto FINISH;
+        }
+    }
+
+    // 受信側が同じプロセスにいれば、FIFO を経由せずに渡す
+    // 返信要求付きも同じキューに積む (受信側はキューを先に読むので、FIFO に分けると順序が入れ替わる)
+    {
+        cc_message_local::item item;
+        item.json_str = send_json_obj.dump();
+        if (send_local (std::move (item))) {
+            goto REPLY;
+        }
     }
+
     // メッセージパケットを生成・送信
     {
         message_packet packet = {0};
@@ -157,6 +377,8 @@ cc_message::send_json (nlohmann::json &send_json_obj)
 #endif
     }
 
+
+ REPLY:
     if (reply_qid == -1) {
         // 返信不要ならここで終了
         goto FINISH;
@@ -164,9 +386,6 @@ cc_message::send_json (nlohmann::json &send_json_obj)
 
     // 返信パケットを受信
     {
-        // 返信FIFOをオープン
-        reply_fd = open_fifo (reply_qid, O_RDONLY);
-
         // select() でイベント待ち
         struct timeval timeout = { 5/*sec*/, 0/*usec*/ };
         fd_set  rfds;
@@ -216,6 +435,111 @@ cc_message::send_json (bool reply_required, std::string sender, nlohmann::json &
     return send_json (send_json_obj);
 }
 
+/**
+ * @brief JSON オブジェクトをムーブして送信する
+ * 受信側が同じプロセスにいればシリアライズせずにオブジェクトのまま渡す (返信要求付きは send_json() でキューに積む)
+ */
+std::string
+cc_message::send_json_move (bool reply_required, std::string sender, nlohmann::json &&send_json_obj)
+{
+    send_json_obj["sender"]   = sender;
+    send_json_obj["receiver"] = nickname;
+    send_json_obj["reply_required"] = reply_required;
+
+    if (!reply_required && open_mailbox ()) {
+        cc_message_local::item item;
+        item.json_obj = std::move (send_json_obj);
+        item.is_obj = true;
+        if (send_local (std::move (item))) {
+            return "";
+        }
+        send_json_obj = std::move (item.json_obj); // 失敗時は戻して FIFO で送る
+    }
+    return send_json (send_json_obj);
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief 送信先の同一プロセス内受信箱を取得
+ * 送信側の cc_message は複数スレッドから使われるので local は atomic に読み書きする。
+ * 受信側が後から生成されることもあるので見つかるまで引き直すが、登録簿の版が変わっていなければ引かない
+ * @return 受信箱、受信側が別プロセスなら NULL
+ */
+std::shared_ptr<cc_message_local>
+cc_message::get_local (void)
+{
+    if (master_flag) {
+        // 受信側の local は open_mailbox() で1回だけ設定される
+        if (local && local->enabled) {
+            return local;
+        }
+        return std::shared_ptr<cc_message_local>();
+    }
+    std::shared_ptr<cc_message_local> box = std::atomic_load (&local);
+    if (box && box->enabled) {
+        return box;
+    }
+    uint64_t gen = local_generation.load (std::memory_order_acquire);
+    if (local_miss_gen.load (std::memory_order_relaxed) == gen) {
+        return std::shared_ptr<cc_message_local>();     // 前回引いてから登録簿が変わっていない
+    }
+    box = local_lookup (send_qid);
+    std::atomic_store (&local, box);
+    if (!box) {
+        local_miss_gen.store (gen, std::memory_order_relaxed);
+    }
+    return box;
+}
+
+/**
+ * @brief 同一プロセス内配送
+ * 積んだ直後に受信側が破棄された場合、そのメッセージは捨てられる (FIFO で送っても受信側がいないので同じ)
+ * @return true: キューに積んだ, false: 受信側が別プロセス (FIFO で送ること)
+ */
+bool
+cc_message::send_local (cc_message_local::item &&item)
+{
+    std::shared_ptr<cc_message_local> box = get_local ();
+    if (!box) {
+        return false;
+    }
+    box->queue.push (std::move (item));
+    wakeup_local (box.get());
+#if defined(ENABLE_SENDLOG)
+    CC_MESSAGE_DBGPR("now send local message [-> %s]\n", nickname.c_str());
+#endif
+    return true;
+}
+
+/**
+ * @brief 受信側の起床、起床通知が FIFO に入っていない時だけ書く (キューが空から空でなくなった時)
+ */
+void
+cc_message::wakeup_local (cc_message_local *box)
+{
+    if (box->wake_pending.exchange (true)) {
+        return;                 // 受信側はまだ起床通知を読んでいない
+    }
+    message_packet packet = {0};
+    packet.com = COM_COMMON_WAKEUP;
+    if (write (send_fd, (void*)&packet, sizeof(packet)) == -1) {
+        perror("wakeup_local(): write()");
+        box->wake_pending = false;      // 次の送信で再試行させる
+    }
+}
+
+/**
+ * @brief 同一プロセス内キューから1つ取り出す (受信スレッドのみ)
+ */
+bool
+cc_message::recv_local (cc_message_local::item &item)
+{
+    if (!master_flag || !opened.load (std::memory_order_acquire) || !local) {
+        return false;
+    }
+    return local->queue.pop (item);
+}
 
 int
 cc_message::open_fifo (int qid, int option)
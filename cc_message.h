@@ -15,15 +15,26 @@
 
 #include <nlohmann/json.hpp>
 #include <sstream>		// for std::ostringstream
+#include <memory>               // for std::shared_ptr
+#include <atomic>
+#include <mutex>
 
 #include "cc_message_def.h"
 #include "cc_debugprint.h"
+#include "cc_mpscq.h"
 
 
 #define MKSENDSTR(_sender,_receiver,_json_str)                            \
     (R"({"sender":")" _sender R"(","receiver":")" _receiver R"(",)" _json_str R"(})")
     
 
+/// 受信箱 (msgget() と /tmp/fifo.<qid>) を作るタイミング
+enum cc_mailbox_policy {
+    CC_MAILBOX_EAGER,                           ///< コンストラクターで作る (既定)
+    CC_MAILBOX_LAZY,                            ///< 最初の送受信 (receiver_get_fd() を含む) で作る
+    CC_MAILBOX_NONE,                            ///< 作らない (メッセージを使わないワーカースレッド用)
+};
+
 class cc_message_data {
 public:
     cc_message_data(int arg_com=0);
@@ -55,28 +66,68 @@ public:
     }
 };
 
+/**
+ * @struct cc_message_local
+ * @brief 同一プロセス内配送用の受信箱
+ *
+ * 受信側(master)の cc_message が生成し、qid をキーにプロセス内の登録簿に載せる。
+ * 送信側は返信要求付きも含めて FIFO を経由せずにキューへ積み、空から空でなくなった時だけ FIFO に起床通知を1つ書く。
+ * 受信側は起床通知をキューが空になるまで読まないので、溜まっている間は1通ごとのシステムコールがない。
+ * 積んだ直後に受信側が破棄されると、そのメッセージは失われる。
+ */
+struct cc_message_local {
+    struct item {
+        std::string json_str;                   ///< JSON 文字列 (is_obj == false)
+        nlohmann::json json_obj;                ///< JSON オブジェクト (is_obj == true)
+        bool is_obj;
+        item (void) : is_obj (false) {}
+    };
+    cc_mpscq<item> queue;                       ///< 受信キュー
+    std::atomic<bool> wake_pending;             ///< FIFO に起床通知が入っている (受信側がキューを空にして読むまで)
+    std::atomic<bool> enabled;                  ///< false なら FIFO で送る (同じ qid の受信側が複数ある等)
+
+    cc_message_local (void) : wake_pending (false), enabled (true) {}
+};
+
 class cc_message : public cc_message_base{
 private:
+    key_t send_key;
     int send_qid;
     int send_fd;
     int master_flag;
+    cc_mailbox_policy policy;
+    std::atomic<bool> opened;                   ///< open_mailbox() 済み (成否は send_fd で判断)
+    std::mutex open_mtx;
+    std::shared_ptr<cc_message_local> local;    ///< 同一プロセス内の受信箱 (なければ NULL)
+                                                ///< 送信側は複数スレッドから引き直すので std::atomic_load/store で読み書きする
+    std::atomic<uint64_t> local_miss_gen;       ///< 受信箱が見つからなかったときの登録簿の版 (0 なら未検索)
+
+    bool open_mailbox (void);
+    std::shared_ptr<cc_message_local> get_local (void);
+    bool send_local (cc_message_local::item &&item);
+    bool recv_local (cc_message_local::item &item);
+    void wakeup_local (cc_message_local *box);
 
     int open_fifo (int qid, int option);
     void close_fifo (int fd);
     void destroy_fifo (int qid);
 
 public:
-    cc_message (key_t send_key, std::string nickname, bool master_falg);
+    cc_message (key_t send_key, std::string nickname, bool master_falg,
+                cc_mailbox_policy policy=CC_MAILBOX_EAGER);
     ~cc_message ();
 
     // ----------------------------------------------- API for receiver
     int receiver_get_fd (void);
     std::string receiver_recv_json_str (void);
+    bool receiver_recv_json (nlohmann::json &json_obj);
+    bool receiver_try_recv_json_str (std::string &json_str);
 
     // ----------------------------------------------- API for sender
     std::string send_json (nlohmann::json &send_json_obj);
     std::string send_json (bool reply_required, std::string sender, std::string send_json_str);
     std::string send_json (bool reply_required, std::string sender, nlohmann::json &send_json_obj);
+    std::string send_json_move (bool reply_required, std::string sender, nlohmann::json &&send_json_obj);
 };
 
 #endif // __CC_MESSAGE_H__
@@ -33,6 +33,7 @@ enum {
     COM_COMMON_INVALID,
     COM_COMMON_JSON,
     COM_COMMON_USERCOM,
+    COM_COMMON_WAKEUP,          // 同一プロセス内配送の起床通知 (データなし)
 };
 
 #define CC_MESSAGE_SENDERNAME_MAXLEN 15
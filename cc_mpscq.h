@@ -0,0 +1,83 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_mpscq.h
+ * @brief lock-free multi-producer single-consumer queue for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_MPSCQ_H__
+#define __CC_MPSCQ_H__
+
+#include <atomic>
+#include <utility>
+
+/**
+ * @class cc_mpscq
+ * @brief ロックフリー MPSC キュー (Vyukov 方式の連結リスト)
+ *
+ * push() はどのスレッドから呼んでもよい (wait-free、アトミック交換1回)。
+ * pop() は1つのスレッドだけが呼ぶこと。
+ * push() の途中でプロデューサーが止まると、後続の要素が一時的に見えなくなることがある。
+ * このとき pop() は false を返すが maybe_nonempty() は true を返すので、
+ * 呼び出し側は取りこぼしを防ぐために再度起床するようにすること。
+ */
+template <typename T>
+class cc_mpscq {
+private:
+    struct node {
+        std::atomic<node*> next;
+        T value;
+        node (void) : next (nullptr), value () {}
+        node (T &&v) : next (nullptr), value (std::move (v)) {}
+    };
+
+    std::atomic<node*> head;                    ///< プロデューサー側 (最後に push された要素)
+    node *tail;                                 ///< コンシューマー側 (ダミー要素)
+
+    cc_mpscq (const cc_mpscq &);                // コピー禁止
+    cc_mpscq &operator= (const cc_mpscq &);
+
+public:
+    cc_mpscq (void) {
+        node *stub = new node ();
+        head.store (stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+    ~cc_mpscq () {
+        T dummy;
+        while (pop (dummy)) {}
+        delete tail;
+    }
+
+    /// 要素を追加する (どのスレッドからでも可)
+    void push (T &&value) {
+        node *n = new node (std::move (value));
+        node *prev = head.exchange (n, std::memory_order_acq_rel);
+        prev->next.store (n, std::memory_order_release);
+    }
+
+    /// 要素を取り出す (コンシューマースレッドのみ)
+    bool pop (T &value) {
+        node *t = tail;
+        node *next = t->next.load (std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+        value = std::move (next->value);
+        tail = next;                            // next が新しいダミー要素になる
+        delete t;
+        return true;
+    }
+
+    /// 要素が残っている可能性があるか (コンシューマースレッドのみ)
+    bool maybe_nonempty (void) {
+        return head.load (std::memory_order_acquire) != tail;
+    }
+};
+
+#endif // __CC_MPSCQ_H__
@@ -3,11 +3,11 @@
 /**
  * @file cc_mutex.h
  * @brief mutex class for C++
- * 
+ *
  * Copyright (c) 2023 Yoshikazu Hirai
  * Released under the MIT license
  * https://opensource.org/licenses/mit-license.php
- * 
+ *
  */
 
 #ifndef __CC_MUTEX_H__
@@ -15,18 +15,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+
+#include <pthread.h>
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <string>
 
 #undef CC_MUTEX_DBGPR
 #undef CC_MUTEX_ERRPR
@@ -38,19 +47,178 @@
 
 #if !defined(CC_MUTEX_ENB_DBGPR)
 #define CC_MUTEX_DBGPR(fmt, args...)
-#else 
+#else
 #define CC_MUTEX_DBGPR(fmt, args...)    \
         { printf(" [CC_MUTEX:%s():%d] " fmt,__FUNCTION__,__LINE__,## args); }
 #endif
 
+/// futex で待つ前にスピンする回数
+#if !defined(CC_MUTEX_SPIN_COUNT)
+#define CC_MUTEX_SPIN_COUNT 100
+#endif
+
+/// 待ち時間ヒストグラムのバケット数 (バケット i は 2^i nsec 未満)
+#define CC_MUTEX_HIST_BUCKETS 32
+
+/// スピン中のCPUヒント
+static inline void
+cc_cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause ();
+#elif defined(__aarch64__)
+        __asm__ __volatile__ ("yield");
+#endif
+}
+
+/// 現在時刻 (nsec)
+static inline uint64_t
+cc_mutex_now_ns (void)
+{
+        struct timespec ts;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+///
+/// ■■■■■　mutex 競合統計
+///
+struct cc_mutex_stats {
+        uint64_t acquisitions;                          ///< ロック獲得回数
+        uint64_t contended;                             ///< すぐに獲得できなかった回数
+        uint64_t total_wait_ns;                         ///< 待ち時間の合計
+        uint64_t max_hold_ns;                           ///< 最大保持時間
+        uint64_t wait_hist[CC_MUTEX_HIST_BUCKETS];      ///< 待ち時間ヒストグラム (log2 nsec)
+};
+
 ///
 /// ■■■■■　mutex 制御クラス
 ///
+/// 短時間スピンしてから futex で待つアダプティブ mutex。
+/// enable_stats() すると獲得回数、競合回数、待ち時間ヒストグラム、最大保持時間を記録する。
+/// 統計オフのときの追加コストは分岐1つだけ。
+///
 class cc_mutex {
 private:
-        pthread_mutex_t mtx;
+        std::atomic<int> state;                         ///< 0:未ロック, 1:ロック中, 2:ロック中で待ちあり
+        std::atomic<pid_t> owner;                       ///< 保持スレッドのTID
+        int recursion;                                  ///< 再帰ロック回数 (保持スレッドのみ参照)
         char *mutex_name;
+        bool recursive;
         bool blocker;
+
+        // 統計 (他スレッドから読むので atomic)
+        std::atomic<bool> stats_enabled;
+        std::atomic<uint64_t> st_acquisitions;
+        std::atomic<uint64_t> st_contended;
+        std::atomic<uint64_t> st_total_wait_ns;
+        std::atomic<uint64_t> st_max_hold_ns;
+        std::atomic<uint64_t> st_wait_hist[CC_MUTEX_HIST_BUCKETS];
+        uint64_t lock_start_ns;                         ///< 獲得時刻 (保持スレッドのみ参照)
+
+        // 統計の登録簿 (統計を有効にした mutex だけを繋ぐ双方向リスト、registry_mutex() で保護)
+        cc_mutex *registry_prev;
+        cc_mutex *registry_next;
+        bool registered;
+
+        cc_mutex (const cc_mutex &);                    // コピー禁止
+        cc_mutex &operator= (const cc_mutex &);
+
+        static pid_t self_tid (void)
+        {
+                static __thread pid_t tid = 0;
+                if (tid == 0) {
+                        tid = (pid_t)syscall (SYS_gettid);
+                }
+                return tid;
+        }
+        static long futex (std::atomic<int> *addr, int op, int val)
+        {
+                return syscall (SYS_futex, (int*)addr, op, val, NULL, NULL, 0);
+        }
+
+        /// 獲得処理、競合したら true を返す
+        bool acquire (void)
+        {
+                int c = 0;
+                if (state.compare_exchange_strong (c, 1, std::memory_order_acquire)) {
+                        return false;                   // 競合なし
+                }
+                // しばらくスピンして解放を待つ
+                for (int i = 0; i < CC_MUTEX_SPIN_COUNT; i++) {
+                        cc_cpu_relax ();
+                        c = 0;
+                        if (state.load (std::memory_order_relaxed) == 0
+                            && state.compare_exchange_weak (c, 1, std::memory_order_acquire)) {
+                                return true;
+                        }
+                }
+                // futex で待つ (待ちありを示す 2 にしてから寝る)
+                c = state.exchange (2, std::memory_order_acquire);
+                while (c != 0) {
+                        futex (&state, FUTEX_WAIT_PRIVATE, 2);
+                        c = state.exchange (2, std::memory_order_acquire);
+                }
+                return true;
+        }
+        void release (void)
+        {
+                if (state.exchange (0, std::memory_order_release) == 2) {
+                        futex (&state, FUTEX_WAKE_PRIVATE, 1);
+                }
+        }
+
+        // 統計付き mutex の登録簿 (終了時の破棄順に依存しないよう解放しない)
+        static std::mutex &registry_mutex (void)
+        {
+                static std::mutex *mtx = new std::mutex;
+                return *mtx;
+        }
+        static cc_mutex *&registry_head (void)
+        {
+                static cc_mutex *head = NULL;
+                return head;
+        }
+        /// 登録簿に繋ぐ (統計を有効にしたときだけ、登録済みなら何もしない)
+        void registry_add (void)
+        {
+                std::lock_guard<std::mutex> lock(registry_mutex());
+                if (registered) {
+                        return;
+                }
+                cc_mutex *&head = registry_head();
+                registry_prev = NULL;
+                registry_next = head;
+                if (head != NULL) {
+                        head->registry_prev = this;
+                }
+                head = this;
+                registered = true;
+        }
+        /// 登録簿から外す (O(1))
+        void registry_remove (void)
+        {
+                std::lock_guard<std::mutex> lock(registry_mutex());
+                if (!registered) {
+                        return;
+                }
+                if (registry_prev != NULL) {
+                        registry_prev->registry_next = registry_next;
+                } else {
+                        registry_head() = registry_next;
+                }
+                if (registry_next != NULL) {
+                        registry_next->registry_prev = registry_prev;
+                }
+                registry_prev = registry_next = NULL;
+                registered = false;
+        }
+        static std::atomic<bool> &stats_default (void)
+        {
+                static std::atomic<bool> enb (false);
+                return enb;
+        }
+
 public:
         // ------------------------------------------------------------------------------------------- コンストラクタ、デストラクタ
 
@@ -59,26 +227,42 @@ public:
         {
                 CC_MUTEX_DBGPR ("cc_mutex: instance created\n");
 
-                if (mutex_name == NULL) mutex_name = (char*)"unknown mutex";
-                mutex_name = strdup (arg_mutex_name);
+                mutex_name = strdup ((arg_mutex_name == NULL) ? "unknown mutex" : arg_mutex_name);
+                recursive = enb_recursive_lock;         // true なら再帰的にロックすることを許容する
+                state = 0;
+                owner = 0;
+                recursion = 0;
+                blocker = false;
 
-                if (enb_recursive_lock) {
-                        mtx = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;   // 再帰的にロックすることを許容する
-                } else {
-                        mtx = PTHREAD_MUTEX_INITIALIZER;                                // 再帰的にロックすることを許容しない
+                st_acquisitions = 0;
+                st_contended = 0;
+                st_total_wait_ns = 0;
+                st_max_hold_ns = 0;
+                for (int i = 0; i < CC_MUTEX_HIST_BUCKETS; i++) {
+                        st_wait_hist[i] = 0;
+                }
+                lock_start_ns = 0;
+                registry_prev = registry_next = NULL;
+                registered = false;
+                stats_enabled = stats_default().load();
+                if (stats_enabled) {
+                        registry_add ();
                 }
-                blocker = false;
         };
 
         /// ■■■■■　デストラクタ
         virtual ~cc_mutex ()
         {
+                if (registered) {                       // 統計を使わなかった mutex は登録簿のロックを取らない
+                        registry_remove ();
+                }
                 blocker = true;
-                if (now_locking()) {
+                if (now_locking() && owner.load() == self_tid()) {
+                        recursion = 1;
                         unlock ((char*)__FUNCTION__);
                 }
                 free (mutex_name);
-                
+
                 CC_MUTEX_DBGPR ("cc_mutex: instance deleted\n");
         }
 
@@ -88,40 +272,588 @@ public:
                 if (blocker) {
                         return false;
                 }
-#if (DEBUG_MUTEX)
-                extern FILE *dbgfp;
-                fprintf (dbgfp, "%s:%d: #### MUTEX LOCK start (%s:%s)\n", __FUNCTION__,__LINE__, mutex_name, message);
-                fflush (dbgfp);
-                pthread_mutex_lock (&mtx);
-                //fprintf (dbgfp, "%s:%d: #### MUTEX LOCK done  (%s:%s)\n", __FUNCTION__,__LINE__, mutex_name, message);
-                //fflush (dbgfp);
-#else // (DEBUG_MUTEX)
-                pthread_mutex_lock (&mtx);
-#endif
+                pid_t tid = self_tid();
+                if (recursive && owner.load (std::memory_order_relaxed) == tid) {
+                        recursion++;                    // 再帰ロック
+                        return true;
+                }
+                if (!stats_enabled.load (std::memory_order_relaxed)) {
+                        acquire ();
+                } else {
+                        uint64_t start = cc_mutex_now_ns ();
+                        bool contended = acquire ();
+                        uint64_t now = cc_mutex_now_ns ();
+                        record_acquire (contended, now - start);
+                        lock_start_ns = now;
+                }
+                owner.store (tid, std::memory_order_relaxed);
+                recursion = 1;
+                CC_MUTEX_DBGPR ("MUTEX LOCK (%s:%s)\n", mutex_name, message);
+                return true;
+        }
+
+        /// ■■■■■　ロック試行 (獲得できなければすぐ false を返す)
+        bool try_lock (void)
+        {
+                if (blocker) {
+                        return false;
+                }
+                pid_t tid = self_tid();
+                if (recursive && owner.load (std::memory_order_relaxed) == tid) {
+                        recursion++;
+                        return true;
+                }
+                int c = 0;
+                if (!state.compare_exchange_strong (c, 1, std::memory_order_acquire)) {
+                        return false;
+                }
+                if (stats_enabled.load (std::memory_order_relaxed)) {
+                        record_acquire (false, 0);
+                        lock_start_ns = cc_mutex_now_ns ();
+                }
+                owner.store (tid, std::memory_order_relaxed);
+                recursion = 1;
                 return true;
         }
 
         /// ■■■■■　アンロック
         bool unlock (char *message=(char*)"")
         {
-#if (DEBUG_MUTEX)
-                extern FILE *dbgfp;
-                fprintf (dbgfp, "%s:%d: #### MUTEX UNLOCK start (%s:%s)\n", __FUNCTION__,__LINE__, mutex_name, message);
-                fflush (dbgfp);
-                pthread_mutex_unlock (&mtx);
-                //fprintf (dbgfp, "%s:%d: #### MUTEX UNLOCK done  (%s:%s)\n", __FUNCTION__,__LINE__, mutex_name, message);
-                //fflush (dbgfp);
-#else // (DEBUG_MUTEX)
-                pthread_mutex_unlock (&mtx);
-#endif
+                if (owner.load (std::memory_order_relaxed) != self_tid()) {
+                        CC_MUTEX_WARNPR ("unlock by non-owner thread (%s:%s)\n", mutex_name, message);
+                        return false;
+                }
+                if (--recursion > 0) {
+                        return true;                    // 再帰ロックの途中
+                }
+                if (stats_enabled.load (std::memory_order_relaxed) && lock_start_ns != 0) {
+                        uint64_t hold = cc_mutex_now_ns () - lock_start_ns;
+                        uint64_t max = st_max_hold_ns.load (std::memory_order_relaxed);
+                        while (hold > max && !st_max_hold_ns.compare_exchange_weak (max, hold, std::memory_order_relaxed)) {}
+                }
+                lock_start_ns = 0;
+                owner.store (0, std::memory_order_relaxed);
+                release ();
+                CC_MUTEX_DBGPR ("MUTEX UNLOCK (%s:%s)\n", mutex_name, message);
                 return true;
         }
 
-        /// ■■■■■　ロック助教問い合わせ
+        /// ■■■■■　ロック状態問い合わせ
         bool now_locking (void)
         {
+                return state.load (std::memory_order_relaxed) != 0;
+        }
+
+        // ------------------------------------------------------------------------------------------- 競合統計
+
+        /// ■■■■■　統計の記録を開始/停止
+        void enable_stats (void)  { registry_add (); stats_enabled = true; }
+        void disable_stats (void) { stats_enabled = false; }
+
+        /// ■■■■■　以後生成する cc_mutex の統計記録のデフォルト
+        static void set_stats_default (bool enb) { stats_default() = enb; }
+
+        /// ■■■■■　統計の記録 (lock() から呼ばれる)
+        void record_acquire (bool contended, uint64_t wait_ns)
+        {
+                st_acquisitions.fetch_add (1, std::memory_order_relaxed);
+                if (!contended) {
+                        st_wait_hist[0].fetch_add (1, std::memory_order_relaxed);
+                        return;
+                }
+                st_contended.fetch_add (1, std::memory_order_relaxed);
+                st_total_wait_ns.fetch_add (wait_ns, std::memory_order_relaxed);
+                int bucket = (wait_ns == 0) ? 0 : 64 - __builtin_clzll (wait_ns);
+                if (bucket >= CC_MUTEX_HIST_BUCKETS) bucket = CC_MUTEX_HIST_BUCKETS - 1;
+                st_wait_hist[bucket].fetch_add (1, std::memory_order_relaxed);
+        }
+
+        /// ■■■■■　統計の取得
+        void get_stats (cc_mutex_stats &stats)
+        {
+                stats.acquisitions  = st_acquisitions.load (std::memory_order_relaxed);
+                stats.contended     = st_contended.load (std::memory_order_relaxed);
+                stats.total_wait_ns = st_total_wait_ns.load (std::memory_order_relaxed);
+                stats.max_hold_ns   = st_max_hold_ns.load (std::memory_order_relaxed);
+                for (int i = 0; i < CC_MUTEX_HIST_BUCKETS; i++) {
+                        stats.wait_hist[i] = st_wait_hist[i].load (std::memory_order_relaxed);
+                }
+        }
+
+        /// ■■■■■　名前の取得
+        const char *get_name (void) { return mutex_name; }
+
+        /// ■■■■■　統計を記録している全 mutex を表示 (獲得回数0のものは省略)
+        static void dump_all_stats (FILE *fp=stdout)
+        {
+                std::lock_guard<std::mutex> lock(registry_mutex());
+
+                fprintf (fp, "%-24s %12s %12s %14s %14s  wait histogram (<2^n ns:count)\n",
+                         "mutex", "acquire", "contended", "avg wait(ns)", "max hold(ns)");
+                for (cc_mutex *m = registry_head(); m != NULL; m = m->registry_next) {
+                        cc_mutex_stats st;
+                        m->get_stats (st);
+                        if (st.acquisitions == 0) continue;
+                        fprintf (fp, "%-24s %12llu %12llu %14llu %14llu ",
+                                 m->mutex_name,
+                                 (unsigned long long)st.acquisitions, (unsigned long long)st.contended,
+                                 (unsigned long long)(st.contended ? st.total_wait_ns / st.contended : 0),
+                                 (unsigned long long)st.max_hold_ns);
+                        for (int b = 0; b < CC_MUTEX_HIST_BUCKETS; b++) {
+                                if (st.wait_hist[b]) {
+                                        fprintf (fp, " %d:%llu", b, (unsigned long long)st.wait_hist[b]);
+                                }
+                        }
+                        fprintf (fp, "\n");
+                }
+                fflush (fp);
+        }
+};
+
+///
+/// ■■■■■　reader-writer mutex (writer 優先)
+///
+/// pthread_rwlock を writer 優先で初期化したもの。
+/// writer が待っている間は新しい reader を通さないので、読み込みが多くても更新が止まらない。
+/// std::lock_guard / std::unique_lock でも使えるよう標準と同じ名前の関数を持つ。
+///
+class cc_shared_mutex {
+private:
+        pthread_rwlock_t rwlock;
+
+        cc_shared_mutex (const cc_shared_mutex &);      // コピー禁止
+        cc_shared_mutex &operator= (const cc_shared_mutex &);
+public:
+        cc_shared_mutex (void)
+        {
+                pthread_rwlockattr_t attr;
+                pthread_rwlockattr_init (&attr);
+                pthread_rwlockattr_setkind_np (&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+                pthread_rwlock_init (&rwlock, &attr);
+                pthread_rwlockattr_destroy (&attr);
+        }
+        ~cc_shared_mutex ()
+        {
+                pthread_rwlock_destroy (&rwlock);
+        }
+
+        // writer
+        void lock (void)            { pthread_rwlock_wrlock (&rwlock); }
+        bool try_lock (void)        { return pthread_rwlock_trywrlock (&rwlock) == 0; }
+        void unlock (void)          { pthread_rwlock_unlock (&rwlock); }
+
+        // reader
+        void lock_shared (void)     { pthread_rwlock_rdlock (&rwlock); }
+        bool try_lock_shared (void) { return pthread_rwlock_tryrdlock (&rwlock) == 0; }
+        void unlock_shared (void)   { pthread_rwlock_unlock (&rwlock); }
+};
+
+///
+/// ■■■■■　cc_shared_mutex の reader 用スコープロック
+///
+class cc_shared_lock {
+private:
+        cc_shared_mutex &mtx;
+public:
+        explicit cc_shared_lock (cc_shared_mutex &m) : mtx (m) { mtx.lock_shared (); }
+        ~cc_shared_lock () { mtx.unlock_shared (); }
+};
+
+///
+/// ■■■■■　seqlock (小さな trivially copyable 構造体用)
+///
+/// reader はロックを取らず、書き込みと重なったら読み直すだけなので writer を止めない。
+/// データは 64bit ワード単位の atomic で保持するので、読み直し中の値もデータ競合にはならない。
+/// writer どうしは内部の spin lock で直列化する。
+///
+template <typename T>
+class cc_seqlock {
+private:
+        static_assert (std::is_trivially_copyable<T>::value, "cc_seqlock requires a trivially copyable type");
+        enum { WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+        std::atomic<uint32_t> seq;                      ///< 奇数なら書き込み中
+        std::atomic<uint64_t> data[WORDS];
+        std::atomic_flag writer;
+
+        cc_seqlock (const cc_seqlock &);                // コピー禁止
+        cc_seqlock &operator= (const cc_seqlock &);
+public:
+        cc_seqlock (void)
+        {
+                T init = T();
+                writer.clear ();
+                seq = 0;
+                for (int i = 0; i < WORDS; i++) data[i] = 0;
+                store (init);
+        }
+        explicit cc_seqlock (const T &init)
+        {
+                writer.clear ();
+                seq = 0;
+                for (int i = 0; i < WORDS; i++) data[i] = 0;
+                store (init);
+        }
+
+        /// 書き込み
+        void store (const T &value)
+        {
+                uint64_t buf[WORDS];
+                buf[WORDS - 1] = 0;
+                memcpy (buf, &value, sizeof(T));
+
+                while (writer.test_and_set (std::memory_order_acquire)) {
+                        cc_cpu_relax ();
+                }
+                uint32_t s = seq.load (std::memory_order_relaxed);
+                seq.store (s + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence (std::memory_order_release);
+                for (int i = 0; i < WORDS; i++) {
+                        data[i].store (buf[i], std::memory_order_relaxed);
+                }
+                seq.store (s + 2, std::memory_order_release);
+                writer.clear (std::memory_order_release);
+        }
+
+        /// 読み込み (書き込みと重なったら読み直す)
+        T load (void) const
+        {
+                uint64_t buf[WORDS];
+                uint32_t s1, s2;
+                do {
+                        s1 = seq.load (std::memory_order_acquire);
+                        while (s1 & 1) {
+                                cc_cpu_relax ();
+                                s1 = seq.load (std::memory_order_acquire);
+                        }
+                        for (int i = 0; i < WORDS; i++) {
+                                buf[i] = data[i].load (std::memory_order_relaxed);
+                        }
+                        std::atomic_thread_fence (std::memory_order_acquire);
+                        s2 = seq.load (std::memory_order_relaxed);
+                } while (s1 != s2);
+
+                T value;
+                memcpy (&value, buf, sizeof(T));
+                return value;
+        }
+};
+
+///
+/// ■■■■■　RCU 風ポインタ差し替えホルダー
+///
+/// reader は load() で現在の版の shared_ptr を受け取り、ロックなしでそのまま参照し続けられる。
+/// writer は新しい版を作って store() で差し替える。古い版は最後の reader が手放した時に解放される。
+/// update() は writer どうしを直列化して、現在の版のコピーを変更してから差し替える。
+///
+template <typename T>
+class cc_rcu_ptr {
+private:
+        std::shared_ptr<const T> ptr;
+        std::mutex writer_mtx;                          ///< update() の直列化用 (reader は使わない)
+
+        cc_rcu_ptr (const cc_rcu_ptr &);                // コピー禁止
+        cc_rcu_ptr &operator= (const cc_rcu_ptr &);
+public:
+        cc_rcu_ptr (void) : ptr (std::make_shared<const T>()) {}
+        explicit cc_rcu_ptr (std::shared_ptr<const T> init) : ptr (init) {}
+
+        /// 現在の版を取得
+        std::shared_ptr<const T> load (void) const
+        {
+                return std::atomic_load (&ptr);
+        }
+
+        /// 新しい版に差し替え
+        void store (std::shared_ptr<const T> next)
+        {
+                std::atomic_store (&ptr, next);
+        }
+
+        /// 現在の版をコピーして fn で変更し、差し替える
+        template <typename F>
+        void update (F fn)
+        {
+                std::lock_guard<std::mutex> lock(writer_mtx);
+                std::shared_ptr<T> next = std::make_shared<T>(*load ());
+                fn (*next);
+                store (next);
+        }
+};
+
+///
+/// ■■■■■　名前付き共有メモリセグメント
+///
+/// shm_open() で作成/オープンして mmap する。最初に作成したプロセスだけが初期化関数を呼び、
+/// 他のプロセスは初期化完了を待ってから使う。glibc 2.34 より前では -lrt が必要。
+///
+class cc_shm_segment {
+private:
+        struct header {
+                std::atomic<uint32_t> ready;            ///< 1: 初期化完了
+                uint32_t reserved;
+                uint64_t size;                          ///< データ部のサイズ
+        };
+        std::string shm_name;
+        void *base;
+        size_t map_size;
+
+        cc_shm_segment (const cc_shm_segment &);        // コピー禁止
+        cc_shm_segment &operator= (const cc_shm_segment &);
+public:
+        cc_shm_segment (void) : base (NULL), map_size (0) {}
+        ~cc_shm_segment () { close (); }
+
+        /// ■■■■■　作成/オープン
+        /// @param name    セグメント名 ('/' で始まらなければ付加する)
+        /// @param size    データ部のサイズ
+        /// @param init_fn 作成時だけ呼ぶ初期化関数 void (*)(void *data)
+        /// @param created 作成したら true を返す (NULL可)
+        template <typename F>
+        bool open (const char *name, size_t size, F init_fn, bool *created=NULL)
+        {
+                close ();
+                shm_name = (name[0] == '/') ? name : std::string("/") + name;
+                map_size = sizeof(header) + size;
+                if (created) *created = false;
+
+                bool creator = true;
+                int fd = shm_open (shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+                if (fd == -1 && errno == EEXIST) {
+                        creator = false;
+                        fd = shm_open (shm_name.c_str(), O_RDWR, 0666);
+                }
+                if (fd == -1) {
+                        perror ("shm_open()");
+                        CC_MUTEX_ERRPR ("shm open error (%s)\n", shm_name.c_str());
+                        return false;
+                }
+                if (creator) {
+                        if (ftruncate (fd, map_size) == -1) {
+                                perror ("ftruncate()");
+                                ::close (fd);
+                                shm_unlink (shm_name.c_str());
+                                return false;
+                        }
+                } else {
+                        // 作成側の ftruncate() が終わるまで待つ
+                        struct stat st;
+                        for (int i = 0; ; i++) {
+                                if (fstat (fd, &st) == -1) {
+                                        perror ("fstat()");
+                                        ::close (fd);
+                                        return false;
+                                }
+                                if ((size_t)st.st_size >= map_size) break;
+                                if (st.st_size != 0 || i >= 1000) {
+                                        CC_MUTEX_ERRPR ("shm size mismatch (%s)\n", shm_name.c_str());
+                                        ::close (fd);
+                                        return false;
+                                }
+                                usleep (1000);
+                        }
+                }
+                base = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close (fd);
+                if (base == MAP_FAILED) {
+                        perror ("mmap()");
+                        base = NULL;
+                        return false;
+                }
+                header *hdr = (header*)base;
+                if (creator) {
+                        hdr->size = size;
+                        init_fn (data ());
+                        hdr->ready.store (1, std::memory_order_release);
+                        if (created) *created = true;
+                } else {
+                        for (int i = 0; hdr->ready.load (std::memory_order_acquire) == 0; i++) {
+                                if (i >= 1000) {
+                                        CC_MUTEX_ERRPR ("shm not initialized (%s)\n", shm_name.c_str());
+                                        close ();
+                                        return false;
+                                }
+                                usleep (1000);
+                        }
+                        if (hdr->size != size) {
+                                CC_MUTEX_ERRPR ("shm size mismatch (%s)\n", shm_name.c_str());
+                                close ();
+                                return false;
+                        }
+                }
                 return true;
         }
+        bool open (const char *name, size_t size)
+        {
+                return open (name, size, [](void *) {});
+        }
+
+        /// ■■■■■　アンマップ (セグメント自体は残る)
+        void close (void)
+        {
+                if (base != NULL) {
+                        munmap (base, map_size);
+                        base = NULL;
+                }
+        }
+
+        /// ■■■■■　セグメントの削除 (マップ中のプロセスはそのまま使える)
+        static bool remove (const char *name)
+        {
+                std::string n = (name[0] == '/') ? name : std::string("/") + name;
+                return shm_unlink (n.c_str()) == 0;
+        }
+
+        void *data (void) { return base ? (char*)base + sizeof(header) : NULL; }
+        bool is_valid (void) { return base != NULL; }
+};
+
+///
+/// ■■■■■　プロセス間共有ロバスト mutex
+///
+/// 名前付き共有メモリ上の PTHREAD_PROCESS_SHARED, PTHREAD_MUTEX_ROBUST な mutex。
+/// 保持プロセスが死んだ場合、次に lock() したプロセスが一貫性を回復して recovered=true を受け取る。
+/// その時は保護しているデータを検査/修復してから unlock() すること。
+///
+class cc_shm_mutex {
+private:
+        cc_shm_segment segment;
+        pthread_mutex_t *mtx;
+
+        static void init (void *data)
+        {
+                pthread_mutexattr_t attr;
+                pthread_mutexattr_init (&attr);
+                pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+                pthread_mutex_init ((pthread_mutex_t*)data, &attr);
+                pthread_mutexattr_destroy (&attr);
+        }
+        bool check (int ret, bool *recovered)
+        {
+                if (recovered) *recovered = false;
+                if (ret == 0) {
+                        return true;
+                }
+                if (ret == EOWNERDEAD) {
+                        // 保持プロセスが死んでいた、一貫性を回復して獲得扱いにする
+                        CC_MUTEX_WARNPR ("owner died, recovering mutex\n");
+                        pthread_mutex_consistent (mtx);
+                        if (recovered) *recovered = true;
+                        return true;
+                }
+                if (ret != EBUSY && ret != ETIMEDOUT) {
+                        CC_MUTEX_ERRPR ("pthread_mutex_lock() failed: %s\n", strerror (ret));
+                }
+                return false;
+        }
+
+        cc_shm_mutex (const cc_shm_mutex &);            // コピー禁止
+        cc_shm_mutex &operator= (const cc_shm_mutex &);
+public:
+        /// ■■■■■　コンストラクタ、name の共有メモリを作成/オープンする
+        explicit cc_shm_mutex (const char *name) : mtx (NULL)
+        {
+                if (segment.open (name, sizeof(pthread_mutex_t), init)) {
+                        mtx = (pthread_mutex_t*)segment.data ();
+                }
+        }
+
+        bool is_valid (void) { return mtx != NULL; }
+
+        /// ■■■■■　ロック
+        /// @param recovered 前の保持プロセスが死んでいたら true を返す (NULL可)
+        bool lock (bool *recovered=NULL)
+        {
+                if (mtx == NULL) return false;
+                return check (pthread_mutex_lock (mtx), recovered);
+        }
+        bool try_lock (bool *recovered=NULL)
+        {
+                if (mtx == NULL) return false;
+                return check (pthread_mutex_trylock (mtx), recovered);
+        }
+        bool unlock (void)
+        {
+                if (mtx == NULL) return false;
+                return pthread_mutex_unlock (mtx) == 0;
+        }
+
+        /// ■■■■■　共有メモリの削除
+        static bool remove (const char *name) { return cc_shm_segment::remove (name); }
+
+        pthread_mutex_t *native_handle (void) { return mtx; }
+};
+
+///
+/// ■■■■■　プロセス間共有条件変数
+///
+/// 名前付き共有メモリ上の PTHREAD_PROCESS_SHARED な条件変数 (CLOCK_MONOTONIC)。cc_shm_mutex と組み合わせて使う。
+///
+class cc_shm_cond {
+private:
+        cc_shm_segment segment;
+        pthread_cond_t *cond;
+
+        static void init (void *data)
+        {
+                pthread_condattr_t attr;
+                pthread_condattr_init (&attr);
+                pthread_condattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+                pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+                pthread_cond_init ((pthread_cond_t*)data, &attr);
+                pthread_condattr_destroy (&attr);
+        }
+
+        cc_shm_cond (const cc_shm_cond &);              // コピー禁止
+        cc_shm_cond &operator= (const cc_shm_cond &);
+public:
+        /// ■■■■■　コンストラクタ、name の共有メモリを作成/オープンする
+        explicit cc_shm_cond (const char *name) : cond (NULL)
+        {
+                if (segment.open (name, sizeof(pthread_cond_t), init)) {
+                        cond = (pthread_cond_t*)segment.data ();
+                }
+        }
+
+        bool is_valid (void) { return cond != NULL; }
+
+        /// ■■■■■　待ち (mutex はロックした状態で呼ぶ)
+        /// @param mutex      ロック中の cc_shm_mutex
+        /// @param timeout_ms タイムアウト(msec)、-1 なら無期限
+        /// @param recovered  待ちの間に mutex の保持プロセスが死んでいたら true を返す (NULL可)
+        /// @return true: 起床した, false: タイムアウト/エラー
+        bool wait (cc_shm_mutex &mutex, int timeout_ms=-1, bool *recovered=NULL)
+        {
+                if (recovered) *recovered = false;
+                if (cond == NULL || !mutex.is_valid ()) return false;
+                int ret;
+                if (timeout_ms < 0) {
+                        ret = pthread_cond_wait (cond, mutex.native_handle ());
+                } else {
+                        struct timespec ts;
+                        clock_gettime (CLOCK_MONOTONIC, &ts);
+                        ts.tv_sec  += timeout_ms / 1000;
+                        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+                        if (ts.tv_nsec >= 1000000000L) {
+                                ts.tv_sec++;
+                                ts.tv_nsec -= 1000000000L;
+                        }
+                        ret = pthread_cond_timedwait (cond, mutex.native_handle (), &ts);
+                }
+                if (ret == EOWNERDEAD) {
+                        CC_MUTEX_WARNPR ("owner died, recovering mutex\n");
+                        pthread_mutex_consistent (mutex.native_handle ());
+                        if (recovered) *recovered = true;
+                        return true;
+                }
+                return ret == 0;
+        }
+        bool signal (void)    { return cond != NULL && pthread_cond_signal (cond) == 0; }
+        bool broadcast (void) { return cond != NULL && pthread_cond_broadcast (cond) == 0; }
+
+        /// ■■■■■　共有メモリの削除
+        static bool remove (const char *name) { return cc_shm_segment::remove (name); }
 };
 
 #endif // __CC_MUTEX_H__
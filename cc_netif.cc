@@ -0,0 +1,595 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_netif.cc
+ * @brief cached network interface / route table via rtnetlink for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "cc_netif.h"
+
+// -------------------------------------------------------------------------------------------
+
+/// アドレスのバイト列 (IPv4: 4, IPv6: 16)
+static const unsigned char *
+addr_bytes (const cc_sockaddr &sa, size_t &len)
+{
+    if (sa.family () == AF_INET) {
+        len = 4;
+        return (const unsigned char *)&((const struct sockaddr_in *)&sa.addr)->sin_addr;
+    }
+    if (sa.family () == AF_INET6) {
+        len = 16;
+        return (const unsigned char *)&((const struct sockaddr_in6 *)&sa.addr)->sin6_addr;
+    }
+    len = 0;
+    return NULL;
+}
+
+/// バイト列から cc_sockaddr を作る
+static void
+make_sockaddr (cc_sockaddr &sa, int family, const void *data, size_t len, int ifindex)
+{
+    memset (&sa.addr, 0, sizeof(sa.addr));
+    if (family == AF_INET && len >= 4) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&sa.addr;
+        in->sin_family = AF_INET;
+        memcpy (&in->sin_addr, data, 4);
+        sa.len = sizeof(*in);
+    } else if (family == AF_INET6 && len >= 16) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa.addr;
+        in6->sin6_family = AF_INET6;
+        memcpy (&in6->sin6_addr, data, 16);
+        if (IN6_IS_ADDR_LINKLOCAL(&in6->sin6_addr)) {
+            in6->sin6_scope_id = ifindex;
+        }
+        sa.len = sizeof(*in6);
+    } else {
+        sa.len = 0;
+    }
+}
+
+/// 先頭 bits ビットが一致するか
+static bool
+prefix_match (const unsigned char *a, const unsigned char *b, unsigned int bits)
+{
+    unsigned int bytes = bits / 8;
+    if (memcmp (a, b, bytes) != 0) {
+        return false;
+    }
+    unsigned int rest = bits % 8;
+    if (rest == 0) {
+        return true;
+    }
+    unsigned char mask = (unsigned char)(0xff << (8 - rest));
+    return (a[bytes] & mask) == (b[bytes] & mask);
+}
+
+const cc_netif_addr *
+cc_netif_info::first_addr (int family) const
+{
+    const cc_netif_addr *found = NULL;
+    for (auto it = addrs.begin(); it != addrs.end(); it++) {
+        if (it->addr.family () != family) {
+            continue;
+        }
+        if (it->scope == RT_SCOPE_UNIVERSE) {
+            return &(*it);
+        }
+        if (found == NULL) {
+            found = &(*it);
+        }
+    }
+    return found;
+}
+
+const cc_netif_info *
+cc_netif_table::find (const std::string &name) const
+{
+    for (auto it = ifs.begin(); it != ifs.end(); it++) {
+        if (it->name == name) {
+            return &(*it);
+        }
+    }
+    return NULL;
+}
+
+const cc_netif_info *
+cc_netif_table::find (int index) const
+{
+    for (auto it = ifs.begin(); it != ifs.end(); it++) {
+        if (it->index == index) {
+            return &(*it);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 宛先への経路 (最長一致、同じ長さならメトリックの小さい方)
+ */
+const cc_netif_route *
+cc_netif_table::route (const cc_sockaddr &dst) const
+{
+    size_t len;
+    const unsigned char *a = addr_bytes (dst, len);
+    if (a == NULL) {
+        return NULL;
+    }
+    const cc_netif_route *best = NULL;
+    for (auto it = routes.begin(); it != routes.end(); it++) {
+        if (it->family != dst.family () || !prefix_match (a, it->dst, it->dst_len)) {
+            continue;
+        }
+        if (best == NULL || it->dst_len > best->dst_len
+            || (it->dst_len == best->dst_len && it->priority < best->priority)) {
+            best = &(*it);
+        }
+    }
+    return best;
+}
+
+// -------------------------------------------------------------------------------------------
+
+///
+/// netlink の変更通知を待つスレッド (cc_netif が所有する)
+///
+class cc_netif_watcher : public cc_thread {
+private:
+    cc_netif *owner;
+    int nl_fd;
+public:
+    cc_netif_watcher (cc_netif *owner);
+    virtual ~cc_netif_watcher ();
+    virtual void thread_main (void);
+    bool ready (void) const { return nl_fd != -1; }
+};
+
+/**
+ * @brief 通知のソケットはコンストラクターで購読する (ダンプの前に購読して、間の変更を取りこぼさない)
+ */
+cc_netif_watcher::cc_netif_watcher (cc_netif *owner) :
+    cc_thread (-1, "cc_netif", CC_MAILBOX_NONE),
+    owner (owner)
+{
+    nl_fd = socket (AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (nl_fd == -1) {
+        perror("cc_netif_watcher: socket()");
+        return;
+    }
+    struct sockaddr_nl sa;
+    memset (&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+    if (bind (nl_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror("cc_netif_watcher: bind()");
+        close (nl_fd);
+        nl_fd = -1;
+    }
+}
+
+cc_netif_watcher::~cc_netif_watcher ()
+{
+    if (nl_fd != -1) {
+        close (nl_fd);
+    }
+}
+
+void
+cc_netif_watcher::thread_main (void)
+{
+    std::vector<char> buf (CC_NETIF_RECV_SIZE);
+    while (loop_continue ()) {
+        fd_set readSet;
+        struct timeval timeout;
+        FD_ZERO(&readSet);
+        FD_SET(nl_fd, &readSet);
+        timeout.tv_sec  = 1;
+        timeout.tv_usec = 0;
+        if (thread_select (nl_fd + 1, &readSet, 0, 0, &timeout) <= 0) {
+            continue;
+        }
+        // 通知の中身は見ずに読み捨てて、まとめてダンプし直す
+        // (溢れて ENOBUFS になっても、ダンプし直せば取りこぼしはない)
+        bool changed = false;
+        for (;;) {
+            ssize_t ret = recv (nl_fd, &buf[0], buf.size (), 0);
+            if (ret > 0 || (ret == -1 && errno == ENOBUFS)) {
+                changed = true;
+                continue;
+            }
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (changed && loop_continue ()) {
+            owner->refresh ();
+        }
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+cc_netif::cc_netif (void) :
+    netif_dbg ("cc_netif")
+{
+    //netif_dbg.enable();
+
+    watcher = NULL;
+    loaded  = false;
+}
+
+cc_netif::~cc_netif ()
+{
+    shutdown ();
+}
+
+/**
+ * @brief プロセスで1つのインスタンスを返す
+ */
+cc_netif &
+cc_netif::instance (void)
+{
+    static cc_netif netif;
+    return netif;
+}
+
+/// ダンプ要求を送って、NLMSG_DONE まで fn(nlmsghdr*) を呼ぶ
+template <typename F>
+static bool
+nl_dump (int fd, uint16_t type, int family, uint32_t seq, F fn)
+{
+    struct {
+        struct nlmsghdr nh;
+        union {
+            struct ifinfomsg ifi;
+            struct ifaddrmsg ifa;
+            struct rtmsg rtm;
+        };
+    } req;
+    memset (&req, 0, sizeof(req));
+    req.nh.nlmsg_type  = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq   = seq;
+    if (type == RTM_GETLINK) {
+        req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+        req.ifi.ifi_family = family;
+    } else if (type == RTM_GETADDR) {
+        req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+        req.ifa.ifa_family = family;
+    } else {
+        req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(struct rtmsg));
+        req.rtm.rtm_family = family;
+    }
+    if (send (fd, &req, req.nh.nlmsg_len, 0) == -1) {
+        perror("cc_netif: send()");
+        return false;
+    }
+
+    std::vector<char> buf (CC_NETIF_RECV_SIZE);
+    for (;;) {
+        ssize_t ret = recv (fd, &buf[0], buf.size (), 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cc_netif: recv()");
+            return false;
+        }
+        int len = (int)ret;
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)&buf[0]; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_seq != seq) {
+                continue;
+            }
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                return true;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nh);
+                errno = -err->error;
+                perror("cc_netif: netlink");
+                return false;
+            }
+            fn (nh);
+        }
+    }
+}
+
+/**
+ * @brief リンク/アドレス/経路をダンプして表を作る
+ */
+bool
+cc_netif::dump (cc_netif_table &out)
+{
+    int fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd == -1) {
+        perror("cc_netif::dump: socket()");
+        return false;
+    }
+    struct timeval tv;
+    tv.tv_sec  = 1;                             // カーネルが応答しないことはないが、念のため
+    tv.tv_usec = 0;
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    bool ok = nl_dump (fd, RTM_GETLINK, AF_UNSPEC, 1, [&out](struct nlmsghdr *nh) {
+            struct ifinfomsg *ifi = (struct ifinfomsg *)NLMSG_DATA(nh);
+            cc_netif_info info;
+            info.index = ifi->ifi_index;
+            info.flags = ifi->ifi_flags;
+            int alen = IFLA_PAYLOAD(nh);
+            for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type == IFLA_IFNAME) {
+                    info.name = std::string ((const char *)RTA_DATA(rta), strnlen ((const char *)RTA_DATA(rta), RTA_PAYLOAD(rta)));
+                } else if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+                    info.mtu = *(uint32_t *)RTA_DATA(rta);
+                } else if (rta->rta_type == IFLA_ADDRESS && RTA_PAYLOAD(rta) <= sizeof(info.hwaddr)) {
+                    info.hwaddr_len = RTA_PAYLOAD(rta);
+                    memcpy (info.hwaddr, RTA_DATA(rta), info.hwaddr_len);
+                }
+            }
+            out.ifs.push_back (info);
+        });
+
+    ok = ok && nl_dump (fd, RTM_GETADDR, AF_UNSPEC, 2, [&out](struct nlmsghdr *nh) {
+            struct ifaddrmsg *ifa = (struct ifaddrmsg *)NLMSG_DATA(nh);
+            if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+                return;
+            }
+            struct rtattr *address = NULL, *local = NULL, *broadcast = NULL;
+            int alen = IFA_PAYLOAD(nh);
+            for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                if (rta->rta_type == IFA_ADDRESS) {
+                    address = rta;
+                } else if (rta->rta_type == IFA_LOCAL) {
+                    local = rta;
+                } else if (rta->rta_type == IFA_BROADCAST) {
+                    broadcast = rta;
+                }
+            }
+            // IPv4 の point-to-point では IFA_ADDRESS は相手のアドレスなので IFA_LOCAL を使う
+            struct rtattr *own = (local != NULL) ? local : address;
+            if (own == NULL) {
+                return;
+            }
+            for (auto it = out.ifs.begin(); it != out.ifs.end(); it++) {
+                if (it->index != (int)ifa->ifa_index) {
+                    continue;
+                }
+                cc_netif_addr a;
+                a.prefixlen = ifa->ifa_prefixlen;
+                a.scope     = ifa->ifa_scope;
+                make_sockaddr (a.addr, ifa->ifa_family, RTA_DATA(own), RTA_PAYLOAD(own), ifa->ifa_index);
+                if (broadcast != NULL) {
+                    make_sockaddr (a.broadcast, ifa->ifa_family, RTA_DATA(broadcast), RTA_PAYLOAD(broadcast), ifa->ifa_index);
+                }
+                it->addrs.push_back (a);
+                break;
+            }
+        });
+
+    ok = ok && nl_dump (fd, RTM_GETROUTE, AF_UNSPEC, 3, [&out](struct nlmsghdr *nh) {
+            struct rtmsg *rtm = (struct rtmsg *)NLMSG_DATA(nh);
+            if ((rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+                || (rtm->rtm_type != RTN_UNICAST && rtm->rtm_type != RTN_LOCAL)) {
+                return;
+            }
+            cc_netif_route r;
+            uint32_t table = rtm->rtm_table;
+            size_t alen_max = (rtm->rtm_family == AF_INET) ? 4 : 16;
+            r.family  = rtm->rtm_family;
+            r.dst_len = rtm->rtm_dst_len;
+            int alen = RTM_PAYLOAD(nh);
+            for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+                size_t plen = RTA_PAYLOAD(rta);
+                switch (rta->rta_type) {
+                case RTA_TABLE:
+                    if (plen >= sizeof(uint32_t)) table = *(uint32_t *)RTA_DATA(rta);
+                    break;
+                case RTA_DST:
+                    if (plen == alen_max) memcpy (r.dst, RTA_DATA(rta), plen);
+                    break;
+                case RTA_GATEWAY:
+                    if (plen == alen_max) { memcpy (r.gateway, RTA_DATA(rta), plen); r.has_gateway = true; }
+                    break;
+                case RTA_PREFSRC:
+                    if (plen == alen_max) { memcpy (r.prefsrc, RTA_DATA(rta), plen); r.has_prefsrc = true; }
+                    break;
+                case RTA_OIF:
+                    if (plen >= sizeof(int)) r.oif = *(int *)RTA_DATA(rta);
+                    break;
+                case RTA_PRIORITY:
+                    if (plen >= sizeof(uint32_t)) r.priority = *(uint32_t *)RTA_DATA(rta);
+                    break;
+                case RTA_MULTIPATH:
+                    // ECMP は最初の経路だけ使う
+                    if (r.oif == 0 && plen >= sizeof(struct rtnexthop)) {
+                        r.oif = ((struct rtnexthop *)RTA_DATA(rta))->rtnh_ifindex;
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+            // 自分宛て (local テーブル) と main テーブルだけ (ポリシールーティングは扱わない)
+            if ((table == RT_TABLE_MAIN || table == RT_TABLE_LOCAL) && r.oif != 0) {
+                out.routes.push_back (r);
+            }
+        });
+
+    close (fd);
+    return ok;
+}
+
+/**
+ * @brief 最初の参照で監視スレッドを起動して表を作る
+ */
+void
+cc_netif::ensure_loaded (void)
+{
+    if (loaded.load (std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(start_mtx);
+    if (loaded) {
+        return;
+    }
+    // 先に購読してからダンプする
+    watcher = new cc_netif_watcher (this);
+    if (watcher->ready ()) {
+        watcher->thread_up ();
+    }
+    refresh ();
+    loaded = true;                              // 失敗しても毎回やり直さない (refresh() で再試行できる)
+}
+
+/**
+ * @brief すぐにダンプし直して表を差し替える
+ */
+bool
+cc_netif::refresh (void)
+{
+    std::lock_guard<std::mutex> lock(refresh_mtx);
+    std::shared_ptr<cc_netif_table> next = std::make_shared<cc_netif_table>();
+    if (dump (*next) == false) {
+        CC_NETIF_ERRPR ("rtnetlink dump failed\n");
+        return false;
+    }
+    next->generation = table.load ()->generation + 1;
+    table.store (next);
+    CC_NETIF_DBGPR ("table updated: %lu interfaces, %lu routes\n",
+                    (unsigned long)next->ifs.size (), (unsigned long)next->routes.size ());
+    return true;
+}
+
+/**
+ * @brief 監視スレッドを止める (表はそのまま、次の参照で再開する)
+ */
+void
+cc_netif::shutdown (void)
+{
+    cc_netif_watcher *w;
+    {
+        std::lock_guard<std::mutex> lock(start_mtx);
+        w = watcher;
+        watcher = NULL;
+        loaded = false;
+    }
+    if (w != NULL) {
+        w->set_loop_continue (false);
+        w->thread_down ();
+        delete w;
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+std::shared_ptr<const cc_netif_table>
+cc_netif::snapshot (void)
+{
+    ensure_loaded ();
+    return table.load ();
+}
+
+bool
+cc_netif::find (const std::string &name, cc_netif_info &info)
+{
+    std::shared_ptr<const cc_netif_table> t = snapshot ();
+    const cc_netif_info *p = t->find (name);
+    if (p == NULL) {
+        return false;
+    }
+    info = *p;
+    return true;
+}
+
+bool
+cc_netif::find (int index, cc_netif_info &info)
+{
+    std::shared_ptr<const cc_netif_table> t = snapshot ();
+    const cc_netif_info *p = t->find (index);
+    if (p == NULL) {
+        return false;
+    }
+    info = *p;
+    return true;
+}
+
+/**
+ * @brief 宛先への経路の出力インターフェース
+ * @param src NULL でなければ送信元アドレス (経路の推奨送信元、なければインターフェースの最初のアドレス)
+ */
+bool
+cc_netif::route (const cc_sockaddr &dst, cc_netif_info &info, cc_sockaddr *src)
+{
+    std::shared_ptr<const cc_netif_table> t = snapshot ();
+    const cc_netif_route *r = t->route (dst);
+    if (r == NULL) {
+        return false;
+    }
+    const cc_netif_info *p = t->find (r->oif);
+    if (p == NULL) {
+        return false;
+    }
+    info = *p;
+    if (src != NULL) {
+        if (r->has_prefsrc) {
+            make_sockaddr (*src, r->family, r->prefsrc, (r->family == AF_INET) ? 4 : 16, r->oif);
+        } else {
+            const cc_netif_addr *a = p->first_addr (r->family);
+            *src = (a != NULL) ? a->addr : cc_sockaddr();
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 旧 get_ifinfo() 互換: ifr_name とインターフェースの IPv4 アドレス (ifr_addr) を入れる
+ * @param dst 宛先 (NULL ならデフォルト経路)、経路がなければループバック以外で最初の IPv4 インターフェース
+ */
+bool
+cc_netif::default_ifreq (struct ifreq &ifr, const cc_sockaddr *dst)
+{
+    memset (&ifr, 0, sizeof(ifr));
+    ifr.ifr_addr.sa_family = AF_INET;
+
+    std::shared_ptr<const cc_netif_table> t = snapshot ();
+    const cc_netif_info *p = NULL;
+    cc_sockaddr any;
+    make_sockaddr (any, AF_INET, "\0\0\0\0", 4, 0);
+    const cc_netif_route *r = t->route ((dst != NULL && dst->len > 0) ? *dst : any);
+    if (r != NULL) {
+        p = t->find (r->oif);
+    }
+    if (p == NULL || p->first_addr (AF_INET) == NULL) {
+        p = NULL;
+        for (auto it = t->ifs.begin(); it != t->ifs.end(); it++) {
+            if ((it->flags & IFF_UP) && !(it->flags & IFF_LOOPBACK) && it->first_addr (AF_INET) != NULL) {
+                p = &(*it);
+                break;
+            }
+        }
+    }
+    if (p == NULL) {
+        return false;
+    }
+    strncpy (ifr.ifr_name, p->name.c_str(), IFNAMSIZ - 1);
+    const cc_netif_addr *a = p->first_addr (AF_INET);
+    if (a != NULL) {
+        memcpy (&ifr.ifr_addr, &a->addr.addr, sizeof(struct sockaddr_in));
+    }
+    return true;
+}
@@ -0,0 +1,138 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_netif.h
+ * @brief cached network interface / route table via rtnetlink for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_NETIF_H__
+#define __CC_NETIF_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <net/if.h>
+
+#include "cc_thread.h"
+#include "cc_mutex.h"
+#include "cc_resolver.h"
+
+#define CC_NETIF_RECV_SIZE      65536           ///< netlink の受信バッファ
+
+/**
+ * @struct cc_netif_addr
+ * @brief インターフェースのアドレス (IPv4/IPv6)
+ */
+struct cc_netif_addr {
+    cc_sockaddr addr;                           ///< アドレス (ポートは 0)
+    cc_sockaddr broadcast;                      ///< ブロードキャストアドレス (IPv4 のみ、なければ len=0)
+    unsigned int prefixlen;                     ///< プレフィックス長
+    unsigned int scope;                         ///< RT_SCOPE_UNIVERSE/LINK/HOST
+};
+
+/**
+ * @struct cc_netif_info
+ * @brief ネットワークインターフェース
+ */
+struct cc_netif_info {
+    int index;                                  ///< インターフェース番号
+    std::string name;                           ///< "eth0" など
+    unsigned int flags;                         ///< IFF_UP/IFF_LOOPBACK/...
+    unsigned int mtu;
+    unsigned char hwaddr[16];                   ///< MAC アドレス
+    unsigned int hwaddr_len;
+    std::vector<cc_netif_addr> addrs;
+
+    cc_netif_info (void) : index (0), flags (0), mtu (0), hwaddr_len (0) { memset (hwaddr, 0, sizeof(hwaddr)); }
+    const cc_netif_addr *first_addr (int family) const;     // 最初のグローバル (なければリンク) アドレス
+};
+
+/**
+ * @struct cc_netif_route
+ * @brief 経路 (main テーブルのユニキャスト経路と local テーブルの自分宛て経路)
+ */
+struct cc_netif_route {
+    int family;                                 ///< AF_INET/AF_INET6
+    unsigned char dst[16];                      ///< 宛先プレフィックス (ネットワークバイトオーダー)
+    unsigned int dst_len;                       ///< プレフィックス長 (0 ならデフォルト経路)
+    unsigned char gateway[16];
+    bool has_gateway;
+    unsigned char prefsrc[16];                  ///< 推奨送信元アドレス
+    bool has_prefsrc;
+    int oif;                                    ///< 出力インターフェース番号
+    uint32_t priority;                          ///< メトリック (小さいほど優先)
+
+    cc_netif_route (void) : family (0), dst_len (0), has_gateway (false), has_prefsrc (false), oif (0), priority (0) {
+        memset (dst, 0, sizeof(dst)); memset (gateway, 0, sizeof(gateway)); memset (prefsrc, 0, sizeof(prefsrc));
+    }
+};
+
+/**
+ * @struct cc_netif_table
+ * @brief インターフェースと経路の表 (版ごとに作り直して差し替える、参照中は変わらない)
+ */
+struct cc_netif_table {
+    std::vector<cc_netif_info> ifs;
+    std::vector<cc_netif_route> routes;
+    uint64_t generation;                        ///< 作り直すたびに増える
+
+    cc_netif_table (void) : generation (0) {}
+    const cc_netif_info *find (const std::string &name) const;
+    const cc_netif_info *find (int index) const;
+    const cc_netif_route *route (const cc_sockaddr &dst) const;  // 最長一致、同じ長さならメトリック順
+};
+
+class cc_netif_watcher;
+
+///
+/// ■■■■■　ネットワークインターフェース表 (プロセスで1つ)
+///
+/// 最初の参照で rtnetlink からリンク/アドレス/経路をダンプして表を作り、
+/// 以降は監視スレッドが netlink の変更通知を受けて表を作り直す。
+/// 参照は cc_rcu_ptr の現在の版を取るだけなので、システムコールもロックの競合もない。
+///
+class cc_netif {
+private:
+    cc_rcu_ptr<cc_netif_table> table;
+    std::mutex refresh_mtx;                     ///< ダンプと差し替えを直列化する (古い版で上書きしない)
+    std::mutex start_mtx;                       ///< 以下を保護する
+    cc_netif_watcher *watcher;
+    std::atomic<bool> loaded;                   ///< 最初のダンプ済み (参照の速い経路はロックしない)
+
+    cc_netif (void);
+    ~cc_netif ();
+    cc_netif (const cc_netif &);                // コピー禁止
+    cc_netif &operator= (const cc_netif &);
+
+    bool dump (cc_netif_table &out);
+    void ensure_loaded (void);
+    friend class cc_netif_watcher;
+
+public:
+    static cc_netif &instance (void);
+
+    std::shared_ptr<const cc_netif_table> snapshot (void);      // 現在の版 (保持している間は変わらない)
+    bool find (const std::string &name, cc_netif_info &info);
+    bool find (int index, cc_netif_info &info);
+    bool route (const cc_sockaddr &dst, cc_netif_info &info, cc_sockaddr *src=NULL);   // dst への経路のインターフェース
+    bool default_ifreq (struct ifreq &ifr, const cc_sockaddr *dst=NULL);              // 旧 get_ifinfo() 互換
+    bool refresh (void);                        // すぐにダンプし直す
+    void shutdown (void);                       // 監視スレッドを止める (次の参照で再開する)
+
+    cc_debugprint netif_dbg;                    /// cclib debugprint
+};
+
+#define CC_NETIF_ERRPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### ERROR!: " fmt,netif_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+#define CC_NETIF_DBGPR(fmt, args...) \
+    if (netif_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,netif_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+
+#endif // __CC_NETIF_H__
@@ -18,6 +18,7 @@ cc_pipeexec::cc_pipeexec(void)
 {
     pipe_fd = -1;
     pid = 0;
+    outputLines = std::make_shared<std::vector<std::string> >();
 }
     
 bool
@@ -25,12 +26,10 @@ cc_pipeexec::executeCommand(std::string &cmd)
 {
     int pipes[2];             // パイプ
 
-    // 配列を初期化する
-    {
-        std::lock_guard<std::mutex> lock(mtx); // mutexをロック
-        outputLines.clear();
-        outputModified = false;
-    }
+    // 配列を初期化する (以前のスナップショットは前の領域を持ったまま残る)
+    outputLines = std::make_shared<std::vector<std::string> >();
+    outputLines->reserve(CC_PIPEEXEC_LINES_INIT);
+    publishOutput();
 
     if (pipe(pipes) == -1) {
         throw std::runtime_error("pipe(): Failed to pipe create");
@@ -114,8 +113,45 @@ cc_pipeexec::getOutputAll(std::vector<std::string> &result)
         result.clear();
         throw std::runtime_error("get_outputAll(): pipe fd is ZERO error");
     }
+    std::shared_ptr<const cc_pipeexec_output> snapshot = getOutputSnapshot();
+    result.assign(snapshot->begin(), snapshot->end());
     return true;
 }
+
+/**
+ * @brief 出力行のスナップショットを取得 (ポインタを読むだけ、読み込みスレッドを止めない)
+ */
+std::shared_ptr<const cc_pipeexec_output>
+cc_pipeexec::getOutputSnapshot(void)
+{
+    return outputSnapshot.load();
+}
+
+/**
+ * @brief 出力行を1行追加する (読み込みスレッド)
+ * 公開済みの行は書き換えず、容量の中で末尾に追加する。容量を超えたら倍の領域にコピーして乗り換えるので、
+ * コピーは償却 O(1)。古い領域は、それを見ているスナップショットがなくなった時点で解放される
+ */
+void
+cc_pipeexec::appendOutput(const std::string &line)
+{
+    if (outputLines->size() == outputLines->capacity()) {
+        std::shared_ptr<std::vector<std::string> > next = std::make_shared<std::vector<std::string> >();
+        next->reserve(std::max((size_t)CC_PIPEEXEC_LINES_INIT, outputLines->capacity() * 2));
+        next->insert(next->end(), outputLines->begin(), outputLines->end());
+        outputLines = next;
+    }
+    outputLines->push_back(line);
+}
+
+/**
+ * @brief ここまでの出力行を公開版として差し替える (読み込みスレッド、読み込みごとに1回)
+ */
+void
+cc_pipeexec::publishOutput(void)
+{
+    outputSnapshot.store(std::make_shared<const cc_pipeexec_output>(outputLines, outputLines->size()));
+}
     
 int
 cc_pipeexec::get_fd(void)
@@ -148,8 +184,7 @@ cc_pipeexec::simpleExecuteCommand(std::string &cmd)
 {
     // exception は呼び元で受ける前提
     if (executeCommand(cmd) == false) {
-        outputLines.clear();
-        return outputLines;
+        return std::vector<std::string>();
     }
 
     // 以下、標準出力・エラーを読み取る処理
@@ -171,16 +206,17 @@ cc_pipeexec::simpleExecuteCommand(std::string &cmd)
                     partial_line += buffer;
                     
                     size_t newline_pos;
+                    size_t added = 0;
                     while ((newline_pos = partial_line.find('\n')) != std::string::npos) {
                         std::string line = partial_line.substr(0, newline_pos);
                         partial_line.erase(0, newline_pos + 1);
                         
                         // 行単位で処理
-                        {
-                            std::lock_guard<std::mutex> lock(mtx);
-                            outputLines.push_back(line);
-                            outputModified = true;
-                        }
+                        appendOutput(line);
+                        added++;
+                    }
+                    if (added > 0) {
+                        publishOutput();    // 読み込んだ分をまとめて公開する
                     }
                 } else {
                     // パイプの終端に達した
@@ -204,7 +240,7 @@ cc_pipeexec::simpleExecuteCommand(std::string &cmd)
 
     finish(0);
     
-    return outputLines;
+    return std::vector<std::string>(outputLines->begin(), outputLines->end());
 }
 
 //int
@@ -20,12 +20,38 @@
 #include <string>
 #include <unistd.h>
 #include <string.h>
+#include <memory>
+
+#include "cc_mutex.h"
+
+#define CC_PIPEEXEC_LINES_INIT  64      ///< 出力行の領域の初期容量 (行)
+
+/**
+ * @brief 出力行のスナップショット (作った時点までの行、以後変わらない)
+ * 読み込みスレッドが追加していく領域を共有し、先頭 count 行だけを見せる
+ */
+class cc_pipeexec_output {
+private:
+    std::shared_ptr<const std::vector<std::string> > lines;
+    size_t count;
+public:
+    cc_pipeexec_output(void) : count(0) {}
+    cc_pipeexec_output(std::shared_ptr<const std::vector<std::string> > lines, size_t count) : lines(lines), count(count) {}
+
+    size_t size(void) const { return count; }
+    bool empty(void) const { return count == 0; }
+    const std::string &operator[](size_t i) const { return lines->data()[i]; }
+    const std::string *begin(void) const { return count ? lines->data() : NULL; }
+    const std::string *end(void) const { return count ? lines->data() + count : NULL; }
+};
 
 class cc_pipeexec {
 private:
     int pipe_fd;
-    bool outputModified;
-    std::vector<std::string> outputLines;
+    std::shared_ptr<std::vector<std::string> > outputLines; ///< 出力行 (読み込みスレッドだけが追加する)
+    cc_rcu_ptr<cc_pipeexec_output> outputSnapshot;          ///< 公開版 (読み込みスレッドが読み込みのたびに差し替える)
+    void appendOutput(const std::string &line);
+    void publishOutput(void);
 public:
     std::mutex mtx;                     ///< 変数保護用MUTEX @n 変数を直接参照する時にはロックすること
     pid_t pid;
@@ -34,6 +60,7 @@ public:
     
     bool executeCommand(std::string &cmd);
     bool getOutputAll(std::vector<std::string> &result);
+    std::shared_ptr<const cc_pipeexec_output> getOutputSnapshot(void);
     bool pipeClose(void);
     void finish(pid_t finpid);
 
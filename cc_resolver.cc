@@ -0,0 +1,385 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_resolver.cc
+ * @brief asynchronous host name resolver with cache for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <chrono>
+
+#include "cc_resolver.h"
+
+/// 時刻取得 (nsec)
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// -------------------------------------------------------------------------------------------
+
+void
+cc_sockaddr::set_port (unsigned int port)
+{
+    if (addr.ss_family == AF_INET) {
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+    } else if (addr.ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+    }
+}
+
+std::string
+cc_sockaddr::str (void) const
+{
+    char buf[INET6_ADDRSTRLEN];
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&addr;
+        inet_ntop (AF_INET, &in->sin_addr, buf, sizeof(buf));
+        return std::string (buf) + ":" + std::to_string (ntohs(in->sin_port));
+    }
+    if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&addr;
+        inet_ntop (AF_INET6, &in6->sin6_addr, buf, sizeof(buf));
+        return "[" + std::string (buf) + "]:" + std::to_string (ntohs(in6->sin6_port));
+    }
+    return "";
+}
+
+/// 数値表記のアドレスならスレッドを使わずに変換する
+static bool
+parse_numeric (const std::string &host, cc_sockaddr &sa)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *)&sa.addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa.addr;
+    if (inet_pton (AF_INET, host.c_str(), &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        sa.len = sizeof(*in);
+        return true;
+    }
+    // "[::1]" 形式も受け付ける
+    std::string h = host;
+    if (h.size () > 2 && h[0] == '[' && h[h.size () - 1] == ']') {
+        h = h.substr (1, h.size () - 2);
+    }
+    if (inet_pton (AF_INET6, h.c_str(), &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        sa.len = sizeof(*in6);
+        return true;
+    }
+    return false;
+}
+
+// -------------------------------------------------------------------------------------------
+
+///
+/// 名前解決スレッド (cc_resolver が所有する)
+///
+class cc_resolver_worker : public cc_thread {
+private:
+    cc_resolver *owner;
+public:
+    cc_resolver_worker (cc_resolver *owner) : cc_thread (-1, "cc_resolver", CC_MAILBOX_NONE), owner (owner) {}
+    virtual ~cc_resolver_worker () {}
+    virtual void thread_main (void) {
+        while (loop_continue () && owner->worker_step ()) {
+        }
+    }
+};
+
+cc_resolver::cc_resolver (void) :
+    resolver_dbg ("cc_resolver")
+{
+    //resolver_dbg.enable();
+
+    running         = false;
+    ttl_ms          = CC_RESOLVER_TTL_MS;
+    negative_ttl_ms = CC_RESOLVER_NEGATIVE_TTL_MS;
+    sweep_ns        = 0;
+}
+
+cc_resolver::~cc_resolver ()
+{
+    shutdown ();
+}
+
+/**
+ * @brief プロセスで1つのインスタンスを返す
+ */
+cc_resolver &
+cc_resolver::instance (void)
+{
+    static cc_resolver resolver;
+    return resolver;
+}
+
+void
+cc_resolver::start_workers (void)
+{
+    if (workers.empty () == false) {
+        return;
+    }
+    running = true;
+    for (int i = 0; i < CC_RESOLVER_WORKERS; i++) {
+        cc_resolver_worker *w = new cc_resolver_worker (this);
+        workers.push_back (w);
+        w->thread_up ();
+    }
+    CC_RESOLVER_DBGPR ("%d workers started\n", CC_RESOLVER_WORKERS);
+}
+
+/**
+ * @brief 期限切れのエントリーを消す
+ * 解決中のものと、結果を待っている resolve()/resolve_async() があるものは残す
+ * @param all true なら期限に関係なく消せるものをすべて消す (flush())
+ */
+void
+cc_resolver::evict_expired (bool all)
+{
+    uint64_t now = monotonic_ns ();
+    for (auto it = cache.begin(); it != cache.end(); ) {
+        entry &e = it->second;
+        if (!e.pending && e.refs == 0 && e.waiters.empty () && (all || e.expire <= now)) {
+            it = cache.erase (it);
+        } else {
+            if (all) {
+                e.expire = 0;
+            }
+            ++it;
+        }
+    }
+    sweep_ns = now + (uint64_t)CC_RESOLVER_SWEEP_MS * 1000000ULL;
+}
+
+/**
+ * @brief 名前解決スレッドを止める
+ * getaddrinfo() の実行中ならその完了を待つ。キューに残った要求は EAI_AGAIN で失敗させ、
+ * 待っている resolve()/resolve_async() に通知する (次の要求で名前解決スレッドを再開する)。
+ */
+void
+cc_resolver::shutdown (void)
+{
+    std::vector<cc_resolver_worker*> stopping;
+    std::vector<cc_resolver_callback> waiters;
+    {
+        std::lock_guard<std::mutex> lock(res_mtx);
+        running = false;
+        stopping.swap (workers);
+        for (auto &host : queue) {
+            entry &e = cache[host];
+            e.err     = EAI_AGAIN;
+            e.addrs.clear ();
+            e.expire  = 0;                      // キャッシュしない
+            e.pending = false;
+            for (auto &cb : e.waiters) {
+                waiters.push_back (cb);
+            }
+            e.waiters.clear ();
+        }
+        queue.clear ();
+    }
+    queue_cond.notify_all ();
+    res_cond.notify_all ();
+    std::vector<cc_sockaddr> none;
+    for (auto &cb : waiters) {
+        cb (EAI_AGAIN, none);
+    }
+    for (cc_resolver_worker *w : stopping) {
+        w->thread_down ();
+        delete w;
+    }
+}
+
+/**
+ * @brief 名前解決スレッドの1回分の処理、キューから1件取り出して getaddrinfo() する
+ * @return false: 停止する
+ */
+bool
+cc_resolver::worker_step (void)
+{
+    std::string host;
+    {
+        std::unique_lock<std::mutex> lock(res_mtx);
+        queue_cond.wait_for (lock, std::chrono::seconds(1),
+                             [this] { return !queue.empty () || !running; });
+        if (running == false) {
+            return false;
+        }
+        if (queue.empty ()) {
+            return true;
+        }
+        host = queue.front ();
+        queue.pop_front ();
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_ADDRCONFIG;
+    int err = getaddrinfo (host.c_str(), NULL, &hints, &res);
+    std::vector<cc_sockaddr> addrs;
+    for (struct addrinfo *ai = res; err == 0 && ai != NULL; ai = ai->ai_next) {
+        if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        cc_sockaddr sa;
+        memcpy (&sa.addr, ai->ai_addr, ai->ai_addrlen);
+        sa.len = ai->ai_addrlen;
+        addrs.push_back (sa);
+    }
+    if (res != NULL) {
+        freeaddrinfo (res);
+    }
+    if (err == 0 && addrs.empty ()) {
+        err = EAI_NONAME;
+    }
+    CC_RESOLVER_DBGPR ("%s: %s (%lu addresses)\n", host.c_str(),
+                       err == 0 ? "ok" : gai_strerror(err), (unsigned long)addrs.size ());
+
+    std::vector<cc_resolver_callback> waiters;
+    {
+        std::lock_guard<std::mutex> lock(res_mtx);
+        entry &e = cache[host];
+        e.err     = err;
+        e.addrs   = addrs;
+        e.expire  = monotonic_ns () + (uint64_t)(err == 0 ? ttl_ms : negative_ttl_ms) * 1000000ULL;
+        e.pending = false;
+        waiters.swap (e.waiters);
+    }
+    res_cond.notify_all ();
+    for (auto &cb : waiters) {
+        cb (err, addrs);
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief ホスト名を解決する (キャッシュにあればすぐに返る)
+ * 名前解決は専用スレッドで行い、呼び出し側は timeout_ms まで待つ。
+ * タイムアウトしても問い合わせは続き、結果はキャッシュされる。
+ * @param timeout_ms 待つ最大時間 (msec)、負なら無制限
+ * @return true: 成功、false: 失敗 (タイムアウトなら errno=ETIMEDOUT)
+ */
+bool
+cc_resolver::resolve (const std::string &host, std::vector<cc_sockaddr> &addrs, int timeout_ms)
+{
+    addrs.clear ();
+    cc_sockaddr sa;
+    if (parse_numeric (host, sa)) {
+        addrs.push_back (sa);
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(res_mtx);
+    if (monotonic_ns () >= sweep_ns) {
+        evict_expired (false);
+    }
+    entry &e = cache[host];
+    if (e.pending == false && e.expire > monotonic_ns ()) {
+        addrs = e.addrs;
+        if (e.err != 0) {
+            errno = EHOSTUNREACH;
+        }
+        return e.err == 0;
+    }
+    if (e.pending == false) {
+        e.pending = true;
+        queue.push_back (host);
+        start_workers ();
+        queue_cond.notify_one ();
+    }
+    auto done = [&e] { return e.pending == false; };
+    e.refs++;                                   // 待っている間は消させない
+    bool ok = true;
+    if (timeout_ms < 0) {
+        res_cond.wait (lock, done);
+    } else {
+        ok = res_cond.wait_for (lock, std::chrono::milliseconds(timeout_ms), done);
+    }
+    e.refs--;
+    if (!ok) {
+        CC_RESOLVER_ERRPR ("%s: timeout (%d msec)\n", host.c_str(), timeout_ms);
+        errno = ETIMEDOUT;
+        return false;
+    }
+    if (e.err != 0) {
+        CC_RESOLVER_ERRPR ("%s: %s\n", host.c_str(), gai_strerror(e.err));
+        errno = EHOSTUNREACH;
+        return false;
+    }
+    addrs = e.addrs;
+    return true;
+}
+
+/**
+ * @brief ホスト名を非同期に解決する
+ * キャッシュにあれば呼び出したスレッドで、なければ名前解決スレッドで callback を呼ぶ。
+ */
+void
+cc_resolver::resolve_async (const std::string &host, cc_resolver_callback callback)
+{
+    std::vector<cc_sockaddr> addrs;
+    cc_sockaddr sa;
+    if (parse_numeric (host, sa)) {
+        addrs.push_back (sa);
+        callback (0, addrs);
+        return;
+    }
+    int err;
+    {
+        std::lock_guard<std::mutex> lock(res_mtx);
+        if (monotonic_ns () >= sweep_ns) {
+            evict_expired (false);
+        }
+        entry &e = cache[host];
+        if (e.pending || e.expire <= monotonic_ns ()) {
+            e.waiters.push_back (callback);
+            if (e.pending == false) {
+                e.pending = true;
+                queue.push_back (host);
+                start_workers ();
+                queue_cond.notify_one ();
+            }
+            return;
+        }
+        err   = e.err;
+        addrs = e.addrs;
+    }
+    callback (err, addrs);
+}
+
+/**
+ * @brief キャッシュ時間の設定
+ * @param ttl_ms 解決結果をキャッシュする時間 (msec)
+ * @param negative_ttl_ms 解決失敗をキャッシュする時間 (msec)
+ */
+void
+cc_resolver::set_ttl (int ttl_ms, int negative_ttl_ms)
+{
+    std::lock_guard<std::mutex> lock(res_mtx);
+    this->ttl_ms          = ttl_ms;
+    this->negative_ttl_ms = negative_ttl_ms;
+}
+
+void
+cc_resolver::flush (void)
+{
+    // 解決を待っているスレッドが参照しているエントリーは、消さずに期限切れにする
+    std::lock_guard<std::mutex> lock(res_mtx);
+    evict_expired (true);
+}
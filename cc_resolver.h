@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_resolver.h
+ * @brief asynchronous host name resolver with cache for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_RESOLVER_H__
+#define __CC_RESOLVER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/socket.h>
+
+#include "cc_thread.h"
+
+#define CC_RESOLVER_WORKERS         4           ///< 名前解決スレッドの数
+#define CC_RESOLVER_TTL_MS          60000       ///< 解決結果をキャッシュする時間 (msec)
+#define CC_RESOLVER_NEGATIVE_TTL_MS 5000        ///< 解決失敗をキャッシュする時間 (msec)
+#define CC_RESOLVER_SWEEP_MS        10000       ///< 期限切れのエントリーを掃除する間隔 (msec)
+
+/**
+ * @struct cc_sockaddr
+ * @brief IPv4/IPv6 どちらも入るソケットアドレス
+ */
+struct cc_sockaddr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+
+    cc_sockaddr (void) : len (0) { memset (&addr, 0, sizeof(addr)); }
+    int family (void) const { return addr.ss_family; }
+    const struct sockaddr *sa (void) const { return (const struct sockaddr *)&addr; }
+    void set_port (unsigned int port);
+    std::string str (void) const;               // "192.0.2.1:80" / "[2001:db8::1]:80"
+};
+
+/// resolve_async() の完了コールバック (err は getaddrinfo() の戻り値、0: 成功)
+typedef std::function<void (int err, const std::vector<cc_sockaddr> &addrs)> cc_resolver_callback;
+
+class cc_resolver_worker;
+
+///
+/// ■■■■■　名前解決 (プロセスで1つ)
+///
+/// getaddrinfo() を専用スレッドで実行し、結果をホスト名ごとにキャッシュする。
+/// getaddrinfo() は TTL を返さないので、キャッシュ時間は set_ttl() で設定する。
+/// 同じホストの解決中に来た要求は、実行中の問い合わせの結果を待つ。
+/// 解決結果は getaddrinfo() の優先順 (RFC 6724) のまま、ポートは 0 で返す。
+///
+class cc_resolver {
+private:
+    struct entry {
+        int err;                                ///< getaddrinfo() の戻り値
+        std::vector<cc_sockaddr> addrs;
+        uint64_t expire;                        ///< 期限 (CLOCK_MONOTONIC, nsec)
+        bool pending;                           ///< 解決中
+        int refs;                               ///< 結果を待っている resolve() の数 (0 になるまで消さない)
+        std::vector<cc_resolver_callback> waiters;
+        entry (void) : err (0), expire (0), pending (false), refs (0) {}
+    };
+
+    std::mutex res_mtx;                         ///< 以下を保護する
+    std::condition_variable res_cond;           ///< 解決完了の通知
+    std::condition_variable queue_cond;         ///< 要求の通知 (名前解決スレッド向け)
+    std::map<std::string, entry> cache;
+    std::deque<std::string> queue;              ///< 解決待ちのホスト名
+    std::vector<cc_resolver_worker*> workers;
+    bool running;
+    int ttl_ms;
+    int negative_ttl_ms;
+    uint64_t sweep_ns;                          ///< 次に期限切れのエントリーを掃除する時刻
+
+    cc_resolver (void);
+    ~cc_resolver ();
+    cc_resolver (const cc_resolver &);          // コピー禁止
+    cc_resolver &operator= (const cc_resolver &);
+
+    void start_workers (void);                  // res_mtx をロックして呼ぶ
+    void evict_expired (bool all);              // res_mtx をロックして呼ぶ
+    bool worker_step (void);
+    friend class cc_resolver_worker;
+
+public:
+    static cc_resolver &instance (void);
+
+    bool resolve (const std::string &host, std::vector<cc_sockaddr> &addrs, int timeout_ms=-1);
+    void resolve_async (const std::string &host, cc_resolver_callback callback);
+    void set_ttl (int ttl_ms, int negative_ttl_ms=CC_RESOLVER_NEGATIVE_TTL_MS);
+    void flush (void);                          // キャッシュを捨てる
+    void shutdown (void);                       // 名前解決スレッドを止め、解決待ちの要求は失敗させる (次の要求で再開する)
+
+    cc_debugprint resolver_dbg;                 /// cclib debugprint
+};
+
+#define CC_RESOLVER_ERRPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### ERROR!: " fmt,resolver_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+#define CC_RESOLVER_DBGPR(fmt, args...) \
+    if (resolver_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,resolver_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+
+#endif // __CC_RESOLVER_H__
@@ -0,0 +1,650 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_shmstore.cc
+ * @brief shared-memory key-value state store for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <string.h>             // for memset/strncmp
+#include <errno.h>              // for errno
+#include <fcntl.h>              // for open
+#include <unistd.h>             // for read/write/close/unlink
+#include <signal.h>             // for kill/pthread_sigmask
+#include <sched.h>              // for sched_yield
+#include <sys/stat.h>           // for mkfifo
+
+#include "cc_shmstore.h"
+
+/// デバックプリント エラー表示用マクロ、enableの是非に関わらず表示
+#define CC_SHMSTORE_ERRPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### ERROR!: " fmt,shmstore_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+/// デバックプリント 警告表示用マクロ、enableの是非に関わらず表示
+#define CC_SHMSTORE_WARNPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### WARNING!: " fmt,shmstore_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+/// デバックプリント デバック表示用マクロ、enableのときだけ表示
+#define CC_SHMSTORE_DBGPR(fmt, args...) \
+    if (shmstore_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,shmstore_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+
+/// エントリの状態
+#define CC_SHMSTORE_EMPTY       0       ///< 未使用
+#define CC_SHMSTORE_USED        1       ///< 値あり
+#define CC_SHMSTORE_ERASED      2       ///< 削除済み (キーは残る)
+
+/// 共有メモリ上のストア管理領域
+struct cc_shmstore::store_header {
+    uint32_t capacity;
+    uint32_t value_maxlen;
+    std::atomic<uint64_t> change_count;                         ///< ストア全体の変更回数
+    std::atomic<uint32_t> used;                                 ///< 使用中のエントリ数 (削除済みを含む)
+    std::atomic<int32_t> subscribers[CC_SHMSTORE_MAX_SUBSCRIBERS];  ///< 購読プロセスの pid (0:空き)
+};
+
+/// 共有メモリ上のエントリ、直後に value_maxlen バイト(8バイト単位)の値が続く
+/// key と hash は作成時に1度だけ書き、以降は変更しない。
+/// 値 (type/len/値本体) は seq による seqlock で保護する。奇数のあいだは書き込み中。
+struct cc_shmstore::entry_header {
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> state;
+    std::atomic<uint32_t> type;
+    std::atomic<uint32_t> len;
+    uint32_t hash;
+    uint32_t reserved;
+    char key[CC_SHMSTORE_KEY_MAXLEN + 1];
+};
+
+static uint32_t
+shmstore_hash (const std::string &key)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < key.size(); i++) {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief コンストラクター、name の共有メモリを作成/オープンする
+ * @param name         ストア名 (共有メモリ名、FIFO名に使う)
+ * @param capacity     エントリ数 (作成時のみ有効、既存のストアと一致しなければエラー)
+ * @param value_maxlen 値の最大長(バイト)
+ */
+cc_shmstore::cc_shmstore (const char *name, uint32_t capacity, uint32_t value_maxlen) :
+    shmstore_dbg (name),
+    store_name (name),
+    wlock ((std::string(name) + ".wlock").c_str())
+{
+    hdr          = NULL;
+    entries      = NULL;
+    notify_fd    = -1;
+    notify_slot  = -1;
+    this->capacity     = (capacity == 0) ? 1 : capacity;
+    this->value_maxlen = value_maxlen;
+    entry_size   = sizeof(entry_header) + ((value_maxlen + 7) & ~7u);
+
+    if (!wlock.is_valid ()) {
+        CC_SHMSTORE_ERRPR ("writer lock open error\n");
+        return;
+    }
+    uint32_t cap = this->capacity;
+    uint32_t vmax = value_maxlen;
+    size_t esize = entry_size;
+    if (!segment.open (name, sizeof(store_header) + (size_t)cap * esize,
+                       [cap, vmax, esize](void *data) {
+                           // ftruncate() 直後の共有メモリはゼロ埋めされているので、ヘッダーだけ設定する
+                           store_header *h = (store_header*)data;
+                           h->capacity = cap;
+                           h->value_maxlen = vmax;
+                       })) {
+        CC_SHMSTORE_ERRPR ("shm open error\n");
+        return;
+    }
+    store_header *h = (store_header*)segment.data ();
+    if (h->capacity != this->capacity || h->value_maxlen != this->value_maxlen) {
+        CC_SHMSTORE_ERRPR ("store geometry mismatch (capacity %u/%u, value_maxlen %u/%u)\n",
+                           h->capacity, this->capacity, h->value_maxlen, this->value_maxlen);
+        segment.close ();
+        return;
+    }
+    hdr     = h;
+    entries = (char*)segment.data () + sizeof(store_header);
+}
+
+/**
+ * @brief デストラクター、購読を解除する (共有メモリは残る)
+ */
+cc_shmstore::~cc_shmstore ()
+{
+    unsubscribe ();
+    for (std::map<int,int>::iterator it = notify_out.begin(); it != notify_out.end(); ++it) {
+        close (it->second);
+    }
+    notify_out.clear ();
+}
+
+bool
+cc_shmstore::is_valid (void)
+{
+    return hdr != NULL;
+}
+
+/**
+ * @brief ストアの削除 (共有メモリと書き込みロック)
+ */
+bool
+cc_shmstore::remove (const char *name)
+{
+    bool ret = cc_shm_segment::remove (name);
+    cc_shm_mutex::remove ((std::string(name) + ".wlock").c_str());
+    return ret;
+}
+
+// -------------------------------------------------------------------------------------------
+
+cc_shmstore::entry_header *
+cc_shmstore::entry_at (uint32_t index)
+{
+    return (entry_header*)(entries + (size_t)index * entry_size);
+}
+
+/**
+ * @brief キーのエントリを探す (削除済みも含む)
+ * @return エントリ番号、なければ -1
+ */
+int32_t
+cc_shmstore::find (const std::string &key, uint32_t hash)
+{
+    for (uint32_t i = 0; i < capacity; i++) {
+        uint32_t idx = (hash + i) % capacity;
+        entry_header *e = entry_at (idx);
+        uint32_t state = e->state.load (std::memory_order_acquire);
+        if (state == CC_SHMSTORE_EMPTY) {
+            return -1;                          // 線形探索の終端
+        }
+        if (e->hash == hash && strncmp (e->key, key.c_str(), sizeof(e->key)) == 0) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+/// 値本体の書き込み、seqlock の読み手と競合するので8バイト単位のアトミック操作で行う
+void
+cc_shmstore::write_bytes (entry_header *e, const void *data, uint32_t len)
+{
+    std::atomic<uint64_t> *dst = (std::atomic<uint64_t>*)(e + 1);
+    const char *src = (const char*)data;
+    for (uint32_t off = 0; off < len; off += 8) {
+        uint64_t w = 0;
+        memcpy (&w, src + off, (len - off < 8) ? len - off : 8);
+        dst[off / 8].store (w, std::memory_order_relaxed);
+    }
+}
+
+void
+cc_shmstore::read_bytes (entry_header *e, uint32_t len, std::string &data)
+{
+    std::atomic<uint64_t> *src = (std::atomic<uint64_t>*)(e + 1);
+    data.resize (len);
+    for (uint32_t off = 0; off < len; off += 8) {
+        uint64_t w = src[off / 8].load (std::memory_order_relaxed);
+        memcpy (&data[off], &w, (len - off < 8) ? len - off : 8);
+    }
+}
+
+/**
+ * @brief 書き込みロックの獲得
+ * 前の保持プロセスが書き込み途中で死んでいた場合、奇数のまま残った seq を偶数に戻す
+ * (その値は途中までしか書かれていない可能性があるが、読み手が止まり続けるのを防ぐ)
+ */
+bool
+cc_shmstore::writer_lock (void)
+{
+    bool recovered = false;
+    if (!wlock.lock (&recovered)) {
+        CC_SHMSTORE_ERRPR ("writer lock error\n");
+        return false;
+    }
+    if (recovered) {
+        for (uint32_t i = 0; i < capacity; i++) {
+            entry_header *e = entry_at (i);
+            uint32_t seq = e->seq.load (std::memory_order_relaxed);
+            if (seq & 1) {
+                CC_SHMSTORE_WARNPR ("entry %u (%s) was being written by a dead process\n", i, e->key);
+                e->seq.store (seq + 1, std::memory_order_release);
+            }
+        }
+    }
+    return true;
+}
+
+void
+cc_shmstore::writer_unlock (void)
+{
+    wlock.unlock ();
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief 値の書き込み (書き込みロック内で seqlock を更新し、購読者に通知する)
+ */
+bool
+cc_shmstore::set_value (const std::string &key, value_type type, const void *data, uint32_t len)
+{
+    if (hdr == NULL) {
+        return false;
+    }
+    if (key.empty() || key.size() > CC_SHMSTORE_KEY_MAXLEN) {
+        CC_SHMSTORE_ERRPR ("invalid key length (%zu)\n", key.size());
+        return false;
+    }
+    if (len > value_maxlen) {
+        CC_SHMSTORE_ERRPR ("value too long (%s, %u > %u)\n", key.c_str(), len, value_maxlen);
+        return false;
+    }
+    uint32_t hash = shmstore_hash (key);
+    if (!writer_lock ()) {
+        return false;
+    }
+
+    bool ret = false;
+    int32_t idx = find (key, hash);
+    if (idx == -1) {
+        // 新規エントリ、探索列上の最初の空きを使う
+        for (uint32_t i = 0; i < capacity; i++) {
+            uint32_t n = (hash + i) % capacity;
+            if (entry_at (n)->state.load (std::memory_order_relaxed) == CC_SHMSTORE_EMPTY) {
+                idx = n;
+                break;
+            }
+        }
+        if (idx == -1) {
+            CC_SHMSTORE_ERRPR ("store full (%s)\n", key.c_str());
+            goto FINISH;
+        }
+        entry_header *e = entry_at (idx);
+        e->hash = hash;
+        memset (e->key, 0, sizeof(e->key));
+        memcpy (e->key, key.c_str(), key.size());
+        hdr->used.fetch_add (1, std::memory_order_relaxed);
+    }
+    {
+        entry_header *e = entry_at (idx);
+        uint32_t seq = e->seq.load (std::memory_order_relaxed);
+        e->seq.store (seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+        e->type.store (type, std::memory_order_relaxed);
+        e->len.store (len, std::memory_order_relaxed);
+        write_bytes (e, data, len);
+        e->state.store (CC_SHMSTORE_USED, std::memory_order_release);
+        e->seq.store (seq + 2, std::memory_order_release);
+    }
+    hdr->change_count.fetch_add (1, std::memory_order_release);
+    notify_all ();
+    ret = true;
+
+ FINISH:
+    writer_unlock ();
+    return ret;
+}
+
+/**
+ * @brief 値の読み出し (ロックなし、書き込み中なら読み直す)
+ * @return true: キーあり
+ */
+bool
+cc_shmstore::get_value (const std::string &key, value_type &type, std::string &data)
+{
+    type = TYPE_NONE;
+    if (hdr == NULL) {
+        return false;
+    }
+    int32_t idx = find (key, shmstore_hash (key));
+    if (idx == -1) {
+        return false;
+    }
+    entry_header *e = entry_at (idx);
+    uint32_t state;
+    for (int spin = 0; ; spin++) {
+        uint32_t seq = e->seq.load (std::memory_order_acquire);
+        if ((seq & 1) == 0) {
+            state = e->state.load (std::memory_order_relaxed);
+            type  = (value_type)e->type.load (std::memory_order_relaxed);
+            uint32_t len = e->len.load (std::memory_order_relaxed);
+            if (len > value_maxlen) {
+                len = value_maxlen;             // 書き込み途中の値、下の seq 比較で読み直しになる
+            }
+            read_bytes (e, len, data);
+            std::atomic_thread_fence (std::memory_order_acquire);
+            if (e->seq.load (std::memory_order_relaxed) == seq) {
+                break;
+            }
+        }
+        if (spin < CC_MUTEX_SPIN_COUNT) {
+            cc_cpu_relax ();
+        } else {
+            sched_yield ();
+        }
+    }
+    if (state != CC_SHMSTORE_USED) {
+        type = TYPE_NONE;
+        return false;
+    }
+    return true;
+}
+
+bool
+cc_shmstore::set_int (const std::string &key, int64_t value)
+{
+    return set_value (key, TYPE_INT, &value, sizeof(value));
+}
+
+bool
+cc_shmstore::set_double (const std::string &key, double value)
+{
+    return set_value (key, TYPE_DOUBLE, &value, sizeof(value));
+}
+
+bool
+cc_shmstore::set_string (const std::string &key, const std::string &value)
+{
+    return set_value (key, TYPE_STRING, value.data(), value.size());
+}
+
+bool
+cc_shmstore::set_json (const std::string &key, const nlohmann::json &value)
+{
+    std::string str = value.dump ();
+    return set_value (key, TYPE_JSON, str.data(), str.size());
+}
+
+bool
+cc_shmstore::get_int (const std::string &key, int64_t &value)
+{
+    value_type type;
+    std::string data;
+    if (!get_value (key, type, data) || type != TYPE_INT || data.size() != sizeof(value)) {
+        return false;
+    }
+    memcpy (&value, data.data(), sizeof(value));
+    return true;
+}
+
+bool
+cc_shmstore::get_double (const std::string &key, double &value)
+{
+    value_type type;
+    std::string data;
+    if (!get_value (key, type, data) || type != TYPE_DOUBLE || data.size() != sizeof(value)) {
+        return false;
+    }
+    memcpy (&value, data.data(), sizeof(value));
+    return true;
+}
+
+bool
+cc_shmstore::get_string (const std::string &key, std::string &value)
+{
+    value_type type;
+    if (!get_value (key, type, value) || type != TYPE_STRING) {
+        return false;
+    }
+    return true;
+}
+
+bool
+cc_shmstore::get_json (const std::string &key, nlohmann::json &value)
+{
+    value_type type;
+    std::string data;
+    if (!get_value (key, type, data) || type != TYPE_JSON) {
+        return false;
+    }
+    value = nlohmann::json::parse (data, nullptr, false);
+    if (value.is_discarded ()) {
+        CC_SHMSTORE_ERRPR ("json parse error (%s)\n", key.c_str());
+        return false;
+    }
+    return true;
+}
+
+cc_shmstore::value_type
+cc_shmstore::get_type (const std::string &key)
+{
+    value_type type;
+    std::string data;
+    get_value (key, type, data);
+    return type;
+}
+
+/**
+ * @brief キーの変更回数 (書き込み/削除のたびに1増える)
+ * @return 変更回数、キーがなければ 0
+ */
+uint64_t
+cc_shmstore::get_version (const std::string &key)
+{
+    if (hdr == NULL) {
+        return 0;
+    }
+    int32_t idx = find (key, shmstore_hash (key));
+    if (idx == -1) {
+        return 0;
+    }
+    return entry_at (idx)->seq.load (std::memory_order_acquire) / 2;
+}
+
+uint64_t
+cc_shmstore::get_change_count (void)
+{
+    if (hdr == NULL) {
+        return 0;
+    }
+    return hdr->change_count.load (std::memory_order_acquire);
+}
+
+/**
+ * @brief キーの削除 (エントリはキーを残したまま削除済みになる)
+ */
+bool
+cc_shmstore::erase (const std::string &key)
+{
+    if (hdr == NULL) {
+        return false;
+    }
+    if (!writer_lock ()) {
+        return false;
+    }
+    bool ret = false;
+    int32_t idx = find (key, shmstore_hash (key));
+    if (idx != -1) {
+        entry_header *e = entry_at (idx);
+        if (e->state.load (std::memory_order_relaxed) == CC_SHMSTORE_USED) {
+            uint32_t seq = e->seq.load (std::memory_order_relaxed);
+            e->seq.store (seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence (std::memory_order_release);
+            e->state.store (CC_SHMSTORE_ERASED, std::memory_order_relaxed);
+            e->seq.store (seq + 2, std::memory_order_release);
+            hdr->change_count.fetch_add (1, std::memory_order_release);
+            notify_all ();
+            ret = true;
+        }
+    }
+    writer_unlock ();
+    return ret;
+}
+
+// -------------------------------------------------------------------------------------------
+
+std::string
+cc_shmstore::fifo_path (int pid)
+{
+    std::string base = (store_name[0] == '/') ? store_name.substr (1) : store_name;
+    return "/tmp/cc_shmstore." + base + "." + std::to_string (pid);
+}
+
+/**
+ * @brief 変更通知の購読
+ * 返した fd はストアが変更されるたびに読み込み可能になる (select/epoll で待つ)。
+ * 起床後は drain_notify() で読み捨ててから、必要な値を読み直すこと。
+ * @return 通知 fd、エラーなら -1
+ */
+int
+cc_shmstore::subscribe (void)
+{
+    if (hdr == NULL) {
+        return -1;
+    }
+    if (notify_fd != -1) {
+        return notify_fd;
+    }
+    int pid = getpid ();
+    std::string path = fifo_path (pid);
+    if (mkfifo (path.c_str(), 0666) == -1 && errno != EEXIST) {
+        perror ("mkfifo()");
+        CC_SHMSTORE_ERRPR ("fifo create error (%s)\n", path.c_str());
+        return -1;
+    }
+    // 書き込み側がいなくても開けるように非ブロッキングで開く
+    notify_fd = open (path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (notify_fd == -1) {
+        perror ("open()");
+        CC_SHMSTORE_ERRPR ("fifo open error (%s)\n", path.c_str());
+        unlink (path.c_str());
+        return -1;
+    }
+    // 空きスロット、または死んだプロセスのスロットを使う
+    for (int i = 0; i < CC_SHMSTORE_MAX_SUBSCRIBERS; i++) {
+        int32_t cur = hdr->subscribers[i].load (std::memory_order_acquire);
+        if (cur != 0 && cur != pid && !(kill (cur, 0) == -1 && errno == ESRCH)) {
+            continue;
+        }
+        if (hdr->subscribers[i].compare_exchange_strong (cur, pid, std::memory_order_acq_rel)) {
+            notify_slot = i;
+            CC_SHMSTORE_DBGPR ("subscribed slot %d (%s)\n", i, path.c_str());
+            return notify_fd;
+        }
+    }
+    CC_SHMSTORE_ERRPR ("too many subscribers\n");
+    close (notify_fd);
+    notify_fd = -1;
+    unlink (path.c_str());
+    return -1;
+}
+
+void
+cc_shmstore::unsubscribe (void)
+{
+    if (notify_fd == -1) {
+        return;
+    }
+    int32_t pid = getpid ();
+    if (hdr != NULL && notify_slot != -1) {
+        hdr->subscribers[notify_slot].compare_exchange_strong (pid, 0, std::memory_order_acq_rel);
+    }
+    close (notify_fd);
+    notify_fd   = -1;
+    notify_slot = -1;
+    unlink (fifo_path (getpid ()).c_str());
+}
+
+/**
+ * @brief 通知 fd にたまったデータを読み捨てる
+ * @return 読んだバイト数 (前回からの変更回数の目安、FIFO が満杯の間の変更は数えられない)
+ */
+int
+cc_shmstore::drain_notify (void)
+{
+    if (notify_fd == -1) {
+        return 0;
+    }
+    int total = 0;
+    char buf[256];
+    for (;;) {
+        ssize_t n = read (notify_fd, buf, sizeof(buf));
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        break;
+    }
+    return total;
+}
+
+/**
+ * @brief 購読者全員の FIFO に1バイト書く (書き込みロック内で呼ぶ)
+ * FIFO は購読者ごとに1回だけ開いて使い回す。満杯なら既に通知済みなので捨てる。
+ * 読み手がいなくなった FIFO への書き込みは EPIPE で分かるので、SIGPIPE は要らない。
+ * プロセス全体で SIGPIPE を無視していればそのまま書く。そうでなければ呼び出しスレッドで
+ * 一時的にブロックし、自分の書き込みで SIGPIPE を出したときだけ、それを読み捨ててから戻す
+ * (元々ブロックしていたなら、アプリケーションが保留している SIGPIPE と区別できないので読み捨てない)。
+ */
+void
+cc_shmstore::notify_all (void)
+{
+    sigset_t pipeset, oldset;
+    bool checked = false;
+    bool blocked = false;
+    bool raised = false;                        // 自分の書き込みで SIGPIPE を出した
+    for (int i = 0; i < CC_SHMSTORE_MAX_SUBSCRIBERS; i++) {
+        int32_t pid = hdr->subscribers[i].load (std::memory_order_acquire);
+        if (pid == 0) {
+            continue;
+        }
+        if (!checked) {
+            checked = true;
+            struct sigaction sa;
+            if (sigaction (SIGPIPE, NULL, &sa) == -1 || sa.sa_handler != SIG_IGN) {
+                sigemptyset (&pipeset);
+                sigaddset (&pipeset, SIGPIPE);
+                pthread_sigmask (SIG_BLOCK, &pipeset, &oldset);
+                blocked = true;
+            }
+        }
+        std::map<int,int>::iterator it = notify_out.find (pid);
+        int fd;
+        if (it != notify_out.end()) {
+            fd = it->second;
+        } else {
+            fd = open (fifo_path (pid).c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd == -1) {
+                // 読み手がいない、プロセスが死んでいればスロットを空ける
+                if (kill (pid, 0) == -1 && errno == ESRCH) {
+                    hdr->subscribers[i].compare_exchange_strong (pid, 0, std::memory_order_acq_rel);
+                }
+                continue;
+            }
+            notify_out[pid] = fd;
+        }
+        char c = 1;
+        if (write (fd, &c, 1) == -1 && errno != EAGAIN) {
+            // EPIPE: 読み手が閉じた、次回開き直す
+            if (errno == EPIPE) {
+                raised = true;
+            }
+            CC_SHMSTORE_DBGPR ("notify pid %d failed: %s\n", pid, strerror (errno));
+            close (fd);
+            notify_out.erase (pid);
+        }
+    }
+    if (blocked) {
+        if (raised && !sigismember (&oldset, SIGPIPE)) {
+            // 自分が出した SIGPIPE を捨ててから元に戻す (ブロックしていなかったので他に保留中のものはない)
+            struct timespec ts = {0, 0};
+            while (sigtimedwait (&pipeset, NULL, &ts) > 0) {}
+        }
+        pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+    }
+}
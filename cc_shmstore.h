@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_shmstore.h
+ * @brief shared-memory key-value state store for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_SHMSTORE_H__
+#define __CC_SHMSTORE_H__
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <nlohmann/json.hpp>
+
+#include "cc_mutex.h"
+#include "cc_debugprint.h"
+
+#define CC_SHMSTORE_KEY_MAXLEN          63      ///< キーの最大長
+#define CC_SHMSTORE_MAX_SUBSCRIBERS     32      ///< 変更通知を受けるプロセスの最大数
+
+/**
+ * @class cc_shmstore
+ * @brief 共有メモリ上の固定容量キー・バリューストア
+ *
+ * 名前付き共有メモリにオープンアドレス法のハッシュテーブルを置く。
+ * 値はエントリごとの seqlock で保護されるので、読み出しはロックなしのメモリ読み込みだけで済む。
+ * 書き込みはプロセス間共有のロバスト mutex で直列化する。
+ * subscribe() で得た fd は、どこかのプロセスが値を変更するたびに読み込み可能になる。
+ *
+ * 値の型は 整数(int64)、実数(double)、文字列、JSON(文字列として格納) の4種類。
+ * エントリは削除しても領域を再利用しないので、容量は使用するキーの数より十分大きくすること。
+ * 変更通知は /tmp 以下の FIFO をプロセスごとに1つ作って行う (1プロセス1購読)。
+ * 購読者がいるとき、SIGPIPE を signal(SIGPIPE, SIG_IGN) で無視しているプロセスの set() は
+ * シグナルマスクを操作しないので速い。
+ */
+class cc_shmstore {
+public:
+    enum value_type {
+        TYPE_NONE = 0,
+        TYPE_INT,
+        TYPE_DOUBLE,
+        TYPE_STRING,
+        TYPE_JSON,
+    };
+
+    cc_shmstore (const char *name, uint32_t capacity=1024, uint32_t value_maxlen=256);
+    virtual ~cc_shmstore ();
+
+    bool is_valid (void);
+
+    // 書き込み
+    bool set_int (const std::string &key, int64_t value);
+    bool set_double (const std::string &key, double value);
+    bool set_string (const std::string &key, const std::string &value);
+    bool set_json (const std::string &key, const nlohmann::json &value);
+    bool erase (const std::string &key);
+
+    // 読み出し (ロックなし)
+    bool get_int (const std::string &key, int64_t &value);
+    bool get_double (const std::string &key, double &value);
+    bool get_string (const std::string &key, std::string &value);
+    bool get_json (const std::string &key, nlohmann::json &value);
+    value_type get_type (const std::string &key);
+    uint64_t get_version (const std::string &key);     // キーごとの変更回数 (0:なし)
+    uint64_t get_change_count (void);                   // ストア全体の変更回数
+
+    // 変更通知
+    int subscribe (void);                               // 変更通知 fd を返す
+    void unsubscribe (void);
+    int drain_notify (void);                            // 通知 fd を読み捨てる、読んだバイト数を返す
+
+    static bool remove (const char *name);              // 共有メモリの削除
+
+    cc_debugprint shmstore_dbg;                         ///< cclib debugprint
+
+private:
+    struct store_header;
+    struct entry_header;
+
+    std::string store_name;
+    cc_shm_mutex wlock;                                 ///< 書き込み側の直列化 (<name>.wlock)
+    cc_shm_segment segment;
+    store_header *hdr;
+    char *entries;
+    uint32_t capacity;
+    uint32_t value_maxlen;
+    size_t entry_size;
+
+    int notify_fd;                                      ///< 自プロセスの通知 FIFO (読み込み側)
+    int notify_slot;                                    ///< 登録した購読スロット
+    std::map<int, int> notify_out;                      ///< 購読 pid -> 書き込み fd のキャッシュ
+
+    entry_header *entry_at (uint32_t index);
+    int32_t find (const std::string &key, uint32_t hash);
+    bool set_value (const std::string &key, value_type type, const void *data, uint32_t len);
+    bool get_value (const std::string &key, value_type &type, std::string &data);
+    bool writer_lock (void);
+    void writer_unlock (void);
+    void write_bytes (entry_header *e, const void *data, uint32_t len);
+    void read_bytes (entry_header *e, uint32_t len, std::string &data);
+    void notify_all (void);
+    std::string fifo_path (int pid);
+};
+
+#endif // __CC_SHMSTORE_H__
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_slotmap.h
+ * @brief lock-free fixed-capacity slot map with generation-tagged handles for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_SLOTMAP_H__
+#define __CC_SLOTMAP_H__
+
+#include <cstddef>
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * @class cc_slotmap
+ * @brief 固定容量のスロットマップ (世代付きハンドル)
+ *
+ * ハンドルは 上位32bit: 世代, 下位32bit: スロット番号。remove() で世代が進むので、
+ * 回収済みのハンドルで get() しても別のオブジェクトを返すことはない (NULL を返す)。
+ * insert()/remove()/get()/for_each()/size() はすべてロックなしで、どのスレッドから呼んでもよい。
+ * 空きスロットは ABA タグ付きのロックフリースタックで管理する。
+ *
+ * 格納するのはポインタだけで、オブジェクトの寿命は管理しない。
+ * 他のスレッドが remove() して delete する可能性があるポインタを get() で得た場合、
+ * 参照してよいのはその削除を行うスレッドと同期が取れている間だけ。
+ */
+template <typename T>
+class cc_slotmap {
+public:
+    typedef uint64_t handle_t;
+    static const handle_t INVALID = 0;          ///< 無効ハンドル (世代は1から始まるので0にならない)
+
+private:
+    struct slot {
+        std::atomic<T*> ptr;
+        std::atomic<uint32_t> gen;
+        std::atomic<uint32_t> next_free;        ///< 空きスタックの次のスロット
+    };
+    slot *slots;
+    uint32_t capacity;
+    std::atomic<uint64_t> free_head;            ///< 上位32bit: ABA タグ, 下位32bit: 先頭スロット (capacity なら空)
+    std::atomic<int> used;
+
+    cc_slotmap (const cc_slotmap &);            // コピー禁止
+    cc_slotmap &operator= (const cc_slotmap &);
+
+    void push_free (uint32_t idx) {
+        uint64_t head = free_head.load (std::memory_order_acquire);
+        for (;;) {
+            slots[idx].next_free.store ((uint32_t)head, std::memory_order_relaxed);
+            uint64_t next = (((head >> 32) + 1) << 32) | idx;
+            if (free_head.compare_exchange_weak (head, next, std::memory_order_acq_rel)) {
+                return;
+            }
+        }
+    }
+    bool pop_free (uint32_t &idx) {
+        uint64_t head = free_head.load (std::memory_order_acquire);
+        for (;;) {
+            uint32_t top = (uint32_t)head;
+            if (top >= capacity) {
+                return false;
+            }
+            uint32_t nf = slots[top].next_free.load (std::memory_order_relaxed);
+            uint64_t next = (((head >> 32) + 1) << 32) | nf;
+            if (free_head.compare_exchange_weak (head, next, std::memory_order_acq_rel)) {
+                idx = top;
+                return true;
+            }
+        }
+    }
+
+public:
+    explicit cc_slotmap (uint32_t capacity=0) : slots (NULL), capacity (0), free_head (0), used (0) {
+        reset (capacity);
+    }
+    ~cc_slotmap () {
+        delete[] slots;
+    }
+
+    /// 容量を変更して空にする (他のスレッドが使っていない時だけ呼ぶこと)
+    void reset (uint32_t capacity) {
+        delete[] slots;
+        this->capacity = capacity;
+        slots = (capacity > 0) ? new slot[capacity] : NULL;
+        for (uint32_t i = 0; i < capacity; i++) {
+            slots[i].ptr.store (NULL, std::memory_order_relaxed);
+            slots[i].gen.store (1, std::memory_order_relaxed);
+            slots[i].next_free.store (i + 1, std::memory_order_relaxed);
+        }
+        free_head.store (0, std::memory_order_release);        // タグ 0, 先頭スロット 0
+        used.store (0, std::memory_order_release);
+    }
+
+    /// 追加する、満杯なら INVALID を返す
+    handle_t insert (T *p) {
+        uint32_t idx;
+        if (p == NULL || !pop_free (idx)) {
+            return INVALID;
+        }
+        slots[idx].ptr.store (p, std::memory_order_release);
+        used.fetch_add (1, std::memory_order_relaxed);
+        return ((handle_t)slots[idx].gen.load (std::memory_order_acquire) << 32) | idx;
+    }
+
+    /// ハンドルからポインタを得る、回収済みなら NULL
+    T *get (handle_t h) {
+        uint32_t idx = (uint32_t)h;
+        uint32_t g = (uint32_t)(h >> 32);
+        if (idx >= capacity || slots[idx].gen.load (std::memory_order_acquire) != g) {
+            return NULL;
+        }
+        T *p = slots[idx].ptr.load (std::memory_order_acquire);
+        if (slots[idx].gen.load (std::memory_order_acquire) != g) {
+            return NULL;                        // 読んでいる間に回収された
+        }
+        return p;
+    }
+
+    /// 削除する、ハンドルが既に無効なら false
+    bool remove (handle_t h) {
+        uint32_t idx = (uint32_t)h;
+        uint32_t g = (uint32_t)(h >> 32);
+        if (idx >= capacity) {
+            return false;
+        }
+        uint32_t ng = (g + 1 == 0) ? 1 : g + 1;
+        if (!slots[idx].gen.compare_exchange_strong (g, ng, std::memory_order_acq_rel)) {
+            return false;
+        }
+        slots[idx].ptr.store (NULL, std::memory_order_release);
+        used.fetch_sub (1, std::memory_order_relaxed);
+        push_free (idx);
+        return true;
+    }
+
+    /// 使用中の全スロットについて fn(handle_t, T*) を呼ぶ
+    template <typename F>
+    void for_each (F fn) {
+        for (uint32_t i = 0; i < capacity; i++) {
+            uint32_t g = slots[i].gen.load (std::memory_order_acquire);
+            T *p = slots[i].ptr.load (std::memory_order_acquire);
+            if (p != NULL && slots[i].gen.load (std::memory_order_acquire) == g) {
+                fn (((handle_t)g << 32) | i, p);
+            }
+        }
+    }
+
+    int size (void) { return used.load (std::memory_order_relaxed); }
+    uint32_t get_capacity (void) { return capacity; }
+};
+
+#endif // __CC_SLOTMAP_H__
@@ -0,0 +1,184 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_sockopt.cc
+ * @brief tcp socket option profiles for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <stdio.h>              // for printf
+#include <string.h>             // for strerror
+#include <errno.h>              // for errno
+#include <sys/socket.h>         // for setsockopt
+#include <netinet/in.h>         // for IPPROTO_TCP
+#include <netinet/tcp.h>        // for TCP_*
+#include <atomic>
+
+#include "cc_sockopt.h"
+
+/// デバックプリント ワーニング表示用マクロ、enableの是非に関わらず表示
+#define CC_SOCKOPT_WARNPR(fmt, args...) \
+    { printf(" [CC_SOCKOPT:%s():%d] ##### WARNING!: " fmt,__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30                 // 古いヘッダー向け (Linux 4.11 以降)
+#endif
+
+/// 値が設定されていれば setsockopt() する、失敗はワーニングにして false を返す
+static bool
+set_opt (int fd, int level, int name, int value, const char *label)
+{
+    if (value == CC_SOCKOPT_UNSET) {
+        return true;
+    }
+    if (setsockopt (fd, level, name, &value, sizeof(value)) == -1) {
+        CC_SOCKOPT_WARNPR ("setsockopt(%s=%d) failed: %s\n", label, value, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/// SO_BUSY_POLL が権限不足で拒否された (以降は設定しない、ワーニングも1回だけ)
+static std::atomic<bool> busy_poll_denied (false);
+
+/// SO_BUSY_POLL を設定する、権限不足なら以降のソケットでは試さない
+static bool
+set_busy_poll (int fd, int value)
+{
+    if (value == CC_SOCKOPT_UNSET || busy_poll_denied.load (std::memory_order_relaxed)) {
+        return true;
+    }
+    if (setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) == -1) {
+        int err = errno;
+        if (err == EPERM || err == EACCES) {
+            if (busy_poll_denied.exchange (true)) {
+                return false;
+            }
+            CC_SOCKOPT_WARNPR ("setsockopt(SO_BUSY_POLL=%d) needs CAP_NET_ADMIN, disabled: %s\n", value, strerror(err));
+        } else {
+            CC_SOCKOPT_WARNPR ("setsockopt(SO_BUSY_POLL=%d) failed: %s\n", value, strerror(err));
+        }
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief 低遅延向けプリセット
+ * Nagle と遅延 ACK を止め、切断を早く検出する。
+ * busy poll は権限 (CAP_NET_ADMIN) が要るので入れていない、必要なら busy_poll を設定すること。
+ */
+cc_sockopt_profile
+cc_sockopt_profile::latency (void)
+{
+    cc_sockopt_profile p;
+    p.nodelay      = 1;
+    p.quickack     = 1;
+    p.fastopen     = 256;
+    p.keepalive    = 1;
+    p.keepidle     = 10;
+    p.keepintvl    = 2;
+    p.keepcnt      = 3;
+    p.user_timeout = 10000;
+    return p;
+}
+
+/**
+ * @brief 大量転送向けプリセット
+ * ソケットバッファを広げ、データが来るまで accept を遅らせる。
+ */
+cc_sockopt_profile
+cc_sockopt_profile::throughput (void)
+{
+    cc_sockopt_profile p;
+    p.nodelay      = 0;
+    p.sndbuf       = 4 * 1024 * 1024;
+    p.rcvbuf       = 4 * 1024 * 1024;
+    p.defer_accept = 1;
+    p.keepalive    = 1;
+    p.keepidle     = 60;
+    p.keepintvl    = 10;
+    p.keepcnt      = 5;
+    return p;
+}
+
+bool
+cc_sockopt_profile::is_empty (void) const
+{
+    return nodelay == CC_SOCKOPT_UNSET && cork == CC_SOCKOPT_UNSET && quickack == CC_SOCKOPT_UNSET
+        && sndbuf == CC_SOCKOPT_UNSET && rcvbuf == CC_SOCKOPT_UNSET
+        && defer_accept == CC_SOCKOPT_UNSET && fastopen == CC_SOCKOPT_UNSET
+        && fastopen_connect == CC_SOCKOPT_UNSET && busy_poll == CC_SOCKOPT_UNSET
+        && keepalive == CC_SOCKOPT_UNSET && keepidle == CC_SOCKOPT_UNSET
+        && keepintvl == CC_SOCKOPT_UNSET && keepcnt == CC_SOCKOPT_UNSET
+        && user_timeout == CC_SOCKOPT_UNSET;
+}
+
+/// 接続ソケット共通の項目 (リスナーに設定すれば accept したソケットに引き継がれる)
+static bool
+apply_stream (int fd, const cc_sockopt_profile &p)
+{
+    bool ret = true;
+    ret &= set_opt (fd, SOL_SOCKET,  SO_SNDBUF,        p.sndbuf,       "SO_SNDBUF");
+    ret &= set_opt (fd, SOL_SOCKET,  SO_RCVBUF,        p.rcvbuf,       "SO_RCVBUF");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_NODELAY,      p.nodelay,      "TCP_NODELAY");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_CORK,         p.cork,         "TCP_CORK");
+    ret &= set_busy_poll (fd, p.busy_poll);
+    ret &= set_opt (fd, SOL_SOCKET,  SO_KEEPALIVE,     p.keepalive,    "SO_KEEPALIVE");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_KEEPIDLE,     p.keepidle,     "TCP_KEEPIDLE");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_KEEPINTVL,    p.keepintvl,    "TCP_KEEPINTVL");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_KEEPCNT,      p.keepcnt,      "TCP_KEEPCNT");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_USER_TIMEOUT, p.user_timeout, "TCP_USER_TIMEOUT");
+    return ret;
+}
+
+/**
+ * @brief リスナーに適用する (listen() の前に呼ぶ)
+ * ソケットバッファ、TCP_NODELAY/TCP_CORK、keepalive、TCP_USER_TIMEOUT、busy poll は
+ * accept したソケットに引き継がれるので、ここで1回だけ設定する。
+ * 受信バッファはウィンドウスケールが SYN で決まるので、この時点で設定しておく必要もある。
+ */
+bool
+cc_sockopt_profile::apply_listen (int fd) const
+{
+    bool ret = apply_stream (fd, *this);
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, "TCP_DEFER_ACCEPT");
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_FASTOPEN,     fastopen,     "TCP_FASTOPEN");
+    return ret;
+}
+
+/**
+ * @brief accept したソケットに適用する
+ * 他の項目はリスナーから引き継がれるので、accept ごとに状態が初期化される TCP_QUICKACK だけ設定する
+ */
+bool
+cc_sockopt_profile::apply_accepted (int fd) const
+{
+    return set_opt (fd, IPPROTO_TCP, TCP_QUICKACK, quickack, "TCP_QUICKACK");
+}
+
+/**
+ * @brief 接続側、connect() の前に適用する
+ */
+bool
+cc_sockopt_profile::apply_connect (int fd) const
+{
+    bool ret = apply_stream (fd, *this);
+    ret &= set_opt (fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, fastopen_connect, "TCP_FASTOPEN_CONNECT");
+    return ret;
+}
+
+/**
+ * @brief 接続側、connect() の後に適用する (TCP_QUICKACK は状態が変わるとリセットされるため)
+ */
+bool
+cc_sockopt_profile::apply_connected (int fd) const
+{
+    return set_opt (fd, IPPROTO_TCP, TCP_QUICKACK, quickack, "TCP_QUICKACK");
+}
@@ -0,0 +1,63 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_sockopt.h
+ * @brief tcp socket option profiles for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_SOCKOPT_H__
+#define __CC_SOCKOPT_H__
+
+#define CC_SOCKOPT_UNSET    -1                  ///< 設定しない (OSの既定値のまま)
+
+/**
+ * @struct cc_sockopt_profile
+ * @brief TCP ソケットオプションのプロファイル
+ *
+ * 値が CC_SOCKOPT_UNSET の項目は設定しない。既定のコンストラクターはすべて UNSET。
+ * cc_tcpserver は listen 時と accept 時、cc_tcpconnect は connect の前後に適用する。
+ * accept したソケットはリスナーの設定を引き継ぐので、accept 時に設定するのは TCP_QUICKACK だけ。
+ * 権限不足やカーネルが対応していない項目はワーニングを表示して続行する。
+ */
+struct cc_sockopt_profile {
+    int nodelay;                                ///< TCP_NODELAY (0/1)
+    int cork;                                   ///< TCP_CORK (0/1)
+    int quickack;                               ///< TCP_QUICKACK (0/1)、accept/connect 後に設定
+    int sndbuf;                                 ///< SO_SNDBUF (bytes)
+    int rcvbuf;                                 ///< SO_RCVBUF (bytes)
+    int defer_accept;                           ///< TCP_DEFER_ACCEPT (sec)、リスナーのみ
+    int fastopen;                               ///< TCP_FASTOPEN のキュー長、リスナーのみ
+    int fastopen_connect;                       ///< TCP_FASTOPEN_CONNECT (0/1)、接続側のみ
+    int busy_poll;                              ///< SO_BUSY_POLL (usec)、既定値より大きくするには CAP_NET_ADMIN が必要
+    int keepalive;                              ///< SO_KEEPALIVE (0/1)
+    int keepidle;                               ///< TCP_KEEPIDLE (sec)
+    int keepintvl;                              ///< TCP_KEEPINTVL (sec)
+    int keepcnt;                                ///< TCP_KEEPCNT
+    int user_timeout;                           ///< TCP_USER_TIMEOUT (msec)
+
+    cc_sockopt_profile (void) :
+        nodelay (CC_SOCKOPT_UNSET), cork (CC_SOCKOPT_UNSET), quickack (CC_SOCKOPT_UNSET),
+        sndbuf (CC_SOCKOPT_UNSET), rcvbuf (CC_SOCKOPT_UNSET),
+        defer_accept (CC_SOCKOPT_UNSET), fastopen (CC_SOCKOPT_UNSET), fastopen_connect (CC_SOCKOPT_UNSET),
+        busy_poll (CC_SOCKOPT_UNSET),
+        keepalive (CC_SOCKOPT_UNSET), keepidle (CC_SOCKOPT_UNSET),
+        keepintvl (CC_SOCKOPT_UNSET), keepcnt (CC_SOCKOPT_UNSET),
+        user_timeout (CC_SOCKOPT_UNSET) {}
+
+    static cc_sockopt_profile latency (void);   // 低遅延向けプリセット
+    static cc_sockopt_profile throughput (void);// 大量転送向けプリセット
+
+    bool apply_listen (int fd) const;           // リスナーに適用 (bind/listen の前)
+    bool apply_accepted (int fd) const;         // accept したソケットに適用
+    bool apply_connect (int fd) const;          // 接続側、connect() の前に適用
+    bool apply_connected (int fd) const;        // 接続側、connect() の後に適用
+
+    bool is_empty (void) const;                 // 何も設定しない
+};
+
+#endif // __CC_SOCKOPT_H__
@@ -0,0 +1,655 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_tcpbuffer.cc
+ * @brief receive ring buffer and send queue for tcp communication
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <stdio.h>              // for perror
+#include <string.h>             // for memcpy
+#include <errno.h>              // for errno
+#include <fcntl.h>              // for splice
+#include <unistd.h>             // for close/pipe2
+#include <sys/socket.h>         // for sendmsg
+#include <sys/sendfile.h>       // for sendfile
+#include <algorithm>            // for std::rotate
+#include <atomic>
+#include <vector>
+
+#include "cc_tcpbuffer.h"
+
+/// n 以上の最小の2のべき乗
+static size_t
+round_pow2 (size_t n)
+{
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// =====================================================================================
+// ===================================================================================== BUFFER POOL
+// =====================================================================================
+
+static std::atomic<size_t> pool_block_limit (CC_TCPBUF_POOL_BLOCKS);
+static std::atomic<size_t> pool_string_limit (CC_TCPBUF_POOL_STRINGS);
+
+/// スレッドごとのフリーリスト
+struct cc_bufpool_cache {
+    std::vector<unsigned char*> blocks;
+    std::vector<std::string> strings;
+};
+
+// スレッド終了時に解放する。解放後 (静的オブジェクトのデストラクターなど) はプールを使わない
+static __thread cc_bufpool_cache *pool_cache = NULL;
+static __thread bool pool_closed = false;
+
+struct cc_bufpool_guard {
+    ~cc_bufpool_guard () {
+        if (pool_cache != NULL) {
+            for (auto b : pool_cache->blocks) {
+                delete[] b;
+            }
+            delete pool_cache;
+            pool_cache = NULL;
+        }
+        pool_closed = true;
+    }
+};
+static thread_local cc_bufpool_guard pool_guard;
+
+static cc_bufpool_cache *
+pool_local (void)
+{
+    if (pool_cache == NULL && !pool_closed) {
+        (void)&pool_guard;                      // 参照してスレッド終了時のデストラクターを登録させる
+        pool_cache = new cc_bufpool_cache;
+    }
+    return pool_cache;
+}
+
+unsigned char *
+cc_bufpool::get_block (void)
+{
+    cc_bufpool_cache *c = pool_local ();
+    if (c != NULL && !c->blocks.empty ()) {
+        unsigned char *block = c->blocks.back ();
+        c->blocks.pop_back ();
+        return block;
+    }
+    return new unsigned char[CC_TCPBUF_RECV_INITIAL];
+}
+
+void
+cc_bufpool::put_block (unsigned char *block)
+{
+    cc_bufpool_cache *c = pool_local ();
+    if (c != NULL && c->blocks.size () < pool_block_limit.load (std::memory_order_relaxed)) {
+        c->blocks.push_back (block);
+        return;
+    }
+    delete[] block;
+}
+
+void
+cc_bufpool::get_string (std::string &str)
+{
+    cc_bufpool_cache *c = pool_local ();
+    if (c != NULL && !c->strings.empty ()) {
+        str.swap (c->strings.back ());
+        c->strings.pop_back ();
+    }
+}
+
+void
+cc_bufpool::put_string (std::string &str)
+{
+    // 小さいもの (SSO) と大きく育ったものは取っておかない
+    cc_bufpool_cache *c = pool_local ();
+    if (c != NULL && str.capacity () >= 256 && str.capacity () <= CC_TCPBUF_COALESCE * 2
+        && c->strings.size () < pool_string_limit.load (std::memory_order_relaxed)) {
+        str.clear ();
+        c->strings.push_back (std::move (str));
+    }
+    std::string ().swap (str);
+}
+
+/**
+ * @brief 1スレッドあたりに取っておく数の上限 (既に溜まっている分は次に返すときに減る)
+ * @param blocks  受信ブロックの数 (1つ CC_TCPBUF_RECV_INITIAL バイト)
+ * @param strings 送信チャンクの数 (1つ最大 CC_TCPBUF_COALESCE*2 バイト)
+ */
+void
+cc_bufpool::set_limit (size_t blocks, size_t strings)
+{
+    pool_block_limit  = blocks;
+    pool_string_limit = strings;
+}
+
+/// 受信バッファの領域、初期容量のものはプールから取る
+static unsigned char *
+ringbuf_alloc (size_t cap)
+{
+    return (cap == CC_TCPBUF_RECV_INITIAL) ? cc_bufpool::get_block () : new unsigned char[cap];
+}
+
+static void
+ringbuf_free (unsigned char *buf, size_t cap)
+{
+    if (cap == CC_TCPBUF_RECV_INITIAL) {
+        cc_bufpool::put_block (buf);
+    } else {
+        delete[] buf;
+    }
+}
+
+// =====================================================================================
+// ===================================================================================== RING BUFFER
+// =====================================================================================
+
+/**
+ * @brief コンストラクター
+ * @param initial 初期容量 (2のべき乗に切り上げる)
+ * @param max     最大容量
+ */
+cc_ringbuf::cc_ringbuf (size_t initial, size_t max)
+{
+    cap     = round_pow2 (initial > 0 ? initial : 1);
+    max_cap = (max > cap) ? round_pow2 (max) : cap;
+    init_cap = cap;
+    buf     = ringbuf_alloc (cap);
+    rpos    = 0;
+    wpos    = 0;
+}
+
+cc_ringbuf::~cc_ringbuf ()
+{
+    ringbuf_free (buf, cap);
+}
+
+int
+cc_ringbuf::readable_iov (struct iovec iov[2]) const
+{
+    size_t n = size ();
+    if (n == 0) {
+        return 0;
+    }
+    size_t start = (size_t)(rpos & (cap - 1));
+    size_t first = (n < cap - start) ? n : cap - start;
+    iov[0].iov_base = buf + start;
+    iov[0].iov_len  = first;
+    if (first == n) {
+        return 1;
+    }
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = n - first;
+    return 2;
+}
+
+int
+cc_ringbuf::writable_iov (struct iovec iov[2])
+{
+    size_t n = space ();
+    if (n == 0) {
+        return 0;
+    }
+    size_t start = (size_t)(wpos & (cap - 1));
+    size_t first = (n < cap - start) ? n : cap - start;
+    iov[0].iov_base = buf + start;
+    iov[0].iov_len  = first;
+    if (first == n) {
+        return 1;
+    }
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = n - first;
+    return 2;
+}
+
+void
+cc_ringbuf::commit (size_t n)
+{
+    wpos += (n < space ()) ? n : space ();
+}
+
+void
+cc_ringbuf::consume (size_t n)
+{
+    rpos += (n < size ()) ? n : size ();
+    if (rpos == wpos) {
+        // 空になったら先頭に戻し、次の読み込みが折り返さないようにする
+        rpos = wpos = 0;
+    }
+}
+
+void
+cc_ringbuf::clear (void)
+{
+    rpos = wpos = 0;
+}
+
+/**
+ * @brief 空にして初期容量に戻す (拡張した領域を解放する)
+ */
+void
+cc_ringbuf::shrink (void)
+{
+    rpos = wpos = 0;
+    if (cap != init_cap) {
+        ringbuf_free (buf, cap);
+        cap = init_cap;
+        buf = ringbuf_alloc (cap);
+    }
+}
+
+/**
+ * @brief 空きが n バイト以上になるよう拡張する
+ * 拡張時はデータを新しい領域の先頭に詰めて移す
+ * @return false: 最大容量を超える
+ */
+bool
+cc_ringbuf::reserve (size_t n)
+{
+    if (space () >= n) {
+        return true;
+    }
+    size_t len = size ();
+    if (len + n > max_cap) {
+        return false;
+    }
+    size_t ncap = round_pow2 (len + n);
+    unsigned char *nbuf = ringbuf_alloc (ncap);
+    peek (nbuf, len);
+    ringbuf_free (buf, cap);
+    buf  = nbuf;
+    cap  = ncap;
+    rpos = 0;
+    wpos = len;
+    return true;
+}
+
+bool
+cc_ringbuf::append (const void *data, size_t n)
+{
+    if (!reserve (n)) {
+        return false;
+    }
+    struct iovec iov[2];
+    int cnt = writable_iov (iov);
+    size_t done = 0;
+    for (int i = 0; i < cnt && done < n; i++) {
+        size_t len = (n - done < iov[i].iov_len) ? n - done : iov[i].iov_len;
+        memcpy (iov[i].iov_base, (const unsigned char *)data + done, len);
+        done += len;
+    }
+    commit (n);
+    return true;
+}
+
+/**
+ * @brief 先頭 offset バイト目から n バイトをコピーする (読み出し位置は進めない)
+ * @return コピーしたバイト数
+ */
+size_t
+cc_ringbuf::peek (void *dst, size_t n, size_t offset) const
+{
+    size_t len = size ();
+    if (offset >= len) {
+        return 0;
+    }
+    if (n > len - offset) {
+        n = len - offset;
+    }
+    size_t start = (size_t)((rpos + offset) & (cap - 1));
+    size_t first = (n < cap - start) ? n : cap - start;
+    memcpy (dst, buf + start, first);
+    memcpy ((unsigned char *)dst + first, buf, n - first);
+    return n;
+}
+
+/**
+ * @brief 先頭 n バイトを連続した領域として返す (読み出し位置は進めない)
+ * 折り返しをまたぐ場合は領域全体をその場で回転してデータを先頭に詰め直す (メモリ確保なし)。
+ * 詰め直すと残りのデータも次に折り返すまでは連続するので、詰め直しは折り返し1回につき1度で済む。
+ * 返したポインタは次に書き込み/詰め直しをするまで有効。
+ * @return 先頭へのポインタ、n バイトに満たなければ NULL
+ */
+const unsigned char *
+cc_ringbuf::contiguous (size_t n)
+{
+    size_t len = size ();
+    if (n > len) {
+        return NULL;
+    }
+    size_t start = (size_t)(rpos & (cap - 1));
+    if (start + n > cap) {
+        std::rotate (buf, buf + start, buf + cap);
+        rpos  = 0;
+        wpos  = len;
+        start = 0;
+    }
+    return buf + start;
+}
+
+/**
+ * @brief fd から readv() で読み込む、空きがなければ最大容量まで拡張する
+ * @param maxread 1回で読む最大バイト数の目安 (空きがこれより少なければ拡張する)
+ * @return 読んだバイト数、0: 相手が切断, -1: エラー (errno 参照、EAGAIN を含む)
+ */
+ssize_t
+cc_ringbuf::read_from (int fd, size_t maxread)
+{
+    if (space () < maxread) {
+        size_t want = maxread;
+        if (size () + want > max_cap) {
+            want = max_cap - size ();
+        }
+        if (want > 0) {
+            reserve (want);
+        }
+    }
+    struct iovec iov[2];
+    int cnt = writable_iov (iov);
+    if (cnt == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    ssize_t ret = readv (fd, iov, cnt);
+    if (ret > 0) {
+        commit ((size_t)ret);
+    }
+    return ret;
+}
+
+// =====================================================================================
+// ===================================================================================== SEND QUEUE
+// =====================================================================================
+
+cc_sendqueue::cc_sendqueue (void)
+{
+    pending     = 0;
+    mem_pending = 0;
+    pipefd[0]   = -1;
+    pipefd[1]   = -1;
+    pipe_fill   = 0;
+    send_calls  = 0;
+    send_eagain = 0;
+}
+
+cc_sendqueue::~cc_sendqueue ()
+{
+    clear ();
+    if (pipefd[0] != -1) {
+        close (pipefd[0]);
+        close (pipefd[1]);
+    }
+}
+
+bool
+cc_sendqueue::append (const void *data, size_t n)
+{
+    if (n == 0) {
+        return true;
+    }
+    if (mem_pending + n > CC_TCPBUF_SEND_MAX) {
+        return false;
+    }
+    if (!chunks.empty() && chunks.back().file_fd == -1 && !chunks.back().locked
+        && chunks.back().data.size() + n <= CC_TCPBUF_COALESCE) {
+        chunks.back().data.append ((const char *)data, n);
+    } else {
+        chunk c;
+        cc_bufpool::get_string (c.data);       // 領域を使い回す
+        c.data.assign ((const char *)data, n);
+        c.off        = 0;
+        c.file_fd    = -1;
+        c.file_off   = 0;
+        c.file_left  = 0;
+        c.use_splice = false;
+        c.locked     = false;
+        chunks.push_back (std::move (c));
+    }
+    pending     += n;
+    mem_pending += n;
+    return true;
+}
+
+bool
+cc_sendqueue::append (std::string &&data)
+{
+    size_t n = data.size();
+    if (n <= CC_TCPBUF_COALESCE) {
+        return append (data.data(), n);             // 小さいものは連結する
+    }
+    if (mem_pending + n > CC_TCPBUF_SEND_MAX) {
+        return false;
+    }
+    chunk c;
+    c.data       = std::move (data);
+    c.off        = 0;
+    c.file_fd    = -1;
+    c.file_off   = 0;
+    c.file_left  = 0;
+    c.use_splice = false;
+    c.locked     = false;
+    chunks.push_back (std::move (c));
+    pending     += n;
+    mem_pending += n;
+    return true;
+}
+
+/**
+ * @brief ファイルの区間を追加する
+ * メモリ上の上限 (CC_TCPBUF_SEND_MAX) には数えない。
+ * @param file_fd 読み込み用の fd、所有権はキューに移る (送り終わるか clear() で閉じる)
+ * @param offset  ファイル上の開始位置 (fd のファイル位置は使わない/変えない)
+ * @param length  バイト数
+ */
+bool
+cc_sendqueue::append_file (int file_fd, off_t offset, size_t length)
+{
+    if (length == 0) {
+        close (file_fd);
+        return true;
+    }
+    chunk c;
+    c.off        = 0;
+    c.file_fd    = file_fd;
+    c.file_off   = offset;
+    c.file_left  = length;
+    c.use_splice = false;
+    c.locked     = false;
+    chunks.push_back (std::move (c));
+    pending += length;
+    return true;
+}
+
+void
+cc_sendqueue::release (chunk &c)
+{
+    if (c.file_fd != -1) {
+        close (c.file_fd);
+        c.file_fd = -1;
+    }
+    cc_bufpool::put_string (c.data);
+}
+
+void
+cc_sendqueue::clear (void)
+{
+    for (std::deque<chunk>::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+        release (*it);
+    }
+    chunks.clear ();
+    pending     = 0;
+    mem_pending = 0;
+    if (pipe_fill > 0) {
+        // パイプに残ったデータは捨てる (パイプごと作り直す)
+        close (pipefd[0]);
+        close (pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+        pipe_fill = 0;
+    }
+}
+
+/**
+ * @brief ファイルチャンクを送る
+ * sendfile() を使い、ファイルシステムが対応していなければ (EINVAL/ENOSYS)
+ * ファイル→パイプ→ソケットの splice() に切り替える。どちらもソケットが非ブロッキングなら待たない。
+ * @return ソケットに送ったバイト数、-1: エラー (EAGAIN を含む)
+ */
+ssize_t
+cc_sendqueue::flush_file (int fd, chunk &c)
+{
+    if (!c.use_splice) {
+        size_t n = (c.file_left < CC_TCPBUF_FILE_STEP) ? c.file_left : CC_TCPBUF_FILE_STEP;
+        ssize_t ret = sendfile (fd, c.file_fd, &c.file_off, n);
+        if (ret > 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            errno = EIO;                        // ファイルが途中で短くなった
+            return -1;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+        c.use_splice = true;
+    }
+    if (pipefd[0] == -1 && pipe2 (pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe_fill == 0) {
+        size_t n = (c.file_left < CC_TCPBUF_FILE_STEP) ? c.file_left : CC_TCPBUF_FILE_STEP;
+        ssize_t ret = splice (c.file_fd, &c.file_off, pipefd[1], NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret <= 0) {
+            if (ret == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        pipe_fill = (size_t)ret;
+    }
+    ssize_t ret = splice (pipefd[0], NULL, fd, NULL, pipe_fill,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    if (ret > 0) {
+        pipe_fill -= (size_t)ret;
+    }
+    return ret;
+}
+
+/**
+ * @brief 送れるだけ送る (ブロックしない)
+ * 先頭から最大 CC_TCPBUF_IOV_MAX チャンクを1回の sendmsg() で送り、
+ * 送りきれなくなる (EAGAIN) かキューが空になるまで繰り返す。
+ * @return 送ったバイト数、-1: エラー (EAGAIN 以外、errno 参照)
+ */
+ssize_t
+cc_sendqueue::flush (int fd)
+{
+    ssize_t total = 0;
+    while (pending > 0) {
+        // 先頭がファイルチャンク
+        if (chunks.front().file_fd != -1) {
+            chunk &c = chunks.front();
+            ssize_t ret = flush_file (fd, c);
+            send_calls++;
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    send_eagain++;
+                    break;
+                }
+                return -1;
+            }
+            total       += ret;
+            pending     -= ret;
+            c.file_left -= ret;
+            if (c.file_left == 0) {
+                release (c);
+                chunks.pop_front ();
+            }
+            continue;
+        }
+        // 先頭から次のファイルチャンクまでのメモリチャンクをまとめて送る
+        struct iovec iov[CC_TCPBUF_IOV_MAX];
+        int cnt = memory_iov (iov, CC_TCPBUF_IOV_MAX, false);
+        struct msghdr msg;
+        memset (&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t ret = sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        send_calls++;
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                send_eagain++;
+                break;
+            }
+            return -1;
+        }
+        total += ret;
+        consume_memory ((size_t)ret);
+    }
+    return total;
+}
+
+/**
+ * @brief 先頭から次のファイルチャンクまでのメモリチャンクを iovec にする
+ * lock なら返したチャンクには以後 append() で連結しない (非同期送信中にデータが再配置されないように)。
+ * 送った分は consume_memory() で外すこと。
+ * @return iovec の数、先頭がファイルチャンクか空なら 0
+ */
+int
+cc_sendqueue::memory_iov (struct iovec *iov, int max, bool lock)
+{
+    int cnt = 0;
+    for (std::deque<chunk>::iterator it = chunks.begin();
+         it != chunks.end() && it->file_fd == -1 && cnt < max; ++it, ++cnt) {
+        iov[cnt].iov_base = (void *)(it->data.data() + it->off);
+        iov[cnt].iov_len  = it->data.size() - it->off;
+        it->locked = it->locked || lock;
+    }
+    return cnt;
+}
+
+/**
+ * @brief 先頭のメモリチャンクから n バイト送ったものとして外す
+ */
+void
+cc_sendqueue::consume_memory (size_t n)
+{
+    pending     -= n;
+    mem_pending -= n;
+    // 送りきったチャンクを外し、途中までのチャンクはオフセットを進める
+    while (n > 0) {
+        chunk &c = chunks.front();
+        size_t rest = c.data.size() - c.off;
+        if (n < rest) {
+            c.off += n;
+            break;
+        }
+        n -= rest;
+        release (c);
+        chunks.pop_front ();
+    }
+}
+
+/**
+ * @brief 先頭がファイルチャンクか
+ */
+bool
+cc_sendqueue::head_is_file (void) const
+{
+    return !chunks.empty() && chunks.front().file_fd != -1;
+}
@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_tcpbuffer.h
+ * @brief receive ring buffer and send queue for tcp communication
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_TCPBUFFER_H__
+#define __CC_TCPBUFFER_H__
+
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CC_TCPBUF_RECV_INITIAL  4096                    ///< 受信バッファの初期容量
+#define CC_TCPBUF_RECV_MAX      (16*1024*1024)          ///< 受信バッファの最大容量
+#define CC_TCPBUF_SEND_MAX      (64*1024*1024)          ///< 送信キューに溜められる最大バイト数
+#define CC_TCPBUF_COALESCE      16384                   ///< これ以下の書き込みは末尾のチャンクにまとめる
+#define CC_TCPBUF_IOV_MAX       64                      ///< 1回の sendmsg() で送るチャンク数
+#define CC_TCPBUF_FILE_STEP     (1024*1024)             ///< 1回の sendfile()/splice() で送る最大バイト数
+#define CC_TCPBUF_POOL_BLOCKS   256                     ///< スレッドごとに取っておく受信ブロック数の既定値
+#define CC_TCPBUF_POOL_STRINGS  64                      ///< スレッドごとに取っておく送信チャンク数の既定値
+
+///
+/// ■■■■■　I/O バッファのプール
+///
+/// 受信バッファの初期容量のブロックと送信チャンクの文字列を、スレッドごとの上限付き
+/// フリーリストで使い回す (accept と切断が多いときに malloc/free を減らす)。
+/// 確保したスレッドと別のスレッドで返してもよく、返したスレッドのリストに入る。
+/// 上限を超えた分とスレッド終了時に残っている分は解放する。
+///
+class cc_bufpool {
+public:
+    static unsigned char *get_block (void);             // CC_TCPBUF_RECV_INITIAL バイトのブロック
+    static void put_block (unsigned char *block);
+    static void get_string (std::string &str);          // 容量を確保済みの空文字列と入れ替える
+    static void put_string (std::string &str);          // 文字列の領域を返す (str は空になる)
+    static void set_limit (size_t blocks, size_t strings);     // 1スレッドあたりの上限 (0: 使わない)
+};
+
+///
+/// ■■■■■　受信用リングバッファ
+///
+/// 容量は2のべき乗で、足りなくなると最大容量まで倍々に拡張する。
+/// 読み書き位置は単調増加のカウンタで持ち、容量でマスクして使う。
+/// 1つのスレッドからだけ使うこと (ロックしない)。
+///
+class cc_ringbuf {
+private:
+    unsigned char *buf;
+    size_t cap;                                         ///< 容量 (2のべき乗)
+    size_t init_cap;                                    ///< 初期容量 (shrink() で戻す)
+    size_t max_cap;                                     ///< 拡張できる最大容量
+    uint64_t rpos;                                      ///< 読み出し位置
+    uint64_t wpos;                                      ///< 書き込み位置
+
+    cc_ringbuf (const cc_ringbuf &);                    // コピー禁止
+    cc_ringbuf &operator= (const cc_ringbuf &);
+
+public:
+    cc_ringbuf (size_t initial=CC_TCPBUF_RECV_INITIAL, size_t max=CC_TCPBUF_RECV_MAX);
+    ~cc_ringbuf ();
+
+    size_t size (void) const { return (size_t)(wpos - rpos); }     // 読み出せるバイト数
+    size_t space (void) const { return cap - size (); }            // 書き込めるバイト数
+    size_t capacity (void) const { return cap; }
+    bool empty (void) const { return wpos == rpos; }
+
+    int readable_iov (struct iovec iov[2]) const;       // 読み出せる領域 (折り返しで最大2つ)
+    int writable_iov (struct iovec iov[2]);             // 書き込める領域 (折り返しで最大2つ)
+    void commit (size_t n);                             // n バイト書き込んだ
+    void consume (size_t n);                            // n バイト読み捨てる
+    bool reserve (size_t n);                            // 空きが n バイト以上になるよう拡張する
+    void clear (void);
+    void shrink (void);                                 // 空にして初期容量に戻す
+
+    bool append (const void *data, size_t n);           // コピーして書き込む (必要なら拡張)
+    size_t peek (void *dst, size_t n, size_t offset=0) const;  // 先頭 offset から n バイトをコピー
+    const unsigned char *contiguous (size_t n);         // 先頭 n バイトを連続領域として返す
+    ssize_t read_from (int fd, size_t maxread);         // fd から readv() で読み込む
+};
+
+///
+/// ■■■■■　送信キュー
+///
+/// 送信データをチャンクの連鎖で保持し、sendmsg() の iovec でまとめて送る。
+/// 小さい書き込みは末尾のチャンクに連結し、大きい std::string はコピーせずにチャンクにする。
+/// ファイルの区間もチャンクにでき、sendfile() (使えなければ splice()) でユーザー空間を通さずに送る。
+/// 送りきれなかった分は先頭チャンクのオフセットとして残る。
+/// ロックしないので、複数のスレッドから使う場合は呼び出し側で排他すること。
+///
+class cc_sendqueue {
+private:
+    struct chunk {
+        std::string data;
+        size_t off;                                     ///< 送信済みバイト数
+        int file_fd;                                    ///< ファイルチャンクなら fd (キューが閉じる)、メモリなら -1
+        off_t file_off;                                 ///< 次にファイルから読む位置
+        size_t file_left;                               ///< ファイルチャンクの未送信バイト数
+        bool use_splice;                                ///< sendfile() が使えなかった
+        bool locked;                                    ///< memory_iov() で渡した (連結しない)
+    };
+    std::deque<chunk> chunks;
+    size_t pending;                                     ///< 未送信バイト数 (ファイルを含む)
+    size_t mem_pending;                                 ///< 未送信バイト数のうちメモリ上の分
+    int pipefd[2];                                      ///< splice() 用のパイプ (必要になったら作る)
+    size_t pipe_fill;                                   ///< パイプに入っていてまだソケットに送っていないバイト数
+    uint64_t send_calls;                                ///< flush() で呼んだ送信システムコール数 (累計)
+    uint64_t send_eagain;                               ///< そのうち EAGAIN で送れなかった数 (累計)
+
+    cc_sendqueue (const cc_sendqueue &);                // コピー禁止
+    cc_sendqueue &operator= (const cc_sendqueue &);
+
+    ssize_t flush_file (int fd, chunk &c);
+    void release (chunk &c);
+
+public:
+    cc_sendqueue (void);
+    ~cc_sendqueue ();
+
+    bool append (const void *data, size_t n);           // コピーして追加
+    bool append (std::string &&data);                   // ムーブして追加
+    bool append_file (int file_fd, off_t offset, size_t length);   // ファイルの区間を追加 (fd の所有権を移す)
+    ssize_t flush (int fd);                             // 送れるだけ送る、送ったバイト数 (-1: エラー)
+    int memory_iov (struct iovec *iov, int max, bool lock=true);   // 先頭のメモリチャンクを iovec にする
+    void consume_memory (size_t n);                     // memory_iov() の先頭 n バイトを送った
+    bool head_is_file (void) const;
+    uint64_t syscalls (void) const { return send_calls; }
+    uint64_t eagain_count (void) const { return send_eagain; }
+    size_t size (void) const { return pending; }
+    bool empty (void) const { return pending == 0; }
+    void clear (void);
+};
+
+#endif // __CC_TCPBUFFER_H__
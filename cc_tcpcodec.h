@@ -0,0 +1,212 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_tcpcodec.h
+ * @brief message framing codecs for tcp streams
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_TCPCODEC_H__
+#define __CC_TCPCODEC_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "cc_tcpbuffer.h"
+
+/**
+ * @struct cc_frame
+ * @brief 受信バッファ内の1フレームを指すビュー (コピーしない)
+ *
+ * data は受信バッファを直接指す。有効なのは次に next() を呼ぶか受信バッファに書き込むまで。
+ */
+struct cc_frame {
+    const unsigned char *data;                  ///< フレーム本体の先頭
+    size_t size;                                ///< フレーム本体のバイト数
+    size_t consume;                             ///< 受信バッファから読み捨てるバイト数 (ヘッダー/区切りを含む)
+
+    cc_frame (void) : data (NULL), size (0), consume (0) {}
+    std::string str (void) const { return std::string ((const char *)data, size); }
+};
+
+/// next() の戻り値
+#define CC_CODEC_ERROR      -1                  ///< フレームが壊れている/長すぎる (切断すべき)
+#define CC_CODEC_NEED_MORE  0                   ///< データが足りない
+#define CC_CODEC_FRAME      1                   ///< フレームを取り出した
+
+///
+/// ■■■■■　長さ前置コーデック (ビッグエンディアンの長さ + 本体)
+///
+/// LenT は uint16_t / uint32_t。長さはヘッダーを含まない本体のバイト数。
+///
+template <typename LenT>
+class cc_codec_length {
+private:
+    size_t max_frame;
+
+public:
+    explicit cc_codec_length (size_t max_frame=CC_TCPBUF_RECV_MAX - sizeof(LenT)) : max_frame (max_frame) {}
+
+    int next (cc_ringbuf &rbuf, cc_frame &frame) {
+        unsigned char hdr[sizeof(LenT)];
+        if (rbuf.peek (hdr, sizeof(hdr)) < sizeof(hdr)) {
+            return CC_CODEC_NEED_MORE;
+        }
+        size_t len = 0;
+        for (size_t i = 0; i < sizeof(LenT); i++) {
+            len = (len << 8) | hdr[i];
+        }
+        if (len > max_frame) {
+            return CC_CODEC_ERROR;
+        }
+        const unsigned char *p = rbuf.contiguous (sizeof(LenT) + len);
+        if (p == NULL) {
+            return CC_CODEC_NEED_MORE;
+        }
+        frame.data    = p + sizeof(LenT);
+        frame.size    = len;
+        frame.consume = sizeof(LenT) + len;
+        return CC_CODEC_FRAME;
+    }
+
+    /// 送信用にエンコードする (out に追加)
+    bool encode (const void *data, size_t size, std::string &out) {
+        if (size > max_frame || (uint64_t)size > (uint64_t)(LenT)~(LenT)0) {
+            return false;
+        }
+        for (int i = (int)sizeof(LenT) - 1; i >= 0; i--) {
+            out.push_back ((char)((size >> (8 * i)) & 0xff));
+        }
+        out.append ((const char *)data, size);
+        return true;
+    }
+};
+
+typedef cc_codec_length<uint16_t> cc_codec_len16;
+typedef cc_codec_length<uint32_t> cc_codec_len32;
+
+///
+/// ■■■■■　改行区切りコーデック
+///
+/// '\n' までを1フレームとする (フレームに '\n' は含まない)。strip_cr なら末尾の '\r' も除く。
+/// 探索済みの位置を覚えておくので、長い行が少しずつ届いても先頭から探し直さない。
+///
+class cc_codec_line {
+private:
+    size_t max_line;
+    bool strip_cr;
+    size_t scanned;                             ///< '\n' がないことを確認済みのバイト数
+
+public:
+    explicit cc_codec_line (size_t max_line=65536, bool strip_cr=true) :
+        max_line (max_line), strip_cr (strip_cr), scanned (0) {}
+
+    int next (cc_ringbuf &rbuf, cc_frame &frame) {
+        struct iovec iov[2];
+        int cnt = rbuf.readable_iov (iov);
+        size_t base = 0;
+        size_t found = (size_t)-1;
+        for (int i = 0; i < cnt && found == (size_t)-1; i++) {
+            size_t len = iov[i].iov_len;
+            if (scanned < base + len) {
+                size_t from = (scanned > base) ? scanned - base : 0;
+                const void *hit = memchr ((const char *)iov[i].iov_base + from, '\n', len - from);
+                if (hit != NULL) {
+                    found = base + (size_t)((const char *)hit - (const char *)iov[i].iov_base);
+                }
+            }
+            base += len;
+        }
+        if (found == (size_t)-1) {
+            scanned = rbuf.size ();
+            return (scanned > max_line) ? CC_CODEC_ERROR : CC_CODEC_NEED_MORE;
+        }
+        if (found > max_line) {
+            return CC_CODEC_ERROR;
+        }
+        const unsigned char *p = rbuf.contiguous (found + 1);
+        size_t len = found;
+        if (strip_cr && len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+        frame.data    = p;
+        frame.size    = len;
+        frame.consume = found + 1;
+        scanned       = 0;                      // 呼び出し側が consume した後は先頭から
+        return CC_CODEC_FRAME;
+    }
+
+    bool encode (const void *data, size_t size, std::string &out) {
+        out.append ((const char *)data, size);
+        out.push_back ('\n');
+        return true;
+    }
+};
+
+///
+/// ■■■■■　固定長コーデック
+///
+/// frame_size が 0 か受信バッファの最大容量 (CC_TCPBUF_RECV_MAX) を超える場合は
+/// フレームを取り出せないので、next() は CC_CODEC_ERROR を返す (切断される)。
+///
+class cc_codec_fixed {
+private:
+    size_t frame_size;
+
+public:
+    explicit cc_codec_fixed (size_t frame_size) : frame_size (frame_size) {}
+
+    int next (cc_ringbuf &rbuf, cc_frame &frame) {
+        if (frame_size == 0 || frame_size > CC_TCPBUF_RECV_MAX) {
+            return CC_CODEC_ERROR;              // 0 バイトのフレームは無限に取り出せ、大きすぎるものは揃わない
+        }
+        const unsigned char *p = rbuf.contiguous (frame_size);
+        if (p == NULL) {
+            return CC_CODEC_NEED_MORE;
+        }
+        frame.data    = p;
+        frame.size    = frame_size;
+        frame.consume = frame_size;
+        return CC_CODEC_FRAME;
+    }
+
+    bool encode (const void *data, size_t size, std::string &out) {
+        if (size != frame_size) {
+            return false;
+        }
+        out.append ((const char *)data, size);
+        return true;
+    }
+};
+
+/**
+ * @brief 受信バッファから取り出せるだけフレームを取り出して fn(const cc_frame &) を呼ぶ
+ * 呼び出し後にフレームを読み捨てる。cc_tcpconnect::on_recv() から呼ぶ想定。
+ * @return 取り出したフレーム数、CC_CODEC_ERROR: フレーム異常
+ */
+template <typename Codec, typename F>
+int
+cc_codec_dispatch (Codec &codec, cc_ringbuf &rbuf, F fn)
+{
+    int count = 0;
+    cc_frame frame;
+    for (;;) {
+        int ret = codec.next (rbuf, frame);
+        if (ret == CC_CODEC_ERROR) {
+            return CC_CODEC_ERROR;
+        }
+        if (ret == CC_CODEC_NEED_MORE) {
+            return count;
+        }
+        fn (frame);
+        rbuf.consume (frame.consume);
+        count++;
+    }
+}
+
+#endif // __CC_TCPCODEC_H__
@@ -9,15 +9,34 @@
  * 
  */
 
+#include <sys/eventfd.h>
+#include <poll.h>
+
 #include "cc_tcpcomm.h"
 
+/// 時刻取得 (nsec)
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 
 // =====================================================================================
 // ===================================================================================== TCP CLIENT
 // =====================================================================================
 
-cc_tcpconnect::cc_tcpconnect (key_t message_key, std::string nickname) :
-    cc_thread (message_key, nickname),
+/**
+ * @brief コンストラクター
+ * @param message_key メッセージキー
+ * @param nickname    ニックネーム文字列(デバックプリントで使用)
+ * @param policy      受信箱 (message) を作るタイミング、既定は最初の送受信で作る
+ *                    (accept ごとに msgget() と FIFO の作成をしないため)
+ */
+cc_tcpconnect::cc_tcpconnect (key_t message_key, std::string nickname, cc_mailbox_policy policy) :
+    cc_thread (message_key, nickname, policy),
     tcpcomm_dbg (nickname)
 {
     // すべてのインスタンスの debugprint をまとめてオンにする
@@ -27,6 +46,19 @@ cc_tcpconnect::cc_tcpconnect (key_t message_key, std::string nickname) :
 
     // initialize
     clientSocket = -1;
+    owner_server = NULL;
+    owner_loop   = NULL;
+    conn_handle  = 0;
+    retired      = false;
+    closing_fd   = -1;
+    write_armed  = false;
+    flush_scheduled = false;
+    uring_sendargs  = NULL;
+    send_inflight   = false;
+    uring_inflight  = 0;
+    uring_closing   = false;
+    connect_ns      = 0;
+    reset_stats ();
 }
 //cc_tcpconnect::cc_tcpconnect (void) :
 //  cc_thread ("cc_tcpconnect")
@@ -40,6 +72,10 @@ cc_tcpconnect::cc_tcpconnect (key_t message_key, std::string nickname) :
 cc_tcpconnect::~cc_tcpconnect ()
 {
     exec_disconnect();
+    if (closing_fd != -1) {
+        close (closing_fd);                     // 回収される前に delete された
+    }
+    delete uring_sendargs;
 
     CC_TCPCOMM_DBGPR ("instance deleted\n");
 }
@@ -56,6 +92,32 @@ cc_tcpconnect::exec_server_connect (unsigned int port, const char *addrstr)
 }
 bool
 cc_tcpconnect::exec_server_connect (unsigned int port, in_addr_t ipaddr)
+{
+    return exec_server_connect_timeout (port, ipaddr, -1);
+}
+
+/**
+ * @brief タイムアウト付きでサーバーに接続してスレッドを起動する
+ * @param timeout_ms 接続完了を待つ最大時間 (msec)、負なら無制限
+ */
+bool
+cc_tcpconnect::exec_server_connect_timeout (unsigned int port, in_addr_t ipaddr, int timeout_ms)
+{
+    if (open_connection (port, ipaddr, timeout_ms) == false) {
+        return false;
+    }
+    // スレッドを起動する
+    thread_up();
+    return true;
+}
+
+/**
+ * @brief サーバーに接続する (スレッドは起動しない)
+ * タイムアウトを指定した場合は非ブロッキングで connect() して poll() で待ち、接続後にブロッキングに戻す。
+ * @param timeout_ms 接続完了を待つ最大時間 (msec)、負なら connect() でブロックする
+ */
+bool
+cc_tcpconnect::open_connection (unsigned int port, in_addr_t ipaddr, int timeout_ms)
 {
     if (clientSocket != -1) {
         CC_TCPCOMM_ERRPR ("already connected\n");
@@ -63,42 +125,280 @@ cc_tcpconnect::exec_server_connect (unsigned int port, in_addr_t ipaddr)
     }
 
     // create socket
-    if ((clientSocket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror ("cc_tcpconnect::exec_server_connect: socket()\n");
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (timeout_ms >= 0 ? SOCK_NONBLOCK : 0), 0);
+    if (fd == -1) {
+        perror ("cc_tcpconnect::open_connection: socket()");
         return false;
     }
+    sockopt.apply_connect (fd);
 
     // address
     clientAddress.sin_family = AF_INET;
     clientAddress.sin_port = htons(port);
     clientAddress.sin_addr.s_addr = ipaddr;
+    memcpy (&peerAddress.addr, &clientAddress, sizeof(clientAddress));
+    peerAddress.len = sizeof(clientAddress);
     CC_TCPCOMM_DBGPR ("PORT = %d\n", port);
 
     // サーバーに接続
-    if (connect(clientSocket, (struct sockaddr*)&clientAddress, sizeof(clientAddress)) < 0) {
-        perror ("cc_tcpconnect::exec_server_connect: connect()\n");
-        CC_TCPCOMM_ERRPR ("connect error\n");
-        close(clientSocket);
+    if (connect(fd, (struct sockaddr*)&clientAddress, sizeof(clientAddress)) < 0) {
+        if (timeout_ms < 0 || errno != EINPROGRESS) {
+            perror ("cc_tcpconnect::open_connection: connect()");
+            CC_TCPCOMM_ERRPR ("connect error\n");
+            goto ERROR;
+        }
+        // 接続完了 (書き込み可能) を待つ
+        struct pollfd pfd;
+        pfd.fd     = fd;
+        pfd.events = POLLOUT;
+        int ret;
+        do {
+            ret = poll (&pfd, 1, timeout_ms);
+        } while (ret == -1 && errno == EINTR);
+        if (ret == 0) {
+            CC_TCPCOMM_ERRPR ("connect timeout (%d msec)\n", timeout_ms);
+            errno = ETIMEDOUT;
+            goto ERROR;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (ret == -1 || getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            if (err != 0) {
+                errno = err;
+            }
+            perror ("cc_tcpconnect::open_connection: connect()");
+            CC_TCPCOMM_ERRPR ("connect error\n");
+            goto ERROR;
+        }
+    }
+    // exec_send()/exec_recv() は従来どおりブロッキングで使う
+    if (timeout_ms >= 0) {
+        fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    sockopt.apply_connected (fd);
+    clientSocket = fd;
+    connect_ns   = monotonic_ns ();
+
+    // connect success
+    CC_TCPCOMM_DBGPR ("connected\n");
+    return true;
+
+ ERROR:
+    {
+        int saved = errno;
+        close (fd);
+        errno = saved;
+    }
+    return false;
+}
+
+/**
+ * @brief ホスト名 (または IPv4/IPv6 の数値表記) で接続してスレッドを起動する
+ * 名前解決は cc_resolver のスレッドで行い、キャッシュにあれば問い合わせない。
+ * @param timeout_ms 名前解決と接続を合わせた最大時間 (msec)、負なら無制限
+ */
+bool
+cc_tcpconnect::exec_host_connect (const std::string &host, unsigned int port, int timeout_ms)
+{
+    if (open_host_connection (host, port, timeout_ms) == false) {
         return false;
     }
     // スレッドを起動する
     thread_up();
+    return true;
+}
 
-    // connect success
-    CC_TCPCOMM_DBGPR ("connected\n");
+/// 経過時間 (msec)
+static int
+elapsed_ms (const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+/**
+ * @brief ホスト名で接続する (スレッドは起動しない)
+ * 候補アドレスを IPv6/IPv4 交互に並べ、前の候補が CC_TCPCONNECT_HE_DELAY_MS 以内に
+ * つながらなければ次の候補の connect() を並行して始める (Happy Eyeballs, RFC 8305)。
+ * 最初に接続できたソケットを使い、残りは閉じる。
+ */
+bool
+cc_tcpconnect::open_host_connection (const std::string &host, unsigned int port, int timeout_ms)
+{
+    if (clientSocket != -1) {
+        CC_TCPCOMM_ERRPR ("already connected\n");
+        return false;
+    }
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    std::vector<cc_sockaddr> addrs;
+    if (cc_resolver::instance ().resolve (host, addrs, timeout_ms) == false) {
+        CC_TCPCOMM_ERRPR ("cannot resolve %s\n", host.c_str());
+        return false;
+    }
+
+    // 先頭の候補のファミリーから交互に並べる
+    std::vector<cc_sockaddr> cands;
+    {
+        std::vector<cc_sockaddr> first, second;
+        for (auto &a : addrs) {
+            (a.family () == addrs[0].family () ? first : second).push_back (a);
+        }
+        for (size_t i = 0; i < first.size () || i < second.size (); i++) {
+            if (i < first.size ())  cands.push_back (first[i]);
+            if (i < second.size ()) cands.push_back (second[i]);
+        }
+        for (auto &c : cands) {
+            c.set_port (port);
+        }
+    }
+
+    std::vector<struct pollfd> pfds;            // 接続中のソケット
+    std::vector<size_t> pidx;                   // pfds に対応する候補の番号
+    size_t next = 0;                            // 次に試す候補
+    int next_at = 0;                            // 次の候補を始める時刻 (start からの msec)
+    int fd = -1;                                // 接続できたソケット
+    size_t won = 0;
+    int last_err = ECONNREFUSED;
+
+    while (fd == -1) {
+        int now = elapsed_ms (start);
+        if (timeout_ms >= 0 && now >= timeout_ms) {
+            CC_TCPCOMM_ERRPR ("connect timeout %s (%d msec)\n", host.c_str(), timeout_ms);
+            last_err = ETIMEDOUT;
+            break;
+        }
+        // 次の候補を始める
+        if (next < cands.size () && (pfds.empty () || now >= next_at)) {
+            const cc_sockaddr &c = cands[next];
+            int s = socket (c.family (), SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+            if (s == -1) {
+                last_err = errno;
+            } else {
+                sockopt.apply_connect (s);
+                if (connect (s, c.sa (), c.len) == 0) {
+                    fd  = s;
+                    won = next;
+                } else if (errno == EINPROGRESS) {
+                    struct pollfd p;
+                    p.fd      = s;
+                    p.events  = POLLOUT;
+                    p.revents = 0;
+                    pfds.push_back (p);
+                    pidx.push_back (next);
+                } else {
+                    last_err = errno;
+                    close (s);
+                }
+            }
+            CC_TCPCOMM_DBGPR ("try %s\n", c.str().c_str());
+            next++;
+            next_at = now + CC_TCPCONNECT_HE_DELAY_MS;
+            continue;
+        }
+        if (pfds.empty ()) {
+            break;                              // すべての候補が失敗した
+        }
+
+        // 接続完了か次の候補の開始時刻まで待つ
+        int wait = -1;
+        if (next < cands.size ()) {
+            wait = (next_at > now) ? next_at - now : 0;
+        }
+        if (timeout_ms >= 0 && (wait < 0 || wait > timeout_ms - now)) {
+            wait = timeout_ms - now;
+        }
+        int ret = poll (pfds.data (), pfds.size (), wait);
+        if (ret == -1 && errno != EINTR) {
+            last_err = errno;
+            perror ("cc_tcpconnect::open_host_connection: poll()");
+            break;
+        }
+        for (size_t i = 0; ret > 0 && i < pfds.size ();) {
+            if (pfds[i].revents == 0) {
+                i++;
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt (pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                fd  = pfds[i].fd;
+                won = pidx[i];
+                pfds.erase (pfds.begin () + i);
+                pidx.erase (pidx.begin () + i);
+                break;
+            }
+            // 失敗したら待たずに次の候補を始める
+            last_err = (err != 0) ? err : errno;
+            close (pfds[i].fd);
+            pfds.erase (pfds.begin () + i);
+            pidx.erase (pidx.begin () + i);
+            next_at = elapsed_ms (start);
+        }
+    }
+    for (auto &p : pfds) {
+        close (p.fd);                           // 負けたソケット
+    }
+    if (fd == -1) {
+        errno = last_err;
+        perror ("cc_tcpconnect::open_host_connection: connect()");
+        CC_TCPCOMM_ERRPR ("connect error %s:%u\n", host.c_str(), port);
+        return false;
+    }
+
+    // exec_send()/exec_recv() は従来どおりブロッキングで使う
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+    sockopt.apply_connected (fd);
+    peerAddress = cands[won];
+    if (peerAddress.family () == AF_INET) {
+        memcpy (&clientAddress, &peerAddress.addr, sizeof(clientAddress));
+    } else {
+        memset (&clientAddress, 0, sizeof(clientAddress));
+    }
+    clientSocket = fd;
+    connect_ns   = monotonic_ns ();
+
+    CC_TCPCOMM_DBGPR ("connected %s\n", peerAddress.str().c_str());
     return true;
 }
+
+/**
+ * @brief connect 時に適用するソケットオプションの設定
+ * @param profile プロファイル (cc_sockopt_profile::latency() など)
+ */
+void
+cc_tcpconnect::set_sockopt_profile (const cc_sockopt_profile &profile)
+{
+    sockopt = profile;
+}
 bool
 cc_tcpconnect::exec_disconnect (void)
 {
     // スレッドを終了する
     thread_down();
 
-    // socket関連あとしまつ
-    if (clientSocket != -1) {
-        close(clientSocket);
-        clientSocket = -1;
-        CC_TCPCOMM_DBGPR ("disconnected\n");
+    // socket関連あとしまつ (他スレッドと同時に呼ばれても1回だけ close する)
+    // 送信中の flush_send() が fd を使い終わるまで send_mtx で待つ。
+    // リアクターモードではループが同じ fd で recv() しているかもしれないので shutdown() だけにして、
+    // close() は回収時にループのスレッドで行う (それまで fd 番号が別の接続に再利用されない)
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        int fd = clientSocket.exchange (-1);
+        if (fd != -1) {
+            if (owner_loop != NULL && conn_handle != 0) {
+                shutdown (fd, SHUT_RDWR);
+                closing_fd = fd;
+            } else {
+                close(fd);
+            }
+            CC_TCPCOMM_DBGPR ("disconnected\n");
+        }
+    }
+    // リアクターモードでは所有ループに回収を依頼する (スレッドモードは thread_finished() で依頼する)
+    if (owner_loop != NULL) {
+        retire ();
     }
     return true;
 }
@@ -106,9 +406,15 @@ ssize_t
 cc_tcpconnect::exec_send (unsigned char *dptr, int dsize)
 {
     ssize_t ret = send(clientSocket, (const void*)dptr, (size_t)dsize, 0);
+    count (CC_TCPSTAT_MSGS_OUT);
+    count (CC_TCPSTAT_WRITE_CALLS);
     if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            count (CC_TCPSTAT_WRITE_EAGAIN);
+        }
         perror("cc_tcpconnect::exec_send: send()");
     } else {
+        count (CC_TCPSTAT_BYTES_OUT, (uint64_t)ret);
         CC_TCPCOMM_DBGPR ("send tcp packet retcode=%ldbyte\n", (unsigned long)ret);
     }
     return ret;
@@ -117,6 +423,7 @@ ssize_t
 cc_tcpconnect::exec_recv (unsigned char *dptr, int dsize)
 {
     ssize_t ret = recv(clientSocket, (void*)dptr, (size_t)dsize, 0);
+    count_read (ret);
     if (ret == -1) {
         perror("cc_tcpconnect::exec_recv: recv()");
     } else {
@@ -125,6 +432,204 @@ cc_tcpconnect::exec_recv (unsigned char *dptr, int dsize)
     return ret;
 }
 
+/**
+ * @brief 送信キューに追加して送る (ブロックしない)
+ * リアクターモードでループのスレッドから呼んだ場合は、イベント処理の最後にまとめて送る。
+ * それ以外は送れるだけ送り、残りはキューに残す (リアクターモードなら書き込み可能になり次第ループが送る、
+ * スレッドモードなら書き込み可能になったら flush_send() を呼ぶこと)。
+ * @return false: 切断済み、キューがあふれた、または送信エラー
+ */
+bool
+cc_tcpconnect::send_buffered (const void *dptr, size_t dsize)
+{
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (clientSocket == -1) {
+            return false;
+        }
+        if (!send_queue.append (dptr, dsize)) {
+            CC_TCPCOMM_ERRPR ("send queue overflow\n");
+            return false;
+        }
+        count (CC_TCPSTAT_MSGS_OUT);
+        count_queue (send_queue.size ());
+    }
+    return kick_send ();
+}
+bool
+cc_tcpconnect::send_buffered (std::string &&data)
+{
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (clientSocket == -1) {
+            return false;
+        }
+        if (!send_queue.append (std::move (data))) {
+            CC_TCPCOMM_ERRPR ("send queue overflow\n");
+            return false;
+        }
+        count (CC_TCPSTAT_MSGS_OUT);
+        count_queue (send_queue.size ());
+    }
+    return kick_send ();
+}
+/**
+ * @brief ファイルを送信キューに追加して送る (ユーザー空間へのコピーなし)
+ * sendfile() で送り、使えないファイルシステムでは splice() で送る。
+ * 送信キューに入るので send_buffered() との順序は保たれ、リアクターモードでは
+ * ソケットが書き込み可能になるたびにループが続きを送る。
+ * スレッドモードのブロッキングソケットでは flush_send() がファイル区間の送信で待つことがある。
+ * @param path   ファイルパス
+ * @param offset 開始位置
+ * @param length バイト数、0 ならファイル末尾まで
+ */
+bool
+cc_tcpconnect::send_file (const char *path, off_t offset, size_t length)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("cc_tcpconnect::send_file: open()");
+        CC_TCPCOMM_ERRPR ("file open error (%s)\n", path);
+        return false;
+    }
+    if (length == 0) {
+        struct stat st;
+        if (fstat (fd, &st) == -1) {
+            perror("cc_tcpconnect::send_file: fstat()");
+            close (fd);
+            return false;
+        }
+        if (st.st_size <= offset) {
+            close (fd);
+            return true;
+        }
+        length = (size_t)(st.st_size - offset);
+    }
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (clientSocket == -1) {
+            close (fd);
+            return false;
+        }
+        send_queue.append_file (fd, offset, length);
+        count (CC_TCPSTAT_MSGS_OUT);
+        count_queue (send_queue.size ());
+    }
+    return kick_send ();
+}
+/**
+ * @brief 開いているファイルを送る (fd は dup して使うので、呼び出し側はすぐ閉じてよい)
+ */
+bool
+cc_tcpconnect::send_file (int file_fd, off_t offset, size_t length)
+{
+    int fd = fcntl (file_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("cc_tcpconnect::send_file: fcntl()");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        if (clientSocket == -1) {
+            close (fd);
+            return false;
+        }
+        send_queue.append_file (fd, offset, length);
+        count (CC_TCPSTAT_MSGS_OUT);
+        count_queue (send_queue.size ());
+    }
+    return kick_send ();
+}
+/**
+ * @brief 送信の起動、ループのスレッド内ならバッチの最後に予約する
+ */
+bool
+cc_tcpconnect::kick_send (void)
+{
+    if (owner_loop != NULL && owner_loop->in_loop_thread ()) {
+        if (!flush_scheduled) {
+            flush_scheduled = true;
+            owner_loop->flush_list.push_back (this);
+        }
+        return true;
+    }
+    return flush_send () != -1;
+}
+/**
+ * @brief 送信キューを送れるだけ送る (ブロックしない)
+ * リアクターモードでは残りがあれば EPOLLOUT を待ち、送信エラーなら切断する。
+ * io_uring バックエンドではループのスレッドからの送信を SENDMSG として投入し、完了時に続きを送る。
+ * @return 残りのバイト数、-1: 切断済みまたは送信エラー
+ */
+ssize_t
+cc_tcpconnect::flush_send (void)
+{
+    std::unique_lock<std::mutex> lock(send_mtx);
+    int fd = clientSocket;
+    if (fd == -1) {
+        return -1;
+    }
+    if (owner_loop != NULL && owner_loop->ring != NULL) {
+        if (send_inflight) {
+            return (ssize_t)send_queue.size ();     // 完了時に続きを送る
+        }
+        if (owner_loop->in_loop_thread () && !send_queue.empty () && !send_queue.head_is_file ()) {
+            owner_loop->uring_send (this);
+            return (ssize_t)send_queue.size ();
+        }
+        // ファイル区間と他スレッドからの送信は epoll と同じく直接送る
+    }
+    uint64_t calls  = send_queue.syscalls ();
+    uint64_t eagain = send_queue.eagain_count ();
+    ssize_t sent = send_queue.flush (fd);
+    int saved = errno;
+    count (CC_TCPSTAT_WRITE_CALLS, send_queue.syscalls () - calls);
+    count (CC_TCPSTAT_WRITE_EAGAIN, send_queue.eagain_count () - eagain);
+    if (sent > 0) {
+        count (CC_TCPSTAT_BYTES_OUT, (uint64_t)sent);
+    }
+    errno = saved;
+    if (sent == -1) {
+        if (errno != EPIPE && errno != ECONNRESET) {
+            perror("cc_tcpconnect::flush_send: sendmsg()");
+        }
+        send_queue.clear ();
+        lock.unlock ();
+        if (owner_loop != NULL) {
+            exec_disconnect ();
+        }
+        return -1;
+    }
+    size_t rest = send_queue.size ();
+    if (owner_loop != NULL && write_armed != (rest > 0)) {
+        write_armed = (rest > 0);
+        owner_loop->set_write_interest (this, write_armed);
+    }
+    return (ssize_t)rest;
+}
+size_t
+cc_tcpconnect::get_send_pending (void)
+{
+    std::lock_guard<std::mutex> lock(send_mtx);
+    return send_queue.size ();
+}
+/**
+ * @brief 受信バッファに1回読み込む (スレッドモードで select() の後などに使う)
+ * @return 読んだバイト数、0: 相手が切断, -1: エラー (EAGAIN を含む)
+ */
+ssize_t
+cc_tcpconnect::recv_to_buffer (void)
+{
+    ssize_t ret = recv_buf.read_from (clientSocket, CC_TCPLOOP_READ_SIZE);
+    count_read (ret);
+    return ret;
+}
+cc_ringbuf &
+cc_tcpconnect::get_recv_buffer (void)
+{
+    return recv_buf;
+}
+
 int
 cc_tcpconnect::get_fd (void) {
     return clientSocket;
@@ -135,6 +640,65 @@ cc_tcpconnect::get_status (void) {
     return clientSocket > 0;
 }
 
+/**
+ * @brief 接続とサーバーのカウンターに加算する (どのスレッドからでも可)
+ */
+void
+cc_tcpconnect::count (int idx, uint64_t n)
+{
+    stat[idx].fetch_add (n, std::memory_order_relaxed);
+    if (owner_server != NULL) {
+        owner_server->counters.add (idx, n);
+    }
+}
+void
+cc_tcpconnect::count_read (ssize_t ret)
+{
+    count (CC_TCPSTAT_READ_CALLS);
+    if (ret > 0) {
+        count (CC_TCPSTAT_BYTES_IN, (uint64_t)ret);
+        count (CC_TCPSTAT_MSGS_IN);
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        count (CC_TCPSTAT_READ_EAGAIN);
+    }
+}
+void
+cc_tcpconnect::count_queue (size_t pending)
+{
+    if (pending > stat_queue_max.load (std::memory_order_relaxed)) {
+        stat_queue_max.store (pending, std::memory_order_relaxed);     // send_mtx の中で呼ぶ
+    }
+}
+void
+cc_tcpconnect::reset_stats (void)
+{
+    for (int i = 0; i < CC_TCPSTAT_CONN_COUNT; i++) {
+        stat[i] = 0;
+    }
+    stat_queue_max = 0;
+}
+
+/**
+ * @brief 通信統計を取得する
+ * 所有スレッド以外から呼ぶ場合は、接続が delete されないことを呼び出し側で保証すること
+ */
+void
+cc_tcpconnect::get_stats (cc_tcpconn_stats &stats)
+{
+    stats.bytes_in       = stat[CC_TCPSTAT_BYTES_IN].load (std::memory_order_relaxed);
+    stats.bytes_out      = stat[CC_TCPSTAT_BYTES_OUT].load (std::memory_order_relaxed);
+    stats.msgs_in        = stat[CC_TCPSTAT_MSGS_IN].load (std::memory_order_relaxed);
+    stats.msgs_out       = stat[CC_TCPSTAT_MSGS_OUT].load (std::memory_order_relaxed);
+    stats.read_calls     = stat[CC_TCPSTAT_READ_CALLS].load (std::memory_order_relaxed);
+    stats.write_calls    = stat[CC_TCPSTAT_WRITE_CALLS].load (std::memory_order_relaxed);
+    stats.read_eagain    = stat[CC_TCPSTAT_READ_EAGAIN].load (std::memory_order_relaxed);
+    stats.write_eagain   = stat[CC_TCPSTAT_WRITE_EAGAIN].load (std::memory_order_relaxed);
+    stats.send_queue     = get_send_pending ();
+    stats.send_queue_max = stat_queue_max.load (std::memory_order_relaxed);
+    uint64_t since       = connect_ns.load (std::memory_order_relaxed);
+    stats.lifetime_ns    = (since != 0) ? monotonic_ns () - since : 0;
+}
+
 void
 cc_tcpconnect::get_ip (struct in_addr &in) {
     struct ifreq ifr;
@@ -143,92 +707,1247 @@ cc_tcpconnect::get_ip (struct in_addr &in) {
     //printf ("myip %s-%s\n" , "eth0" , inet_ntoa(in));
 }
 
+/**
+ * @brief 接続先への経路のインターフェース名と IPv4 アドレス (cc_netif の表から引く、システムコールなし)
+ */
 void
 cc_tcpconnect::get_ifinfo (struct ifreq &ifr) {
-    ifr.ifr_addr.sa_family = AF_INET;
-    strcpy(ifr.ifr_name , "eth0");
-    ioctl(clientSocket, SIOCGIFADDR, &ifr);
+    cc_sockaddr dst;
+    if (peerAddress.len > 0) {
+        dst = peerAddress;
+    } else if (clientAddress.sin_family == AF_INET) {
+        memcpy (&dst.addr, &clientAddress, sizeof(clientAddress));
+        dst.len = sizeof(clientAddress);
+    }
+    cc_netif::instance().default_ifreq (ifr, &dst);
 }
 
-// =====================================================================================
-// ===================================================================================== TCP SERVER
-// =====================================================================================
-
+/**
+ * @brief accept 直後に呼ばれる (リアクターモード)
+ */
 void
-cc_tcpserver::thread_main (void)
+cc_tcpconnect::on_connect (void)
 {
-    struct timeval timeout;
-    fd_set  readSet;
-
-    CC_TCPCOMM_DBGPR ("conn waiting thread: thread up\n");
-    
-    while (loop_continue()) {
-
-        // タイムアウト設定
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 1000*1000; // 1sec loop
-
-        // 待受対象
-        FD_ZERO(&readSet);
-        FD_SET(serverSocket, &readSet);
-
-        // select でイベント待ち
-        select(FD_SETSIZE, &readSet, 0, 0, &timeout);       // wait
-
-        // イベント処理
-        if( FD_ISSET(serverSocket, &readSet) ) {
-            // 新しいクライアント接続の受け入れ
-            {
-                cc_tcpconnect *conn = create_conn(); // connectionのインスタンス生成
-                socklen_t addr_size = sizeof(struct sockaddr_in);
-                conn->clientSocket = accept(serverSocket, (struct sockaddr*)&(conn->clientAddress), &addr_size);
-                if ((int)connections.size() < max_connection
-                    && conn->clientSocket > 0) {
-                    CC_TCPCOMM_DBGPR ("conn waiting thread: new client accepted\n");
-                    // クライアント接続のスレッドを起動する
-                    conn->thread_up();
-                    // 接続が確立したので、connectionsに保存
-                    connections.push_back(conn);
-                    CC_TCPCOMM_DBGPR ("connection count %d\n", (int)connections.size());
-                } else {
-                    // 接続失敗
-                    CC_TCPCOMM_ERRPR ("conn waiting thread: new client ignored\n");
-                    delete conn;
-                }
+    CC_TCPCOMM_DBGPR ("connected %s:%d\n", inet_ntoa(clientAddress.sin_addr), ntohs(clientAddress.sin_port));
+}
+/**
+ * @brief 読み込み可能になったときに呼ばれる (リアクターモード)
+ * 既定の実装は受信バッファに読み込んで on_recv() を呼び、切断やエラーなら exec_disconnect() する。
+ * ほかの接続を待たせないよう、1回の呼び出しで読む回数は制限する (残りは次のイベントで読む)。
+ */
+void
+cc_tcpconnect::on_readable (void)
+{
+    for (int i = 0; i < 4; i++) {
+        ssize_t ret = recv_buf.read_from (clientSocket, CC_TCPLOOP_READ_SIZE);
+        count_read (ret);
+        if (ret > 0) {
+            on_recv (recv_buf);
+            if (clientSocket == -1 || ret < CC_TCPLOOP_READ_SIZE) {
+                return;
             }
-        }
-        // ガベージコレクション、クローズしているコネクションインスタンスをサーチしてdeleteする
-        for (auto it = connections.begin(); it != connections.end(); ) {
-            if ((*it)->clientSocket == -1) {
-                CC_TCPCOMM_DBGPR ("conn waiting thread: found closed conn\n");
-                delete (*it);               // インスタンスをdelete
-                it = connections.erase(it); // vectorからポインタを削除
-                CC_TCPCOMM_DBGPR ("connection count %d\n", (int)connections.size());
-            } else {
-                it++;
+        } else if (ret == 0) {
+            // 相手が切断した
+            CC_TCPCOMM_DBGPR ("peer closed\n");
+            exec_disconnect ();
+            return;
+        } else {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
             }
+            if (errno == ENOBUFS) {
+                // 受信バッファが最大容量に達した (on_recv() が読み捨てていない)
+                CC_TCPCOMM_ERRPR ("recv buffer overflow\n");
+                exec_disconnect ();
+                return;
+            }
+            perror("cc_tcpconnect::on_readable: readv()");
+            exec_disconnect ();
+            return;
         }
     }
-    // コネクションインスタンスをdeleteする
-    for (auto it = connections.begin(); it != connections.end(); ) {
-        delete (*it);               // インスタンスをdelete
-        it = connections.erase(it); // vectorからポインタを削除
-    }
-    CC_TCPCOMM_DBGPR ("conn waiting thread: thread down\n");
 }
-
-cc_tcpserver::cc_tcpserver (key_t message_key, std::string nickname) :
-    cc_thread (message_key, nickname)
+/**
+ * @brief 受信バッファにデータが入ったときに呼ばれる (リアクターモード)
+ * 既定の実装は連続領域ごとに on_data() に渡し、全部読み捨てる。
+ * メッセージの区切りを扱う場合はこれを継承し、完結した分だけ consume() する。
+ */
+void
+cc_tcpconnect::on_recv (cc_ringbuf &rbuf)
 {
-    // すべてのインスタンスの debugprint をまとめてオンにする
-    //tcpcomm_dbg.enable();
-
-    CC_TCPCOMM_DBGPR ("instance created\n");
-
-    // initialize
-    serverSocket = -1;
+    struct iovec iov[2];
+    int cnt = rbuf.readable_iov (iov);
+    for (int i = 0; i < cnt; i++) {
+        on_data ((const unsigned char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    rbuf.consume (rbuf.size ());
 }
-
+/**
+ * @brief 書き込み可能になったときに呼ばれる (リアクターモード、送信キューが残っている時だけ)
+ */
+void
+cc_tcpconnect::on_writable (void)
+{
+    flush_send ();
+}
+/**
+ * @brief データを受信したときに呼ばれる (リアクターモード)、継承先で定義する
+ */
+void
+cc_tcpconnect::on_data (const unsigned char *dptr, size_t dsize)
+{
+    CC_TCPCOMM_DBGPR ("recv %lubyte (no handler)\n", (unsigned long)dsize);
+}
+/**
+ * @brief 切断後、インスタンスを delete する直前に呼ばれる (リアクターモード)
+ */
+void
+cc_tcpconnect::on_disconnect (void)
+{
+    CC_TCPCOMM_DBGPR ("disconnected\n");
+}
+/**
+ * @brief 接続インスタンスを使い回す前に呼ばれる (リアクターモード、set_conn_pool() 指定時)
+ * 基底クラスの状態は初期化済み。派生クラスは接続ごとの状態をここで初期化する。
+ * @return false: 使い回さずに delete する
+ */
+bool
+cc_tcpconnect::on_recycle (void)
+{
+    return true;
+}
+/**
+ * @brief 次の接続で使えるよう状態を初期化する (所有ループのスレッド内、回収後)
+ * 受信バッファは初期容量に戻し、送信キューの残りは捨てる。io_uring の送信引数は取っておく。
+ * @return false: 使い回せない
+ */
+bool
+cc_tcpconnect::recycle (void)
+{
+    if (clientSocket != -1 || closing_fd != -1) {
+        return false;
+    }
+    memset (&clientAddress, 0, sizeof(clientAddress));
+    peerAddress     = cc_sockaddr ();
+    owner_server    = NULL;
+    owner_loop      = NULL;
+    conn_handle     = 0;
+    retired         = false;
+    {
+        std::lock_guard<std::mutex> lock(send_mtx);
+        send_queue.clear ();
+        write_armed   = false;
+        send_inflight = false;
+    }
+    flush_scheduled = false;
+    uring_inflight  = 0;
+    uring_closing   = false;
+    connect_ns      = 0;
+    reset_stats ();
+    recv_buf.shrink ();
+    return on_recycle ();
+}
+/**
+ * @brief 所有者に回収を依頼する (1回だけ)
+ */
+void
+cc_tcpconnect::retire (void)
+{
+    if (conn_handle == 0 || retired.exchange (true)) {
+        return;
+    }
+    if (owner_loop != NULL) {
+        owner_loop->retire (conn_handle);
+    } else if (owner_server != NULL) {
+        owner_server->retire (conn_handle);
+    }
+}
+/**
+ * @brief スレッド終了時 (スレッドモード)、サーバーに回収を依頼する
+ */
+void
+cc_tcpconnect::thread_finished (void)
+{
+    retire ();
+}
+/**
+ * @brief サーバーの接続テーブル上のハンドル、サーバーが accept した接続以外は 0
+ */
+uint64_t
+cc_tcpconnect::get_handle (void)
+{
+    return conn_handle;
+}
+/**
+ * @brief 所有しているイベントループ、リアクターモード以外は NULL
+ */
+cc_tcploop *
+cc_tcpconnect::get_loop (void)
+{
+    return owner_loop;
+}
+
+// =====================================================================================
+// ===================================================================================== TCP EVENT LOOP
+// =====================================================================================
+
+/**
+ * @brief コンストラクター
+ * @param server    所有者のサーバー (接続の生成と接続数の管理に使う)
+ * @param listen_fd このループ専用のリスナー (非ブロッキング、クローズはサーバーが行う)
+ * @param nickname  ニックネーム文字列(デバックプリントで使用)
+ */
+cc_tcploop::cc_tcploop (cc_tcpserver *server, int listen_fd, std::string nickname) :
+    cc_thread (-1, nickname, CC_MAILBOX_NONE),
+    tcpcomm_dbg (nickname)
+{
+    this->server    = server;
+    this->listen_fd = listen_fd;
+    conn_count      = 0;
+    loop_thread     = pthread_t();
+    ring            = NULL;
+    closing_count   = 0;
+    accept_paused   = false;
+    accept_armed    = false;
+    wake_ns         = 0;
+
+    epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("cc_tcploop::cc_tcploop: epoll_create1()");
+    }
+    wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("cc_tcploop::cc_tcploop: eventfd()");
+    }
+
+    // data.ptr でリスナーと停止要求と接続を区別する
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &this->listen_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("cc_tcploop::cc_tcploop: epoll_ctl()");
+        CC_TCPCOMM_ERRPR ("listener register failed\n");
+    }
+    ev.events   = EPOLLIN;
+    ev.data.ptr = &wake_fd;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+        perror("cc_tcploop::cc_tcploop: epoll_ctl()");
+    }
+    CC_TCPCOMM_DBGPR ("instance created\n");
+}
+
+cc_tcploop::~cc_tcploop ()
+{
+    // スレッドを止める (残った接続はスレッドの終了処理で閉じる)
+    set_loop_continue (false);
+    wakeup ();
+    thread_down ();
+    drain_pool ();                              // スレッドが起動しなかった場合
+
+    if (wake_fd != -1) {
+        close (wake_fd);
+    }
+    if (epoll_fd != -1) {
+        close (epoll_fd);
+    }
+    CC_TCPCOMM_DBGPR ("instance deleted\n");
+}
+
+/**
+ * @brief epoll_wait() 中のループを起こす (どのスレッドからでも可)
+ */
+void
+cc_tcploop::wakeup (void)
+{
+    uint64_t v = 1;
+    if (write (wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+        perror("cc_tcploop::wakeup: write()");
+    }
+}
+
+/**
+ * @brief 呼び出し元がこのループのスレッドか
+ */
+bool
+cc_tcploop::in_loop_thread (void)
+{
+    pthread_t tid = loop_thread.load (std::memory_order_acquire);
+    return tid != pthread_t() && pthread_equal (pthread_self(), tid);
+}
+
+/**
+ * @brief 接続の EPOLLOUT 待ちの切り替え (送信キューのロック中に呼ばれる)
+ */
+bool
+cc_tcploop::set_write_interest (cc_tcpconnect *conn, bool enable)
+{
+    if (ring != NULL) {
+        // io_uring は1回きりの POLLOUT を投入する (完了すると write_armed を下ろす)
+        if (enable) {
+            if (in_loop_thread ()) {
+                uring_arm_write (conn);
+            } else {
+                uint64_t handle = conn->conn_handle;
+                arm_queue.push (std::move (handle));
+                wakeup ();
+            }
+        }
+        return true;
+    }
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, conn->clientSocket, &ev) == -1) {
+        if (errno != EBADF && errno != ENOENT) {
+            perror("cc_tcploop::set_write_interest: epoll_ctl()");
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief バッチ中に send_buffered() された接続をまとめて送る (ループのスレッド内)
+ * 1つのバッチで何度 send_buffered() しても、接続ごとの送信は sendmsg() 1回にまとまる
+ */
+void
+cc_tcploop::flush_pending (void)
+{
+    for (auto it = flush_list.begin(); it != flush_list.end(); it++) {
+        (*it)->flush_scheduled = false;
+        if ((*it)->clientSocket != -1) {
+            (*it)->flush_send ();
+        }
+    }
+    flush_list.clear ();
+}
+
+int
+cc_tcploop::get_connection_count (void)
+{
+    return conn_count.load ();
+}
+
+bool
+cc_tcploop::uses_uring (void)
+{
+    return ring != NULL;
+}
+
+/**
+ * @brief 切断した接続の回収依頼 (どのスレッドからでも可)
+ * 実際の delete はループのスレッドがイベント処理の区切りで行う
+ */
+void
+cc_tcploop::retire (uint64_t handle)
+{
+    reclaim_queue.push (std::move (handle));
+    if (!in_loop_thread ()) {
+        wakeup ();                              // ループ自身ならバッチの後で回収するので起こさない
+    }
+}
+
+/**
+ * @brief 回収依頼された接続を接続テーブルから外して delete する (ループのスレッド内)
+ */
+void
+cc_tcploop::reclaim (void)
+{
+    uint64_t handle;
+    while (reclaim_queue.pop (handle)) {
+        cc_tcpconnect *conn = server->conn_table.get (handle);
+        if (conn == NULL) {
+            continue;                           // 回収済み
+        }
+        if (ring != NULL && (conn->uring_closing == false || conn->uring_inflight > 0)) {
+            // 実行中の要求を取り消し、完了をすべて受け取ってから delete する
+            uring_close (conn);
+            if (conn->uring_inflight > 0) {
+                continue;                       // 最後の完了で再度回収依頼される
+            }
+        }
+        if (!server->conn_table.remove (handle)) {
+            continue;
+        }
+        if (conn->closing_fd != -1) {
+            close (conn->closing_fd);           // exec_disconnect() で shutdown() 済み
+            conn->closing_fd = -1;
+        }
+        if (conn->uring_closing) {
+            closing_count--;
+        }
+        conn_count--;
+        server->count_closed (conn);
+        conn->on_disconnect ();
+        release_conn (conn);
+        server->update_status (true, ntohs(server->serverAddress.sin_port));
+        server->notify_loops ();                // 空き待ちで止まっているループを起こす
+        CC_TCPCOMM_DBGPR ("conn reclaimed, connection count %d\n", conn_count.load());
+    }
+}
+
+/**
+ * @brief 接続インスタンスを取る、取っておいたものがあれば使い回す (ループのスレッド内)
+ */
+cc_tcpconnect *
+cc_tcploop::take_conn (void)
+{
+    if (conn_pool.empty ()) {
+        return server->create_conn(); // connectionのインスタンス生成
+    }
+    cc_tcpconnect *conn = conn_pool.back ();
+    conn_pool.pop_back ();
+    server->reused_count++;
+    return conn;
+}
+
+/**
+ * @brief 接続テーブルから外した接続インスタンスを手放す (ループのスレッド内)
+ * 接続統計の走査中ならまだポインタを参照されているかもしれないので、その走査が終わるまで後回しにする
+ */
+void
+cc_tcploop::release_conn (cc_tcpconnect *conn)
+{
+    uint64_t epoch = server->scan_guard ();
+    if (epoch != 0) {
+        deferred.push_back (std::make_pair (conn, epoch));
+        return;
+    }
+    free_conn (conn);
+}
+
+/**
+ * @brief 切断した接続インスタンスを取っておく、上限を超えるか使い回せなければ delete する
+ */
+void
+cc_tcploop::free_conn (cc_tcpconnect *conn)
+{
+    if ((int)conn_pool.size () < server->conn_pool_max && conn->recycle ()) {
+        conn_pool.push_back (conn);
+        return;
+    }
+    delete conn;
+}
+
+/**
+ * @brief 走査が終わった解放待ちの接続インスタンスを手放す (ループのスレッド内)
+ * @param wait true なら全部手放すまで待つ (ループの終了時)
+ */
+void
+cc_tcploop::release_deferred (bool wait)
+{
+    while (!deferred.empty ()) {
+        size_t keep = 0;
+        for (size_t i = 0; i < deferred.size (); i++) {
+            if (server->scan_finished (deferred[i].second)) {
+                free_conn (deferred[i].first);
+            } else {
+                deferred[keep++] = deferred[i];
+            }
+        }
+        deferred.resize (keep);
+        if (!wait || deferred.empty ()) {
+            break;
+        }
+        usleep (1000);
+    }
+}
+
+/**
+ * @brief 待ち受けキューが空になるまで accept する
+ */
+void
+cc_tcploop::accept_all (void)
+{
+    for (;;) {
+        if (server->overload == CC_TCP_OVERLOAD_PAUSE && server->admit_wait_ms () != 0) {
+            return;                             // 残りは listen バックログで待たせる
+        }
+        struct sockaddr_in addr;
+        socklen_t addr_size = sizeof(addr);
+        int fd = accept4 (listen_fd, (struct sockaddr*)&addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // EMFILE 等、次のイベントで再試行する
+                perror("cc_tcploop::accept_all: accept4()");
+            }
+            return;
+        }
+        if (server->admit (fd)) {               // 過負荷なら接続インスタンスを作らずに断る
+            adopt (fd, addr);
+        }
+    }
+}
+
+/**
+ * @brief 過負荷ならリスナーを待ち受けから外し、解消したら戻す (ループのスレッド内)
+ * @return 次に確認するまでの待ち時間 (msec)
+ */
+int
+cc_tcploop::update_accept (void)
+{
+    int wait_ms = server->admit_wait_ms ();
+    bool change = false;
+    if (wait_ms != 0 && !accept_paused) {
+        // 先にフラグを公開してから確認し直す (その間に空いた分は capacity_freed() が起こす)
+        accept_paused = true;
+        wait_ms = server->admit_wait_ms ();
+        if (wait_ms != 0) {
+            server->pause_count++;
+            change = true;
+            CC_TCPCOMM_DBGPR ("accept paused\n");
+        } else {
+            accept_paused = false;
+        }
+    } else if (wait_ms == 0 && accept_paused) {
+        accept_paused = false;
+        change = true;
+        CC_TCPCOMM_DBGPR ("accept resumed\n");
+    }
+    if (ring != NULL) {
+        // accept の完了で投入が終わっていればここで投入し直す
+        if (accept_paused && change) {
+            uring_cancel_accept ();
+        } else if (!accept_paused && !accept_armed) {
+            uring_arm_accept ();
+        }
+    } else if (change) {
+        struct epoll_event ev;
+        ev.events   = accept_paused ? 0 : EPOLLIN;
+        ev.data.ptr = &listen_fd;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev) == -1) {
+            perror("cc_tcploop::update_accept: epoll_ctl()");
+        }
+    }
+    return (wait_ms > 0 && wait_ms < 1000) ? wait_ms : 1000;
+}
+
+/**
+ * @brief accept したソケットから接続を作り、このループに登録する
+ * @return 接続、接続数の上限などで登録できなければ NULL (ソケットは閉じる)
+ */
+cc_tcpconnect *
+cc_tcploop::adopt (int fd, const struct sockaddr_in &addr)
+{
+    server->sockopt.apply_accepted (fd);
+    cc_tcpconnect *conn = take_conn ();
+    conn->clientSocket  = fd;
+    conn->clientAddress = addr;
+
+    // 接続数の上限は接続テーブルの容量 (サーバー全体)
+    uint64_t handle = server->conn_table.insert (conn);
+    if (handle == 0) {
+        CC_TCPCOMM_ERRPR ("new client ignored (max connection)\n");
+        conn->exec_disconnect ();               // ハンドルがないので回収依頼はされない
+        release_conn (conn);
+        return NULL;
+    }
+    if (ring != NULL) {
+        // 登録ファイルのスロットは接続テーブルのスロット番号
+        if (!ring->update_file ((unsigned)handle, fd)) {
+            perror("cc_tcploop::adopt: io_uring_register()");
+            server->conn_table.remove (handle);
+            conn->exec_disconnect ();
+            release_conn (conn);
+            return NULL;
+        }
+    } else {
+        struct epoll_event ev;
+        ev.events   = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("cc_tcploop::adopt: epoll_ctl()");
+            server->conn_table.remove (handle);
+            conn->exec_disconnect ();
+            release_conn (conn);
+            return NULL;
+        }
+    }
+    conn->owner_server = server;
+    conn->owner_loop   = this;
+    conn->conn_handle  = handle;
+    server->count_accept (conn, wake_ns);
+    conn_count++;
+    server->update_status (true, ntohs(server->serverAddress.sin_port));
+    if ((int)server->conn_table.size () >= server->max_connection) {
+        server->notify_loops ();                // 他のループにも受け付けを止めさせる
+    }
+    CC_TCPCOMM_DBGPR ("new client accepted, connection count %d\n", conn_count.load());
+    conn->on_connect ();
+    if (ring != NULL && conn->clientSocket != -1) {
+        uring_arm_recv (conn);
+    }
+    return conn;
+}
+
+void
+cc_tcploop::thread_main (void)
+{
+    CC_TCPCOMM_DBGPR ("event loop: thread up\n");
+    loop_thread.store (pthread_self(), std::memory_order_release);
+
+    if (server->backend == CC_TCP_BACKEND_URING && uring_setup ()) {
+        uring_main ();
+    } else {
+        epoll_main ();
+    }
+    release_deferred (true);                    // 統計の走査が終わるのを待ってから
+    drain_pool ();
+    loop_thread.store (pthread_t(), std::memory_order_release);
+    CC_TCPCOMM_DBGPR ("event loop: thread down\n");
+}
+
+void
+cc_tcploop::epoll_main (void)
+{
+    struct epoll_event events[CC_TCPLOOP_MAX_EVENTS];
+
+    while (loop_continue()) {
+        int timeout_ms = update_accept ();      // 1sec loop (受け付けレートの待ちならそれまで)
+        if (!deferred.empty () && (timeout_ms < 0 || timeout_ms > CC_TCPLOOP_DEFER_MS)) {
+            timeout_ms = CC_TCPLOOP_DEFER_MS;   // 解放待ちがあれば走査の終わりを見に来る
+        }
+        int n = thread_epoll_wait (epoll_fd, events, CC_TCPLOOP_MAX_EVENTS, timeout_ms);
+        wake_ns = monotonic_ns ();
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cc_tcploop::thread_main: epoll_wait()");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listen_fd) {
+                accept_all ();
+                continue;
+            }
+            if (ptr == &wake_fd) {
+                uint64_t v;
+                if (read (wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+                    perror("cc_tcploop::thread_main: read()");
+                }
+                continue;
+            }
+            cc_tcpconnect *conn = (cc_tcpconnect*)ptr;
+            if (conn->clientSocket == -1) {
+                continue;                       // このバッチの中で既に切断済み
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn->on_writable ();
+            }
+            // エラー/切断も recv() の結果として on_readable() で検出する
+            // (切断すると exec_disconnect() から回収依頼が入る)
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && conn->clientSocket != -1) {
+                conn->on_readable ();
+            }
+        }
+        // バッチ中に溜まった送信をまとめて送る
+        flush_pending ();
+        // 同じバッチの後続イベントが参照しているかもしれないので、delete はバッチの後で行う
+        reclaim ();
+        release_deferred ();
+    }
+    // 残っている接続をすべて閉じる
+    close_all ();
+}
+
+/**
+ * @brief このループの接続をすべて閉じて回収する
+ */
+void
+cc_tcploop::close_all (void)
+{
+    std::vector<uint64_t> rest;
+    server->conn_table.for_each ([this, &rest](uint64_t handle, cc_tcpconnect *conn) {
+            if (conn->owner_loop == this) {
+                rest.push_back (handle);
+            }
+        });
+    for (auto it = rest.begin(); it != rest.end(); it++) {
+        cc_tcpconnect *conn = server->conn_table.get (*it);
+        if (conn != NULL) {
+            conn->exec_disconnect ();
+        }
+    }
+    reclaim ();
+}
+
+/**
+ * @brief 取っておいた接続インスタンスを delete する (ループのスレッド終了時)
+ */
+void
+cc_tcploop::drain_pool (void)
+{
+    for (auto it = conn_pool.begin(); it != conn_pool.end(); it++) {
+        delete *it;
+    }
+    conn_pool.clear ();
+}
+
+// -------------------------------------------------------------------------------------------
+// io_uring バックエンド
+//
+// 接続の要求は user_data に接続のポインタと要求の種類 (下位3bit) を入れる。
+// 接続は実行中の要求 (uring_inflight) がなくなるまで delete しない。
+
+#define CC_TCPURING_OP_ACCEPT   1ULL            ///< multishot accept (ポインタなし)
+#define CC_TCPURING_OP_WAKE     2ULL            ///< wake_fd の multishot poll (ポインタなし)
+#define CC_TCPURING_OP_RECV     3ULL            ///< multishot recv
+#define CC_TCPURING_OP_SEND     4ULL            ///< sendmsg
+#define CC_TCPURING_OP_POLLOUT  5ULL            ///< 書き込み可能待ち
+#define CC_TCPURING_OP_CANCEL   6ULL            ///< 取り消し要求 (完了は無視する)
+#define CC_TCPURING_OP_MASK     7ULL
+#define CC_TCPURING_BUF_GROUP   0               ///< 受信用提供バッファのグループID
+
+/**
+ * @brief io_uring の準備、使えなければ false (epoll で動く)
+ */
+bool
+cc_tcploop::uring_setup (void)
+{
+    if (!cc_uring::supported ()) {
+        CC_TCPCOMM_WARNPR ("io_uring not supported, fallback to epoll\n");
+        return false;
+    }
+    cc_uring *r = new cc_uring;
+    if (!r->init (CC_TCPURING_ENTRIES)
+        || !r->register_files_sparse ((unsigned)server->max_connection)
+        || !r->setup_buffers (CC_TCPURING_BUF_GROUP, CC_TCPURING_BUF_COUNT, CC_TCPLOOP_READ_SIZE)) {
+        perror("cc_tcploop::uring_setup: io_uring");
+        CC_TCPCOMM_WARNPR ("io_uring setup failed, fallback to epoll\n");
+        delete r;
+        return false;
+    }
+    ring = r;
+    CC_TCPCOMM_DBGPR ("io_uring backend\n");
+    return true;
+}
+
+void
+cc_tcploop::uring_main (void)
+{
+    uring_arm_wake ();
+    uring_arm_accept ();
+
+    while (loop_continue()) {
+        int timeout_ms = update_accept ();
+        if (!deferred.empty () && (timeout_ms < 0 || timeout_ms > CC_TCPLOOP_DEFER_MS)) {
+            timeout_ms = CC_TCPLOOP_DEFER_MS;   // 解放待ちがあれば走査の終わりを見に来る
+        }
+        if (ring->submit_and_wait (timeout_ms) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("cc_tcploop::uring_main: io_uring_enter()");
+            break;
+        }
+        wake_ns = monotonic_ns ();
+        uring_process ();
+        // バッチ中に溜まった送信をまとめて投入する (次の io_uring_enter() で送られる)
+        flush_pending ();
+        reclaim ();
+        release_deferred ();
+    }
+    // 残っている接続を閉じて、取り消した要求の完了を待つ (最大 5 秒)
+    close_all ();
+    for (int i = 0; i < 50 && closing_count > 0; i++) {
+        if (ring->submit_and_wait (100) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            break;
+        }
+        uring_process ();
+        reclaim ();
+    }
+    if (closing_count > 0) {
+        CC_TCPCOMM_WARNPR ("%d connections not drained\n", closing_count);
+    }
+    ring->exit ();
+    delete ring;
+    ring = NULL;
+}
+
+/**
+ * @brief 溜まっている完了をすべて処理する
+ */
+void
+cc_tcploop::uring_process (void)
+{
+    struct io_uring_cqe *cqe;
+    while ((cqe = ring->peek_cqe ()) != NULL) {
+        uint64_t user_data = cqe->user_data;
+        int res            = cqe->res;
+        unsigned flags     = cqe->flags;
+        ring->cqe_seen ();
+        uring_complete (user_data, res, flags);
+    }
+    ring->publish_buffers ();
+
+    // 他スレッドから依頼された POLLOUT 待ち
+    uint64_t handle;
+    while (arm_queue.pop (handle)) {
+        cc_tcpconnect *conn = server->conn_table.get (handle);
+        if (conn != NULL && conn->owner_loop == this && conn->clientSocket != -1 && !conn->uring_closing) {
+            uring_arm_write (conn);
+        }
+    }
+}
+
+void
+cc_tcploop::uring_complete (uint64_t user_data, int res, unsigned flags)
+{
+#if CC_URING_ENABLE
+    uint64_t op = user_data & CC_TCPURING_OP_MASK;
+    bool more   = (flags & IORING_CQE_F_MORE) != 0;
+
+    if (op == CC_TCPURING_OP_ACCEPT) {
+        if (res >= 0) {
+            struct sockaddr_in addr;
+            socklen_t addr_size = sizeof(addr);
+            memset (&addr, 0, sizeof(addr));
+            getpeername (res, (struct sockaddr*)&addr, &addr_size);
+            if (server->admit (res)) {
+                adopt (res, addr);
+            }
+        } else if (res != -EAGAIN && res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+            errno = -res;
+            perror("cc_tcploop::uring_complete: accept");
+        }
+        if (!more) {
+            accept_armed = false;               // 次の周回の update_accept() で投入し直す
+        }
+        return;
+    }
+    if (op == CC_TCPURING_OP_WAKE) {
+        uint64_t v;
+        if (read (wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+            perror("cc_tcploop::uring_complete: read()");
+        }
+        if (!more) {
+            uring_arm_wake ();
+        }
+        return;
+    }
+    if (op == CC_TCPURING_OP_CANCEL) {
+        return;
+    }
+
+    cc_tcpconnect *conn = (cc_tcpconnect *)(uintptr_t)(user_data & ~CC_TCPURING_OP_MASK);
+    if (op == CC_TCPURING_OP_RECV) {
+        if (!more) {
+            conn->uring_inflight--;
+        }
+        bool alive = conn->clientSocket != -1 && !conn->uring_closing;
+        conn->count (CC_TCPSTAT_READ_CALLS);
+        if (res > 0) {
+            conn->count (CC_TCPSTAT_BYTES_IN, (uint64_t)res);
+            conn->count (CC_TCPSTAT_MSGS_IN);
+        } else if (res == -ENOBUFS) {
+            conn->count (CC_TCPSTAT_READ_EAGAIN);
+        }
+        if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (alive) {
+                if (conn->recv_buf.append (ring->buffer (bid), (size_t)res)) {
+                    conn->on_recv (conn->recv_buf);
+                } else {
+                    // 受信バッファが最大容量に達した (on_recv() が読み捨てていない)
+                    CC_TCPCOMM_ERRPR ("recv buffer overflow\n");
+                    conn->exec_disconnect ();
+                }
+            }
+            ring->recycle_buffer (bid);
+        } else if (res == 0) {
+            if (alive) {
+                CC_TCPCOMM_DBGPR ("peer closed\n");
+                conn->exec_disconnect ();
+            }
+        } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+            if (alive) {
+                if (res != -ECONNRESET) {
+                    errno = -res;
+                    perror("cc_tcploop::uring_complete: recv");
+                }
+                conn->exec_disconnect ();
+            }
+        }
+        // multishot が終わったら掛け直す (ENOBUFS はバッファを返したので次の投入で続く)
+        if (!more && conn->clientSocket != -1 && !conn->uring_closing && (res > 0 || res == -ENOBUFS)) {
+            uring_arm_recv (conn);
+        }
+    } else if (op == CC_TCPURING_OP_SEND) {
+        conn->uring_inflight--;
+        conn->count (CC_TCPSTAT_WRITE_CALLS);
+        if (res > 0) {
+            conn->count (CC_TCPSTAT_BYTES_OUT, (uint64_t)res);
+        } else if (res == -EAGAIN) {
+            conn->count (CC_TCPSTAT_WRITE_EAGAIN);
+        }
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mtx);
+            conn->send_inflight = false;
+            if (res > 0) {
+                conn->send_queue.consume_memory ((size_t)res);
+            }
+        }
+        if (conn->clientSocket != -1 && !conn->uring_closing) {
+            if (res < 0 && res != -EAGAIN && res != -EINTR) {
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    errno = -res;
+                    perror("cc_tcploop::uring_complete: sendmsg");
+                }
+                conn->exec_disconnect ();
+            } else {
+                conn->flush_send ();            // 残りを送る
+            }
+        }
+    } else if (op == CC_TCPURING_OP_POLLOUT) {
+        conn->uring_inflight--;
+        {
+            std::lock_guard<std::mutex> lock(conn->send_mtx);
+            conn->write_armed = false;
+        }
+        if (conn->clientSocket != -1 && !conn->uring_closing) {
+            conn->on_writable ();
+        }
+    }
+    if (conn->uring_closing && conn->uring_inflight == 0) {
+        uint64_t handle = conn->conn_handle;
+        reclaim_queue.push (std::move (handle));
+    }
+#endif // CC_URING_ENABLE
+}
+
+void
+cc_tcploop::uring_arm_accept (void)
+{
+#if CC_URING_ENABLE
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        return;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listen_fd;
+    // CC_TCP_OVERLOAD_PAUSE では1件ずつ受け付けて、そのたびに過負荷を確認する
+    sqe->ioprio       = (server->overload == CC_TCP_OVERLOAD_PAUSE) ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = CC_TCPURING_OP_ACCEPT;
+    accept_armed = true;
+#endif
+}
+
+/**
+ * @brief multishot accept を取り消す (受け付けの一時停止、再開は最後の完了の後で投入し直す)
+ */
+void
+cc_tcploop::uring_cancel_accept (void)
+{
+#if CC_URING_ENABLE
+    if (!accept_armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        return;
+    }
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = CC_TCPURING_OP_ACCEPT;
+    sqe->user_data = CC_TCPURING_OP_CANCEL;
+#endif
+}
+
+void
+cc_tcploop::uring_arm_wake (void)
+{
+#if CC_URING_ENABLE
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        return;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = wake_fd;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = CC_TCPURING_OP_WAKE;
+#endif
+}
+
+/**
+ * @brief multishot recv の投入 (提供バッファから選ばせ、登録ファイルで fd の参照を省く)
+ */
+void
+cc_tcploop::uring_arm_recv (cc_tcpconnect *conn)
+{
+#if CC_URING_ENABLE
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        conn->exec_disconnect ();
+        return;
+    }
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = (int)(uint32_t)conn->conn_handle;
+    sqe->flags     = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->buf_group = CC_TCPURING_BUF_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | CC_TCPURING_OP_RECV;
+    conn->uring_inflight++;
+#endif
+}
+
+void
+cc_tcploop::uring_arm_write (cc_tcpconnect *conn)
+{
+#if CC_URING_ENABLE
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        return;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = (int)(uint32_t)conn->conn_handle;
+    sqe->flags         = IOSQE_FIXED_FILE;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data     = (uint64_t)(uintptr_t)conn | CC_TCPURING_OP_POLLOUT;
+    conn->uring_inflight++;
+#endif
+}
+
+/**
+ * @brief 送信キュー先頭のメモリチャンクをまとめて SENDMSG で投入する (send_mtx のロック中に呼ばれる)
+ * 1つの接続で実行中の SENDMSG は1つだけにして、送った分は完了時に送信キューから外す。
+ */
+void
+cc_tcploop::uring_send (cc_tcpconnect *conn)
+{
+#if CC_URING_ENABLE
+    if (conn->uring_sendargs == NULL) {
+        conn->uring_sendargs = new cc_tcpconnect::uring_sendctx;
+    }
+    cc_tcpconnect::uring_sendctx *args = conn->uring_sendargs;
+    int cnt = conn->send_queue.memory_iov (args->iov, CC_TCPBUF_IOV_MAX);
+    if (cnt == 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = ring->get_sqe ();
+    if (sqe == NULL) {
+        CC_TCPCOMM_ERRPR ("submission queue full\n");
+        return;
+    }
+    memset (&args->msg, 0, sizeof(args->msg));
+    args->msg.msg_iov    = args->iov;
+    args->msg.msg_iovlen = cnt;
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = (int)(uint32_t)conn->conn_handle;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->addr      = (uint64_t)(uintptr_t)&args->msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | CC_TCPURING_OP_SEND;
+    conn->send_inflight = true;
+    conn->uring_inflight++;
+#endif
+}
+
+/**
+ * @brief 切断した接続の要求をすべて取り消し、登録ファイルから外す (1回だけ)
+ * 登録ファイルがソケットを参照しているので、外すまでソケットは閉じない。
+ */
+void
+cc_tcploop::uring_close (cc_tcpconnect *conn)
+{
+#if CC_URING_ENABLE
+    if (conn->uring_closing) {
+        return;
+    }
+    conn->uring_closing = true;
+    closing_count++;
+    unsigned slot = (unsigned)(uint32_t)conn->conn_handle;
+    if (conn->uring_inflight > 0) {
+        struct io_uring_sqe *sqe = ring->get_sqe ();
+        if (sqe != NULL) {
+            sqe->opcode        = IORING_OP_ASYNC_CANCEL;
+            sqe->fd            = (int)slot;
+            sqe->cancel_flags  = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED;
+            sqe->user_data     = CC_TCPURING_OP_CANCEL;
+            ring->submit ();                    // スロットを外す前に取り消しを投入する
+        }
+    }
+    ring->update_file (slot, -1);
+#endif
+}
+
+// =====================================================================================
+// ===================================================================================== TCP SERVER
+// =====================================================================================
+
+void
+cc_tcpserver::thread_main (void)
+{
+    struct timeval timeout;
+    fd_set  readSet;
+    bool paused = false;
+
+    CC_TCPCOMM_DBGPR ("conn waiting thread: thread up\n");
+    
+    while (loop_continue()) {
+
+        // 過負荷なら受け付けを止める (CC_TCP_OVERLOAD_PAUSE、空きは回収の通知で再確認する)
+        int wait_ms = admit_wait_ms ();
+        if (wait_ms != 0 && !paused) {
+            pause_count++;
+            CC_TCPCOMM_DBGPR ("conn waiting thread: accept paused\n");
+        }
+        paused = (wait_ms != 0);
+
+        // タイムアウト設定
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 1000*1000; // 1sec loop
+        if (wait_ms > 0 && wait_ms < 1000) {
+            timeout.tv_usec = wait_ms*1000;
+        }
+        if (!deferred.empty () && timeout.tv_usec > CC_TCPLOOP_DEFER_MS*1000) {
+            timeout.tv_usec = CC_TCPLOOP_DEFER_MS*1000;     // 解放待ちがあれば走査の終わりを見に来る
+        }
+
+        // 待受対象
+        FD_ZERO(&readSet);
+        if (!paused) {
+            FD_SET(serverSocket, &readSet);
+        }
+        FD_SET(reclaim_fd, &readSet);
+
+        // select でイベント待ち
+        thread_select(FD_SETSIZE, &readSet, 0, 0, &timeout);       // wait
+        uint64_t wake_ns = monotonic_ns ();
+
+        // イベント処理
+        if( !paused && FD_ISSET(serverSocket, &readSet) ) {
+            // 新しいクライアント接続の受け入れ
+            struct sockaddr_in addr;
+            socklen_t addr_size = sizeof(struct sockaddr_in);
+            int fd = accept4(serverSocket, (struct sockaddr*)&addr, &addr_size, SOCK_CLOEXEC);
+            if (fd == -1) {
+                perror("cc_tcpserver::thread_main: accept4()");
+            } else if (admit (fd)) {            // 過負荷なら接続インスタンスを作らずに断る
+                cc_tcpconnect *conn = create_conn(); // connectionのインスタンス生成
+                conn->clientSocket  = fd;
+                conn->clientAddress = addr;
+                sockopt.apply_accepted (fd);
+                uint64_t handle = conn_table.insert (conn);  // 満杯 (max_connection) なら 0
+                if (handle != 0) {
+                    CC_TCPCOMM_DBGPR ("conn waiting thread: new client accepted\n");
+                    // 接続が確立したので、接続テーブルに保存
+                    conn->owner_server = this;
+                    conn->conn_handle  = handle;
+                    // クライアント接続のスレッドを起動する
+                    count_accept (conn, wake_ns);
+                    conn->thread_up();
+                    update_status (true, ntohs(serverAddress.sin_port));
+                    CC_TCPCOMM_DBGPR ("connection count %d\n", conn_table.size());
+                } else {
+                    // 接続失敗
+                    CC_TCPCOMM_ERRPR ("conn waiting thread: new client ignored\n");
+                    delete conn;
+                }
+            }
+        }
+        // 終了したコネクションを回収する (接続スレッドが終了時に回収を依頼してくる)
+        if( FD_ISSET(reclaim_fd, &readSet) ) {
+            uint64_t v;
+            if (read (reclaim_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+                perror("cc_tcpserver::thread_main: read()");
+            }
+            reclaim ();
+        }
+        release_deferred ();
+    }
+    // コネクションインスタンスをdeleteする
+    std::vector<uint64_t> rest;
+    conn_table.for_each ([&rest](uint64_t handle, cc_tcpconnect *conn) { rest.push_back (handle); });
+    for (auto it = rest.begin(); it != rest.end(); it++) {
+        cc_tcpconnect *conn = conn_table.get (*it);
+        if (conn != NULL && conn_table.remove (*it)) {
+            count_closed (conn);
+            delete_conn (conn);         // インスタンスをdelete (スレッドも join される)
+        }
+    }
+    reclaim ();                         // delete 中に入った回収依頼を捨てる
+    release_deferred (true);            // 統計の走査が終わるのを待って delete する
+    update_status (false, ntohs(serverAddress.sin_port));
+    CC_TCPCOMM_DBGPR ("conn waiting thread: thread down\n");
+}
+
+/**
+ * @brief 接続の回収依頼 (スレッドモード、接続スレッドの終了時に呼ばれる)
+ */
+void
+cc_tcpserver::retire (uint64_t handle)
+{
+    reclaim_queue.push (std::move (handle));
+    uint64_t v = 1;
+    if (write (reclaim_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+        perror("cc_tcpserver::retire: write()");
+    }
+}
+
+/**
+ * @brief 回収依頼された接続を接続テーブルから外して delete する (サーバースレッド内)
+ */
+void
+cc_tcpserver::reclaim (void)
+{
+    uint64_t handle;
+    while (reclaim_queue.pop (handle)) {
+        cc_tcpconnect *conn = conn_table.get (handle);
+        if (conn == NULL || !conn_table.remove (handle)) {
+            continue;                   // 回収済み
+        }
+        CC_TCPCOMM_DBGPR ("conn waiting thread: found closed conn\n");
+        count_closed (conn);
+        delete_conn (conn);             // インスタンスをdelete
+        update_status (true, ntohs(serverAddress.sin_port));
+        CC_TCPCOMM_DBGPR ("connection count %d\n", conn_table.size());
+    }
+}
+
+cc_tcpserver::cc_tcpserver (key_t message_key, std::string nickname) :
+    cc_thread (message_key, nickname),
+    tcpcomm_dbg (nickname)
+{
+    // すべてのインスタンスの debugprint をまとめてオンにする
+    //tcpcomm_dbg.enable();
+
+    CC_TCPCOMM_DBGPR ("instance created\n");
+
+    // initialize
+    serverSocket = -1;
+    max_connection = 0;
+    backlog = CC_TCPSERVER_BACKLOG;
+    backend = CC_TCP_BACKEND_EPOLL;
+    overload = CC_TCP_OVERLOAD_SHED;
+    accept_rate      = 0;
+    accept_burst     = 0;
+    accept_tokens    = 0;
+    accept_tokens_ns = 0;
+    accepted_count   = 0;
+    shed_full_count  = 0;
+    shed_rate_count  = 0;
+    pause_count      = 0;
+    conn_pool_max    = CC_TCPLOOP_CONN_POOL;
+    reused_count     = 0;
+    scan_epoch       = 0;
+    scan_active      = 0;
+    admin            = NULL;
+    reclaim_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reclaim_fd == -1) {
+        perror("cc_tcpserver::cc_tcpserver: eventfd()");
+    }
+    update_status (false, 0);
+}
+
 //cc_tcpserver::cc_tcpserver (void) :
 //    cc_thread ("cc_tcpserver")
 //{
@@ -238,69 +1957,274 @@ cc_tcpserver::cc_tcpserver (key_t message_key, std::string nickname) :
 //  serverSocket = -1;
 //}
 
-cc_tcpserver::~cc_tcpserver ()
+cc_tcpserver::~cc_tcpserver ()
+{
+    // detach resource
+    stop_admin ();
+    stop_server ();
+    if (reclaim_fd != -1) {
+        close (reclaim_fd);
+    }
+
+    CC_TCPCOMM_DBGPR ("instance deleted\n");
+}
+
+cc_tcpconnect *
+cc_tcpserver::create_conn (void)
+{
+    return new cc_tcpconnect(-1,"cc_tcpconnect");
+}
+
+/**
+ * @brief listen() のバックログの設定
+ * @param backlog バックログ (カーネルの somaxconn で頭打ちになる)
+ */
+void
+cc_tcpserver::set_backlog (int backlog)
+{
+    this->backlog = (backlog > 0) ? backlog : CC_TCPSERVER_BACKLOG;
+}
+
+/**
+ * @brief リアクターモードの I/O バックエンドの設定
+ * CC_TCP_BACKEND_URING でも、カーネルが multishot recv/提供バッファ (Linux 6.0) に
+ * 対応していなければ各ループは epoll で動く (cc_tcploop::uses_uring() で確認できる)。
+ * io_uring では受信は on_readable() を経由せず、受信バッファに入れて on_recv() を呼ぶ。
+ */
+void
+cc_tcpserver::set_io_backend (cc_tcp_backend backend)
+{
+    this->backend = backend;
+}
+
+/**
+ * @brief 過負荷 (接続数/受け付けレートの上限) のときの受け付け方の設定
+ * CC_TCP_OVERLOAD_SHED は accept してすぐ閉じるので、クライアントは待たされずに断られる。
+ * CC_TCP_OVERLOAD_PAUSE はリスナーを待ち受けから外すので、クライアントは listen バックログで
+ * 空きを待つ (バックログが溢れると SYN が捨てられ、クライアントの再送で待たされる)。
+ */
+void
+cc_tcpserver::set_overload_policy (cc_tcp_overload policy)
+{
+    overload = policy;
+}
+
+/**
+ * @brief 受け付けレートの上限 (トークンバケット)
+ * @param per_sec 1秒あたりの受け付け数、0 なら制限なし
+ * @param burst 連続して受け付けられる数、0 なら per_sec
+ */
+void
+cc_tcpserver::set_accept_rate (int per_sec, int burst)
+{
+    std::lock_guard<std::mutex> lock(admit_mtx);
+    accept_rate      = (per_sec > 0) ? per_sec : 0;
+    accept_burst     = (burst > 0) ? burst : accept_rate;
+    accept_tokens    = accept_burst;
+    accept_tokens_ns = 0;
+}
+
+/**
+ * @brief 切断した接続インスタンスを使い回す数 (リアクターモード)
+ * 切断した接続は on_disconnect() の後、delete せずにループごとのリストに取っておき、
+ * 次の accept で create_conn() の代わりに使う (コンストラクター/デストラクターと
+ * 受信バッファ等の確保を省く)。使い回す前に on_recycle() が呼ばれるので、
+ * 派生クラスが接続ごとの状態を持つ場合はそこで初期化すること。
+ * @param per_loop ループごとに取っておく最大数、0 なら使い回さない
+ */
+void
+cc_tcpserver::set_conn_pool (int per_loop)
 {
-    // detach resource
-    stop_server ();
+    conn_pool_max = (per_loop > 0) ? per_loop : 0;
+}
 
-    CC_TCPCOMM_DBGPR ("instance deleted\n");
+/**
+ * @brief 過負荷で断るときに送る応答 (例: "HTTP/1.1 503 Service Unavailable\r\n...")
+ * 送信はノンブロッキングで1回だけ行い、送れなかった分は捨てる。空なら何も送らずに閉じる。
+ */
+void
+cc_tcpserver::set_busy_response (const std::string &response)
+{
+    busy_response = response;
 }
 
-cc_tcpconnect *
-cc_tcpserver::create_conn (void)
+/**
+ * @brief 受け付けを止めて待つ時間 (CC_TCP_OVERLOAD_PAUSE のみ、どのスレッドからでも可)
+ * @return 0: 受け付けてよい、正: 次のトークンまでの時間 (msec)、-1: 接続の空きを待つ
+ */
+int
+cc_tcpserver::admit_wait_ms (void)
 {
-    return new cc_tcpconnect(-1,"cc_tcpconnect");
+    if (overload != CC_TCP_OVERLOAD_PAUSE) {
+        return 0;
+    }
+    if ((int)conn_table.size () >= max_connection) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(admit_mtx);
+    if (accept_rate == 0) {
+        return 0;
+    }
+    uint64_t now = monotonic_ns ();
+    double tokens = accept_tokens;
+    if (accept_tokens_ns != 0) {
+        tokens += (double)(now - accept_tokens_ns) * accept_rate / 1e9;
+    }
+    if (tokens >= 1.0) {
+        return 0;
+    }
+    return (int)((1.0 - tokens) * 1000.0 / accept_rate) + 1;
 }
 
+/**
+ * @brief accept したソケットを受け入れるか決める (接続インスタンスを作る前に呼ぶ)
+ * 接続数かレートが上限なら、過負荷応答を送ってソケットを閉じる。
+ * @return true: 受け入れる、false: 断った (fd は閉じた)
+ */
 bool
-cc_tcpserver::start_server (unsigned int port, int cmax)
+cc_tcpserver::admit (int fd)
 {
-    if (get_server_status()) {
-        CC_TCPCOMM_ERRPR ("server already opened\n");
-        return false;
+    bool full = (int)conn_table.size () >= max_connection;
+    bool rate_ok = true;
+    if (!full) {
+        std::lock_guard<std::mutex> lock(admit_mtx);
+        if (accept_rate > 0) {
+            uint64_t now = monotonic_ns ();
+            if (accept_tokens_ns != 0) {
+                accept_tokens += (double)(now - accept_tokens_ns) * accept_rate / 1e9;
+                if (accept_tokens > accept_burst) {
+                    accept_tokens = accept_burst;
+                }
+            }
+            accept_tokens_ns = now;
+            if (accept_tokens >= 1.0) {
+                accept_tokens -= 1.0;
+            } else {
+                rate_ok = false;
+            }
+        }
     }
-    // 変数の初期化
-    max_connection = cmax;
+    if (!full && rate_ok) {
+        accepted_count++;
+        return true;
+    }
+    if (full) {
+        shed_full_count++;
+    } else {
+        shed_rate_count++;
+    }
+    if (!busy_response.empty ()) {
+        if (send (fd, busy_response.data (), busy_response.size (), MSG_DONTWAIT | MSG_NOSIGNAL) == -1
+            && errno != EAGAIN && errno != EPIPE && errno != ECONNRESET) {
+            perror("cc_tcpserver::admit: send()");
+        }
+    }
+    close (fd);
+    CC_TCPCOMM_DBGPR ("new client shed (%s)\n", full ? "max connection" : "accept rate");
+    return false;
+}
+
+/**
+ * @brief 接続数が上限に達した/空いたので、他のループに受け付けの再確認を促す (リアクターモード)
+ */
+void
+cc_tcpserver::notify_loops (void)
+{
+    if (overload != CC_TCP_OVERLOAD_PAUSE) {
+        return;
+    }
+    for (auto it = loops.begin(); it != loops.end(); it++) {
+        if (!(*it)->in_loop_thread ()) {
+            (*it)->wakeup ();
+        }
+    }
+}
+
+/**
+ * @brief listen/accept 時に適用するソケットオプションの設定
+ * @param profile プロファイル (cc_sockopt_profile::latency() など)
+ */
+void
+cc_tcpserver::set_sockopt_profile (const cc_sockopt_profile &profile)
+{
+    sockopt = profile;
+}
+
+/**
+ * @brief リスナーソケットの作成 (serverAddress に bind して listen する)
+ * @param reuseport true: SO_REUSEPORT を設定し非ブロッキングにする (リアクターモード)
+ * @return ソケット、エラーなら -1
+ */
+int
+cc_tcpserver::open_listener (unsigned int port, bool reuseport)
+{
+    int fd;
+    int type = SOCK_STREAM | SOCK_CLOEXEC | (reuseport ? SOCK_NONBLOCK : 0);
 
     // create socket
-    if ((serverSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("cc_tcpserver::start_server: socket()");
-        return false;
+    if ((fd = socket(AF_INET, type, 0)) < 0) {
+        perror("cc_tcpserver::open_listener: socket()");
+        return -1;
     }
 
     // SO_REUSEADDRオプションを設定(解放後、すぐ再利用可能とする)
     int reuse = 1;
-    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1) {
-        perror("cc_tcpserver::start_server: setsockopt()");
-        CC_TCPCOMM_ERRPR ("server start failed\n");
-        close (serverSocket);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1) {
+        perror("cc_tcpserver::open_listener: setsockopt()");
+        goto ERROR;
+    }
+    // SO_REUSEPORTオプションを設定(同じポートを複数のリスナーで待ち受け、カーネルが振り分ける)
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) == -1) {
+        perror("cc_tcpserver::open_listener: setsockopt(SO_REUSEPORT)");
+        goto ERROR;
+    }
+
+    // バッファサイズ等は listen 前に設定する (失敗してもワーニングのみ)
+    sockopt.apply_listen (fd);
+
+    // bind
+    if (bind(fd, (const struct sockaddr *) &serverAddress, sizeof(serverAddress)) == -1) {
+        perror("cc_tcpserver::open_listener: bind()");
+        goto ERROR;
+    }
+
+    // listen
+    if (listen(fd, backlog) == -1) {
+        perror("cc_tcpserver::open_listener: listen()");
+        goto ERROR;
+    }
+    return fd;
+
+ ERROR:
+    close (fd);
+    return -1;
+}
+
+bool
+cc_tcpserver::start_server (unsigned int port, int cmax)
+{
+    if (get_server_status()) {
+        CC_TCPCOMM_ERRPR ("server already opened\n");
         return false;
     }
-    
+    // 変数の初期化
+    max_connection = cmax;
+    conn_table.reset (cmax > 0 ? cmax : 0);
+
     // address
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_port = htons(port);
     serverAddress.sin_addr.s_addr = INADDR_ANY;
     CC_TCPCOMM_DBGPR ("PORT = %d\n", port);
 
-    // bind
-    if (bind(serverSocket, (const struct sockaddr *) &serverAddress, sizeof(serverAddress)) == -1) {
-        perror("cc_tcpserver::start_server: bind()");
+    if ((serverSocket = open_listener (port, false)) == -1) {
         CC_TCPCOMM_ERRPR ("server start failed\n");
-        close (serverSocket);
         return false;
     }
+    CC_TCPCOMM_DBGPR ("server start success\n");
+
+    update_status (true, port);
 
-    // listen
-    if (listen(serverSocket, 10) == 0) {
-        CC_TCPCOMM_DBGPR ("server start success\n");
-    } else {
-        perror("cc_tcpserver::start_server: listen()");
-        CC_TCPCOMM_ERRPR ("server start failed\n");
-        close (serverSocket);
-        return false;
-    }
-    
     // threadを上げる
     CC_TCPCOMM_DBGPR ("now start server thread\n");
     thread_up ();
@@ -308,15 +2232,101 @@ cc_tcpserver::start_server (unsigned int port, int cmax)
     return true;
 }
 
+/**
+ * @brief リアクターモードでサーバーを開始する
+ * nloops 本のイベントループスレッドがそれぞれ SO_REUSEPORT のリスナーと epoll を持ち、
+ * accept した接続をそのループのスレッドで処理する (接続ごとのスレッドは起動しない)。
+ * 接続は on_connect()/on_readable()/on_data()/on_disconnect() を継承して処理する。
+ * set_launch_policy() で CPU を指定している場合、ループ i は cpus[i % cpus.size()] に固定する。
+ * @param port   待ち受けポート
+ * @param cmax   最大接続数 (全ループの合計)
+ * @param nloops イベントループ数
+ */
+bool
+cc_tcpserver::start_server_reactor (unsigned int port, int cmax, int nloops)
+{
+    if (get_server_status()) {
+        CC_TCPCOMM_ERRPR ("server already opened\n");
+        return false;
+    }
+    // 変数の初期化
+    max_connection = cmax;
+    conn_table.reset (cmax > 0 ? cmax : 0);
+    if (nloops < 1) {
+        nloops = 1;
+    }
+
+    // address
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(port);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    CC_TCPCOMM_DBGPR ("PORT = %d, loops = %d\n", port, nloops);
+
+    // ループごとのリスナー
+    for (int i = 0; i < nloops; i++) {
+        int fd = open_listener (port, true);
+        if (fd == -1) {
+            CC_TCPCOMM_ERRPR ("server start failed\n");
+            for (auto it = listeners.begin(); it != listeners.end(); it++) {
+                close (*it);
+            }
+            listeners.clear ();
+            return false;
+        }
+        listeners.push_back (fd);
+    }
+    serverSocket = listeners[0];
+    update_status (true, port);
+
+    cc_thread_policy policy;
+    {
+        std::lock_guard<std::mutex> lock(mtx); // mutexをロック
+        policy = launch_policy;
+    }
+    for (int i = 0; i < nloops; i++) {
+        cc_tcploop *loop = new cc_tcploop (this, listeners[i], nickname + ".loop" + std::to_string(i));
+        cc_thread_policy lp = policy;
+        if (!policy.cpus.empty()) {
+            lp.cpus.assign (1, policy.cpus[i % policy.cpus.size()]);
+        }
+        loop->set_launch_policy (lp);
+        loop->thread_up ();
+        loops.push_back (loop);
+    }
+    CC_TCPCOMM_DBGPR ("server start success (reactor)\n");
+    return true;
+}
+
 bool
 cc_tcpserver::stop_server (void)
 {
     // server close
     if (get_server_status()) {
-        // threadを落とす
-        thread_down();
-        // socket類の後始末
-        close (serverSocket);
+        if (!loops.empty()) {
+            // リアクターモード、ループを止めると各ループの接続も閉じられる
+            // (終了処理中のループが他のループを起こすので、すべて止めてから delete する)
+            for (auto it = loops.begin(); it != loops.end(); it++) {
+                (*it)->set_loop_continue (false);
+                (*it)->wakeup ();
+            }
+            for (auto it = loops.begin(); it != loops.end(); it++) {
+                (*it)->thread_down ();
+            }
+            for (auto it = loops.begin(); it != loops.end(); it++) {
+                delete (*it);
+            }
+            loops.clear ();
+            for (auto it = listeners.begin(); it != listeners.end(); it++) {
+                close (*it);
+            }
+            listeners.clear ();
+            update_status (false, ntohs(serverAddress.sin_port));
+        } else {
+            // threadを落とす
+            thread_down();
+            // socket類の後始末
+            close (serverSocket);
+        }
         serverSocket = -1;
         CC_TCPCOMM_DBGPR ("stoped server thread\n");
     }
@@ -328,6 +2338,384 @@ cc_tcpserver::get_server_status (void)
 {
     return serverSocket >= 0;           // 接続していればtrueを返す
 }
+/**
+ * @brief 状態スナップショットの更新 (seqlock なので読み出し側を待たせない)
+ */
+void
+cc_tcpserver::update_status (bool running, unsigned int port)
+{
+    cc_tcpserver_status status;
+    status.running        = running;
+    status.port           = port;
+    status.max_connection = max_connection;
+    status.connections    = conn_table.size ();
+    status.accepted       = 0;                  // カウンターは get_status_snapshot() で埋める
+    status.shed_full      = 0;
+    status.shed_rate      = 0;
+    status.pauses         = 0;
+    status.reused         = 0;
+    status_snapshot.store (status);
+}
+/**
+ * @brief 状態スナップショットの取得、どのスレッドからでもロックなしで呼べる
+ */
+void
+cc_tcpserver::get_status_snapshot (cc_tcpserver_status &status)
+{
+    status = status_snapshot.load ();
+    status.accepted  = accepted_count.load ();
+    status.shed_full = shed_full_count.load ();
+    status.shed_rate = shed_rate_count.load ();
+    status.pauses    = pause_count.load ();
+    status.reused    = reused_count.load ();
+}
+/**
+ * @brief 現在の接続数、どのスレッドからでもロックなしで呼べる
+ */
+int
+cc_tcpserver::get_connection_count (void)
+{
+    return status_snapshot.load ().connections;
+}
+/**
+ * @brief ハンドルから接続を得る、切断して回収済みなら NULL (ロックなし)
+ */
+cc_tcpconnect *
+cc_tcpserver::find_conn (uint64_t handle)
+{
+    return conn_table.get (handle);
+}
+
+/**
+ * @brief 受け付けた接続の接続時刻と受け付け待ち時間を記録する
+ * @param wake_ns リスナーの通知でイベント待ちから戻った時刻
+ */
+void
+cc_tcpserver::count_accept (cc_tcpconnect *conn, uint64_t wake_ns)
+{
+    uint64_t now = monotonic_ns ();
+    uint64_t latency = (wake_ns != 0 && now > wake_ns) ? now - wake_ns : 0;
+    conn->connect_ns = now;
+    counters.add (CC_TCPSTAT_ACCEPT_NS, latency);
+    counters.update_max (CC_TCPSTAT_ACCEPT_MAX_NS, latency);
+}
+/**
+ * @brief 回収した接続の接続時間を記録する
+ */
+void
+cc_tcpserver::count_closed (cc_tcpconnect *conn)
+{
+    uint64_t since = conn->connect_ns.load (std::memory_order_relaxed);
+    if (since == 0) {
+        return;
+    }
+    uint64_t lifetime = monotonic_ns () - since;
+    counters.add (CC_TCPSTAT_CLOSED);
+    counters.add (CC_TCPSTAT_LIFETIME_NS, lifetime);
+    counters.update_max (CC_TCPSTAT_LIFETIME_MAX_NS, lifetime);
+}
+
+/**
+ * @brief サーバー全体の通信統計 (カウンターはシャードの合計、未送信バイト数は全接続の合計)
+ */
+void
+cc_tcpserver::get_metrics (cc_tcpserver_metrics &metrics)
+{
+    metrics.bytes_in          = counters.sum (CC_TCPSTAT_BYTES_IN);
+    metrics.bytes_out         = counters.sum (CC_TCPSTAT_BYTES_OUT);
+    metrics.msgs_in           = counters.sum (CC_TCPSTAT_MSGS_IN);
+    metrics.msgs_out          = counters.sum (CC_TCPSTAT_MSGS_OUT);
+    metrics.read_calls        = counters.sum (CC_TCPSTAT_READ_CALLS);
+    metrics.write_calls       = counters.sum (CC_TCPSTAT_WRITE_CALLS);
+    metrics.read_eagain       = counters.sum (CC_TCPSTAT_READ_EAGAIN);
+    metrics.write_eagain      = counters.sum (CC_TCPSTAT_WRITE_EAGAIN);
+    metrics.connections       = get_connection_count ();
+    metrics.accepted          = accepted_count.load ();
+    metrics.closed            = counters.sum (CC_TCPSTAT_CLOSED);
+    metrics.lifetime_ns_total = counters.sum (CC_TCPSTAT_LIFETIME_NS);
+    metrics.lifetime_ns_max   = counters.max (CC_TCPSTAT_LIFETIME_MAX_NS);
+    metrics.accept_ns_total   = counters.sum (CC_TCPSTAT_ACCEPT_NS);
+    metrics.accept_ns_max     = counters.max (CC_TCPSTAT_ACCEPT_MAX_NS);
+    metrics.send_queue        = 0;
+    scan_begin ();
+    conn_table.for_each ([&metrics](uint64_t handle, cc_tcpconnect *conn) {
+            metrics.send_queue += conn->get_send_pending ();
+        });
+    scan_end ();
+}
+/**
+ * @brief 全接続の通信統計 (接続のハンドルと統計の組)
+ * 走査中に切断した接続は、所有スレッドが走査の終わりまで delete/使い回しを後回しにする
+ */
+void
+cc_tcpserver::get_conn_stats (std::vector<std::pair<uint64_t, cc_tcpconn_stats> > &stats)
+{
+    stats.clear ();
+    scan_begin ();
+    conn_table.for_each ([&stats](uint64_t handle, cc_tcpconnect *conn) {
+            cc_tcpconn_stats s;
+            conn->get_stats (s);
+            stats.push_back (std::make_pair (handle, s));
+        });
+    scan_end ();
+}
+
+/**
+ * @brief 接続統計の走査を始める (接続テーブルのポインタを参照する前に呼ぶ)
+ * 走査どうしは直列化するが、ループ/サーバースレッドは待たせない
+ */
+void
+cc_tcpserver::scan_begin (void)
+{
+    scan_mtx.lock ();
+    scan_active.store (++scan_epoch, std::memory_order_seq_cst);
+    std::atomic_thread_fence (std::memory_order_seq_cst);   // 走査中の印を付けてから接続テーブルを読む
+}
+void
+cc_tcpserver::scan_end (void)
+{
+    scan_active.store (0, std::memory_order_release);
+    scan_mtx.unlock ();
+}
+/**
+ * @brief 接続テーブルから外した接続インスタンスをすぐ手放してよいか
+ * @return 0: よい, 0 以外: 走査中の番号 (scan_finished() になるまで手放さないこと)
+ */
+uint64_t
+cc_tcpserver::scan_guard (void)
+{
+    std::atomic_thread_fence (std::memory_order_seq_cst);   // 接続テーブルから外してから走査中か確認する
+    return scan_active.load (std::memory_order_acquire);    // 直前に終わった走査の読み出しより後に手放す
+}
+
+/**
+ * @brief 接続テーブルから外した接続インスタンスを delete する、走査中なら後回しにする (スレッドモード)
+ */
+void
+cc_tcpserver::delete_conn (cc_tcpconnect *conn)
+{
+    uint64_t epoch = scan_guard ();
+    if (epoch != 0) {
+        deferred.push_back (std::make_pair (conn, epoch));
+        return;
+    }
+    delete conn;
+}
+/**
+ * @brief 走査が終わった解放待ちの接続インスタンスを delete する (サーバースレッド内)
+ * @param wait true なら全部 delete するまで待つ (サーバースレッドの終了時)
+ */
+void
+cc_tcpserver::release_deferred (bool wait)
+{
+    while (!deferred.empty ()) {
+        size_t keep = 0;
+        for (size_t i = 0; i < deferred.size (); i++) {
+            if (scan_finished (deferred[i].second)) {
+                delete deferred[i].first;
+            } else {
+                deferred[keep++] = deferred[i];
+            }
+        }
+        deferred.resize (keep);
+        if (!wait || deferred.empty ()) {
+            break;
+        }
+        usleep (1000);
+    }
+}
+
+/// 通信カウンターを JSON に入れる
+template <typename T>
+static void
+stats_to_json (nlohmann::json &j, const T &s)
+{
+    j["bytes_in"]     = s.bytes_in;
+    j["bytes_out"]    = s.bytes_out;
+    j["msgs_in"]      = s.msgs_in;
+    j["msgs_out"]     = s.msgs_out;
+    j["read_calls"]   = s.read_calls;
+    j["write_calls"]  = s.write_calls;
+    j["read_eagain"]  = s.read_eagain;
+    j["write_eagain"] = s.write_eagain;
+    j["send_queue"]   = s.send_queue;
+}
+
+/**
+ * @brief 状態と通信統計を JSON 文字列にする (管理用リスナーが返すもの)
+ * @param with_conns 接続ごとの統計も入れる
+ */
+std::string
+cc_tcpserver::get_metrics_json (bool with_conns)
+{
+    cc_tcpserver_status status;
+    cc_tcpserver_metrics metrics;
+    get_status_snapshot (status);
+    get_metrics (metrics);
+
+    nlohmann::json j;
+    nlohmann::json &srv = j["server"];
+    srv["nickname"]        = nickname;
+    srv["running"]         = status.running;
+    srv["port"]            = status.port;
+    srv["max_connection"]  = status.max_connection;
+    srv["connections"]     = metrics.connections;
+    srv["accepted"]        = metrics.accepted;
+    srv["closed"]          = metrics.closed;
+    srv["shed_full"]       = status.shed_full;
+    srv["shed_rate"]       = status.shed_rate;
+    srv["pauses"]          = status.pauses;
+    srv["reused"]          = status.reused;
+    stats_to_json (srv, metrics);
+    srv["lifetime_ns_avg"] = metrics.closed ? metrics.lifetime_ns_total / metrics.closed : 0;
+    srv["lifetime_ns_max"] = metrics.lifetime_ns_max;
+    srv["accept_ns_avg"]   = metrics.accepted ? metrics.accept_ns_total / metrics.accepted : 0;
+    srv["accept_ns_max"]   = metrics.accept_ns_max;
+
+    if (with_conns) {
+        std::vector<std::pair<uint64_t, cc_tcpconn_stats> > conns;
+        get_conn_stats (conns);
+        nlohmann::json list = nlohmann::json::array ();
+        for (auto it = conns.begin(); it != conns.end(); it++) {
+            nlohmann::json c;
+            c["handle"]         = it->first;
+            stats_to_json (c, it->second);
+            c["send_queue_max"] = it->second.send_queue_max;
+            c["lifetime_ns"]    = it->second.lifetime_ns;
+            list.push_back (c);
+        }
+        j["connections"] = list;
+    }
+    return j.dump ();
+}
+
+// =====================================================================================
+// ===================================================================================== TCP ADMIN
+// =====================================================================================
+
+///
+/// 統計を JSON で返す管理用リスナー (cc_tcpserver::start_admin() で起動する)
+///
+/// 1接続ずつ受け付け、リクエストを読んだら HTTP/1.0 で get_metrics_json() を返して閉じる。
+/// リクエストは中身を見ず、"conns=0" を含むときだけ接続ごとの統計を省く。
+///
+class cc_tcpadmin : public cc_thread {
+private:
+    cc_tcpserver *server;
+    int listen_fd;
+    void serve (int fd);
+public:
+    cc_tcpadmin (cc_tcpserver *server, int listen_fd) :
+        cc_thread (-1, server->nickname + ".admin", CC_MAILBOX_NONE), server (server), listen_fd (listen_fd) {}
+    virtual ~cc_tcpadmin () {
+        set_loop_continue (false);
+        thread_down ();
+        close (listen_fd);
+    }
+    virtual void thread_main (void);
+};
+
+void
+cc_tcpadmin::thread_main (void)
+{
+    while (loop_continue ()) {
+        struct timeval timeout = { 0, 100*1000 };   // 100msec loop
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(listen_fd, &readSet);
+        if (thread_select (listen_fd + 1, &readSet, 0, 0, &timeout) <= 0) {
+            continue;
+        }
+        int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                perror("cc_tcpadmin::thread_main: accept4()");
+            }
+            continue;
+        }
+        serve (fd);
+        close (fd);
+    }
+}
+
+void
+cc_tcpadmin::serve (int fd)
+{
+    // 遅いクライアントで止まらないよう、送受信とも 1 秒で諦める
+    struct timeval tv = { 1, 0 };
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string request;
+    char buf[1024];
+    while (request.size () < 8192 && request.find ("\r\n\r\n") == std::string::npos
+           && request.find ("\n\n") == std::string::npos) {
+        ssize_t n = recv (fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;                              // 切断/タイムアウトでもそのまま返す
+        }
+        request.append (buf, n);
+    }
+    std::string body = server->get_metrics_json (request.find ("conns=0") == std::string::npos);
+    std::string response = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: " + std::to_string (body.size ()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    size_t off = 0;
+    while (off < response.size ()) {
+        ssize_t n = send (fd, response.data () + off, response.size () - off, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        off += n;
+    }
+}
+
+/**
+ * @brief 統計を JSON で返す管理用リスナーを起動する
+ * curl http://127.0.0.1:<port>/ で get_metrics_json() が返る ("?conns=0" で接続ごとの統計を省く)。
+ * @param port    待ち受けポート
+ * @param addrstr 待ち受けアドレス (既定はループバックのみ)
+ */
+bool
+cc_tcpserver::start_admin (unsigned int port, const char *addrstr)
+{
+    if (admin != NULL) {
+        CC_TCPCOMM_ERRPR ("admin listener already started\n");
+        return false;
+    }
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if (inet_pton (AF_INET, addrstr, &addr.sin_addr) != 1) {
+        CC_TCPCOMM_ERRPR ("invalid admin address (%s)\n", addrstr);
+        return false;
+    }
+    int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("cc_tcpserver::start_admin: socket()");
+        return false;
+    }
+    int one = 1;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind (fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen (fd, 16) == -1) {
+        perror("cc_tcpserver::start_admin: bind()/listen()");
+        close (fd);
+        return false;
+    }
+    admin = new cc_tcpadmin (this, fd);
+    admin->thread_up ();
+    CC_TCPCOMM_DBGPR ("admin listener started (%s:%d)\n", addrstr, port);
+    return true;
+}
+
+void
+cc_tcpserver::stop_admin (void)
+{
+    delete admin;
+    admin = NULL;
+}
 void
 cc_tcpserver::get_ip (struct in_addr &in) {
     struct ifreq ifr;
@@ -335,10 +2723,11 @@ cc_tcpserver::get_ip (struct in_addr &in) {
     in = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
     //printf ("myip %s-%s\n" , "eth0" , inet_ntoa(in));
 }
+/**
+ * @brief デフォルト経路のインターフェース名と IPv4 アドレス (cc_netif の表から引く、システムコールなし)
+ */
 void cc_tcpserver::get_ifinfo (struct ifreq &ifr) {
-    ifr.ifr_addr.sa_family = AF_INET;
-    strcpy(ifr.ifr_name , "eth3");
-    ioctl(serverSocket, SIOCGIFADDR, &ifr);
+    cc_netif::instance().default_ifreq (ifr);
 }
 
 
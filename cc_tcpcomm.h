@@ -14,8 +14,19 @@
 #define __CC_TCPCOMM_H__
 
 #include <vector>
+#include <atomic>
+#include <utility>
 
 #include "cc_thread.h"
+#include "cc_mutex.h"
+#include "cc_counter.h"
+#include "cc_mpscq.h"
+#include "cc_slotmap.h"
+#include "cc_tcpbuffer.h"
+#include "cc_sockopt.h"
+#include "cc_resolver.h"
+#include "cc_netif.h"
+#include "cc_uring.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,6 +44,94 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+
+#define CC_TCPSERVER_BACKLOG    SOMAXCONN       ///< listen() バックログの既定値
+#define CC_TCPLOOP_MAX_EVENTS   256             ///< 1回の epoll_wait() で受け取るイベント数
+#define CC_TCPLOOP_READ_SIZE    16384           ///< on_readable() の既定実装の読み込み単位
+#define CC_TCPCONNECT_HE_DELAY_MS 250           ///< Happy Eyeballs: 次の候補アドレスを試すまでの待ち時間 (msec)
+#define CC_TCPURING_ENTRIES     1024            ///< io_uring バックエンド: 送信キューのエントリー数 (ループごと)
+#define CC_TCPURING_BUF_COUNT   256             ///< io_uring バックエンド: 受信用提供バッファの数 (ループごと)
+#define CC_TCPLOOP_CONN_POOL    0               ///< 切断した接続インスタンスを使い回す数の既定値 (ループごと、0: 使わない)
+#define CC_TCPLOOP_DEFER_MS     10              ///< 解放待ちの接続があるときのイベント待ちの上限 (msec)
+
+/// リアクターモードの I/O バックエンド
+enum cc_tcp_backend {
+    CC_TCP_BACKEND_EPOLL,                   ///< epoll (既定)
+    CC_TCP_BACKEND_URING,                   ///< io_uring、カーネルが対応していなければ epoll で動く
+};
+
+/// 過負荷 (接続数/受け付けレートの上限) のときの受け付け方
+enum cc_tcp_overload {
+    CC_TCP_OVERLOAD_SHED,                   ///< accept して過負荷応答を送って閉じる (既定、接続インスタンスは作らない)
+    CC_TCP_OVERLOAD_PAUSE,                  ///< リスナーを待ち受けから外す (クライアントは listen バックログで待つ)
+};
+
+/// 通信カウンターの添字 (CC_TCPSTAT_CONN_COUNT までは接続ごとにも数える)
+enum cc_tcpstat {
+    CC_TCPSTAT_BYTES_IN,                    ///< 受信バイト数
+    CC_TCPSTAT_BYTES_OUT,                   ///< 送信バイト数
+    CC_TCPSTAT_MSGS_IN,                     ///< データを受け取った読み込みの数
+    CC_TCPSTAT_MSGS_OUT,                    ///< 送信要求の数 (send_buffered/send_file/exec_send)
+    CC_TCPSTAT_READ_CALLS,                  ///< 受信システムコール数 (io_uring では完了数)
+    CC_TCPSTAT_WRITE_CALLS,                 ///< 送信システムコール数 (io_uring では完了数)
+    CC_TCPSTAT_READ_EAGAIN,                 ///< 受信が EAGAIN だった数 (io_uring では ENOBUFS)
+    CC_TCPSTAT_WRITE_EAGAIN,                ///< 送信が EAGAIN だった数
+    CC_TCPSTAT_CONN_COUNT,
+    CC_TCPSTAT_CLOSED = CC_TCPSTAT_CONN_COUNT,  ///< 回収した接続数
+    CC_TCPSTAT_LIFETIME_NS,                 ///< 回収した接続の接続時間の合計
+    CC_TCPSTAT_LIFETIME_MAX_NS,             ///< 回収した接続の接続時間の最大
+    CC_TCPSTAT_ACCEPT_NS,                   ///< 受け付け待ち時間の合計 (リスナーの通知から接続の登録まで)
+    CC_TCPSTAT_ACCEPT_MAX_NS,               ///< 受け付け待ち時間の最大
+    CC_TCPSTAT_COUNT
+};
+
+///
+/// ■■■■■　接続ごとの通信統計のスナップショット
+///
+struct cc_tcpconn_stats {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t msgs_in;
+    uint64_t msgs_out;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t read_eagain;
+    uint64_t write_eagain;
+    uint64_t send_queue;                    ///< 未送信バイト数 (現在)
+    uint64_t send_queue_max;                ///< 未送信バイト数の最大
+    uint64_t lifetime_ns;                   ///< 接続してからの時間
+};
+
+///
+/// ■■■■■　TCP サーバー全体の通信統計のスナップショット
+///
+struct cc_tcpserver_metrics {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t msgs_in;
+    uint64_t msgs_out;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t read_eagain;
+    uint64_t write_eagain;
+    uint64_t send_queue;                    ///< 全接続の未送信バイト数 (現在)
+    int connections;                        ///< 現在の接続数
+    uint64_t accepted;                      ///< 受け付けた接続数 (累計)
+    uint64_t closed;                        ///< 回収した接続数 (累計)
+    uint64_t lifetime_ns_total;             ///< 回収した接続の接続時間の合計
+    uint64_t lifetime_ns_max;
+    uint64_t accept_ns_total;               ///< 受け付け待ち時間の合計
+    uint64_t accept_ns_max;
+};
+
+class cc_tcploop;
+class cc_tcpserver;
+class cc_tcpadmin;
+class cc_tcpconnect;
+
+/// 接続統計の走査が終わるまで解放を待たせる接続インスタンスと走査の番号 (所有スレッドだけが触る)
+typedef std::vector<std::pair<cc_tcpconnect*, uint64_t> > cc_tcpdeferred;
 
 ///
 /// ■■■■■　TCP 送信クラス
@@ -40,10 +139,11 @@
 class cc_tcpconnect : public cc_thread {
 
 public:
-    int clientSocket;
+    std::atomic<int> clientSocket;          ///< 他スレッドから切断されうるので atomic
     struct sockaddr_in clientAddress;
+    cc_sockaddr peerAddress;                ///< 接続先 (IPv4/IPv6)、exec_server_connect/exec_host_connect で設定
 
-    cc_tcpconnect (key_t message_key, std::string nickname);
+    cc_tcpconnect (key_t message_key, std::string nickname, cc_mailbox_policy policy=CC_MAILBOX_LAZY);
     //cc_tcpconnect (void);
     virtual ~cc_tcpconnect ();
 
@@ -51,19 +151,172 @@ public:
     
     bool exec_server_connect (unsigned int port, const char *addrstr);
     bool exec_server_connect (unsigned int port, in_addr_t ipaddr);
+    bool exec_server_connect_timeout (unsigned int port, in_addr_t ipaddr, int timeout_ms);
+    bool exec_host_connect (const std::string &host, unsigned int port, int timeout_ms=-1);   // ホスト名/IPv6 で接続
+    void set_sockopt_profile (const cc_sockopt_profile &profile);  // exec_server_connect() 前に呼ぶ
     bool exec_disconnect (void);
     ssize_t exec_send (unsigned char *dptr, int dsize);
     ssize_t exec_recv (unsigned char *dptr, int dsize);
 
+    // バッファ付き送受信 (send_buffered はどのスレッドからでも呼べる、ブロックしない)
+    bool send_buffered (const void *dptr, size_t dsize);
+    bool send_buffered (std::string &&data);
+    bool send_file (const char *path, off_t offset=0, size_t length=0);    // ファイルを送る (length 0: 末尾まで)
+    bool send_file (int file_fd, off_t offset, size_t length);
+    ssize_t flush_send (void);              // 送信キューを書き出す、残りバイト数を返す (-1: エラー)
+    size_t get_send_pending (void);         // 送信キューの未送信バイト数
+    ssize_t recv_to_buffer (void);          // 受信バッファに読み込む (スレッドモード用)
+    cc_ringbuf &get_recv_buffer (void);
+
     int get_fd (void);
     bool get_status (void);
+    void get_stats (cc_tcpconn_stats &stats);   // 通信統計 (所有スレッド以外からは cc_tcpserver::get_conn_stats() を使う)
+    using cc_thread::get_stats;                 // スレッドの実行統計も引き続き呼べるように
     void get_ip (struct in_addr &in);
     void get_ifinfo (struct ifreq &ifr);    // inet_ntoa((&(ifr.ifr_addr))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_broadaddr))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_netmask))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_hwaddr))->sin_addr)
 
+    // リアクターモード用フック (接続を所有するイベントループのスレッドから呼ばれる)
+    // リアクターモードでは接続ごとのスレッドは起動せず、thread_main() は使わない
+    virtual void on_connect (void);                                 // accept 直後
+    virtual void on_readable (void);                                // 読み込み可能、既定は受信バッファに読んで on_recv() (io_uring では呼ばれない)
+    virtual void on_recv (cc_ringbuf &rbuf);                        // 受信バッファ、既定は on_data() に渡して読み捨てる
+    virtual void on_data (const unsigned char *dptr, size_t dsize); // 受信データ
+    virtual void on_writable (void);                                // 書き込み可能、既定は flush_send()
+    virtual void on_disconnect (void);                              // 切断後、delete (使い回すなら on_recycle()) の直前
+    virtual bool on_recycle (void);                                 // 使い回す前に派生クラスの状態を初期化する、false なら delete
+    cc_tcploop *get_loop (void);
+    uint64_t get_handle (void);             // サーバーの接続テーブル上のハンドル (0: なし)
+
     cc_debugprint tcpcomm_dbg;              /// cclib debugprint
+
+protected:
+    virtual void thread_finished (void);    // スレッド終了時に所有サーバーへ回収を依頼する
+
+    cc_ringbuf recv_buf;                    ///< 受信バッファ
+
+private:
+    cc_tcpserver *owner_server;             ///< accept したサーバー (クライアント側は NULL)
+    cc_tcploop *owner_loop;                 ///< 所有するイベントループ (リアクターモード以外は NULL)
+    cc_sockopt_profile sockopt;             ///< connect 時に適用するソケットオプション
+    uint64_t conn_handle;                   ///< 接続テーブル上のハンドル
+    std::atomic<bool> retired;              ///< 回収依頼済み
+    int closing_fd;                         ///< shutdown() 済みで、回収時にループが close() する fd (リアクターモード)
+    cc_sendqueue send_queue;                ///< 送信キュー (send_mtx で保護)
+    std::mutex send_mtx;
+    bool write_armed;                       ///< EPOLLOUT 待ち中 (send_mtx で保護)
+    bool flush_scheduled;                   ///< ループのバッチ後の送信を予約済み (ループのスレッド内のみ)
+    // io_uring バックエンド用
+    struct uring_sendctx {
+        struct msghdr msg;
+        struct iovec iov[CC_TCPBUF_IOV_MAX];
+    };
+    uring_sendctx *uring_sendargs;          ///< 実行中の SENDMSG の引数 (最初の送信で確保)
+    bool send_inflight;                     ///< SENDMSG の完了待ち (send_mtx で保護)
+    int uring_inflight;                     ///< 完了待ちの要求数 (ループのスレッド内のみ)
+    bool uring_closing;                     ///< 要求を取り消して完了を待っている (ループのスレッド内のみ)
+    // 通信統計
+    std::atomic<uint64_t> stat[CC_TCPSTAT_CONN_COUNT];
+    std::atomic<uint64_t> stat_queue_max;   ///< 未送信バイト数の最大
+    std::atomic<uint64_t> connect_ns;       ///< 接続した時刻 (CLOCK_MONOTONIC)、統計の走査から読まれる
+    void count (int idx, uint64_t n=1);     // 接続とサーバーのカウンターに加算する
+    void count_read (ssize_t ret);          // 受信システムコール1回分を数える
+    void count_queue (size_t pending);      // 未送信バイト数の最大を更新する
+    void reset_stats (void);
+    void retire (void);
+    bool recycle (void);
+    bool kick_send (void);
+    bool open_connection (unsigned int port, in_addr_t ipaddr, int timeout_ms);
+    bool open_host_connection (const std::string &host, unsigned int port, int timeout_ms);
+    friend class cc_tcploop;
+    friend class cc_tcpserver;
+    friend class cc_tcppool;
+};
+
+///
+/// ■■■■■　TCP イベントループ (リアクターモードの cc_tcpserver が起動する)
+///
+/// 自分専用の SO_REUSEPORT リスナーと epoll を持ち、accept した接続を所有する。
+/// 接続のフックはすべてこのループのスレッドで呼ばれる。
+///
+class cc_tcploop : public cc_thread {
+
+private:
+    cc_tcpserver *server;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                            ///< 停止要求/回収依頼用 eventfd
+    std::atomic<int> conn_count;            ///< このループの接続数
+    std::atomic<pthread_t> loop_thread;     ///< thread_main() を実行中のスレッド (実行中でなければ 0)
+    cc_mpscq<uint64_t> reclaim_queue;       ///< 切断した接続のハンドル (どのスレッドからでも push)
+    std::vector<cc_tcpconnect*> flush_list; ///< バッチの最後に送信する接続
+    cc_uring *ring;                         ///< io_uring バックエンドで動いていれば非 NULL
+    cc_mpscq<uint64_t> arm_queue;           ///< POLLOUT 待ちを依頼された接続 (io_uring、他スレッドから)
+    int closing_count;                      ///< 取り消しの完了を待っている接続数 (io_uring)
+    std::atomic<bool> accept_paused;        ///< 過負荷でリスナーを待ち受けから外している
+    bool accept_armed;                      ///< multishot accept を投入済み (io_uring)
+    uint64_t wake_ns;                       ///< 最後にイベント待ちから戻った時刻 (受け付け待ち時間の起点)
+    std::vector<cc_tcpconnect*> conn_pool;  ///< 切断後に使い回す接続インスタンス (上限 server->conn_pool_max)
+    cc_tcpdeferred deferred;                ///< 統計の走査中に切断した接続インスタンス (走査が終わったら release_conn)
+
+    void accept_all (void);
+    int update_accept (void);
+    cc_tcpconnect *adopt (int fd, const struct sockaddr_in &addr);
+    cc_tcpconnect *take_conn (void);
+    void release_conn (cc_tcpconnect *conn);
+    void free_conn (cc_tcpconnect *conn);
+    void release_deferred (bool wait=false);
+    void reclaim (void);
+    void retire (uint64_t handle);
+    void flush_pending (void);
+    bool set_write_interest (cc_tcpconnect *conn, bool enable);
+    void epoll_main (void);
+    void close_all (void);
+    void drain_pool (void);
+    // io_uring バックエンド
+    bool uring_setup (void);
+    void uring_main (void);
+    void uring_process (void);
+    void uring_complete (uint64_t user_data, int res, unsigned flags);
+    void uring_arm_accept (void);
+    void uring_cancel_accept (void);
+    void uring_arm_wake (void);
+    void uring_arm_recv (cc_tcpconnect *conn);
+    void uring_arm_write (cc_tcpconnect *conn);
+    void uring_send (cc_tcpconnect *conn);
+    void uring_close (cc_tcpconnect *conn);
+    friend class cc_tcpconnect;
+    friend class cc_tcpserver;
+
+public:
+    cc_tcploop (cc_tcpserver *server, int listen_fd, std::string nickname);
+    virtual ~cc_tcploop ();
+
+    virtual void thread_main (void);
+
+    void wakeup (void);
+    bool in_loop_thread (void);
+    int get_connection_count (void);
+    bool uses_uring (void);                 // io_uring バックエンドで動いているか
+
+    cc_debugprint tcpcomm_dbg;              /// cclib debugprint
+};
+
+///
+/// ■■■■■　TCP サーバー状態のスナップショット
+///
+struct cc_tcpserver_status {
+    bool running;                           ///< サーバー稼働中
+    unsigned int port;                      ///< 待ち受けポート
+    int max_connection;                     ///< 最大接続数
+    int connections;                        ///< 現在の接続数
+    uint64_t accepted;                      ///< 受け付けた接続数 (累計)
+    uint64_t shed_full;                     ///< 接続数の上限で断った接続数 (累計)
+    uint64_t shed_rate;                     ///< 受け付けレートの上限で断った接続数 (累計)
+    uint64_t pauses;                        ///< 受け付けを止めた回数 (累計、CC_TCP_OVERLOAD_PAUSE)
+    uint64_t reused;                        ///< 使い回した接続インスタンス数 (累計)
 };
 
 ///
@@ -75,7 +328,54 @@ private:
     int serverSocket;
     struct sockaddr_in serverAddress;
     int max_connection;
-    std::vector<cc_tcpconnect*> connections;
+    int backlog;                            ///< listen() バックログ
+    cc_sockopt_profile sockopt;             ///< listen/accept 時に適用するソケットオプション
+    cc_tcp_backend backend;                 ///< リアクターモードの I/O バックエンド
+    // 受け付け制御
+    cc_tcp_overload overload;               ///< 過負荷のときの受け付け方
+    std::string busy_response;              ///< 断るときに送る応答 (空なら送らずに閉じる)
+    int accept_rate;                        ///< 1秒あたりの受け付け数の上限 (0: 制限なし)
+    int accept_burst;                       ///< 連続して受け付けられる数 (トークンバケットの容量)
+    std::mutex admit_mtx;                   ///< 以下のトークンバケットを保護する
+    double accept_tokens;
+    uint64_t accept_tokens_ns;              ///< トークンを補充した時刻 (CLOCK_MONOTONIC)
+    std::atomic<uint64_t> accepted_count;
+    std::atomic<uint64_t> shed_full_count;
+    std::atomic<uint64_t> shed_rate_count;
+    std::atomic<uint64_t> pause_count;
+    int conn_pool_max;                      ///< ループごとに取っておく接続インスタンス数
+    std::atomic<uint64_t> reused_count;
+    cc_sharded_counters<CC_TCPSTAT_COUNT> counters;     ///< 通信カウンター (スレッドごとに分散)
+    // 接続統計の走査と接続インスタンスの解放の調停 (ループは走査を待たずに解放を後回しにする)
+    std::mutex scan_mtx;                    ///< 走査どうしを直列化する (ループ/接続側は取らない)
+    std::atomic<uint64_t> scan_epoch;       ///< 走査ごとに増える番号
+    std::atomic<uint64_t> scan_active;      ///< 走査中の番号 (0: 走査していない)
+    cc_tcpdeferred deferred;                ///< 統計の走査中に切断した接続インスタンス (スレッドモード)
+    cc_tcpadmin *admin;                     ///< 統計を返す管理用リスナー (start_admin())
+    cc_slotmap<cc_tcpconnect> conn_table;   ///< 接続テーブル (容量 max_connection)
+    std::vector<cc_tcploop*> loops;         ///< リアクターモードのイベントループ
+    std::vector<int> listeners;             ///< リアクターモードのリスナー (ループごと)
+    int reclaim_fd;                         ///< 回収依頼用 eventfd (スレッドモード)
+    cc_mpscq<uint64_t> reclaim_queue;       ///< 終了した接続のハンドル (スレッドモード)
+    cc_seqlock<cc_tcpserver_status> status_snapshot;   ///< 状態 (サーバースレッドを止めずに読める)
+
+    int open_listener (unsigned int port, bool reuseport);
+    void update_status (bool running, unsigned int port);
+    int admit_wait_ms (void);
+    bool admit (int fd);
+    void notify_loops (void);
+    void retire (uint64_t handle);
+    void reclaim (void);
+    void count_closed (cc_tcpconnect *conn);
+    void count_accept (cc_tcpconnect *conn, uint64_t wake_ns);
+    void scan_begin (void);
+    void scan_end (void);
+    uint64_t scan_guard (void);
+    bool scan_finished (uint64_t epoch) { return scan_active.load (std::memory_order_acquire) != epoch; }
+    void delete_conn (cc_tcpconnect *conn);
+    void release_deferred (bool wait=false);
+    friend class cc_tcploop;
+    friend class cc_tcpconnect;
 
 public:
     //cc_tcpserver (void);
@@ -85,11 +385,35 @@ public:
     virtual void thread_main (void);
     
     bool start_server (unsigned int port, int cmax=1);
+    bool start_server_reactor (unsigned int port, int cmax, int nloops);
+    void set_backlog (int backlog);         // start_server() 前に呼ぶ
+    void set_sockopt_profile (const cc_sockopt_profile &profile);  // start_server() 前に呼ぶ
+    void set_io_backend (cc_tcp_backend backend);   // start_server_reactor() 前に呼ぶ
+    void set_overload_policy (cc_tcp_overload policy);          // start_server() 前に呼ぶ
+    void set_accept_rate (int per_sec, int burst=0);            // start_server() 前に呼ぶ
+    void set_busy_response (const std::string &response);      // start_server() 前に呼ぶ
+    void set_conn_pool (int per_loop);      // start_server_reactor() 前に呼ぶ
     bool stop_server (void);
 
     virtual cc_tcpconnect *create_conn (void);
     
     bool get_server_status (void);
+    void get_status_snapshot (cc_tcpserver_status &status);
+    int get_connection_count (void);
+    cc_tcpconnect *find_conn (uint64_t handle);
+
+    // 通信統計 (どのスレッドからでも呼べる)
+    void get_metrics (cc_tcpserver_metrics &metrics);
+    void get_conn_stats (std::vector<std::pair<uint64_t, cc_tcpconn_stats> > &stats);
+    std::string get_metrics_json (bool with_conns=true);
+    bool start_admin (unsigned int port, const char *addrstr="127.0.0.1");  // 統計を JSON で返す HTTP リスナー
+    void stop_admin (void);
+
+    /// 全接続について fn(uint64_t handle, cc_tcpconnect *conn) を呼ぶ (ロックなし)
+    /// 接続は所有スレッドがいつ delete してもおかしくないので、所有スレッド以外では
+    /// ハンドルの収集などポインタを参照しない用途に限ること
+    template <typename F>
+    void for_each_conn (F fn) { conn_table.for_each (fn); }
     void get_ip (struct in_addr &in);
     void get_ifinfo (struct ifreq &ifr);    // inet_ntoa((&(ifr.ifr_addr))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_broadaddr))->sin_addr)
@@ -0,0 +1,394 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_tcppool.cc
+ * @brief outbound tcp connection pool for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <time.h>
+#include <sys/eventfd.h>
+#include <vector>
+#include <algorithm>
+
+#include "cc_tcppool.h"
+
+/// 時刻取得 (nsec)
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+cc_tcppool::cc_tcppool (std::string nickname, const cc_tcppool_config &config) :
+    cc_thread (-1, nickname, CC_MAILBOX_LAZY),
+    config (config),
+    tcppool_dbg (nickname)
+{
+    //tcppool_dbg.enable();
+
+    CC_TCPPOOL_DBGPR ("instance created\n");
+
+    memset (&stats, 0, sizeof(stats));
+    wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("cc_tcppool::cc_tcppool: eventfd()");
+    }
+}
+
+cc_tcppool::~cc_tcppool ()
+{
+    // 貸し出し中の接続は呼び出し側が持っているので、ここでは閉じない
+    stop ();
+    if (wake_fd != -1) {
+        close (wake_fd);
+    }
+
+    CC_TCPPOOL_DBGPR ("instance deleted\n");
+}
+
+cc_tcpconnect *
+cc_tcppool::create_conn (void)
+{
+    return new cc_tcpconnect(-1,"cc_tcppool_conn");
+}
+
+// -------------------------------------------------------------------------------------------
+
+std::string
+cc_tcppool::make_key (const std::string &host, unsigned int port)
+{
+    return host + ":" + std::to_string (port);
+}
+
+/**
+ * @brief アイドル接続が使えるか調べる
+ * 相手が閉じていれば recv() が 0 を返し、要求していないデータが届いていれば同期がずれているので使わない。
+ */
+bool
+cc_tcppool::is_alive (cc_tcpconnect *conn)
+{
+    int fd = conn->get_fd ();
+    if (fd == -1) {
+        return false;
+    }
+    char c;
+    ssize_t ret = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * @brief 新しい接続を作る (ロックせずに呼ぶ)
+ * 名前解決は cc_resolver のキャッシュを使い、IPv6/IPv4 の候補を並行して試す。
+ */
+cc_tcpconnect *
+cc_tcppool::connect_new (const std::string &host, unsigned int port, int timeout_ms)
+{
+    cc_tcpconnect *conn = create_conn ();
+    conn->set_sockopt_profile (config.sockopt);
+    if (conn->open_host_connection (host, port, timeout_ms) == false) {
+        delete conn;
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        stats.connect_failures++;
+        return NULL;
+    }
+    CC_TCPPOOL_DBGPR ("connected %s:%u\n", host.c_str(), port);
+    std::lock_guard<std::mutex> lock(pool_mtx);
+    stats.connects++;
+    return conn;
+}
+
+void
+cc_tcppool::wakeup (void)
+{
+    uint64_t v = 1;
+    if (wake_fd != -1 && write (wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+        perror("cc_tcppool::wakeup: write()");
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief バックグラウンドスレッドを起動する
+ */
+bool
+cc_tcppool::start (void)
+{
+    if (wake_fd == -1) {
+        CC_TCPPOOL_ERRPR ("no eventfd\n");
+        return false;
+    }
+    thread_up ();
+    return true;
+}
+
+/**
+ * @brief バックグラウンドスレッドを停止して、アイドル接続をすべて閉じる
+ */
+void
+cc_tcppool::stop (void)
+{
+    set_loop_continue (false);
+    wakeup ();
+    thread_down ();
+    clear ();
+}
+
+void
+cc_tcppool::thread_main (void)
+{
+    CC_TCPPOOL_DBGPR ("thread up\n");
+
+    while (loop_continue()) {
+        fd_set readSet;
+        struct timeval timeout;
+        FD_ZERO(&readSet);
+        FD_SET(wake_fd, &readSet);
+        timeout.tv_sec  = config.check_interval_ms / 1000;
+        timeout.tv_usec = (config.check_interval_ms % 1000) * 1000;
+
+        int ret = thread_select (wake_fd + 1, &readSet, 0, 0, &timeout);
+        if (ret > 0) {
+            uint64_t v;
+            if (read (wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+                perror("cc_tcppool::thread_main: read()");
+            }
+        }
+        if (loop_continue() == false) {
+            break;
+        }
+        maintain ();
+    }
+    CC_TCPPOOL_DBGPR ("thread down\n");
+}
+
+/**
+ * @brief ヘルスチェック、アイドル接続の追い出し、warm() した接続先の補充
+ * ロック中は古い接続を外し、残りのアイドル接続をいったんプールから取り出すだけにする。
+ * 切断の検出 (recv) と close/connect はロックの外で行い、生きている接続だけを戻す。
+ * その間 acquire()/release() は止まらない (取り出した接続は貸し出されないだけ)。
+ */
+void
+cc_tcppool::maintain (void)
+{
+    std::vector<cc_tcpconnect*> victims;
+    std::vector<std::pair<std::string,idle_conn>> probing;
+    std::vector<std::pair<std::string,unsigned int>> refill;
+    uint64_t now = monotonic_ns ();
+    uint64_t idle_limit = (uint64_t)config.idle_timeout_ms * 1000000ULL;
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        for (auto &it : endpoints) {
+            endpoint &ep = it.second;
+            for (auto c = ep.idle.begin (); c != ep.idle.end ();) {
+                if (now - c->idle_since > idle_limit && (!ep.warm || (int)ep.idle.size () > config.min_idle)) {
+                    stats.evicted_idle++;
+                    victims.push_back (c->conn);
+                } else {
+                    probing.push_back (std::make_pair (it.first, *c));
+                }
+                c = ep.idle.erase (c);
+            }
+        }
+    }
+    size_t evicted = victims.size ();
+
+    // ロックの外で切断を検出する
+    std::vector<std::pair<std::string,idle_conn>> alive;
+    for (auto &p : probing) {
+        if (is_alive (p.second.conn)) {
+            alive.push_back (p);
+        } else {
+            victims.push_back (p.second.conn);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        stats.evicted_dead += victims.size () - evicted;
+        // 調べている間に release() で戻った接続は先頭に入っているので、古いものは後ろに戻す
+        for (auto &p : alive) {
+            endpoint &ep = endpoints[p.first];
+            if ((int)ep.idle.size () >= config.max_idle) {
+                stats.evicted_idle++;
+                victims.push_back (p.second.conn);
+                continue;
+            }
+            ep.idle.push_back (p.second);
+        }
+        for (auto &it : endpoints) {
+            endpoint &ep = it.second;
+            if (ep.warm) {
+                int target = std::min (config.min_idle, config.max_idle);
+                for (int i = (int)ep.idle.size (); i < target; i++) {
+                    refill.push_back (std::make_pair (ep.host, ep.port));
+                }
+            }
+        }
+    }
+    for (cc_tcpconnect *conn : victims) {
+        delete conn;
+    }
+    if (victims.size () > 0) {
+        CC_TCPPOOL_DBGPR ("evicted %lu connections\n", (unsigned long)victims.size ());
+    }
+    for (auto &r : refill) {
+        cc_tcpconnect *conn = connect_new (r.first, r.second, config.connect_timeout_ms);
+        if (conn == NULL) {
+            break;                              // 次の周期で再試行する
+        }
+        {
+            std::lock_guard<std::mutex> lock(pool_mtx);
+            endpoint &ep = endpoints[make_key (r.first, r.second)];
+            if ((int)ep.idle.size () < config.max_idle) {
+                idle_conn ic;
+                ic.conn       = conn;
+                ic.idle_since = monotonic_ns ();
+                ep.idle.push_back (ic);
+                continue;
+            }
+        }
+        delete conn;                            // 接続している間に release() で埋まった
+    }
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief 接続を借りる
+ * アイドル接続があればそれを返し、なければ新しく接続する。
+ * アイドル接続はロック中に取り出すだけにして、切断の検出はロックの外で行う。
+ * @param timeout_ms 新しく接続する場合のタイムアウト (msec)、負なら設定値
+ * @return 接続、失敗なら NULL。使い終わったら release() で返すこと
+ */
+cc_tcpconnect *
+cc_tcppool::acquire (const std::string &host, unsigned int port, int timeout_ms)
+{
+    std::string key = make_key (host, port);
+    cc_tcpconnect *conn = NULL;
+    for (;;) {
+        cc_tcpconnect *c = NULL;
+        {
+            std::lock_guard<std::mutex> lock(pool_mtx);
+            endpoint &ep = endpoints[key];
+            ep.host = host;
+            ep.port = port;
+            if (!ep.idle.empty ()) {
+                c = ep.idle.front ().conn;
+                ep.idle.pop_front ();
+            }
+        }
+        if (c == NULL) {
+            break;
+        }
+        bool alive = is_alive (c);
+        {
+            std::lock_guard<std::mutex> lock(pool_mtx);
+            if (alive) {
+                stats.reuses++;
+                borrowed[c] = key;
+            } else {
+                stats.evicted_dead++;
+            }
+        }
+        if (alive) {
+            return c;
+        }
+        delete c;
+    }
+
+    conn = connect_new (host, port, (timeout_ms < 0) ? config.connect_timeout_ms : timeout_ms);
+    if (conn != NULL) {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        borrowed[conn] = key;
+    }
+    return conn;
+}
+
+/**
+ * @brief 借りた接続を返す
+ * @param reusable false なら閉じる (プロトコルエラーや送受信の途中で中断した場合)
+ */
+void
+cc_tcppool::release (cc_tcpconnect *conn, bool reusable)
+{
+    if (conn == NULL) {
+        return;
+    }
+    // 切断の検出はロックの外で (返すまでは呼び出し側の接続なので他から触られない)
+    bool alive = reusable && is_alive (conn);
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        auto it = borrowed.find (conn);
+        if (it == borrowed.end ()) {
+            CC_TCPPOOL_ERRPR ("connection not borrowed from this pool\n");
+            return;
+        }
+        endpoint &ep = endpoints[it->second];
+        borrowed.erase (it);
+        if (alive && (int)ep.idle.size () < config.max_idle) {
+            idle_conn ic;
+            ic.conn       = conn;
+            ic.idle_since = monotonic_ns ();
+            ep.idle.push_front (ic);
+            return;
+        }
+    }
+    delete conn;
+}
+
+/**
+ * @brief アイドル接続を min_idle 個維持する接続先として登録する
+ * 補充はバックグラウンドスレッドが行うので start() していること。
+ */
+void
+cc_tcppool::warm (const std::string &host, unsigned int port)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        endpoint &ep = endpoints[make_key (host, port)];
+        ep.host = host;
+        ep.port = port;
+        ep.warm = true;
+    }
+    wakeup ();
+}
+
+/**
+ * @brief アイドル接続をすべて閉じる (貸し出し中の接続はそのまま)
+ */
+void
+cc_tcppool::clear (void)
+{
+    std::vector<cc_tcpconnect*> victims;
+    {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        for (auto &it : endpoints) {
+            for (auto &c : it.second.idle) {
+                victims.push_back (c.conn);
+            }
+            it.second.idle.clear ();
+        }
+    }
+    for (cc_tcpconnect *conn : victims) {
+        delete conn;
+    }
+}
+
+void
+cc_tcppool::get_stats (cc_tcppool_stats &out)
+{
+    std::lock_guard<std::mutex> lock(pool_mtx);
+    out = stats;
+    out.idle = 0;
+    for (auto &it : endpoints) {
+        out.idle += it.second.idle.size ();
+    }
+    out.borrowed = borrowed.size ();
+}
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_tcppool.h
+ * @brief outbound tcp connection pool for C++
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_TCPPOOL_H__
+#define __CC_TCPPOOL_H__
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#include "cc_thread.h"
+#include "cc_tcpcomm.h"
+
+/**
+ * @struct cc_tcppool_config
+ * @brief cc_tcppool の設定
+ */
+struct cc_tcppool_config {
+    int connect_timeout_ms;                     ///< 接続のタイムアウト (msec)
+    int max_idle;                               ///< 接続先ごとに保持するアイドル接続の最大数
+    int min_idle;                               ///< warm() した接続先で維持するアイドル接続数
+    int idle_timeout_ms;                        ///< これより長くアイドルな接続は閉じる (msec)
+    int check_interval_ms;                      ///< ヘルスチェック/追い出しの間隔 (msec)
+    cc_sockopt_profile sockopt;                 ///< 接続に適用するソケットオプション
+
+    cc_tcppool_config (void) :
+        connect_timeout_ms (1000), max_idle (8), min_idle (0),
+        idle_timeout_ms (30000), check_interval_ms (1000) {}
+};
+
+/**
+ * @struct cc_tcppool_stats
+ * @brief cc_tcppool 統計のスナップショット
+ */
+struct cc_tcppool_stats {
+    uint64_t connects;                          ///< 新規に接続した数
+    uint64_t connect_failures;                  ///< 接続失敗数 (タイムアウトを含む)
+    uint64_t reuses;                            ///< アイドル接続を貸し出した数
+    uint64_t evicted_idle;                      ///< アイドルタイムアウトで閉じた数
+    uint64_t evicted_dead;                      ///< ヘルスチェックで切断を検出して閉じた数
+    size_t idle;                                ///< 現在のアイドル接続数
+    size_t borrowed;                            ///< 現在の貸し出し中の接続数
+};
+
+///
+/// ■■■■■　TCP 接続プール
+///
+/// "host:port" ごとにアイドル接続を保持し、acquire() で貸し出して release() で戻す。
+/// 貸し出す接続はスレッドを起動せず、ブロッキングの exec_send()/exec_recv() で使う。
+/// バックグラウンドのスレッドが一定間隔でアイドル接続の切断を検出し、古い接続を閉じ、
+/// warm() した接続先のアイドル接続を min_idle まで補充する。
+/// acquire()/release() はどのスレッドからでも呼べる。
+///
+class cc_tcppool : public cc_thread {
+private:
+    struct idle_conn {
+        cc_tcpconnect *conn;
+        uint64_t idle_since;                    ///< プールに戻した時刻 (CLOCK_MONOTONIC, nsec)
+    };
+    struct endpoint {
+        std::string host;
+        unsigned int port;
+        std::deque<idle_conn> idle;             ///< 先頭が最近戻した接続
+        bool warm;                              ///< min_idle を維持する
+        endpoint (void) : port (0), warm (false) {}
+    };
+
+    cc_tcppool_config config;
+    std::mutex pool_mtx;                        ///< 以下を保護する
+    std::map<std::string, endpoint> endpoints;  ///< キーは "host:port"
+    std::unordered_map<cc_tcpconnect*, std::string> borrowed;  ///< 貸し出し中の接続とキー
+    cc_tcppool_stats stats;
+    int wake_fd;                                ///< バックグラウンドスレッドを起こす eventfd
+
+    static std::string make_key (const std::string &host, unsigned int port);
+    static bool is_alive (cc_tcpconnect *conn);
+    cc_tcpconnect *connect_new (const std::string &host, unsigned int port, int timeout_ms);
+    void maintain (void);
+    void wakeup (void);
+
+protected:
+    virtual void thread_main (void);
+
+public:
+    cc_tcppool (std::string nickname, const cc_tcppool_config &config=cc_tcppool_config());
+    virtual ~cc_tcppool ();
+
+    bool start (void);                          // バックグラウンドスレッドを起動する
+    void stop (void);                           // 停止してアイドル接続をすべて閉じる
+
+    cc_tcpconnect *acquire (const std::string &host, unsigned int port, int timeout_ms=-1);
+    void release (cc_tcpconnect *conn, bool reusable=true);   // 壊れた接続は reusable=false で返す
+    void warm (const std::string &host, unsigned int port);    // min_idle を維持する接続先に登録
+    void clear (void);                          // アイドル接続をすべて閉じる
+
+    virtual cc_tcpconnect *create_conn (void);  // 接続インスタンスの生成、継承先で差し替えられる
+
+    void get_stats (cc_tcppool_stats &out);
+
+    cc_debugprint tcppool_dbg;                  /// cclib debugprint
+};
+
+#define CC_TCPPOOL_ERRPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### ERROR!: " fmt,tcppool_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+#define CC_TCPPOOL_WARNPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### WARNING!: " fmt,tcppool_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+#define CC_TCPPOOL_DBGPR(fmt, args...) \
+    if (tcppool_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,tcppool_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); }
+
+#endif // __CC_TCPPOOL_H__
@@ -10,6 +10,13 @@
  * 
  */
 
+#include <string.h>             // for strerror
+#include <errno.h>              // for errno
+#include <unistd.h>             // for syscall
+#include <sys/syscall.h>        // for SYS_gettid
+#include <sys/resource.h>       // for setpriority, getrusage
+#include <time.h>               // for clock_gettime
+
 #include "cc_thread.h"
 
 /// デバックプリント エラー表示用マクロ、enableの是非に関わらず表示
@@ -24,13 +31,49 @@
 
 // -------------------------------------------------------------------------------------------
 
+/// 実行統計のCPU時間等を更新する間隔
+#define CC_THREAD_USAGE_INTERVAL_NS (100ULL*1000*1000)
+
+/// 時刻取得 (nsec)
+static uint64_t
+clock_ns (clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime (clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/// プロセス内の cc_thread の登録簿 (終了時の破棄順に依存しないよう解放しない)
+static std::mutex &
+registry_mutex (void)
+{
+    static std::mutex *mtx = new std::mutex;
+    return *mtx;
+}
+/// 登録簿の先頭 (registry_mutex() で保護)
+static cc_thread *registry_head = NULL;
+
+// -------------------------------------------------------------------------------------------
+
 /**
  * @brief コンストラクター
  * @param nickname     ニックネーム文字列(デバックプリントで使用)
  */
 cc_thread::cc_thread (key_t message_key, std::string nickname) :
+    cc_thread (message_key, nickname, CC_MAILBOX_EAGER)
+{
+}
+/**
+ * @brief コンストラクター
+ * @param message_key  メッセージキー
+ * @param nickname     ニックネーム文字列(デバックプリントで使用)
+ * @param policy       受信箱 (message) を作るタイミング
+ *                     EAGER は msgget() と FIFO の作成をここで行う。スレッドを大量に作る場合は
+ *                     LAZY (最初の送受信で作る) か NONE (作らない) にすると生成が軽くなる
+ */
+cc_thread::cc_thread (key_t message_key, std::string nickname, cc_mailbox_policy policy) :
     thread_dbg (nickname),
-    message(message_key,nickname,true/*master_flag*/)
+    message(message_key,nickname,true/*master_flag*/,policy)
 {
     CC_THREAD_DBGPR ("instance created\n");
 
@@ -39,8 +82,21 @@ cc_thread::cc_thread (key_t message_key, std::string nickname) :
         std::lock_guard<std::mutex> lock(mtx); // mutexをロック
         thread_loop     = false;
         thread_enable   = false;
+        thread_joinable = false;
         this->nickname  = nickname;
     }
+    stat_loops      = 0;
+    stat_wakeups    = 0;
+    stat_blocked_ns = 0;
+    stat_cpu_ns     = 0;
+    stat_nvcsw      = 0;
+    stat_nivcsw     = 0;
+    stat_start_ns   = 0;
+    stat_end_ns     = 0;
+    stat_usage_ns   = 0;
+    registry_prev   = NULL;
+    registry_next   = NULL;
+    registered      = false;
 
     // debugprint をまとめてオンにする
     //thread_dbg.enable();
@@ -50,12 +106,59 @@ cc_thread::cc_thread (key_t message_key, std::string nickname) :
  */
 cc_thread::~cc_thread ()
 {
+    registry_remove ();
     if (thread_enable) {
         thread_down ();
     }
     CC_THREAD_DBGPR ("instance deleted\n");
 }
 
+/**
+ * @brief 登録簿に入れる (初めて thread_up() したとき)
+ * スレッドを起動しない接続 (リアクター駆動の cc_tcpconnect など) は登録簿のロックを取らない
+ */
+void
+cc_thread::registry_add (void)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    if (registered) {
+        return;
+    }
+    registry_prev = NULL;
+    registry_next = registry_head;
+    if (registry_head != NULL) {
+        registry_head->registry_prev = this;
+    }
+    registry_head = this;
+    registered    = true;
+}
+/**
+ * @brief 登録簿から外す (O(1))
+ * 一度も thread_up() していなければ登録簿のロックを取らない
+ */
+void
+cc_thread::registry_remove (void)
+{
+    if (!registered) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    if (!registered) {
+        return;
+    }
+    if (registry_prev != NULL) {
+        registry_prev->registry_next = registry_next;
+    } else {
+        registry_head = registry_next;
+    }
+    if (registry_next != NULL) {
+        registry_next->registry_prev = registry_prev;
+    }
+    registry_prev = NULL;
+    registry_next = NULL;
+    registered    = false;
+}
+
 // -------------------------------------------------------------------------------------------
 /**
  * @brief thread_main のループ継続判定
@@ -64,9 +167,50 @@ cc_thread::~cc_thread ()
 bool
 cc_thread::loop_continue(void)
 {
+    stat_loops.fetch_add (1, std::memory_order_relaxed);
+
+    // CPU時間等は一定間隔で更新する (毎回だとシステムコールが増えるため)
+    uint64_t now = clock_ns (CLOCK_MONOTONIC_COARSE);
+    if (now - stat_usage_ns >= CC_THREAD_USAGE_INTERVAL_NS) {
+        stat_usage_ns = now;
+        update_thread_usage ();
+    }
+
     std::lock_guard<std::mutex> lock(mtx); // mutexをロック
     return thread_loop == true;
 }
+
+/**
+ * @brief 待ち時間と起床回数を記録しながら select() する
+ * 引数と戻り値は select() と同じ
+ */
+int
+cc_thread::thread_select(int nfds, fd_set *readfds, fd_set *writefds,
+                         fd_set *exceptfds, struct timeval *timeout)
+{
+    uint64_t start = clock_ns (CLOCK_MONOTONIC);
+    int ret = select (nfds, readfds, writefds, exceptfds, timeout);
+    stat_blocked_ns.fetch_add (clock_ns (CLOCK_MONOTONIC) - start, std::memory_order_relaxed);
+    if (ret > 0) {
+        stat_wakeups.fetch_add (1, std::memory_order_relaxed);
+    }
+    return ret;
+}
+/**
+ * @brief 待ち時間と起床回数を記録しながら epoll_wait() する
+ * 引数と戻り値は epoll_wait() と同じ
+ */
+int
+cc_thread::thread_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout_ms)
+{
+    uint64_t start = clock_ns (CLOCK_MONOTONIC);
+    int ret = epoll_wait (epfd, events, maxevents, timeout_ms);
+    stat_blocked_ns.fetch_add (clock_ns (CLOCK_MONOTONIC) - start, std::memory_order_relaxed);
+    if (ret > 0) {
+        stat_wakeups.fetch_add (1, std::memory_order_relaxed);
+    }
+    return ret;
+}
 /**
  * @brief thread_main のループ継続判定の設定関数
  * @param enb true: 継続, false: ループ終了
@@ -78,6 +222,17 @@ cc_thread::set_loop_continue(bool enb)
     thread_loop = enb;
 }
 
+/**
+ * @brief 起動ポリシーの設定
+ * @param policy 起動ポリシー、thread_up() 以降に変更しても次回起動まで反映されない
+ */
+void
+cc_thread::set_launch_policy(const cc_thread_policy &policy)
+{
+    std::lock_guard<std::mutex> lock(mtx); // mutexをロック
+    launch_policy = policy;
+}
+
 /**
  * @brief スレッド起動
  */
@@ -87,12 +242,129 @@ cc_thread::thread_up (void)
     if (thread_enable == false) {
         // wakeup thread
         CC_THREAD_DBGPR ("now wakeup thread\n");
+        registry_add ();
+        pthread_attr_t attr;
+        pthread_attr_init (&attr);
         {
             std::lock_guard<std::mutex> lock(mtx); // mutexをロック
             thread_loop     = true;
             thread_enable   = true;
+            // スタックサイズはスレッド生成前に attr で指定する
+            if (launch_policy.stack_size > 0) {
+                int err = pthread_attr_setstacksize (&attr, launch_policy.stack_size);
+                if (err != 0) {
+                    CC_THREAD_WARNPR ("pthread_attr_setstacksize(%lu) failed: %s\n",
+                                      (unsigned long)launch_policy.stack_size, strerror(err));
+                }
+            }
+        }
+        int err = pthread_create (&thread_id, &attr, thread_entry, this);
+        pthread_attr_destroy (&attr);
+        if (err != 0) {
+            CC_THREAD_ERRPR ("pthread_create() failed: %s\n", strerror(err));
+            std::lock_guard<std::mutex> lock(mtx); // mutexをロック
+            thread_loop     = false;
+            thread_enable   = false;
+            return;
         }
-        thread_obj = std::thread([this]() {this->thread_main();}); // ラムダ式経由でスレッド関数を呼ぶ
+        thread_joinable = true;
+    }
+}
+
+/**
+ * @brief pthread エントリー関数、起動ポリシーを適用してから thread_main() を呼ぶ
+ * @param arg cc_thread インスタンス
+ */
+void *
+cc_thread::thread_entry (void *arg)
+{
+    cc_thread *myobj = (cc_thread *)arg;
+    myobj->stat_start_ns = clock_ns (CLOCK_MONOTONIC);
+    myobj->stat_end_ns   = 0;
+    myobj->apply_launch_policy ();
+    myobj->thread_main ();
+    myobj->update_thread_usage ();
+    myobj->stat_end_ns   = clock_ns (CLOCK_MONOTONIC);
+    myobj->thread_finished ();      // この後はインスタンスに触らない (delete されてもよい)
+    return NULL;
+}
+
+/**
+ * @brief thread_main() から戻った後、スレッドの最後に呼ばれる
+ * 継承先で所有者への回収依頼などに使う。既定の実装は何もしない。
+ * ここから先でインスタンスが delete されても、スレッドは join されるまで待つだけなので安全。
+ */
+void
+cc_thread::thread_finished (void)
+{
+}
+
+/**
+ * @brief 起動ポリシーの適用、起動したスレッド自身のコンテキストで呼ばれる
+ * 権限不足などで失敗した項目はワーニングを表示して続行する
+ */
+void
+cc_thread::apply_launch_policy (void)
+{
+    cc_thread_policy policy;
+    {
+        std::lock_guard<std::mutex> lock(mtx); // mutexをロック
+        policy = launch_policy;
+    }
+
+    // スレッド名 (最大15文字)
+    if (policy.set_name) {
+        std::string name = nickname.substr (0, 15);
+        int err = pthread_setname_np (pthread_self(), name.c_str());
+        if (err != 0) {
+            CC_THREAD_WARNPR ("pthread_setname_np() failed: %s\n", strerror(err));
+        }
+    }
+    // CPUアフィニティ
+    if (!policy.cpus.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO (&cpuset);
+        for (size_t i = 0; i < policy.cpus.size(); i++) {
+            if (policy.cpus[i] >= 0 && policy.cpus[i] < CPU_SETSIZE) {
+                CPU_SET (policy.cpus[i], &cpuset);
+            }
+        }
+        int err = pthread_setaffinity_np (pthread_self(), sizeof(cpuset), &cpuset);
+        if (err != 0) {
+            CC_THREAD_WARNPR ("pthread_setaffinity_np() failed: %s\n", strerror(err));
+        }
+    }
+    // スケジューリングクラス
+    if (policy.sched_policy == SCHED_FIFO || policy.sched_policy == SCHED_RR) {
+        struct sched_param param;
+        memset (&param, 0, sizeof(param));
+        param.sched_priority = policy.sched_priority;
+        int err = pthread_setschedparam (pthread_self(), policy.sched_policy, &param);
+        if (err != 0) {
+            CC_THREAD_WARNPR ("pthread_setschedparam() failed: %s\n", strerror(err));
+        }
+    }
+    // nice値 (Linux ではスレッド単位で設定可能)
+    if (policy.nice_enable) {
+        pid_t tid = (pid_t)syscall (SYS_gettid);
+        if (setpriority (PRIO_PROCESS, tid, policy.nice) == -1) {
+            CC_THREAD_WARNPR ("setpriority(%d) failed: %s\n", policy.nice, strerror(errno));
+        }
+    }
+}
+
+/**
+ * @brief スレッドCPU時間とコンテキストスイッチ数の更新、スレッド自身のコンテキストで呼ばれる
+ */
+void
+cc_thread::update_thread_usage (void)
+{
+    stat_cpu_ns.store (clock_ns (CLOCK_THREAD_CPUTIME_ID), std::memory_order_relaxed);
+
+    struct rusage ru;
+    if (getrusage (RUSAGE_THREAD, &ru) == 0) {
+        stat_nvcsw.store ((uint64_t)ru.ru_nvcsw, std::memory_order_relaxed);
+        stat_nivcsw.store ((uint64_t)ru.ru_nivcsw, std::memory_order_relaxed);
     }
 }
 
@@ -110,9 +382,10 @@ cc_thread::thread_down(void)
             thread_loop   = false;
         }
     }
-    if (thread_obj.joinable()) {
+    if (thread_joinable) {
         CC_THREAD_DBGPR ("start thread join\n");
-        thread_obj.join ();
+        pthread_join (thread_id, NULL);
+        thread_joinable = false;
         CC_THREAD_DBGPR ("success thread join\n");
     }
 }
@@ -124,8 +397,59 @@ cc_thread::thread_down(void)
 void
 cc_thread::thread_detach (void)
 {
-    thread_obj.detach();
+    if (thread_joinable) {
+        pthread_detach (thread_id);
+        thread_joinable = false;
+    }
     CC_THREAD_DBGPR ("thread detached\n");
 }
 
+// -------------------------------------------------------------------------------------------
+/**
+ * @brief 実行統計の取得
+ * @param stats 統計の格納先
+ */
+void
+cc_thread::get_stats (cc_thread_stats &stats)
+{
+    uint64_t start = stat_start_ns.load();
+    uint64_t end   = stat_end_ns.load();
 
+    stats.loop_count        = stat_loops.load (std::memory_order_relaxed);
+    stats.wakeup_count      = stat_wakeups.load (std::memory_order_relaxed);
+    stats.blocked_ns        = stat_blocked_ns.load (std::memory_order_relaxed);
+    stats.cpu_ns            = stat_cpu_ns.load (std::memory_order_relaxed);
+    stats.voluntary_ctxsw   = stat_nvcsw.load (std::memory_order_relaxed);
+    stats.involuntary_ctxsw = stat_nivcsw.load (std::memory_order_relaxed);
+    stats.running           = (start != 0 && end == 0);
+
+    // 稼働時間 = 開始から終了(稼働中なら現在)まで
+    uint64_t elapsed = 0;
+    if (start != 0) {
+        elapsed = (end != 0 ? end : clock_ns (CLOCK_MONOTONIC)) - start;
+    }
+    stats.working_ns = (elapsed > stats.blocked_ns) ? elapsed - stats.blocked_ns : 0;
+}
+
+/**
+ * @brief プロセス内の全 cc_thread (一度でも thread_up() したもの) の実行統計を表示
+ * @param fp 出力先
+ */
+void
+cc_thread::dump_all_stats (FILE *fp)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex());
+
+    fprintf (fp, "%-20s %-3s %12s %10s %12s %12s %12s %10s %10s\n",
+             "nickname", "run", "loops", "wakeups", "blocked(ms)", "working(ms)", "cpu(ms)", "vcsw", "ivcsw");
+    for (cc_thread *th = registry_head; th != NULL; th = th->registry_next) {
+        cc_thread_stats st;
+        th->get_stats (st);
+        fprintf (fp, "%-20s %-3s %12llu %10llu %12.1f %12.1f %12.1f %10llu %10llu\n",
+                 th->nickname.c_str(), st.running ? "yes" : "no",
+                 (unsigned long long)st.loop_count, (unsigned long long)st.wakeup_count,
+                 st.blocked_ns / 1e6, st.working_ns / 1e6, st.cpu_ns / 1e6,
+                 (unsigned long long)st.voluntary_ctxsw, (unsigned long long)st.involuntary_ctxsw);
+    }
+    fflush (fp);
+}
@@ -17,10 +17,57 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sched.h>
 
 #include "cc_debugprint.h"
 #include "cc_message.h"
 
+/**
+ * @struct cc_thread_policy
+ * @brief cc_thread 起動ポリシー
+ *
+ * thread_up() より前に set_launch_policy() で設定する。
+ * スタックサイズ以外は起動したスレッド自身の中で thread_main() より前に適用される。
+ */
+struct cc_thread_policy {
+    std::vector<int> cpus;                      ///< CPUアフィニティ、空なら設定しない
+    int sched_policy;                           ///< SCHED_OTHER / SCHED_FIFO / SCHED_RR
+    int sched_priority;                         ///< SCHED_FIFO/SCHED_RR の優先度
+    bool nice_enable;                           ///< true なら nice 値を設定する
+    int nice;                                   ///< nice 値 (-20〜19)
+    size_t stack_size;                          ///< スタックサイズ、0ならデフォルト
+    bool set_name;                              ///< true なら nickname をスレッド名に設定する
+
+    cc_thread_policy (void) :
+        sched_policy (SCHED_OTHER), sched_priority (0),
+        nice_enable (false), nice (0),
+        stack_size (0), set_name (true) {}
+};
+
+/**
+ * @struct cc_thread_stats
+ * @brief cc_thread 実行統計のスナップショット
+ *
+ * CPU時間とコンテキストスイッチ数はスレッド自身が loop_continue() の中で
+ * 一定間隔(100msec)ごとに、およびスレッド終了時に更新する。
+ */
+struct cc_thread_stats {
+    uint64_t loop_count;                        ///< loop_continue() の呼び出し回数
+    uint64_t wakeup_count;                      ///< thread_select()/thread_epoll_wait() がイベントで起床した回数
+    uint64_t blocked_ns;                        ///< thread_select()/thread_epoll_wait() で待っていた時間
+    uint64_t working_ns;                        ///< 稼働時間から blocked_ns を引いた時間
+    uint64_t cpu_ns;                            ///< スレッドCPU時間 (CLOCK_THREAD_CPUTIME_ID)
+    uint64_t voluntary_ctxsw;                   ///< 自発的コンテキストスイッチ数
+    uint64_t involuntary_ctxsw;                 ///< 非自発的コンテキストスイッチ数
+    bool running;                               ///< スレッド稼働中
+};
+
 /**
  * @class cc_thread
  * @brief C++用 汎用スレッドクラス
@@ -29,26 +76,62 @@
  */
 class cc_thread {
 protected:
-    std::thread thread_obj;                     ///< class thread のインスタンス
+    pthread_t thread_id;                        ///< スレッドID
+    bool thread_joinable;                       ///< join 可能フラグ
+    cc_thread_policy launch_policy;             ///< 起動ポリシー
     bool thread_loop;                           ///< スレッドループ有効フラグ、falseにするとスレッドループを抜ける
     bool thread_enable;                         ///< スレッド起動中フラグ
     std::mutex mtx;                             ///< cc_threadが保持する変数保護用
 
     bool loop_continue(void);                   // ループ継続判定
+    int thread_select(int nfds, fd_set *readfds, fd_set *writefds,
+                      fd_set *exceptfds, struct timeval *timeout); // 統計を取りながら select() する
+    int thread_epoll_wait(int epfd, struct epoll_event *events,
+                          int maxevents, int timeout_ms);  // 統計を取りながら epoll_wait() する
     virtual void thread_main (void) = 0;        // threadのメイン関数、継承先のクラスで必ず定義しなければならない
+    virtual void thread_finished (void);        // thread_main() 終了後にスレッド内で呼ばれる
+
+private:
+    static void *thread_entry (void *arg);      // pthread エントリー関数
+    void apply_launch_policy (void);            // 起動ポリシーの適用 (スレッド内で呼ぶ)
+    void update_thread_usage (void);            // CPU時間等の更新 (スレッド内で呼ぶ)
+
+    // 実行統計 (他スレッドから読むので atomic)
+    std::atomic<uint64_t> stat_loops;
+    std::atomic<uint64_t> stat_wakeups;
+    std::atomic<uint64_t> stat_blocked_ns;
+    std::atomic<uint64_t> stat_cpu_ns;
+    std::atomic<uint64_t> stat_nvcsw;
+    std::atomic<uint64_t> stat_nivcsw;
+    std::atomic<uint64_t> stat_start_ns;        ///< スレッド開始時刻 (CLOCK_MONOTONIC)
+    std::atomic<uint64_t> stat_end_ns;          ///< スレッド終了時刻、稼働中は 0
+    uint64_t stat_usage_ns;                     ///< 前回 update_thread_usage() した時刻 (スレッド内のみ)
+
+    // 登録簿 (dump_all_stats() 用の侵入型リスト、初めて thread_up() したときに入る)
+    cc_thread *registry_prev;
+    cc_thread *registry_next;
+    bool registered;                            ///< 登録簿に入っている (登録簿のロックで書き換える、自分のデストラクタではロックなしで読む)
+    void registry_add (void);
+    void registry_remove (void);
     
 public:
     // public functions
     cc_thread (key_t message_key, std::string nickname);           // コンストラクター
+    cc_thread (key_t message_key, std::string nickname, cc_mailbox_policy policy); // 受信箱を作るタイミングを指定
     ~cc_thread ();                              // デストラクター
 
     void set_loop_continue(bool enb);           // ループ継続判定設定
+    void set_launch_policy(const cc_thread_policy &policy); // 起動ポリシー設定、thread_up()前に呼ぶ
 
     // スレッド制御系
     void thread_up (void);                      // スレッド起動
     void thread_down (void);                    // スレッド停止
     void thread_detach (void);                  // スレッドdetache
 
+    // 実行統計
+    void get_stats (cc_thread_stats &stats);    // このスレッドの統計を取得
+    static void dump_all_stats (FILE *fp=stdout); // 起動したことのある全 cc_thread の統計を表示
+
     // public variables
     std::string nickname;                       ///< ニックネーム
     cc_debugprint thread_dbg;                   ///< cclib debugprint
@@ -0,0 +1,450 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_timer.cc
+ * @brief timer service class for C++ (hierarchical timing wheel on timerfd)
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <string.h>             // for memset
+#include <errno.h>              // for errno
+#include <time.h>               // for clock_gettime
+#include <unistd.h>             // for read/close
+#include <sys/timerfd.h>        // for timerfd_create etc
+#include <sys/select.h>         // for select
+
+#include "cc_timer.h"
+
+/// デバックプリント エラー表示用マクロ、enableの是非に関わらず表示
+#define CC_TIMER_ERRPR(fmt, args...) \
+    { printf("[%s:%s():%d] ##### ERROR!: " fmt,timer_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+/// デバックプリント デバック表示用マクロ、enableのときだけ表示
+#define CC_TIMER_DBGPR(fmt, args...) \
+    if (timer_dbg.enable_flg) { printf("[%s:%s():%d] " fmt,timer_dbg.nickname.c_str(),__FUNCTION__,__LINE__, ## args); fflush(stdout); }
+
+/// 登録可能な最大ティック数 (最上段の範囲内に収める)
+#define CC_TIMER_MAX_TICKS  ((uint64_t)1 << 32)
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief コンストラクター
+ * @param nickname ニックネーム文字列(デバックプリントで使用)
+ * @param tick_ms  1ティックの長さ(msec)、タイマーの分解能になる
+ */
+cc_timer::cc_timer (std::string nickname, unsigned int tick_ms) :
+    cc_thread (-1, nickname, CC_MAILBOX_LAZY),
+    timer_dbg (nickname)
+{
+    this->tick_ms = (tick_ms == 0) ? 1 : tick_ms;
+    base_ns = monotonic_ns ();
+    current = 0;
+    armed   = 0;
+    active  = 0;
+    memset (heads, 0xff, sizeof(heads));        // すべて -1
+    memset (bitmap, 0, sizeof(bitmap));
+
+    timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror ("timerfd_create()");
+        CC_TIMER_ERRPR ("timerfd create error\n");
+    }
+    CC_TIMER_DBGPR ("instance created\n");
+}
+
+/**
+ * @brief デストラクター
+ */
+cc_timer::~cc_timer ()
+{
+    thread_down ();
+    if (timer_fd != -1) {
+        close (timer_fd);
+        timer_fd = -1;
+    }
+    CC_TIMER_DBGPR ("instance deleted\n");
+}
+
+/**
+ * @brief 専用スレッドで駆動する場合のメイン関数
+ */
+void
+cc_timer::thread_main (void)
+{
+    struct timeval timeout;
+    fd_set  readSet;
+
+    CC_TIMER_DBGPR ("thread up\n");
+    while (loop_continue()) {
+        // タイムアウト設定 (停止判定用)
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 100*1000; // 100msec loop
+
+        FD_ZERO(&readSet);
+        FD_SET(timer_fd, &readSet);
+        thread_select(timer_fd + 1, &readSet, 0, 0, &timeout);
+
+        if (FD_ISSET(timer_fd, &readSet)) {
+            process ();
+        }
+    }
+    CC_TIMER_DBGPR ("thread down\n");
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief ワンショットタイマーの登録
+ * @param delay_ms 満了までの時間(msec)
+ * @param cb       コールバック
+ * @param exec     コールバックの実行先、省略時は process() を呼んだスレッドで実行
+ * @return タイマーID、失敗時は 0
+ */
+cc_timer_id
+cc_timer::add_oneshot (unsigned int delay_ms, callback_t cb, executor_t exec)
+{
+    uint64_t ticks = (delay_ms + tick_ms - 1) / tick_ms;
+    return add_timer (ticks, 0, cb, exec);
+}
+
+/**
+ * @brief 周期タイマーの登録
+ * @param interval_ms 周期(msec)
+ * @param cb          コールバック
+ * @param exec        コールバックの実行先、省略時は process() を呼んだスレッドで実行
+ * @return タイマーID、失敗時は 0
+ */
+cc_timer_id
+cc_timer::add_periodic (unsigned int interval_ms, callback_t cb, executor_t exec)
+{
+    uint64_t ticks = (interval_ms + tick_ms - 1) / tick_ms;
+    if (ticks == 0) ticks = 1;
+    return add_timer (ticks, ticks, cb, exec);
+}
+
+/**
+ * @brief タイマーのキャンセル
+ * @param id タイマーID
+ * @return true: キャンセルした, false: 満了済み/無効なID
+ */
+bool
+cc_timer::cancel (cc_timer_id id)
+{
+    std::lock_guard<std::mutex> lock(wheel_mtx);
+    if (id == 0) return false;
+    int32_t idx = (int32_t)(id & 0xffffffff) - 1;
+    uint32_t gen = (uint32_t)(id >> 32);
+    if (idx < 0 || idx >= (int32_t)nodes.size()) return false;
+    timer_node &node = nodes[idx];
+    if (node.gen != gen || node.level < 0) return false;
+
+    unlink_node (idx);
+    free_node (idx);
+    active--;
+    // timerfd は次回の process() で設定し直すのでここでは触らない
+    return true;
+}
+
+/**
+ * @brief 登録中のタイマー数
+ */
+size_t
+cc_timer::count (void)
+{
+    std::lock_guard<std::mutex> lock(wheel_mtx);
+    return active;
+}
+
+/**
+ * @brief select/epoll で待つための fd
+ */
+int
+cc_timer::get_fd (void)
+{
+    return timer_fd;
+}
+
+/**
+ * @brief 期限切れタイマーの処理
+ * get_fd() が読み込み可能になったら呼ぶ。コールバックはロックの外で実行される
+ * @return 実行(または executor に渡した)コールバック数
+ */
+int
+cc_timer::process (void)
+{
+    // timerfd の満了回数を読み捨て (時刻は CLOCK_MONOTONIC から求める)
+    uint64_t expirations;
+    if (read (timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+        perror ("read()");
+    }
+
+    std::vector<fired_entry> fired;
+    {
+        std::lock_guard<std::mutex> lock(wheel_mtx);
+        advance (now_tick(), fired);
+        rearm ();
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        if (fired[i].exec) {
+            fired[i].exec (fired[i].cb);
+        } else {
+            fired[i].cb ();
+        }
+    }
+    return (int)fired.size();
+}
+
+// -------------------------------------------------------------------------------------------
+
+/**
+ * @brief タイマー登録の共通処理
+ */
+cc_timer_id
+cc_timer::add_timer (uint64_t delay_ticks, uint64_t interval_ticks, callback_t &cb, executor_t &exec)
+{
+    if (!cb) return 0;
+    if (delay_ticks >= CC_TIMER_MAX_TICKS) delay_ticks = CC_TIMER_MAX_TICKS - 1;
+
+    std::lock_guard<std::mutex> lock(wheel_mtx);
+
+    // ノード確保
+    int32_t idx;
+    if (free_nodes.empty()) {
+        idx = (int32_t)nodes.size();
+        timer_node node;
+        node.gen = 1;
+        nodes.push_back (node);
+    } else {
+        idx = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    timer_node &node = nodes[idx];
+    node.prev = node.next = -1;
+    node.level = -1;
+    node.interval = interval_ticks;
+    node.cb = cb;
+    node.exec = exec;
+
+    // 満了ティックは実時刻基準 (process() が遅れていても早く満了しない)
+    uint64_t expire = now_tick() + delay_ticks;
+    if (expire <= current) expire = current + 1;
+    node.expire = expire;
+
+    link_node (idx);
+    active++;
+
+    // 今の設定より早く満了するなら timerfd を設定し直す
+    if (armed == 0 || expire < armed) {
+        rearm ();
+    }
+    return ((uint64_t)node.gen << 32) | (uint64_t)(idx + 1);
+}
+
+/**
+ * @brief 現在時刻のティック
+ */
+uint64_t
+cc_timer::now_tick (void)
+{
+    return (monotonic_ns() - base_ns) / ((uint64_t)tick_ms * 1000000ULL);
+}
+
+/**
+ * @brief ノードをホイールに登録する
+ * (expire と current が同じ窓に入る最も下の段に置くので、スロットは必ず current より先になる)
+ */
+void
+cc_timer::link_node (int32_t idx)
+{
+    timer_node &node = nodes[idx];
+    int level;
+    for (level = 0; level < CC_TIMER_LEVELS - 1; level++) {
+        int upper = (level + 1) * CC_TIMER_SLOTBITS;
+        if ((node.expire >> upper) == (current >> upper)) break;
+    }
+    int slot = (int)((node.expire >> (level * CC_TIMER_SLOTBITS)) & (CC_TIMER_SLOTS - 1));
+
+    node.level = (int8_t)level;
+    node.slot  = (uint8_t)slot;
+    node.prev  = -1;
+    node.next  = heads[level][slot];
+    if (node.next != -1) nodes[node.next].prev = idx;
+    heads[level][slot] = idx;
+    bitmap[level][slot / 64] |= (1ULL << (slot % 64));
+}
+
+/**
+ * @brief ノードをホイールから外す
+ */
+void
+cc_timer::unlink_node (int32_t idx)
+{
+    timer_node &node = nodes[idx];
+    int level = node.level;
+    int slot  = node.slot;
+    if (node.prev != -1) {
+        nodes[node.prev].next = node.next;
+    } else {
+        heads[level][slot] = node.next;
+    }
+    if (node.next != -1) nodes[node.next].prev = node.prev;
+    if (heads[level][slot] == -1) {
+        bitmap[level][slot / 64] &= ~(1ULL << (slot % 64));
+    }
+    node.prev = node.next = -1;
+    node.level = -1;
+}
+
+/**
+ * @brief ノードを解放する、世代番号を進めて古いIDを無効にする
+ */
+void
+cc_timer::free_node (int32_t idx)
+{
+    timer_node &node = nodes[idx];
+    node.gen++;
+    if (node.gen == 0) node.gen = 1;
+    node.cb = callback_t();
+    node.exec = executor_t();
+    free_nodes.push_back (idx);
+}
+
+/**
+ * @brief 指定段で from 以降の使用中スロットを探す
+ * @return スロット番号、なければ -1
+ */
+int
+cc_timer::next_slot (int level, int from)
+{
+    for (int w = from / 64; w < CC_TIMER_SLOTS / 64; w++) {
+        uint64_t bits = bitmap[level][w];
+        if (w == from / 64) {
+            bits &= ~0ULL << (from % 64);
+        }
+        if (bits) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 次に処理(満了または下の段への移動)が必要なティック
+ * @return ティック、タイマーがなければ 0
+ */
+uint64_t
+cc_timer::next_event_tick (void)
+{
+    uint64_t next = 0;
+    for (int level = 0; level < CC_TIMER_LEVELS; level++) {
+        int shift = level * CC_TIMER_SLOTBITS;
+        int cur_slot = (int)((current >> shift) & (CC_TIMER_SLOTS - 1));
+        if (cur_slot + 1 >= CC_TIMER_SLOTS) continue;
+        int slot = next_slot (level, cur_slot + 1);
+        if (slot < 0) continue;
+        uint64_t tick = ((current >> shift) + (uint64_t)(slot - cur_slot)) << shift;
+        if (next == 0 || tick < next) next = tick;
+    }
+    return next;
+}
+
+/**
+ * @brief 1ティック進める、上の段の移動と最下段の満了処理を行う
+ */
+void
+cc_timer::tick_once (std::vector<fired_entry> &fired)
+{
+    current++;
+
+    // 上の段の窓の先頭に来たら、そのスロットを下の段に移す
+    for (int level = 1; level < CC_TIMER_LEVELS; level++) {
+        int shift = level * CC_TIMER_SLOTBITS;
+        if ((current & (((uint64_t)1 << shift) - 1)) != 0) break;
+        int slot = (int)((current >> shift) & (CC_TIMER_SLOTS - 1));
+        int32_t idx = heads[level][slot];
+        heads[level][slot] = -1;
+        bitmap[level][slot / 64] &= ~(1ULL << (slot % 64));
+        while (idx != -1) {
+            int32_t next = nodes[idx].next;
+            link_node (idx);
+            idx = next;
+        }
+    }
+
+    // 最下段のスロットを満了させる
+    int slot = (int)(current & (CC_TIMER_SLOTS - 1));
+    int32_t idx = heads[0][slot];
+    heads[0][slot] = -1;
+    bitmap[0][slot / 64] &= ~(1ULL << (slot % 64));
+    while (idx != -1) {
+        timer_node &node = nodes[idx];
+        int32_t next = node.next;
+        fired_entry entry;
+        entry.cb = node.cb;
+        entry.exec = node.exec;
+        fired.push_back (entry);
+        if (node.interval > 0) {
+            // 周期タイマーは再登録
+            node.expire += node.interval;
+            if (node.expire <= current) node.expire = current + 1;
+            link_node (idx);
+        } else {
+            node.level = -1;
+            free_node (idx);
+            active--;
+        }
+        idx = next;
+    }
+}
+
+/**
+ * @brief 指定ティックまで進める、何もないティックは読み飛ばす
+ */
+void
+cc_timer::advance (uint64_t target, std::vector<fired_entry> &fired)
+{
+    while (current < target) {
+        uint64_t next = next_event_tick ();
+        if (next == 0 || next > target) {
+            current = target;
+            break;
+        }
+        current = next - 1;
+        tick_once (fired);
+    }
+}
+
+/**
+ * @brief timerfd を次に処理が必要なティックに設定する (wheel_mtx をロックして呼ぶこと)
+ */
+void
+cc_timer::rearm (void)
+{
+    uint64_t next = next_event_tick ();
+    if (next == armed) return;
+
+    struct itimerspec its;
+    memset (&its, 0, sizeof(its));
+    if (next != 0) {
+        uint64_t ns = base_ns + next * (uint64_t)tick_ms * 1000000ULL;
+        its.it_value.tv_sec  = ns / 1000000000ULL;
+        its.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+    if (timerfd_settime (timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror ("timerfd_settime()");
+        CC_TIMER_ERRPR ("timerfd set error\n");
+    }
+    armed = next;
+}
@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_timer.h
+ * @brief timer service class for C++ (hierarchical timing wheel on timerfd)
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_TIMER_H__
+#define __CC_TIMER_H__
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include <mutex>
+
+#include "cc_thread.h"
+
+#define CC_TIMER_LEVELS     5           ///< ホイールの段数
+#define CC_TIMER_SLOTS      256         ///< 1段あたりのスロット数
+#define CC_TIMER_SLOTBITS   8           ///< 1段あたりのビット数
+
+typedef uint64_t cc_timer_id;           ///< タイマーID、0は無効
+
+/**
+ * @class cc_timer
+ * @brief 階層タイミングホイールによるタイマーサービス
+ *
+ * 1個の timerfd で多数のワンショット/周期タイマーを駆動する。
+ * 登録・キャンセルは O(1)。timerfd は次に処理が必要なティックにだけ設定されるので、
+ * 遠いタイムアウトを大量に登録してもウェイクアップは増えない。
+ *
+ * コールバックの実行コンテキストは次のいずれか
+ *  - thread_up() した場合は cc_timer 自身のスレッド
+ *  - 任意の cc_thread のループで get_fd() を select し、読み込み可能になったら process() を呼ぶ
+ *    (そのスレッドのコンテキストで実行される)
+ *  - タイマー登録時に executor を指定した場合は executor に渡される
+ */
+class cc_timer : public cc_thread {
+public:
+    typedef std::function<void(void)> callback_t;               ///< コールバック
+    typedef std::function<void(callback_t)> executor_t;         ///< コールバックの実行先
+
+    cc_timer (std::string nickname, unsigned int tick_ms=1);    // コンストラクター
+    virtual ~cc_timer ();                                       // デストラクター
+
+    virtual void thread_main (void);                            // 専用スレッドで駆動する場合のメイン関数
+
+    // タイマー登録/キャンセル (どのスレッドから呼んでもよい)
+    cc_timer_id add_oneshot (unsigned int delay_ms, callback_t cb, executor_t exec=executor_t());
+    cc_timer_id add_periodic (unsigned int interval_ms, callback_t cb, executor_t exec=executor_t());
+    bool cancel (cc_timer_id id);
+    size_t count (void);
+
+    // 外部のイベントループで駆動する場合に使用
+    int get_fd (void);                                          // select/epoll で待つ fd
+    int process (void);                                         // 期限切れのコールバックを実行、実行数を返す
+
+    cc_debugprint timer_dbg;                                    ///< cclib debugprint
+
+private:
+    struct timer_node {
+        int32_t prev;                   ///< リスト前方 (-1:なし)
+        int32_t next;                   ///< リスト後方 (-1:なし)
+        uint32_t gen;                   ///< 世代番号、ID の再利用検出用
+        int8_t level;                   ///< 登録中の段 (-1:未登録)
+        uint8_t slot;                   ///< 登録中のスロット
+        uint64_t expire;                ///< 満了ティック
+        uint64_t interval;              ///< 周期ティック (0:ワンショット)
+        callback_t cb;
+        executor_t exec;
+    };
+    struct fired_entry {
+        callback_t cb;
+        executor_t exec;
+    };
+
+    std::mutex wheel_mtx;                                       ///< ホイール保護用
+    int timer_fd;                                               ///< timerfd
+    unsigned int tick_ms;                                       ///< 1ティックの長さ
+    uint64_t base_ns;                                           ///< ティック0の時刻 (CLOCK_MONOTONIC)
+    uint64_t current;                                           ///< 処理済みティック
+    uint64_t armed;                                             ///< timerfd に設定中のティック (0:停止中)
+    size_t active;                                              ///< 登録中のタイマー数
+    std::vector<timer_node> nodes;                              ///< ノードプール
+    std::vector<int32_t> free_nodes;                            ///< 空きノード
+    int32_t heads[CC_TIMER_LEVELS][CC_TIMER_SLOTS];             ///< スロットのリスト先頭
+    uint64_t bitmap[CC_TIMER_LEVELS][CC_TIMER_SLOTS/64];        ///< 使用中スロットのビットマップ
+
+    cc_timer_id add_timer (uint64_t delay_ticks, uint64_t interval_ticks, callback_t &cb, executor_t &exec);
+    uint64_t now_tick (void);
+    void link_node (int32_t idx);
+    void unlink_node (int32_t idx);
+    void free_node (int32_t idx);
+    int next_slot (int level, int from);
+    uint64_t next_event_tick (void);
+    void tick_once (std::vector<fired_entry> &fired);
+    void advance (uint64_t target, std::vector<fired_entry> &fired);
+    void rearm (void);
+};
+
+#endif // __CC_TIMER_H__
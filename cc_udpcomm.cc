@@ -10,10 +10,6 @@
  * 
  */
 
-// #####################################################################################
-// ###############################  under construction   ###############################
-// #####################################################################################
-
 #include "cc_udpcomm.h"
 
 // =====================================================================================
@@ -91,10 +87,14 @@ cc_udpsend::get_ip (struct in_addr &in) {
     in = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
     //printf ("myip %s-%s\n" , "eth0" , inet_ntoa(in));
 }
+/**
+ * @brief 送信先への経路のインターフェース名と IPv4 アドレス (cc_netif の表から引く、システムコールなし)
+ */
 void cc_udpsend::get_ifinfo (struct ifreq &ifr) {
-    ifr.ifr_addr.sa_family = AF_INET;
-    strcpy(ifr.ifr_name , "eth0");
-    ioctl(sock, SIOCGIFADDR, &ifr);
+    cc_sockaddr dst;
+    memcpy (&dst.addr, &addr, sizeof(addr));
+    dst.len = sizeof(addr);
+    cc_netif::instance().default_ifreq (ifr, &dst);
 }
     
 
@@ -114,91 +114,180 @@ cc_udpsend::send (unsigned char *dptr, int dsize)
 // ===================================================================================== RECV
 // =====================================================================================
 
-void *
-cc_udprecv::thread_func(void *arg)
-{
-    cc_udprecv *myobj = (cc_udprecv *)arg;
-    struct timeval timeout;
-    fd_set  rfds;
-    ssize_t ret;
-
-    struct sockaddr_in from;
-    socklen_t sockaddr_in_size = (socklen_t)sizeof(struct sockaddr_in);
-    
-    while (myobj->thread_loop) {
-        // タイムアウト値の設定
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 200*1000;
-
-        FD_ZERO(&rfds);
-        FD_SET(myobj->fifo_to_thread->get_fd(), &rfds);
-        if (myobj->sock != -1) {
-            FD_SET(myobj->sock, &rfds);
-        }
-        select(FD_SETSIZE, &rfds, 0, 0, &timeout);      // wait
-
-        if( FD_ISSET(myobj->fifo_to_thread->get_fd(), &rfds) ) {
-            int recvsize;
-            unsigned char buf[200];
-            recvsize = myobj->fifo_to_thread->recv (buf, sizeof(buf));
-            printf ("cc_udpsend: recv fifo event (%d byte)\n", recvsize);
-        }
-        if (myobj->sock != -1) {
-            if( FD_ISSET(myobj->sock, &rfds) ) {
-                
-                if ((ret = recvfrom (myobj->sock, myobj->buffer, myobj->buffersize, 0, (struct sockaddr *)&from, &sockaddr_in_size)) == -1) {
-                    perror("#### error recvfrom()");
-                } else {
-                    CC_UDPCOMM_DBGPR ("cc_udpsend: recv udp packet   retcode=%ldbyte\n", (unsigned long)ret);
-                }
-                myobj->datarecv (ret, from);
-            }
-        }
-    }
-    pthread_exit (NULL);
-    return NULL;
-}
-
-cc_udprecv::cc_udprecv (void) : cc_thread (true/*thread_up_flg*/,thread_func)
+cc_udprecv::cc_udprecv (void) : cc_thread (-1, "udprecv", CC_MAILBOX_NONE),
+    stat_packets (0), stat_bytes (0), stat_calls (0), stat_truncated (0)
 {
     CC_UDPCOMM_DBGPR ("cc_udrecv: instance created\n");
 
     // initialize
-    buffer = NULL;
     sock = -1;
     connected = false;
-
-    // crate sub thread
-    thread_up (thread_func);
+    rcvbuf = 0;
+    slot_data  = NULL;
+    slot_size  = 0;
+    slot_count = 0;
+    slot_head  = 0;
+    slot_hdr   = NULL;
+    slot_iov   = NULL;
+    slot_from  = NULL;
+    slot_pkt   = NULL;
 }
 
 cc_udprecv::~cc_udprecv ()
 {
     // detach resource
     disconnect ();
-    thread_down ();
 
     CC_UDPCOMM_DBGPR ("cc_udprecv: instance deleted\n");
 }
 
+/**
+ * @brief スロットのリングを確保して、各 mmsghdr をスロットに向けておく
+ * @param size  1スロットの大きさ
+ * @param count スロット数 (CC_UDPRECV_BATCH の倍数に切り上げる)
+ */
 bool
-cc_udprecv::connect (unsigned int port, in_addr_t ipaddr, int bsize)
+cc_udprecv::alloc_slots (size_t size, unsigned int count)
+{
+    count = (count + CC_UDPRECV_BATCH - 1) / CC_UDPRECV_BATCH * CC_UDPRECV_BATCH;
+    if (count == 0) {
+        count = CC_UDPRECV_BATCH;
+    }
+    if ((slot_data = (unsigned char*)malloc (size * count)) == NULL) {
+        perror("#### error malloc()");
+        return false;
+    }
+    slot_hdr  = new struct mmsghdr[count];
+    slot_iov  = new struct iovec[count];
+    slot_from = new struct sockaddr_in[count];
+    slot_pkt  = new cc_udppacket[count];
+    memset (slot_hdr, 0, sizeof(struct mmsghdr) * count);
+    for (unsigned int i = 0; i < count; i++) {
+        slot_iov[i].iov_base = slot_data + size * i;
+        slot_iov[i].iov_len  = size;
+        slot_hdr[i].msg_hdr.msg_iov    = &slot_iov[i];
+        slot_hdr[i].msg_hdr.msg_iovlen = 1;
+        slot_hdr[i].msg_hdr.msg_name   = &slot_from[i];
+        slot_pkt[i].data      = slot_data + size * i;
+        slot_pkt[i].size      = 0;
+        slot_pkt[i].from      = &slot_from[i];
+        slot_pkt[i].truncated = false;
+    }
+    slot_size  = size;
+    slot_count = count;
+    slot_head  = 0;
+    return true;
+}
+void
+cc_udprecv::free_slots (void)
+{
+    free (slot_data);
+    delete[] slot_hdr;
+    delete[] slot_iov;
+    delete[] slot_from;
+    delete[] slot_pkt;
+    slot_data  = NULL;
+    slot_hdr   = NULL;
+    slot_iov   = NULL;
+    slot_from  = NULL;
+    slot_pkt   = NULL;
+    slot_size  = 0;
+    slot_count = 0;
+}
+
+/**
+ * @brief 受信キューを recvmmsg() で読めるだけ読んで datarecv() に渡す
+ * @return true: CC_UDPRECV_DRAIN 回使い切った (まだ残っている), false: 空になった
+ */
+bool
+cc_udprecv::drain (void)
+{
+    for (int round = 0; round < CC_UDPRECV_DRAIN; round++) {
+        unsigned int head = slot_head;
+        unsigned int vlen = CC_UDPRECV_BATCH;   // slot_count は BATCH の倍数なので末尾をまたがない
+        for (unsigned int i = head; i < head + vlen; i++) {
+            slot_hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        int n = recvmmsg (sock, &slot_hdr[head], vlen, MSG_DONTWAIT, NULL);
+        stat_calls.fetch_add (1, std::memory_order_relaxed);
+        if (n <= 0) {
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("#### error recvmmsg()");
+            }
+            return false;
+        }
+        uint64_t bytes = 0, truncated = 0;
+        for (unsigned int i = head; i < head + (unsigned int)n; i++) {
+            cc_udppacket &pkt = slot_pkt[i];
+            pkt.truncated = (slot_hdr[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+            pkt.size      = pkt.truncated ? slot_size : slot_hdr[i].msg_len;
+            bytes        += pkt.size;
+            truncated    += pkt.truncated;
+        }
+        stat_packets.fetch_add (n, std::memory_order_relaxed);
+        stat_bytes.fetch_add (bytes, std::memory_order_relaxed);
+        if (truncated != 0) {
+            stat_truncated.fetch_add (truncated, std::memory_order_relaxed);
+        }
+        slot_head = (head + vlen) % slot_count;  // 使わなかったスロットも飛ばして次のバッチを揃える
+        datarecv (&slot_pkt[head], n);
+        if ((unsigned int)n < vlen) {
+            return false;                       // 受信キューが空になった
+        }
+    }
+    return true;
+}
+
+void
+cc_udprecv::thread_main (void)
+{
+    bool pending = false;
+    while (loop_continue ()) {
+        if (pending == false) {
+            struct timeval timeout = { 0, 200*1000 };   // 200msec loop
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(sock, &rfds);
+            if (thread_select (sock + 1, &rfds, 0, 0, &timeout) <= 0) {
+                continue;
+            }
+        }
+        pending = drain ();
+    }
+}
+
+/**
+ * @brief ソケットを bind し、スロットのリングを確保して受信スレッドを起動する
+ * @param bsize 1スロットの大きさ (これより大きいパケットは切り詰めて truncated を立てる)
+ * @param slots スロット数
+ */
+bool
+cc_udprecv::connect (unsigned int port, in_addr_t ipaddr, int bsize, int slots)
 {
     disconnect ();
 
-    // create buffer
-    if ((buffer = (unsigned char*)malloc (bsize)) == NULL) {
-        perror("#### error malloc()");
+    if (bsize <= 0 || slots <= 0) {
+        CC_UDPCOMM_ERRPR ("invalid slot size/count (%d/%d)\n", bsize, slots);
         return false;
     }
-    buffersize = bsize;
-    
+    // create slot ring
+    if (!alloc_slots (bsize, slots)) {
+        return false;
+    }
+
     // create socket
-    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
         perror("#### error socket()");
         disconnect ();
         return false;
     }
+    if (rcvbuf > 0) {
+        // 受信スレッドが遅れたときの溜め、上限 (rmem_max) を超える指定は特権があれば SO_RCVBUFFORCE で通す
+        if (setsockopt (sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1
+            && setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+            perror("#### error setsockopt(SO_RCVBUF)");
+        }
+    }
     
     // address
     memset(&addr, 0, sizeof(addr));
@@ -215,6 +304,7 @@ cc_udprecv::connect (unsigned int port, in_addr_t ipaddr, int bsize)
     }
     
     connected = true;
+    thread_up ();
     CC_UDPCOMM_DBGPR ("cc_udprecv: connected\n");
     return true;
 }
@@ -222,15 +312,13 @@ cc_udprecv::connect (unsigned int port, in_addr_t ipaddr, int bsize)
 bool
 cc_udprecv::disconnect (void)
 {
-    // disconnect
+    // 受信スレッドを止めてからソケットとリングを解放する
+    thread_down ();
     if (sock != -1) {
         close (sock);
         sock = -1;
     }
-    if (buffer != NULL) {
-        free (buffer);
-        buffer = NULL;
-    }
+    free_slots ();
     if (connected) {
         CC_UDPCOMM_DBGPR ("cc_udprecv: disconnected\n");
         connected = false;
@@ -250,20 +338,28 @@ cc_udprecv::get_ip (struct in_addr &in) {
     in = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
     //printf ("myip %s-%s\n" , "eth0" , inet_ntoa(in));
 }
+/**
+ * @brief デフォルト経路のインターフェース名と IPv4 アドレス (cc_netif の表から引く、システムコールなし)
+ */
 void cc_udprecv::get_ifinfo (struct ifreq &ifr) {
-    ifr.ifr_addr.sa_family = AF_INET;
-    strcpy(ifr.ifr_name , "eth3");
-    ioctl(sock, SIOCGIFADDR, &ifr);
+    cc_netif::instance().default_ifreq (ifr);
 }
 
 void
-cc_udprecv::datarecv (ssize_t rcvsize, struct sockaddr_in from)
+cc_udprecv::get_stats (cc_udprecv_stats &stats)
+{
+    stats.packets    = stat_packets.load (std::memory_order_relaxed);
+    stats.bytes      = stat_bytes.load (std::memory_order_relaxed);
+    stats.recv_calls = stat_calls.load (std::memory_order_relaxed);
+    stats.truncated  = stat_truncated.load (std::memory_order_relaxed);
+}
+
+void
+cc_udprecv::datarecv (const cc_udppacket *pkts, int count)
 {
     // test code
-    if (rcvsize > 0) {
-        //printf ("#### recv data [%s] %dbyte\n", buffer, rcvsize);
-        CC_UDPCOMM_DBGPR ("cc_udprecv: recv data %ldbyte from %s:%d\n", (unsigned long)rcvsize, inet_ntoa(from.sin_addr), ntohs(from.sin_port));
-    } else {
-        CC_UDPCOMM_DBGPR ("cc_udprecv: connection closed\n");
+    for (int i = 0; i < count; i++) {
+        CC_UDPCOMM_DBGPR ("cc_udprecv: recv data %ldbyte from %s:%d\n", (unsigned long)pkts[i].size,
+                          inet_ntoa(pkts[i].from->sin_addr), ntohs(pkts[i].from->sin_port));
     }
 }
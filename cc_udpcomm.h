@@ -10,10 +10,6 @@
  * 
  */
 
-// #####################################################################################
-// ###############################  under construction   ###############################
-// #####################################################################################
-
 /**
  * @file cc_udpcomm.h
  * @brief udp communication class for C++
@@ -38,8 +34,11 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <sys/uio.h>
+#include <atomic>
 
 #include "cc_thread.h"
+#include "cc_netif.h"
 
 #undef CC_UDPCOMM_DBGPR
 #undef CC_UDPCOMM_ERRPR
@@ -80,8 +79,37 @@ public:
     ssize_t send (unsigned char *dptr, int dsize);
 };
 
+#define CC_UDPRECV_BATCH        64              ///< recvmmsg() 1回で受け取る最大パケット数
+#define CC_UDPRECV_SLOTS        1024            ///< パケットスロット (リング) の既定の数
+#define CC_UDPRECV_SLOTSIZE     2048            ///< 1スロットの既定の大きさ (これより大きいパケットは切り詰める)
+#define CC_UDPRECV_DRAIN        64              ///< 1回の起床で続けて呼ぶ recvmmsg() の上限 (使い切ったら待たずに続ける)
+
 ///
-/// ■■■■■　UDP 送信クラス
+/// ■■■■■　受信したパケット (スロットを指す、コピーしない)
+///
+struct cc_udppacket {
+    unsigned char *data;                        ///< スロットの先頭
+    size_t size;                                ///< 受信バイト数 (truncated ならスロットの大きさまで)
+    const struct sockaddr_in *from;             ///< 送信元
+    bool truncated;                             ///< スロットより大きいパケットだった (MSG_TRUNC)
+};
+
+///
+/// ■■■■■　UDP 受信の統計
+///
+struct cc_udprecv_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t recv_calls;                        ///< recvmmsg() の呼び出し回数 (空振りを含む)
+    uint64_t truncated;
+};
+
+///
+/// ■■■■■　UDP 受信クラス
+///
+/// connect() で bind したソケットを専用スレッドで recvmmsg() し、確保済みのスロットのリングに
+/// まとめて受け取って datarecv() にバッチで渡す。パケットごとの malloc やコピーはしない。
+/// 受信キューが空になるまで待たずに読み続けるので、1回の起床で多数のパケットを処理する。
 ///
 class cc_udprecv : public cc_thread {
     
@@ -89,27 +117,49 @@ class cc_udprecv : public cc_thread {
     int sock;
     struct sockaddr_in addr;
     bool connected;
+    int rcvbuf;                                 ///< SO_RCVBUF (0 なら OS の既定値)
+
+    // スロットのリング (connect() で確保する)
+    unsigned char *slot_data;
+    size_t slot_size;
+    unsigned int slot_count;
+    unsigned int slot_head;                     ///< 次に受信するスロット
+    struct mmsghdr *slot_hdr;
+    struct iovec *slot_iov;
+    struct sockaddr_in *slot_from;
+    cc_udppacket *slot_pkt;
+
+    std::atomic<uint64_t> stat_packets;
+    std::atomic<uint64_t> stat_bytes;
+    std::atomic<uint64_t> stat_calls;
+    std::atomic<uint64_t> stat_truncated;
+
+    bool alloc_slots (size_t size, unsigned int count);
+    void free_slots (void);
+    bool drain (void);
+
+ protected:
+    virtual void thread_main (void);
 
  public:
-    int  buffersize;
-    unsigned char *buffer;
-
-    static void *thread_func (void *arg);
-    
     cc_udprecv (void);
     virtual ~cc_udprecv ();     // 継承用なのでvirtual
 
-    bool connect (unsigned int port, in_addr_t ipaddr, int bsize=1024);
+    void set_rcvbuf (int bytes) { rcvbuf = bytes; }    // connect() より前に呼ぶ
+    bool connect (unsigned int port, in_addr_t ipaddr, int bsize=CC_UDPRECV_SLOTSIZE, int slots=CC_UDPRECV_SLOTS);
     bool disconnect (void);
     bool get_status (void);
+    void get_stats (cc_udprecv_stats &stats);
+    using cc_thread::get_stats;
     void get_ip (struct in_addr &in);
     void get_ifinfo (struct ifreq &ifr);    // inet_ntoa((&(ifr.ifr_addr))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_broadaddr))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_netmask))->sin_addr)
                                             // inet_ntoa((&(ifr.ifr_hwaddr))->sin_addr)
 
-    virtual void datarecv (ssize_t rcvsize, struct sockaddr_in from); // この関数は main thread ではなく thread_func のコンテキストで呼ばれるので注意
+    // 受信スレッドのコンテキストで呼ばれるので注意。
+    // pkts[].data はリングが一周してスロットが再利用されるまで (slots / CC_UDPRECV_BATCH - 1 回先の datarecv() まで) 有効
+    virtual void datarecv (const cc_udppacket *pkts, int count);
 };
 
 #endif// __CC_UDPCOMM_H__
-
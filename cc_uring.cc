@@ -0,0 +1,348 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_uring.cc
+ * @brief minimal io_uring wrapper (raw system calls, no liburing)
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#include "cc_uring.h"
+
+cc_uring::cc_uring (void)
+{
+    ring_fd       = -1;
+    sq_head       = sq_tail = sq_mask = sq_array = NULL;
+    sqes          = NULL;
+    sq_local_tail = 0;
+    cq_head       = cq_tail = cq_mask = NULL;
+    cqes          = NULL;
+    ring_ptr      = sqe_ptr = NULL;
+    ring_size     = sqe_size = 0;
+    buf_ring      = NULL;
+    buf_ring_size = 0;
+    buf_base      = NULL;
+    buf_size      = 0;
+    buf_count     = 0;
+    buf_group     = 0;
+    buf_added     = 0;
+}
+
+cc_uring::~cc_uring ()
+{
+    exit ();
+}
+
+#if CC_URING_ENABLE
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief カーネルが必要な機能に対応しているか
+ * multishot recv と提供バッファリングは Linux 6.0 から。io_uring_setup() が禁止されている環境も除く。
+ */
+bool
+cc_uring::supported (void)
+{
+    struct utsname u;
+    int major = 0, minor = 0;
+    if (uname (&u) == -1 || sscanf (u.release, "%d.%d", &major, &minor) != 2 || major < 6) {
+        return false;
+    }
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup (4, &p);
+    if (fd == -1) {
+        return false;
+    }
+    close (fd);
+    return (p.features & IORING_FEAT_SINGLE_MMAP) && (p.features & IORING_FEAT_EXT_ARG);
+}
+
+/**
+ * @brief リングの作成と mmap
+ * @param entries 送信キューのエントリー数 (2のべき乗に切り上げられる)
+ */
+bool
+cc_uring::init (unsigned entries)
+{
+    if (ring_fd != -1) {
+        return true;
+    }
+    struct io_uring_params p;
+    memset (&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;                         // multishot で完了が多くなるので大きめに
+    int fd = sys_io_uring_setup (entries, &p);
+    if (fd == -1) {
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close (fd);
+        errno = ENOSYS;
+        return false;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring_ptr  = mmap (NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring_ptr == MAP_FAILED) {
+        ring_ptr = NULL;
+        close (fd);
+        return false;
+    }
+    sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqe_ptr  = mmap (NULL, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqe_ptr == MAP_FAILED) {
+        sqe_ptr = NULL;
+        munmap (ring_ptr, ring_size);
+        ring_ptr = NULL;
+        close (fd);
+        return false;
+    }
+    char *base = (char *)ring_ptr;
+    sq_head  = (unsigned *)(base + p.sq_off.head);
+    sq_tail  = (unsigned *)(base + p.sq_off.tail);
+    sq_mask  = (unsigned *)(base + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(base + p.sq_off.array);
+    sqes     = (struct io_uring_sqe *)sqe_ptr;
+    cq_head  = (unsigned *)(base + p.cq_off.head);
+    cq_tail  = (unsigned *)(base + p.cq_off.tail);
+    cq_mask  = (unsigned *)(base + p.cq_off.ring_mask);
+    cqes     = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    sq_local_tail = *sq_tail;
+    ring_fd  = fd;
+    return true;
+}
+
+/**
+ * @brief リングと提供バッファを解放する (実行中の要求はカーネルが取り消す)
+ */
+void
+cc_uring::exit (void)
+{
+    if (ring_fd != -1) {
+        close (ring_fd);
+        ring_fd = -1;
+    }
+    if (sqe_ptr != NULL) {
+        munmap (sqe_ptr, sqe_size);
+        sqe_ptr = NULL;
+    }
+    if (ring_ptr != NULL) {
+        munmap (ring_ptr, ring_size);
+        ring_ptr = NULL;
+    }
+    if (buf_ring != NULL) {
+        munmap (buf_ring, buf_ring_size);
+        buf_ring = NULL;
+    }
+    if (buf_base != NULL) {
+        munmap (buf_base, buf_size * buf_count);
+        buf_base = NULL;
+    }
+}
+
+struct io_uring_sqe *
+cc_uring::get_sqe (void)
+{
+    unsigned head = __atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+    if (sq_local_tail - head > *sq_mask) {
+        submit ();                                      // 満杯なら投入して空ける
+        head = __atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+        if (sq_local_tail - head > *sq_mask) {
+            return NULL;
+        }
+    }
+    unsigned idx = sq_local_tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    memset (sqe, 0, sizeof(*sqe));
+    sq_array[idx] = idx;
+    sq_local_tail++;
+    return sqe;
+}
+
+int
+cc_uring::submit (void)
+{
+    unsigned n = sq_local_tail - *sq_tail;
+    if (n == 0) {
+        return 0;
+    }
+    __atomic_store_n (sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = sys_io_uring_enter (ring_fd, n, 0, 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret;
+}
+
+/**
+ * @brief 溜まった SQE を投入し、完了が1件以上になるか timeout_ms まで待つ (システムコール1回)
+ * @return 0 以上: 投入した数、-1: エラー (タイムアウトは ETIME、シグナルは EINTR)
+ */
+int
+cc_uring::submit_and_wait (int timeout_ms)
+{
+    unsigned n = sq_local_tail - *sq_tail;
+    __atomic_store_n (sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    if (__atomic_load_n (cq_tail, __ATOMIC_ACQUIRE) != *cq_head) {
+        // もう完了があるので待たない
+        return (n > 0) ? sys_io_uring_enter (ring_fd, n, 0, 0, NULL, 0) : 0;
+    }
+    struct __kernel_timespec ts;
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset (&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts         = (uint64_t)(uintptr_t)&ts;
+    return sys_io_uring_enter (ring_fd, n, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe *
+cc_uring::peek_cqe (void)
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n (cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &cqes[head & *cq_mask];
+}
+
+void
+cc_uring::cqe_seen (void)
+{
+    __atomic_store_n (cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool
+cc_uring::register_files_sparse (unsigned count)
+{
+    struct io_uring_rsrc_register reg;
+    memset (&reg, 0, sizeof(reg));
+    reg.nr    = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return sys_io_uring_register (ring_fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0;
+}
+
+bool
+cc_uring::update_file (unsigned slot, int fd)
+{
+    struct io_uring_rsrc_update2 up;
+    memset (&up, 0, sizeof(up));
+    up.offset = slot;
+    up.data   = (uint64_t)(uintptr_t)&fd;
+    up.nr     = 1;
+    return sys_io_uring_register (ring_fd, IORING_REGISTER_FILES_UPDATE2, &up, sizeof(up)) == 1;
+}
+
+/**
+ * @brief 提供バッファリングを作って登録する (multishot recv が受信ごとに1つ選ぶ)
+ * @param group バッファグループID
+ * @param count バッファ数 (2のべき乗、最大 32768)
+ * @param size  1つのバッファのバイト数
+ */
+bool
+cc_uring::setup_buffers (unsigned short group, unsigned count, size_t size)
+{
+    buf_ring_size = count * sizeof(struct io_uring_buf);
+    void *r = mmap (NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) {
+        return false;
+    }
+    void *b = mmap (NULL, size * count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        munmap (r, buf_ring_size);
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset (&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)r;
+    reg.ring_entries = count;
+    reg.bgid         = group;
+    if (sys_io_uring_register (ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        munmap (b, size * count);
+        munmap (r, buf_ring_size);
+        return false;
+    }
+    buf_ring  = (struct io_uring_buf_ring *)r;
+    buf_base  = (unsigned char *)b;
+    buf_size  = size;
+    buf_count = count;
+    buf_group = group;
+    buf_added = 0;
+    for (unsigned i = 0; i < count; i++) {
+        recycle_buffer ((unsigned short)i);
+    }
+    publish_buffers ();
+    return true;
+}
+
+void
+cc_uring::recycle_buffer (unsigned short bid)
+{
+    unsigned short tail = buf_ring->tail;
+    // C++ では uapi ヘッダーの bufs[] (__DECLARE_FLEX_ARRAY) の位置がずれるので、先頭から数える
+    struct io_uring_buf *buf = (struct io_uring_buf *)buf_ring + ((tail + buf_added) & (buf_count - 1));
+    buf->addr = (uint64_t)(uintptr_t)buffer (bid);
+    buf->len  = (uint32_t)buf_size;
+    buf->bid  = bid;
+    buf_added++;
+}
+
+void
+cc_uring::publish_buffers (void)
+{
+    if (buf_added > 0) {
+        __atomic_store_n (&buf_ring->tail, (unsigned short)(buf_ring->tail + buf_added), __ATOMIC_RELEASE);
+        buf_added = 0;
+    }
+}
+
+#else // CC_URING_ENABLE
+
+// ヘッダーが古い環境では常に使えない (呼び出し側は epoll にフォールバックする)
+bool cc_uring::supported (void) { return false; }
+bool cc_uring::init (unsigned entries) { errno = ENOSYS; return false; }
+void cc_uring::exit (void) {}
+struct io_uring_sqe *cc_uring::get_sqe (void) { return NULL; }
+int cc_uring::submit (void) { errno = ENOSYS; return -1; }
+int cc_uring::submit_and_wait (int timeout_ms) { errno = ENOSYS; return -1; }
+struct io_uring_cqe *cc_uring::peek_cqe (void) { return NULL; }
+void cc_uring::cqe_seen (void) {}
+bool cc_uring::register_files_sparse (unsigned count) { return false; }
+bool cc_uring::update_file (unsigned slot, int fd) { return false; }
+bool cc_uring::setup_buffers (unsigned short group, unsigned count, size_t size) { return false; }
+void cc_uring::recycle_buffer (unsigned short bid) {}
+void cc_uring::publish_buffers (void) {}
+
+#endif // CC_URING_ENABLE
@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 4 -*- */
+
+/**
+ * @file cc_uring.h
+ * @brief minimal io_uring wrapper (raw system calls, no liburing)
+ *
+ * Copyright (c) 2023 Yoshikazu Hirai
+ * Released under the MIT license
+ * https://opensource.org/licenses/mit-license.php
+ *
+ */
+
+#ifndef __CC_URING_H__
+#define __CC_URING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// カーネルヘッダーが multishot recv (Linux 6.0) に対応していればビルドする
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define CC_URING_ENABLE 1
+#else
+#define CC_URING_ENABLE 0
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+#endif
+
+///
+/// ■■■■■　io_uring (1つのスレッドから使う)
+///
+/// 送信キュー/完了キューの mmap、登録ファイル (疎なテーブル)、提供バッファリングだけを扱う。
+/// 使えない環境 (古いカーネル/ヘッダー、seccomp で禁止など) では init() が false を返すので、
+/// 呼び出し側は epoll 等にフォールバックすること。
+///
+class cc_uring {
+private:
+    int ring_fd;
+    // 送信キュー
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;                             ///< get_sqe() 済みでまだ公開していない末尾
+    // 完了キュー
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // mmap 領域
+    void *ring_ptr;
+    size_t ring_size;
+    void *sqe_ptr;
+    size_t sqe_size;
+    // 提供バッファリング
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned char *buf_base;
+    size_t buf_size;
+    unsigned buf_count;
+    unsigned short buf_group;
+    unsigned buf_added;                                 ///< 追加してまだ公開していないバッファ数
+
+    cc_uring (const cc_uring &);                        // コピー禁止
+    cc_uring &operator= (const cc_uring &);
+
+public:
+    cc_uring (void);
+    ~cc_uring ();
+
+    static bool supported (void);                       // カーネルが必要な機能に対応しているか
+
+    bool init (unsigned entries);
+    void exit (void);
+    bool active (void) const { return ring_fd != -1; }
+
+    struct io_uring_sqe *get_sqe (void);                // 空きがなければ submit() してから取る
+    int submit (void);                                  // 溜まった SQE を投入する
+    int submit_and_wait (int timeout_ms);               // 投入して1件以上の完了か timeout_ms まで待つ
+
+    struct io_uring_cqe *peek_cqe (void);               // 次の完了 (なければ NULL)
+    void cqe_seen (void);                               // peek_cqe() した完了を消費する
+
+    bool register_files_sparse (unsigned count);        // 登録ファイルのテーブルを確保する
+    bool update_file (unsigned slot, int fd);           // スロットに fd を登録/解除 (-1) する
+
+    bool setup_buffers (unsigned short group, unsigned count, size_t size);   // 提供バッファリングの登録
+    unsigned char *buffer (unsigned short bid) const { return buf_base + (size_t)bid * buf_size; }
+    size_t buffer_size (void) const { return buf_size; }
+    void recycle_buffer (unsigned short bid);           // バッファを返す (publish_buffers() で公開)
+    void publish_buffers (void);
+};
+
+#endif // __CC_URING_H__
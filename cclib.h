@@ -15,12 +15,20 @@
 
 #include "cc_message.h"
 #include "cc_thread.h"
+#include "cc_timer.h"
 #include "cc_pipeexec.h"
 #include "cc_tcpcomm.h"
+#include "cc_tcpcodec.h"
+#include "cc_sockopt.h"
+#include "cc_resolver.h"
+#include "cc_netif.h"
+#include "cc_tcppool.h"
 #include "cc_api.h"
 #include "cc_misc.h"
+#include "cc_shmstore.h"
+#include "cc_counter.h"
 //#include "cc_md5.h"
 //#include "cc_mutex.h"
-//#include "cc_udpcomm.h"
+#include "cc_udpcomm.h"
 
 #endif // __CCLIB_H__
@@ -85,7 +85,7 @@ main (int argc, char *argv[])
         printf("ERROR: failed connect server, process exit now.\n");
         return 1;
     }
-    client_send.clientSocket = client_recv.clientSocket;
+    client_send.clientSocket = client_recv.clientSocket.load();
 
     // 入力＆送信スレッド
     client_send.thread_up();
@@ -22,7 +22,7 @@ sample_tcpserver_conn::thread_main (void)
         FD_SET(clientSocket, &readSet);
 
         // select でイベント待ち
-        select(FD_SETSIZE, &readSet, 0, 0, &timeout);
+        thread_select(FD_SETSIZE, &readSet, 0, 0, &timeout);
 
         // イベント処理
         if( FD_ISSET(clientSocket, &readSet) ) {